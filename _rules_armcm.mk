@@ -31,6 +31,13 @@ ifneq ($(BUILD_BOOTLOADER),0)
               $(ZUBAX_CHIBIOS_DIR)/zubax_chibios/bootloader/loaders/ymodem.cpp
 endif
 
+BUILD_PROFILER ?= 0
+ifneq ($(BUILD_PROFILER),0)
+    CPPSRC += $(ZUBAX_CHIBIOS_DIR)/zubax_chibios/sys/profiler.cpp                \
+              $(ZUBAX_CHIBIOS_DIR)/zubax_chibios/sys/sampling_profiler.cpp
+    UDEFS += -DOS_PROFILER_ENABLED=1
+endif
+
 #
 # OS configuration
 #
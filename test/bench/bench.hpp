@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Minimal microbenchmark harness for the host build; see the makefile in the parent directory.
+ *
+ *      BENCHMARK(CRC32)
+ *      {
+ *          context.setBytesPerOp(sizeof(data));
+ *          context.run([&]() {
+ *              os::crc::CRC32 crc;
+ *              crc.add(data, sizeof(data));
+ *              bench::doNotOptimize(crc);
+ *          });
+ *      }
+ *
+ * The operation is repeated in batches that grow until a batch takes long enough to be measured reliably;
+ * then the best of several batches is reported as ns/op, together with the throughput and the heap usage per op.
+ * Command line options:
+ *      --save=FILE         Save the results into the file
+ *      --compare=FILE      Compare against the saved results, exit with failure if anything got slower
+ *      --tolerance=X       Relative slowdown that is not considered a regression, default 0.1
+ *  Other arguments select the benchmarks whose names contain any of them.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+
+namespace bench
+{
+
+/**
+ * Heap usage of the process, counted by the replaced global operator new.
+ */
+struct HeapCounters
+{
+    std::uint64_t num_allocations = 0;
+    std::uint64_t num_bytes = 0;
+};
+
+HeapCounters getHeapCounters();
+
+/**
+ * Keeps the value from being optimized away as unused.
+ */
+template <typename T>
+inline void doNotOptimize(const T& value)
+{
+    asm volatile ("" : : "r"(&value) : "memory");
+}
+
+class Context
+{
+    static constexpr std::uint64_t MinBatchDurationNSec = 20000000;
+    static constexpr unsigned NumBatches = 5;
+
+    std::size_t bytes_per_op_ = 0;
+
+    double ns_per_op_ = 0;
+    double allocations_per_op_ = 0;
+    double heap_bytes_per_op_ = 0;
+
+    template <typename Operation>
+    static std::uint64_t runBatch(Operation& op, std::uint64_t iterations)
+    {
+        const auto started_at = std::chrono::steady_clock::now();
+        for (std::uint64_t i = 0; i < iterations; i++)
+        {
+            op();
+        }
+        return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started_at).count());
+    }
+
+public:
+    /**
+     * Amount of data processed by one operation, used to compute the throughput; zero if not applicable.
+     */
+    void setBytesPerOp(std::size_t x) { bytes_per_op_ = x; }
+
+    template <typename Operation>
+    void run(Operation op)
+    {
+        // Calibration; this also warms up the caches
+        std::uint64_t iterations = 1;
+        while (runBatch(op, iterations) < MinBatchDurationNSec)
+        {
+            iterations *= 2;
+        }
+
+        const HeapCounters heap_before = getHeapCounters();
+        std::uint64_t best_duration = ~std::uint64_t(0);
+        for (unsigned i = 0; i < NumBatches; i++)
+        {
+            const std::uint64_t duration = runBatch(op, iterations);
+            best_duration = (duration < best_duration) ? duration : best_duration;
+        }
+        const HeapCounters heap_after = getHeapCounters();
+
+        const double total_iterations = double(iterations) * NumBatches;
+        ns_per_op_ = double(best_duration) / double(iterations);
+        allocations_per_op_ = double(heap_after.num_allocations - heap_before.num_allocations) / total_iterations;
+        heap_bytes_per_op_ = double(heap_after.num_bytes - heap_before.num_bytes) / total_iterations;
+    }
+
+    std::size_t getBytesPerOp() const { return bytes_per_op_; }
+    double getNanosecondsPerOp() const { return ns_per_op_; }
+    double getAllocationsPerOp() const { return allocations_per_op_; }
+    double getHeapBytesPerOp() const { return heap_bytes_per_op_; }
+};
+
+using Function = void (*)(Context&);
+
+class Registrar
+{
+public:
+    Registrar(const char* name, Function function);
+};
+
+}
+
+#define BENCHMARK(name)                                                           \
+    static void benchmark_##name(::bench::Context& context);                      \
+    static ::bench::Registrar benchmark_registrar_##name(#name, &benchmark_##name); \
+    static void benchmark_##name(::bench::Context& context)
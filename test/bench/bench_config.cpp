@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "bench.hpp"
+#include <zubax_chibios/config/config.hpp>
+#include <cerrno>
+
+namespace
+{
+/*
+ * A parameter set of a typical size, with a mix of types.
+ */
+os::config::Param<int>   p_node_id("uavcan.node_id", 0, 0, 125);
+os::config::Param<int>   p_bitrate("uavcan.bit_rate", 1000000, 100000, 1000000);
+os::config::Param<bool>  p_can_term("uavcan.can_term", false);
+os::config::Param<float> p_pub_rate("uavcan.pub_rate", 10.F, 0.F, 100.F);
+os::config::Param<float> p_gain_p("ctl.gain_p", 1.F, 0.F, 100.F);
+os::config::Param<float> p_gain_i("ctl.gain_i", 0.1F, 0.F, 100.F);
+os::config::Param<float> p_gain_d("ctl.gain_d", 0.F, 0.F, 100.F);
+os::config::Param<float> p_limit("ctl.limit", 10.F, 0.F, 100.F);
+os::config::Param<bool>  p_reverse("ctl.reverse", false);
+os::config::Param<int>   p_mode("ctl.mode", 0, 0, 3);
+os::config::Param<int>   p_timeout("ctl.timeout_ms", 500, 0, 10000);
+os::config::Param<float> p_cal_offset("sensor.offset", 0.F, -10.F, 10.F);
+os::config::Param<float> p_cal_scale("sensor.scale", 1.F, 0.5F, 2.F);
+os::config::Param<int>   p_filter("sensor.filter_len", 8, 1, 64);
+os::config::Param<bool>  p_enabled("sensor.enabled", true);
+os::config::Param<const char*> p_name("node.name", "node");
+
+class MemoryStorage : public os::config::IStorageBackend
+{
+    std::uint8_t data_[os::config::MaxStorageSize];
+
+public:
+    MemoryStorage() { std::memset(data_, 0xFF, sizeof(data_)); }
+
+    int read(std::size_t offset, void* data, std::size_t len) override
+    {
+        std::memcpy(data, &data_[offset], len);
+        return 0;
+    }
+
+    int write(std::size_t offset, const void* data, std::size_t len) override
+    {
+        std::memcpy(&data_[offset], data, len);
+        return 0;
+    }
+
+    int erase() override
+    {
+        std::memset(data_, 0xFF, sizeof(data_));
+        return 0;
+    }
+
+    bool canWriteWithoutErase() const override { return true; }
+};
+
+void initConfig()
+{
+    static MemoryStorage storage;
+    static const int res = os::config::init(&storage);
+    (void)res;
+}
+
+}
+
+BENCHMARK(ConfigIndexByName)
+{
+    initConfig();
+    static const char* const Names[] = { "uavcan.node_id", "ctl.gain_d", "sensor.enabled", "no.such.param" };
+    unsigned i = 0;
+    context.run([&]()
+    {
+        bench::doNotOptimize(configIndexByName(Names[i++ % 4U]));
+    });
+}
+
+BENCHMARK(ConfigGetByName)
+{
+    initConfig();
+    context.run([&]()
+    {
+        bench::doNotOptimize(configGet("ctl.gain_i"));
+    });
+}
+
+BENCHMARK(ConfigParamGet)
+{
+    initConfig();
+    context.run([&]()
+    {
+        bench::doNotOptimize(p_gain_i.get());
+    });
+}
+
+BENCHMARK(ConfigParamSet)
+{
+    initConfig();
+    int x = 0;
+    context.run([&]()
+    {
+        bench::doNotOptimize(p_timeout.set(x++ % 10000));
+    });
+}
+
+BENCHMARK(ConfigSaveIncremental)
+{
+    initConfig();
+    int x = 0;
+    context.run([&]()
+    {
+        (void)p_filter.set(1 + (x++ % 64));
+        bench::doNotOptimize(os::config::save());
+    });
+}
+
+BENCHMARK(ConfigExportImage)
+{
+    initConfig();
+    static std::uint8_t image[os::config::MaxImageSize];
+    context.setBytesPerOp(os::config::getImageSize());
+    context.run([&]()
+    {
+        bench::doNotOptimize(os::config::exportImage(image, sizeof(image)));
+    });
+}
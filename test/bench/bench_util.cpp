@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "bench.hpp"
+#include <zubax_chibios/util/crc.hpp>
+#include <zubax_chibios/util/base64.hpp>
+#include <zubax_chibios/util/heapless.hpp>
+#include <array>
+#include <random>
+#include <cmath>
+
+namespace
+{
+
+constexpr std::size_t DataSize = 1024;
+
+using Data = std::array<std::uint8_t, DataSize>;
+
+const Data& getRandomData()
+{
+    static Data data = []()
+    {
+        Data out{};
+        std::mt19937 rng(42);
+        for (auto& x : out)
+        {
+            x = std::uint8_t(rng());
+        }
+        return out;
+    }();
+    return data;
+}
+
+template <typename CRC>
+void benchmarkCRC(bench::Context& context)
+{
+    const Data& data = getRandomData();
+    context.setBytesPerOp(data.size());
+    context.run([&]()
+    {
+        CRC crc;
+        crc.add(data.data(), unsigned(data.size()));
+        bench::doNotOptimize(crc);
+    });
+}
+
+}
+
+BENCHMARK(CRC16CCITT_1K) { benchmarkCRC<os::crc::CRC16CCITT>(context); }
+BENCHMARK(CRC32_1K)      { benchmarkCRC<os::crc::CRC32>(context); }
+BENCHMARK(CRC64WE_1K)    { benchmarkCRC<os::crc::CRC64WE>(context); }
+
+BENCHMARK(Base64Encode_1K)
+{
+    const Data& data = getRandomData();
+    static char encoded[os::base64::predictEncodedDataLength(DataSize) + 1];
+    context.setBytesPerOp(data.size());
+    context.run([&]()
+    {
+        bench::doNotOptimize(os::base64::encode(data, encoded));
+    });
+}
+
+BENCHMARK(Base64Decode_1K)
+{
+    static char encoded[os::base64::predictEncodedDataLength(DataSize) + 1];
+    (void)os::base64::encode(getRandomData(), encoded);
+    Data decoded{};
+    context.setBytesPerOp(decoded.size());
+    context.run([&]()
+    {
+        bench::doNotOptimize(os::base64::decode(decoded, encoded));
+    });
+}
+
+BENCHMARK(Base64StreamDecode_1K)
+{
+    static char encoded[os::base64::predictEncodedDataLength(DataSize) + 1];
+    (void)os::base64::encode(getRandomData(), encoded);
+    const std::size_t encoded_length = std::strlen(encoded);
+    Data decoded{};
+    context.setBytesPerOp(decoded.size());
+    context.run([&]()
+    {
+        os::base64::StreamDecoder decoder;
+        // Odd chunks, like the lines of a terminal
+        constexpr std::size_t ChunkSize = 61;
+        std::size_t out_offset = 0;
+        for (std::size_t i = 0; i < encoded_length; i += ChunkSize)
+        {
+            const int res = decoder.feed(&encoded[i], std::min(ChunkSize, encoded_length - i), &decoded[out_offset]);
+            out_offset += std::size_t(res);
+        }
+        bench::doNotOptimize(decoder.finish());
+        bench::doNotOptimize(decoded);
+    });
+}
+
+BENCHMARK(HeaplessIntToString)
+{
+    std::int32_t x = 1234567;
+    context.run([&]()
+    {
+        x = (x * 1103515245) + 12345;
+        bench::doNotOptimize(os::heapless::intToString(x));
+    });
+}
+
+BENCHMARK(HeaplessFloatToString)
+{
+    // Finite values of all magnitudes; the conversion time depends on the exponent
+    static std::array<float, 256> values = []()
+    {
+        std::array<float, 256> out{};
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> mantissa(-10.F, 10.F);
+        std::uniform_int_distribution<int> exponent(-30, 30);
+        for (auto& x : out)
+        {
+            x = std::ldexp(mantissa(rng), exponent(rng));
+        }
+        return out;
+    }();
+    unsigned i = 0;
+    context.run([&]()
+    {
+        bench::doNotOptimize(os::heapless::floatToString(values[i++ % values.size()]));
+    });
+}
+
+BENCHMARK(HeaplessFormat)
+{
+    int x = 0;
+    context.run([&]()
+    {
+        x++;
+        bench::doNotOptimize(os::heapless::format("%s: %d of %d", "Progress", x, 1000000));
+    });
+}
+
+BENCHMARK(HeaplessConcatenate)
+{
+    int x = 0;
+    context.run([&]()
+    {
+        x++;
+        bench::doNotOptimize(os::heapless::concatenate("Progress: ", x, " of ", 1000000));
+    });
+}
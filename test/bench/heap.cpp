@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * The code under test is not supposed to use the heap; the replaced global allocation functions make sure
+ * any use of it is visible in the results.
+ * They are kept in a separate translation unit, so that they are never inlined into their callers.
+ */
+
+#include "bench.hpp"
+#include <cstdlib>
+#include <new>
+#include <atomic>
+
+namespace
+{
+
+std::atomic<std::uint64_t> g_num_allocations{0};
+std::atomic<std::uint64_t> g_num_allocated_bytes{0};
+
+}
+
+namespace bench
+{
+
+HeapCounters getHeapCounters()
+{
+    HeapCounters out;
+    out.num_allocations = g_num_allocations.load();
+    out.num_bytes = g_num_allocated_bytes.load();
+    return out;
+}
+
+}
+
+void* operator new(std::size_t size)
+{
+    g_num_allocations++;
+    g_num_allocated_bytes += size;
+    void* const p = std::malloc((size == 0) ? 1 : size);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
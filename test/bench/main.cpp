@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "bench.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace bench
+{
+namespace
+{
+
+struct Benchmark
+{
+    const char* name;
+    Function function;
+};
+
+std::vector<Benchmark>& getRegistry()
+{
+    static std::vector<Benchmark> registry;
+    return registry;
+}
+
+const char* getOption(const char* arg, const char* name)
+{
+    const std::size_t len = std::strlen(name);
+    return (std::strncmp(arg, name, len) == 0) ? (arg + len) : nullptr;
+}
+
+bool isSelected(const char* name, int argc, char** argv)
+{
+    bool has_filters = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            has_filters = true;
+            if (std::strstr(name, argv[i]) != nullptr)
+            {
+                return true;
+            }
+        }
+    }
+    return !has_filters;
+}
+
+/**
+ * The result file contains one line per benchmark: name and ns/op.
+ */
+std::map<std::string, double> loadResults(const char* path)
+{
+    std::map<std::string, double> out;
+    std::FILE* const f = std::fopen(path, "r");
+    if (f == nullptr)
+    {
+        std::perror(path);
+        std::exit(EXIT_FAILURE);
+    }
+    char name[200];
+    double ns_per_op = 0;
+    while (std::fscanf(f, "%199s %lf", name, &ns_per_op) == 2)
+    {
+        out[name] = ns_per_op;
+    }
+    std::fclose(f);
+    return out;
+}
+
+}
+
+Registrar::Registrar(const char* name, Function function)
+{
+    getRegistry().push_back({name, function});
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    const char* save_path = nullptr;
+    const char* compare_path = nullptr;
+    double tolerance = 0.1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (const char* x = bench::getOption(argv[i], "--save="))
+        {
+            save_path = x;
+        }
+        else if (const char* x = bench::getOption(argv[i], "--compare="))
+        {
+            compare_path = x;
+        }
+        else if (const char* x = bench::getOption(argv[i], "--tolerance="))
+        {
+            tolerance = std::atof(x);
+        }
+        else if (argv[i][0] == '-')
+        {
+            std::fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const auto baseline = (compare_path != nullptr) ? bench::loadResults(compare_path)
+                                                    : std::map<std::string, double>();
+    std::FILE* const save_file = (save_path != nullptr) ? std::fopen(save_path, "w") : nullptr;
+    if ((save_path != nullptr) && (save_file == nullptr))
+    {
+        std::perror(save_path);
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%-32s %12s %12s %10s %10s %10s\n", "Benchmark", "ns/op", "MB/s", "B/op", "allocs/op", "baseline");
+    unsigned num_regressions = 0;
+    for (const auto& b : bench::getRegistry())
+    {
+        if (!bench::isSelected(b.name, argc, argv))
+        {
+            continue;
+        }
+        bench::Context context;
+        b.function(context);
+
+        const double ns_per_op = context.getNanosecondsPerOp();
+        std::printf("%-32s %12.1f ", b.name, ns_per_op);
+        if (context.getBytesPerOp() > 0)
+        {
+            std::printf("%12.1f ", double(context.getBytesPerOp()) * 1e3 / ns_per_op);
+        }
+        else
+        {
+            std::printf("%12s ", "-");
+        }
+        std::printf("%10.1f %10.2f", context.getHeapBytesPerOp(), context.getAllocationsPerOp());
+
+        const auto it = baseline.find(b.name);
+        if (it != baseline.end())
+        {
+            const double ratio = ns_per_op / it->second;
+            const bool regression = ratio > (1.0 + tolerance);
+            std::printf(" %+9.1f%%%s", (ratio - 1.0) * 100.0, regression ? "  REGRESSION" : "");
+            num_regressions += regression ? 1U : 0U;
+        }
+        std::puts("");
+
+        if (save_file != nullptr)
+        {
+            std::fprintf(save_file, "%s %.3f\n", b.name, ns_per_op);
+        }
+    }
+
+    if (save_file != nullptr)
+    {
+        std::fclose(save_file);
+    }
+    if (num_regressions > 0)
+    {
+        std::printf("%u benchmarks are slower than the baseline by more than %.0f%%\n",
+                    num_regressions, tolerance * 100.0);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "test.hpp"
+#include <shim/shim.hpp>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <csignal>
+
+namespace test
+{
+namespace
+{
+
+struct TestCase
+{
+    const char* name;
+    Function function;
+};
+
+std::vector<TestCase>& getRegistry()
+{
+    static std::vector<TestCase> registry;
+    return registry;
+}
+
+unsigned g_num_failed_checks = 0;
+
+bool isSelected(const char* name, int argc, char** argv)
+{
+    bool has_filters = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            has_filters = true;
+            if (std::strstr(name, argv[i]) != nullptr)
+            {
+                return true;
+            }
+        }
+    }
+    return !has_filters;
+}
+
+}
+
+Registrar::Registrar(const char* name, Function function)
+{
+    getRegistry().push_back({name, function});
+}
+
+bool check(bool condition, const char* expression, const char* file, int line)
+{
+    if (!condition)
+    {
+        g_num_failed_checks++;
+        std::printf("%s:%d: check failed: %s\n", file, line, expression);
+    }
+    return condition;
+}
+
+bool runIsolated(const std::function<void ()>& function)
+{
+    std::fflush(stdout);
+    std::fflush(stderr);
+
+    const ::pid_t pid = ::fork();
+    if (pid < 0)
+    {
+        std::perror("fork");
+        std::exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        const unsigned failures_before = g_num_failed_checks;
+        function();
+        std::fflush(stdout);
+        ::_exit((g_num_failed_checks == failures_before) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status = 0;
+    (void)::waitpid(pid, &status, 0);
+    return WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+bool halts(const std::function<void ()>& function)
+{
+    std::fflush(stdout);
+    std::fflush(stderr);
+
+    const ::pid_t pid = ::fork();
+    if (pid < 0)
+    {
+        std::perror("fork");
+        std::exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        std::freopen("/dev/null", "w", stderr);    // The halt message is expected
+        function();
+        ::_exit(EXIT_SUCCESS);
+    }
+
+    int status = 0;
+    (void)::waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && (WTERMSIG(status) == SIGABRT);
+}
+
+void* allocateShared(std::size_t size)
+{
+    void* const p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        std::perror("mmap");
+        std::exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    std::setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "-v") == 0)
+        {
+            shim::setLogEnabled(true);
+        }
+    }
+
+    unsigned num_run = 0;
+    unsigned num_failed = 0;
+    for (const auto& tc : test::getRegistry())
+    {
+        if (!test::isSelected(tc.name, argc, argv))
+        {
+            continue;
+        }
+        const unsigned failures_before = test::g_num_failed_checks;
+        tc.function();
+        const bool ok = test::g_num_failed_checks == failures_before;
+        std::printf("[%s] %s\n", ok ? " OK " : "FAIL", tc.name);
+        num_run++;
+        num_failed += ok ? 0U : 1U;
+    }
+
+    std::printf("%s: %u test cases, %u failed\n", argv[0], num_run, num_failed);
+    return (num_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
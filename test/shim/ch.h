@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Host shim of the ChibiOS kernel API, just enough to build the portable parts of the library.
+ * Threads are scheduled cooperatively: only one runs at a time, and it runs until it blocks, so the execution is
+ * deterministic. Mutexes detect recursive locking, which would be a deadlock on the target.
+ * The system time is virtual: it advances only when all threads are blocked, see shim.hpp.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t systime_t;
+typedef uint32_t syssts_t;
+typedef uint32_t rtcnt_t;
+typedef uint8_t tprio_t;
+typedef int32_t msg_t;
+typedef uint32_t eventmask_t;
+typedef uint32_t eventflags_t;
+
+#define TRUE                    1
+#define FALSE                   0
+
+#define MSG_OK                  0
+#define MSG_TIMEOUT             -1
+#define MSG_RESET               -2
+#define STM_OK                  MSG_OK
+#define Q_TIMEOUT               MSG_TIMEOUT
+
+#define TIME_IMMEDIATE          ((systime_t)0)
+#define TIME_INFINITE           ((systime_t)-1)
+
+#define CH_CFG_ST_FREQUENCY     10000
+#define CH_CFG_ST_RESOLUTION    32
+
+#define S2ST(sec)               ((systime_t)((uint32_t)(sec) * CH_CFG_ST_FREQUENCY))
+#define MS2ST(msec)             ((systime_t)(((uint32_t)(msec) * CH_CFG_ST_FREQUENCY + 999U) / 1000U))
+#define US2ST(usec)             ((systime_t)(((uint32_t)(usec) * CH_CFG_ST_FREQUENCY + 999999U) / 1000000U))
+#define ST2MS(n)                (((uint32_t)(n) * 1000U + CH_CFG_ST_FREQUENCY - 1U) / CH_CFG_ST_FREQUENCY)
+#define ST2US(n)                (((uint32_t)(n) * 1000000U + CH_CFG_ST_FREQUENCY - 1U) / CH_CFG_ST_FREQUENCY)
+
+#define IDLEPRIO                1
+#define LOWPRIO                 2
+#define NORMALPRIO              128
+#define HIGHPRIO                255
+
+typedef struct ch_thread
+{
+    const char* name;
+    tprio_t prio;
+} thread_t;
+
+void chSysHalt(const char* reason);
+
+syssts_t chSysGetStatusAndLockX(void);
+void chSysRestoreStatusX(syssts_t sts);
+void chSysLock(void);
+void chSysUnlock(void);
+void chSysLockFromISR(void);
+void chSysUnlockFromISR(void);
+
+rtcnt_t chSysGetRealtimeCounterX(void);
+
+systime_t chVTGetSystemTime(void);
+systime_t chVTGetSystemTimeX(void);
+systime_t chVTTimeElapsedSinceX(systime_t start);
+
+void chThdSleep(systime_t time);
+#define chThdSleepSeconds(sec)          chThdSleep(S2ST(sec))
+#define chThdSleepMilliseconds(msec)    chThdSleep(MS2ST(msec))
+#define chThdSleepMicroseconds(usec)    chThdSleep(US2ST(usec))
+
+thread_t* chThdGetSelfX(void);
+msg_t chThdWait(thread_t* tp);
+
+void chEvtSignal(thread_t* tp, eventmask_t events);
+
+#ifdef __cplusplus
+}
+#endif
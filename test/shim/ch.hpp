@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Host shim of the ChibiOS C++ wrappers, see ch.h.
+ * Waiting on an unavailable resource switches to another thread that can run; if there is none, the virtual time
+ * is advanced to the nearest timeout, see shim.cpp.
+ */
+
+#pragma once
+
+#include "ch.h"
+
+namespace chibios_rt
+{
+
+class BaseThread;
+
+class Mutex
+{
+    thread_t* owner_ = nullptr;
+
+public:
+    void lock();
+    void unlock();
+    bool tryLock();
+};
+
+class BinarySemaphore
+{
+    bool taken_;
+
+public:
+    explicit BinarySemaphore(bool taken) : taken_(taken) { }
+
+    msg_t wait(systime_t timeout = TIME_INFINITE);
+    void signal()  { taken_ = false; }
+    void signalI() { taken_ = false; }
+    void reset(bool taken)  { taken_ = taken; }
+    void resetI(bool taken) { taken_ = taken; }
+};
+
+class CounterSemaphore
+{
+    int count_;
+
+public:
+    explicit CounterSemaphore(int count) : count_(count) { }
+
+    msg_t wait(systime_t timeout = TIME_INFINITE);
+    void signal()  { count_++; }
+    void signalI() { count_++; }
+};
+
+class ThreadReference
+{
+public:
+    thread_t* thread_ref;
+
+    ThreadReference(thread_t* tp) : thread_ref(tp) { }
+
+    /**
+     * Waits for the thread to exit; the exit code is always zero.
+     */
+    msg_t wait();
+};
+
+class BaseThread
+{
+public:
+    virtual ~BaseThread() { }
+
+    virtual void main() = 0;
+
+    static tprio_t setPriority(tprio_t prio);
+    static void setName(const char* name);
+    static void sleep(systime_t interval) { chThdSleep(interval); }
+};
+
+}
+
+namespace shim
+{
+/**
+ * Starts a thread that executes thread->main(); the stack is allocated by the host.
+ */
+thread_t* startThread(chibios_rt::BaseThread* thread, tprio_t prio);
+}
+
+namespace chibios_rt
+{
+
+template <int N>
+class BaseStaticThread : public BaseThread
+{
+public:
+    ThreadReference start(tprio_t prio) { return ThreadReference(shim::startThread(this, prio)); }
+};
+
+}
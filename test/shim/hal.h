@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Host shim of the ChibiOS HAL: only the channel interface. Channels are implemented by the tests,
+ * see shim::LoopbackChannel.
+ */
+
+#pragma once
+
+#include "ch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct BaseChannel BaseChannel;
+
+struct BaseChannelVMT
+{
+    size_t (*write)(BaseChannel* ip, const uint8_t* bp, size_t n, systime_t timeout);
+    size_t (*read)(BaseChannel* ip, uint8_t* bp, size_t n, systime_t timeout);
+};
+
+struct BaseChannel
+{
+    const struct BaseChannelVMT* vmt;
+};
+
+typedef BaseChannel BaseSequentialStream;
+
+static inline size_t chnWriteTimeout(BaseChannel* ip, const uint8_t* bp, size_t n, systime_t timeout)
+{
+    return ip->vmt->write(ip, bp, n, timeout);
+}
+
+static inline size_t chnReadTimeout(BaseChannel* ip, uint8_t* bp, size_t n, systime_t timeout)
+{
+    return ip->vmt->read(ip, bp, n, timeout);
+}
+
+static inline size_t chnWrite(BaseChannel* ip, const uint8_t* bp, size_t n)
+{
+    return chnWriteTimeout(ip, bp, n, TIME_INFINITE);
+}
+
+static inline size_t chnRead(BaseChannel* ip, uint8_t* bp, size_t n)
+{
+    return chnReadTimeout(ip, bp, n, TIME_INFINITE);
+}
+
+static inline msg_t chnPutTimeout(BaseChannel* ip, uint8_t b, systime_t timeout)
+{
+    return (chnWriteTimeout(ip, &b, 1, timeout) == 1) ? MSG_OK : MSG_TIMEOUT;
+}
+
+static inline msg_t chnGetTimeout(BaseChannel* ip, systime_t timeout)
+{
+    uint8_t b = 0;
+    return (chnReadTimeout(ip, &b, 1, timeout) == 1) ? (msg_t)b : MSG_TIMEOUT;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Extensions of the C library that the firmware gets from newlib; this header is included in every host
+ * translation unit by the makefile, the same way newlib's stdlib.h provides them on the target.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+float atoff(const char* str);
+
+#ifdef __cplusplus
+}
+#endif
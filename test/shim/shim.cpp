@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "shim.hpp"
+#include <zubax_chibios/sys/sys.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <algorithm>
+
+namespace
+{
+/*
+ * Threads are host threads that pass the right to run between each other, so exactly one of them runs at any time.
+ * A thread that has to wait records its wake-up condition and deadline, and hands over to the next thread that
+ * can run; if there is none, the virtual time jumps to the nearest deadline.
+ * All of the state below is protected by g_scheduler_mutex; the code under test runs with the mutex released.
+ */
+struct Thread
+{
+    thread_t tcb;
+    chibios_rt::BaseThread* object;
+    std::function<bool ()> condition;       ///< Empty if the thread is ready to run
+    systime_t deadline;
+    bool has_deadline;
+    bool exited;
+};
+
+/*
+ * Never destroyed, because the threads that are still blocked when the process exits keep using them.
+ */
+std::mutex& g_scheduler_mutex = *new std::mutex;
+std::condition_variable& g_scheduler_cv = *new std::condition_variable;
+std::list<Thread>& g_threads = *new std::list<Thread>{ Thread{ { "main", NORMALPRIO }, nullptr, {}, 0, false, false } };
+Thread* g_running = &g_threads.front();
+thread_local Thread* t_self = &g_threads.front();
+
+systime_t g_system_time = 0;
+bool g_log_enabled = false;
+
+unsigned g_critical_section_nesting = 0;
+
+bool hasExpired(const Thread& t)
+{
+    return t.has_deadline && (systime_t(g_system_time - t.deadline) < (TIME_INFINITE / 2));
+}
+
+bool canRun(const Thread& t)
+{
+    return !t.exited && (!t.condition || t.condition() || hasExpired(t));
+}
+
+/**
+ * Passes control to another thread that can run, advancing the time if necessary, and waits until it comes back.
+ * The calling thread must have recorded its wake-up condition, unless it has exited; the latter returns immediately.
+ */
+void switchAway(std::unique_lock<std::mutex>& lock)
+{
+    Thread* const self = t_self;
+    for (;;)
+    {
+        // Round robin, starting after the current thread, so that every thread gets to run
+        auto it = std::find_if(g_threads.begin(), g_threads.end(), [self](const Thread& t) { return &t == self; });
+        for (std::size_t i = 0; i < g_threads.size(); i++)
+        {
+            if (++it == g_threads.end())
+            {
+                it = g_threads.begin();
+            }
+            if (canRun(*it))
+            {
+                g_running = &*it;
+                if ((g_running != self) && !self->exited)
+                {
+                    g_scheduler_cv.notify_all();
+                    g_scheduler_cv.wait(lock, [self]() { return g_running == self; });
+                }
+                g_scheduler_cv.notify_all();
+                return;
+            }
+        }
+
+        // All threads are blocked, so the time goes by until the nearest deadline
+        const Thread* nearest = nullptr;
+        for (const auto& t : g_threads)
+        {
+            if (!t.exited && t.has_deadline &&
+                ((nearest == nullptr) || (systime_t(t.deadline - g_system_time) < systime_t(nearest->deadline -
+                                                                                            g_system_time))))
+            {
+                nearest = &t;
+            }
+        }
+        if (nearest == nullptr)
+        {
+            lock.unlock();
+            chSysHalt("shim: deadlock, all threads are blocked forever");
+        }
+        g_system_time = nearest->deadline;
+    }
+}
+
+void threadMain(Thread* self)
+{
+    t_self = self;
+    {
+        std::unique_lock<std::mutex> lock(g_scheduler_mutex);
+        g_scheduler_cv.wait(lock, [self]() { return g_running == self; });
+    }
+
+    self->object->main();
+
+    std::unique_lock<std::mutex> lock(g_scheduler_mutex);
+    self->exited = true;
+    switchAway(lock);
+}
+
+}
+
+namespace shim
+{
+
+void advanceTime(systime_t interval)
+{
+    std::lock_guard<std::mutex> lock(g_scheduler_mutex);
+    g_system_time += interval;
+}
+
+bool waitUntil(const std::function<bool ()>& condition, systime_t timeout)
+{
+    ASSERT_ALWAYS(g_critical_section_nesting == 0);     // Can't block in a critical section
+
+    std::unique_lock<std::mutex> lock(g_scheduler_mutex);
+    Thread* const self = t_self;
+    self->condition = condition;
+    self->has_deadline = timeout != TIME_INFINITE;
+    self->deadline = systime_t(g_system_time + timeout);
+
+    bool satisfied = condition();
+    while (!satisfied && !hasExpired(*self))
+    {
+        switchAway(lock);
+        satisfied = condition();
+    }
+
+    self->condition = nullptr;
+    self->has_deadline = false;
+    return satisfied;
+}
+
+thread_t* startThread(chibios_rt::BaseThread* thread, tprio_t prio)
+{
+    Thread* t = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_scheduler_mutex);
+        g_threads.push_back(Thread{ { "", prio }, thread, {}, 0, false, false });
+        t = &g_threads.back();
+    }
+    // The new thread waits for its turn, which comes when the current thread blocks
+    std::thread(&threadMain, t).detach();
+    return &t->tcb;
+}
+
+void setLogEnabled(bool enabled)
+{
+    g_log_enabled = enabled;
+}
+
+LoopbackChannel::LoopbackChannel()
+{
+    static const ::BaseChannelVMT vmt = { &LoopbackChannel::writeImpl, &LoopbackChannel::readImpl };
+    base_.vmt = &vmt;
+}
+
+void LoopbackChannel::push(const void* data, std::size_t size)
+{
+    auto p = static_cast<const std::uint8_t*>(data);
+    rx_.insert(rx_.end(), p, p + size);
+}
+
+std::size_t LoopbackChannel::writeImpl(::BaseChannel* ip, const std::uint8_t* bp, std::size_t n, systime_t)
+{
+    auto self = reinterpret_cast<LoopbackChannel*>(ip);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        if (self->on_transmit)
+        {
+            self->on_transmit(bp[i]);
+        }
+        else
+        {
+            self->transmitted.push_back(bp[i]);
+        }
+    }
+    return n;
+}
+
+std::size_t LoopbackChannel::readImpl(::BaseChannel* ip, std::uint8_t* bp, std::size_t n, systime_t timeout)
+{
+    auto self = reinterpret_cast<LoopbackChannel*>(ip);
+    (void)waitUntil([self, n]() { return self->rx_.size() >= n; }, timeout);
+    std::size_t i = 0;
+    while ((i < n) && !self->rx_.empty())
+    {
+        bp[i++] = self->rx_.front();
+        self->rx_.pop_front();
+    }
+    return i;
+}
+
+}
+
+/*
+ * Kernel API
+ */
+extern "C"
+{
+
+void chSysHalt(const char* reason)
+{
+    std::fprintf(stderr, "HALT: %s\n", reason);
+    std::fflush(stderr);
+    std::abort();
+}
+
+syssts_t chSysGetStatusAndLockX(void)
+{
+    return syssts_t(g_critical_section_nesting++);
+}
+
+void chSysRestoreStatusX(syssts_t sts)
+{
+    ASSERT_ALWAYS(g_critical_section_nesting == (sts + 1U));
+    g_critical_section_nesting--;
+}
+
+void chSysLock(void)
+{
+    ASSERT_ALWAYS(g_critical_section_nesting == 0);
+    g_critical_section_nesting++;
+}
+
+void chSysUnlock(void)
+{
+    ASSERT_ALWAYS(g_critical_section_nesting == 1);
+    g_critical_section_nesting--;
+}
+
+void chSysLockFromISR(void)   { chSysLock(); }
+void chSysUnlockFromISR(void) { chSysUnlock(); }
+
+rtcnt_t chSysGetRealtimeCounterX(void)
+{
+    using namespace std::chrono;
+    return rtcnt_t(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+systime_t chVTGetSystemTime(void)            { return g_system_time; }
+systime_t chVTGetSystemTimeX(void)           { return g_system_time; }
+systime_t chVTTimeElapsedSinceX(systime_t s) { return systime_t(g_system_time - s); }
+
+void chThdSleep(systime_t time)
+{
+    ASSERT_ALWAYS(time != TIME_INFINITE);   // Would never wake up
+    (void)shim::waitUntil([]() { return false; }, time);
+}
+
+thread_t* chThdGetSelfX(void)
+{
+    return &t_self->tcb;
+}
+
+msg_t chThdWait(thread_t* tp)
+{
+    ASSERT_ALWAYS(tp != chThdGetSelfX());
+    const Thread* thread = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_scheduler_mutex);
+        for (const auto& t : g_threads)
+        {
+            thread = (&t.tcb == tp) ? &t : thread;
+        }
+    }
+    ASSERT_ALWAYS(thread != nullptr);
+    (void)shim::waitUntil([thread]() { return thread->exited; }, TIME_INFINITE);
+    return MSG_OK;
+}
+
+void chEvtSignal(thread_t*, eventmask_t)
+{
+}
+
+}
+
+/*
+ * C++ wrappers
+ */
+namespace chibios_rt
+{
+
+void Mutex::lock()
+{
+    ASSERT_ALWAYS(owner_ != chThdGetSelfX());   // Recursive locking would be a deadlock
+    (void)shim::waitUntil([this]() { return owner_ == nullptr; }, TIME_INFINITE);
+    owner_ = chThdGetSelfX();
+}
+
+void Mutex::unlock()
+{
+    ASSERT_ALWAYS(owner_ == chThdGetSelfX());
+    owner_ = nullptr;
+}
+
+bool Mutex::tryLock()
+{
+    if (owner_ != nullptr)
+    {
+        return false;
+    }
+    owner_ = chThdGetSelfX();
+    return true;
+}
+
+msg_t BinarySemaphore::wait(systime_t timeout)
+{
+    if (!shim::waitUntil([this]() { return !taken_; }, timeout))
+    {
+        return MSG_TIMEOUT;
+    }
+    taken_ = true;
+    return MSG_OK;
+}
+
+msg_t CounterSemaphore::wait(systime_t timeout)
+{
+    if (!shim::waitUntil([this]() { return count_ > 0; }, timeout))
+    {
+        return MSG_TIMEOUT;
+    }
+    count_--;
+    return MSG_OK;
+}
+
+msg_t ThreadReference::wait()
+{
+    return chThdWait(thread_ref);
+}
+
+tprio_t BaseThread::setPriority(tprio_t prio)
+{
+    thread_t* const self = chThdGetSelfX();
+    const tprio_t old = self->prio;
+    self->prio = prio;
+    return old;
+}
+
+void BaseThread::setName(const char* name)
+{
+    chThdGetSelfX()->name = name;
+}
+
+}
+
+/*
+ * Parts of the library that are implemented in the platform-specific sources
+ */
+namespace os
+{
+
+void lowsyslog(const char* format, ...)
+{
+    if (g_log_enabled)
+    {
+        va_list vl;
+        va_start(vl, format);
+        std::vfprintf(stderr, format, vl);
+        va_end(vl);
+    }
+}
+
+}
+
+/*
+ * Newlib extensions
+ */
+extern "C" float atoff(const char* str)
+{
+    return std::strtof(str, nullptr);
+}
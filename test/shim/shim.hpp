@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Controls of the host shim that are available to the tests.
+ */
+
+#pragma once
+
+#include <ch.hpp>
+#include <hal.h>
+#include "newlib.h"
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <functional>
+
+namespace shim
+{
+/**
+ * Advances the virtual system time, see ch.h.
+ */
+void advanceTime(systime_t interval);
+
+/**
+ * Blocks the calling thread until the condition is satisfied or the timeout expires, letting other threads run.
+ * This is the basis of all blocking primitives of the shim.
+ * @return True if the condition is satisfied, false on timeout.
+ */
+bool waitUntil(const std::function<bool ()>& condition, systime_t timeout);
+
+/**
+ * Enables the output of os::lowsyslog() to stderr; disabled by default to keep the test output readable.
+ */
+void setLogEnabled(bool enabled);
+
+/**
+ * Channel that connects the code under test with the test.
+ * The bytes pushed by the test are read by the code under test; the bytes written by the code under test are
+ * passed to the handler, which can respond by pushing more data, or are accumulated if there is no handler.
+ * If there is not enough data to read, the read operation waits until the timeout expires.
+ */
+class LoopbackChannel
+{
+    ::BaseChannel base_;            // Must be the first member, the channel functions cast it back
+
+    std::deque<std::uint8_t> rx_;
+
+    static std::size_t writeImpl(::BaseChannel* ip, const std::uint8_t* bp, std::size_t n, systime_t timeout);
+    static std::size_t readImpl(::BaseChannel* ip, std::uint8_t* bp, std::size_t n, systime_t timeout);
+
+public:
+    std::function<void (std::uint8_t)> on_transmit;
+    std::vector<std::uint8_t> transmitted;
+
+    LoopbackChannel();
+
+    LoopbackChannel(const LoopbackChannel&) = delete;
+    LoopbackChannel& operator=(const LoopbackChannel&) = delete;
+
+    void push(const void* data, std::size_t size);
+    void push(std::uint8_t byte) { push(&byte, 1); }
+
+    std::size_t getNumPending() const { return rx_.size(); }
+
+    ::BaseChannel* getChannel() { return &base_; }
+};
+
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Minimal unit test framework for the host build; see the makefile in this directory.
+ * Every test executable consists of one or more test sources and main.cpp, which runs all registered cases:
+ *
+ *      TEST_CASE(StringConcatenation)
+ *      {
+ *          CHECK(...);
+ *          REQUIRE(...);           // Returns from the test case on failure
+ *      }
+ *
+ * The command line arguments, if any, select the test cases whose names contain any of them.
+ * The option -v enables the debug output of the library.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+namespace test
+{
+
+using Function = void (*)();
+
+class Registrar
+{
+public:
+    Registrar(const char* name, Function function);
+};
+
+inline bool streq(const char* a, const char* b)
+{
+    return std::strcmp(a, b) == 0;
+}
+
+/**
+ * Records the outcome of a check; prints the failure message.
+ * @return The outcome.
+ */
+bool check(bool condition, const char* expression, const char* file, int line);
+
+/**
+ * Runs the function in a child process, so that it can terminate the process or modify the global state
+ * (e.g. initialize the config engine) without affecting the other test cases.
+ * @return True if the function returned normally and all of its checks passed.
+ */
+bool runIsolated(const std::function<void ()>& function);
+
+/**
+ * @return True if the function halted the system, e.g. by failing ASSERT_ALWAYS().
+ */
+bool halts(const std::function<void ()>& function);
+
+/**
+ * Allocates memory that is shared with the child processes started by @ref runIsolated(); it is never freed.
+ * Use it to pass data between isolated runs, e.g. the contents of the config storage.
+ */
+void* allocateShared(std::size_t size);
+
+}
+
+#define TEST_CASE(name)                                                     \
+    static void test_case_##name();                                         \
+    static ::test::Registrar test_registrar_##name(#name, &test_case_##name); \
+    static void test_case_##name()
+
+/// Evaluates to the outcome of the check
+#define CHECK(x)        ::test::check(bool(x), #x, __FILE__, __LINE__)
+
+#define REQUIRE(x)                                                          \
+    do {                                                                    \
+        if (!::test::check(bool(x), #x, __FILE__, __LINE__)) {              \
+            return;                                                         \
+        }                                                                   \
+    } while (0)
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "test.hpp"
+#include <zubax_chibios/util/base64.hpp>
+#include <string>
+#include <vector>
+#include <random>
+
+namespace base64 = os::base64;
+
+namespace
+{
+
+using Bytes = std::vector<std::uint8_t>;
+
+Bytes makeBytes(const char* s)
+{
+    return Bytes(s, s + std::strlen(s));
+}
+
+std::string encode(const Bytes& data)
+{
+    std::vector<char> buffer(base64::predictEncodedDataLength(data.size()) + 1U);
+    return base64::encode(data, buffer.data());
+}
+
+bool decode(const char* in, Bytes& out)
+{
+    out.resize(((std::strlen(in) % 4U) == 0) ? base64::predictDecodedDataLength(in) : 0U);
+    return base64::decode(out, in);
+}
+
+/// Straightforward implementation of RFC 4648 to compare against
+std::string encodeReference(const Bytes& data)
+{
+    static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (std::size_t i = 0; i < data.size(); i += 3)
+    {
+        const std::size_t n = std::min<std::size_t>(3, data.size() - i);
+        std::uint32_t x = 0;
+        for (std::size_t k = 0; k < 3; k++)
+        {
+            x = (x << 8) | ((k < n) ? data[i + k] : 0U);
+        }
+        for (std::size_t k = 0; k < 4; k++)
+        {
+            out += (k <= n) ? Alphabet[(x >> (18U - k * 6U)) & 0x3FU] : '=';
+        }
+    }
+    return out;
+}
+
+Bytes makeRandomBytes(std::mt19937& rng, std::size_t size)
+{
+    Bytes out(size);
+    for (auto& x : out)
+    {
+        x = std::uint8_t(rng());
+    }
+    return out;
+}
+
+}
+
+TEST_CASE(EncodeKnownVectors)
+{
+    // RFC 4648, section 10
+    CHECK(encode(makeBytes("")) == "");
+    CHECK(encode(makeBytes("f")) == "Zg==");
+    CHECK(encode(makeBytes("fo")) == "Zm8=");
+    CHECK(encode(makeBytes("foo")) == "Zm9v");
+    CHECK(encode(makeBytes("foob")) == "Zm9vYg==");
+    CHECK(encode(makeBytes("fooba")) == "Zm9vYmE=");
+    CHECK(encode(makeBytes("foobar")) == "Zm9vYmFy");
+    CHECK(encode(Bytes{0xFF, 0xFE, 0x00, 0x80}) == "//4AgA==");
+}
+
+TEST_CASE(DecodeKnownVectors)
+{
+    Bytes out;
+    CHECK(decode("", out) && out.empty());
+    CHECK(decode("Zg==", out) && (out == makeBytes("f")));
+    CHECK(decode("Zm8=", out) && (out == makeBytes("fo")));
+    CHECK(decode("Zm9v", out) && (out == makeBytes("foo")));
+    CHECK(decode("Zm9vYmE=", out) && (out == makeBytes("fooba")));
+    CHECK(decode("Zm9vYmFy", out) && (out == makeBytes("foobar")));
+    CHECK(decode("//4AgA==", out) && (out == (Bytes{0xFF, 0xFE, 0x00, 0x80})));
+}
+
+TEST_CASE(DecodeInvalid)
+{
+    Bytes out;
+    CHECK(!decode("Zm9", out));                 // Not a multiple of 4
+    CHECK(!decode("Zm9!", out));                // Invalid symbol
+    CHECK(!decode("Zm 9", out));                // Whitespace is not accepted by the one-shot decoder
+    CHECK(!decode("Z===", out));                // Too much padding
+    CHECK(!decode("QQ=A", out));                // Data after padding
+    CHECK(!decode("QQ==QUFB", out));            // Padding in the middle
+
+    Bytes wrong_size(2);
+    CHECK(!base64::decode(wrong_size, "Zm9v"));
+    CHECK(!base64::decode(wrong_size, nullptr));
+}
+
+TEST_CASE(RandomRoundTrip)
+{
+    std::mt19937 rng(42);
+    for (int i = 0; i < 5000; i++)
+    {
+        const Bytes data = makeRandomBytes(rng, rng() % 100U);
+        const std::string encoded = encode(data);
+        REQUIRE(encoded == encodeReference(data));
+        REQUIRE(encoded.size() == base64::predictEncodedDataLength(data.size()));
+
+        Bytes decoded;
+        REQUIRE(decode(encoded.c_str(), decoded));
+        REQUIRE(decoded == data);
+    }
+}
+
+TEST_CASE(StreamEncoder)
+{
+    std::mt19937 rng(42);
+    for (int i = 0; i < 2000; i++)
+    {
+        const Bytes data = makeRandomBytes(rng, rng() % 100U);
+
+        base64::StreamEncoder encoder;
+        std::string encoded;
+        std::size_t offset = 0;
+        while (offset < data.size())
+        {
+            const std::size_t chunk = std::min<std::size_t>(rng() % 8U, data.size() - offset);
+            std::vector<char> buffer(base64::StreamEncoder::predictFeedOutputLength(chunk));
+            const std::size_t n = encoder.feed(data.data() + offset, chunk, buffer.data());
+            REQUIRE(n <= buffer.size());
+            encoded.append(buffer.data(), n);
+            offset += chunk;
+        }
+        char tail[base64::StreamEncoder::MaxFinishOutputLength];
+        encoded.append(tail, encoder.finish(tail));
+
+        REQUIRE(encoded == encodeReference(data));
+    }
+}
+
+TEST_CASE(StreamDecoderWholeInput)
+{
+    base64::StreamDecoder decoder;
+    std::uint8_t out[16];
+
+    CHECK(decoder.feed("Zm9v\r\nYmE=", 10, out) == 5);
+    CHECK(std::memcmp(out, "fooba", 5) == 0);
+    CHECK(decoder.finish() == 0);
+
+    CHECK(decoder.feed("Zm9v YmFy", 9, out) == 6);
+    CHECK(std::memcmp(out, "foobar", 6) == 0);
+    CHECK(decoder.finish() == 0);
+
+    CHECK(decoder.feed("Zm9", 3, out) == 0);
+    CHECK(decoder.finish() == -EINVAL);         // Truncated
+
+    CHECK(decoder.feed("Zm!v", 4, out) == -EINVAL);
+    CHECK(decoder.feed("Zm9v", 4, out) == -EINVAL);     // Sticky until reset
+    decoder.reset();
+    CHECK(decoder.feed("Zm9v", 4, out) == 3);
+
+    CHECK(decoder.feed("Zg==Zg==", 8, out) == -EINVAL); // Data after the end
+    CHECK(decoder.finish() == -EINVAL);
+}
+
+TEST_CASE(StreamDecoderSplitPadding)
+{
+    // The output buffers are exactly as large as predicted, so that the sanitizer catches any overflow
+    base64::StreamDecoder decoder;
+    std::vector<std::uint8_t> out1(base64::StreamDecoder::predictFeedOutputLength(3));
+    std::vector<std::uint8_t> out2(base64::StreamDecoder::predictFeedOutputLength(4));
+    std::vector<std::uint8_t> out3(base64::StreamDecoder::predictFeedOutputLength(1));
+    CHECK(out2.size() == 3);
+
+    CHECK(decoder.feed("QUJ", 3, out1.data()) == 0);
+    CHECK(decoder.feed("DQQ=", 4, out2.data()) == 3);
+    CHECK(std::memcmp(out2.data(), "ABC", 3) == 0);
+    CHECK(decoder.feed("=", 1, out3.data()) == 1);
+    CHECK(out3.at(0) == 'A');
+    CHECK(decoder.finish() == 0);
+}
+
+TEST_CASE(StreamDecoderRandomChunks)
+{
+    std::mt19937 rng(42);
+    for (int i = 0; i < 5000; i++)
+    {
+        const Bytes data = makeRandomBytes(rng, rng() % 100U);
+
+        // Random whitespace
+        std::string encoded;
+        for (char c : encodeReference(data))
+        {
+            while ((rng() % 8U) == 0)
+            {
+                encoded += " \r\n\t"[rng() % 4U];
+            }
+            encoded += c;
+        }
+
+        base64::StreamDecoder decoder;
+        Bytes decoded;
+        std::size_t offset = 0;
+        while (offset < encoded.size())
+        {
+            const std::size_t chunk = std::min<std::size_t>(rng() % 9U, encoded.size() - offset);
+            std::vector<std::uint8_t> buffer(base64::StreamDecoder::predictFeedOutputLength(chunk));
+            const int n = decoder.feed(&encoded[offset], chunk, buffer.data());
+            REQUIRE((n >= 0) && (std::size_t(n) <= buffer.size()));
+            decoded.insert(decoded.end(), buffer.begin(), buffer.begin() + n);
+            offset += chunk;
+        }
+        REQUIRE(decoder.finish() == 0);
+        REQUIRE(decoded == data);
+    }
+}
@@ -0,0 +1,661 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * The config engine can be initialized only once per process, and the parameters are registered globally,
+ * so every scenario is executed in an isolated process with its own set of parameters.
+ * The storage is shared between the processes, which allows to emulate restarts of the firmware.
+ */
+
+#include "test.hpp"
+#include <zubax_chibios/config/config.hpp>
+#include <zubax_chibios/util/base64.hpp>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <unistd.h>
+
+namespace config = os::config;
+
+namespace
+{
+
+constexpr int InitCodeRestored       = 1;
+constexpr int InitCodeLayoutMismatch = 2;
+constexpr int InitCodeCRCMismatch    = 3;
+constexpr int InitCodeMigrated       = 4;
+
+struct StorageMemory
+{
+    std::uint8_t data[config::MaxStorageSize];
+    unsigned num_writes;
+    unsigned num_erases;
+    std::size_t num_bytes_written;
+
+    void erase()
+    {
+        std::memset(data, 0xFF, sizeof(data));
+    }
+};
+
+/**
+ * Emulates the flash in the shared memory. The plain backend requires erasing before writing, like real flash.
+ */
+class RamStorage : public config::IStorageBackend
+{
+    StorageMemory& mem_;
+    const bool can_write_without_erase_;
+
+public:
+    RamStorage(StorageMemory& mem, bool can_write_without_erase) :
+        mem_(mem),
+        can_write_without_erase_(can_write_without_erase)
+    { }
+
+    int read(std::size_t offset, void* data, std::size_t len) override
+    {
+        if (!CHECK((offset + len) <= sizeof(mem_.data)))
+        {
+            return -EIO;
+        }
+        std::memcpy(data, &mem_.data[offset], len);
+        return 0;
+    }
+
+    int write(std::size_t offset, const void* data, std::size_t len) override
+    {
+        if (!CHECK((offset + len) <= sizeof(mem_.data)) ||
+            !CHECK(((offset % 2) == 0) && ((len % 2) == 0)))             // Half-word programming
+        {
+            return -EIO;
+        }
+        if (!can_write_without_erase_)
+        {
+            for (std::size_t i = 0; i < len; i++)
+            {
+                if (!CHECK(mem_.data[offset + i] == 0xFF))
+                {
+                    return -EIO;
+                }
+            }
+        }
+        std::memcpy(&mem_.data[offset], data, len);
+        mem_.num_writes++;
+        mem_.num_bytes_written += len;
+        return 0;
+    }
+
+    int erase() override
+    {
+        mem_.erase();
+        mem_.num_erases++;
+        return 0;
+    }
+
+    bool canWriteWithoutErase() const override { return can_write_without_erase_; }
+};
+
+StorageMemory& allocateStorage()
+{
+    auto mem = static_cast<StorageMemory*>(test::allocateShared(sizeof(StorageMemory)));
+    mem->erase();
+    mem->num_writes = 0;
+    mem->num_erases = 0;
+    mem->num_bytes_written = 0;
+    return *mem;
+}
+
+/**
+ * Runs the CLI command, e.g. "set foo 123", and returns its output.
+ */
+std::string runCLI(const char* command, int* out_result = nullptr)
+{
+    std::vector<std::string> words;
+    for (const char* p = command; *p != '\0';)
+    {
+        const std::size_t len = std::strcspn(p, " ");
+        if (len > 0)
+        {
+            words.emplace_back(p, len);
+        }
+        p += len + ((p[len] == ' ') ? 1U : 0U);
+    }
+    std::vector<char*> argv;
+    for (auto& w : words)
+    {
+        argv.push_back(&w[0]);
+    }
+
+    std::fflush(stdout);
+    std::FILE* const capture = std::tmpfile();
+    const int saved_stdout = ::dup(STDOUT_FILENO);
+    (void)::dup2(::fileno(capture), STDOUT_FILENO);
+
+    const int result = config::executeCLICommand(int(argv.size()), argv.data());
+
+    std::fflush(stdout);
+    (void)::dup2(saved_stdout, STDOUT_FILENO);
+    (void)::close(saved_stdout);
+
+    std::string output;
+    std::rewind(capture);
+    for (int c = std::fgetc(capture); c != EOF; c = std::fgetc(capture))
+    {
+        output += char(c);
+    }
+    std::fclose(capture);
+
+    if (out_result != nullptr)
+    {
+        *out_result = result;
+    }
+    return output;
+}
+
+}
+
+TEST_CASE(Defaults)
+{
+    StorageMemory& mem = allocateStorage();
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<int> p_int("int", 42, -100, 100);
+        config::Param<float> p_float("float", 0.5F, -1.F, 1.F);
+        config::Param<bool> p_bool("bool", true);
+        config::Param<const char*> p_string("string", "hello");
+        config::Param<std::uint8_t> p_u8("u8", 200, 0, 255);
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) == InitCodeLayoutMismatch);     // Blank storage
+
+        CHECK(p_int.get() == 42);
+        CHECK(os::float_eq::exactlyEqual(p_float.get(), 0.5F));
+        CHECK(p_bool.get());
+        CHECK(test::streq(p_string.get().c_str(), "hello"));
+        CHECK(p_u8.get() == 200);
+
+        CHECK(configIndexByName("int") == p_int.index);
+        CHECK(configIndexByName("nope") < 0);
+        CHECK(test::streq(configNameByIndex(p_bool.index), "bool"));
+        CHECK(configNameByIndex(5) == nullptr);
+        CHECK(os::float_eq::exactlyEqual(configGet("int"), 42.F));
+
+        CHECK(config::getImageSize() <= config::MaxImageSize);
+        CHECK(mem.num_writes == 0);
+    }));
+}
+
+TEST_CASE(SetGet)
+{
+    StorageMemory& mem = allocateStorage();
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<int> p_int("int", 42, -100, 100);
+        config::Param<int> p_big("big", 0, -2147483647 - 1, 2147483647);
+        config::Param<float> p_float("float", 0.5F, -1.F, 1.F);
+        config::Param<bool> p_bool("bool", true);
+        config::Param<const char*> p_string("string", "hello");
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) >= 0);
+        const unsigned initial_modification_counter = config::getModificationCounter();
+
+        CHECK(p_int.set(-100) == 0);
+        CHECK(p_int.get() == -100);
+        CHECK(p_int.isMin());
+        CHECK(p_int.set(101) == -EINVAL);
+        CHECK(p_int.get() == -100);
+        CHECK(configSet("int", 1.5F) == -EINVAL);          // Not an integer
+        CHECK(configSet("int", 99.F) == 0);
+        CHECK(p_int.get() == 99);
+
+        // Integers are stored exactly, beyond the precision of float
+        CHECK(p_big.set(2147483647) == 0);
+        CHECK(p_big.get() == 2147483647);
+        CHECK(p_big.set(16777217) == 0);
+        CHECK(p_big.get() == 16777217);
+
+        CHECK(p_float.set(-1.F) == 0);
+        CHECK(os::float_eq::exactlyEqual(p_float.get(), -1.F));
+        CHECK(p_float.set(1.01F) == -EINVAL);
+
+        CHECK(p_bool.set(false) == 0);
+        CHECK(!p_bool.get());
+        CHECK(configSet("bool", 0.5F) == -EINVAL);
+
+        CHECK(p_string.set("world") == 0);
+        CHECK(test::streq(p_string.get().c_str(), "world"));
+        CHECK(p_string.set("0123456789abcdefX") == -EINVAL);  // Too long
+        CHECK(configSet("string", 1.F) < 0);
+
+        char small_buffer[4];
+        CHECK(configGetStringByIndex(p_string.index, small_buffer, sizeof(small_buffer)) == 5);  // Truncated
+        CHECK(test::streq(small_buffer, "wor"));
+        CHECK(configGetStringByIndex(p_int.index, small_buffer, sizeof(small_buffer)) == -EINVAL);
+
+        CHECK(configSet("nope", 1.F) < 0);
+        CHECK(configSetByIndex(100, 1.F) == -ENOENT);
+
+        CHECK(config::hasUnsavedChanges());
+        CHECK(config::getModificationCounter() != initial_modification_counter);
+    }));
+}
+
+TEST_CASE(SaveRestore)
+{
+    for (bool can_write_without_erase : { false, true })
+    {
+        StorageMemory& mem = allocateStorage();
+        const auto make_params_and_init = [&](int expected_init_code, const std::function<void (
+                                                    config::Param<int>&, config::Param<float>&,
+                                                    config::Param<bool>&, config::Param<bool>&,
+                                                    config::Param<const char*>&)>& continuation)
+        {
+            return test::runIsolated([&]()
+            {
+                config::Param<int> p_int("int", 42, -100, 100);
+                config::Param<float> p_float("float", 0.5F, -1.F, 1.F);
+                config::Param<bool> p_bool_a("bool_a", true);
+                config::Param<bool> p_bool_b("bool_b", false);
+                config::Param<const char*> p_string("string", "hello");
+
+                RamStorage storage(mem, can_write_without_erase);
+                REQUIRE(config::init(&storage) == expected_init_code);
+                continuation(p_int, p_float, p_bool_a, p_bool_b, p_string);
+            });
+        };
+
+        CHECK(make_params_and_init(InitCodeLayoutMismatch,
+                                   [&](config::Param<int>& p_int, config::Param<float>& p_float,
+                                       config::Param<bool>& p_bool_a, config::Param<bool>&,
+                                       config::Param<const char*>& p_string)
+        {
+            CHECK(p_int.set(-7) == 0);
+            CHECK(p_float.set(0.25F) == 0);
+            CHECK(p_bool_a.set(false) == 0);
+            CHECK(p_string.set("world") == 0);
+            CHECK(config::save() == 0);
+            CHECK(!config::hasUnsavedChanges());
+            CHECK(mem.num_writes > 0);
+            CHECK(config::save() == 0);                 // Nothing to do
+        }));
+
+        // Restart; modify one bool and check that the incremental save writes only its half-word and the CRC
+        mem.num_writes = 0;
+        mem.num_bytes_written = 0;
+        CHECK(make_params_and_init(InitCodeRestored,
+                                   [&](config::Param<int>& p_int, config::Param<float>& p_float,
+                                       config::Param<bool>& p_bool_a, config::Param<bool>& p_bool_b,
+                                       config::Param<const char*>& p_string)
+        {
+            CHECK(p_int.get() == -7);
+            CHECK(os::float_eq::exactlyEqual(p_float.get(), 0.25F));
+            CHECK(!p_bool_a.get());
+            CHECK(!p_bool_b.get());
+            CHECK(test::streq(p_string.get().c_str(), "world"));
+            CHECK(!config::hasUnsavedChanges());
+
+            CHECK(p_bool_b.set(true) == 0);
+            CHECK(p_bool_a.set(true) == 0);
+            CHECK(config::save() == 0);
+        }));
+        if (can_write_without_erase)
+        {
+            CHECK(mem.num_writes == 2);
+            CHECK(mem.num_bytes_written == 6);
+            CHECK(mem.num_erases == 0);
+        }
+        else
+        {
+            CHECK(mem.num_erases == 2);
+        }
+
+        CHECK(make_params_and_init(InitCodeRestored,
+                                   [&](config::Param<int>& p_int, config::Param<float>&,
+                                       config::Param<bool>& p_bool_a, config::Param<bool>& p_bool_b,
+                                       config::Param<const char*>&)
+        {
+            CHECK(p_int.get() == -7);
+            CHECK(p_bool_a.get());
+            CHECK(p_bool_b.get());
+
+            CHECK(configErase() == 0);
+            CHECK(p_int.get() == 42);
+            CHECK(!p_bool_b.get());
+        }));
+
+        CHECK(make_params_and_init(InitCodeLayoutMismatch,
+                                   [&](config::Param<int>& p_int, config::Param<float>&,
+                                       config::Param<bool>&, config::Param<bool>&,
+                                       config::Param<const char*>&)
+        {
+            CHECK(p_int.get() == 42);
+        }));
+    }
+}
+
+TEST_CASE(Migration)
+{
+    StorageMemory& mem = allocateStorage();
+
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<int> p_a("a", 1, 0, 100);
+        config::Param<int> p_removed("removed", 2, 0, 100);
+        config::Param<bool> p_flag("flag", false);
+        config::Param<float> p_retyped("retyped", 0.F, -10.F, 10.F);
+        config::Param<int> p_narrowed("narrowed", 0, 0, 100);
+        config::Param<const char*> p_name("name", "");
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) >= 0);
+        CHECK(p_a.set(11) == 0);
+        CHECK(p_removed.set(22) == 0);
+        CHECK(p_flag.set(true) == 0);
+        CHECK(p_retyped.set(3.F) == 0);
+        CHECK(p_narrowed.set(90) == 0);
+        CHECK(p_name.set("node") == 0);
+        CHECK(config::save() == 0);
+    }));
+
+    // Reordered, one removed, one added, one changed its type, one changed its range
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<const char*> p_name("name", "");
+        config::Param<int> p_added("added", 5, 0, 100);
+        config::Param<int> p_retyped("retyped", 0, -10, 10);
+        config::Param<bool> p_flag("flag", false);
+        config::Param<int> p_narrowed("narrowed", 0, 0, 50);
+        config::Param<int> p_a("a", 1, 0, 100);
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) == InitCodeMigrated);
+        CHECK(test::streq(p_name.get().c_str(), "node"));
+        CHECK(p_added.get() == 5);
+        CHECK(p_retyped.get() == 0);
+        CHECK(p_flag.get());
+        CHECK(p_narrowed.get() == 0);
+        CHECK(p_a.get() == 11);
+
+        CHECK(config::hasUnsavedChanges());            // The new layout is not stored yet
+        CHECK(config::save() == 0);
+    }));
+
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<const char*> p_name("name", "");
+        config::Param<int> p_added("added", 5, 0, 100);
+        config::Param<int> p_retyped("retyped", 0, -10, 10);
+        config::Param<bool> p_flag("flag", false);
+        config::Param<int> p_narrowed("narrowed", 0, 0, 50);
+        config::Param<int> p_a("a", 1, 0, 100);
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) == InitCodeRestored);
+        CHECK(p_a.get() == 11);
+    }));
+}
+
+TEST_CASE(CRCMismatch)
+{
+    StorageMemory& mem = allocateStorage();
+    const auto run = [&](int expected_init_code, int expected_value, int new_value)
+    {
+        return test::runIsolated([&]()
+        {
+            config::Param<int> p_a("a", 1, 0, 100);
+            config::Param<int> p_b("b", 2, 0, 100);
+
+            RamStorage storage(mem, false);
+            REQUIRE(config::init(&storage) == expected_init_code);
+            CHECK(p_a.get() == expected_value);
+            CHECK(p_b.get() == 2);
+            if (new_value > 0)
+            {
+                CHECK(p_a.set(new_value) == 0);
+                CHECK(config::save() == 0);
+            }
+        });
+    };
+
+    CHECK(run(InitCodeLayoutMismatch, 1, 50));
+    CHECK(run(InitCodeRestored, 50, 0));
+
+    // Corrupt the last byte of the values
+    std::size_t last = sizeof(mem.data) - 1;
+    while (mem.data[last] == 0xFF)
+    {
+        last--;
+    }
+    mem.data[last] ^= 1U;
+    CHECK(run(InitCodeCRCMismatch, 1, 0));
+}
+
+TEST_CASE(ExportImport)
+{
+    StorageMemory& mem = allocateStorage();
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<int> p_int("int", 42, -100, 100);
+        config::Param<bool> p_bool("bool", true);
+        config::Param<const char*> p_string("string", "hello");
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) >= 0);
+
+        std::uint8_t image[config::MaxImageSize];
+        CHECK(config::exportImage(image, config::getImageSize() - 1) == -ENOSPC);
+        const int image_size = config::exportImage(image, sizeof(image));
+        REQUIRE(image_size == int(config::getImageSize()));
+
+        CHECK(p_int.set(0) == 0);
+        CHECK(p_bool.set(false) == 0);
+        CHECK(p_string.set("") == 0);
+
+        // Damaged images are rejected entirely
+        std::uint8_t damaged[config::MaxImageSize];
+        std::memcpy(damaged, image, std::size_t(image_size));
+        damaged[image_size - 1] ^= 0x80U;
+        CHECK(config::importImage(damaged, std::size_t(image_size)) == -EINVAL);
+        CHECK(config::importImage(image, std::size_t(image_size) - 1) == -EINVAL);
+        CHECK(p_int.get() == 0);
+
+        const unsigned modification_counter = config::getModificationCounter();
+        CHECK(config::importImage(image, std::size_t(image_size)) == 0);
+        CHECK(config::getModificationCounter() == modification_counter + 1);
+        CHECK(p_int.get() == 42);
+        CHECK(p_bool.get());
+        CHECK(test::streq(p_string.get().c_str(), "hello"));
+    }));
+}
+
+TEST_CASE(CLI)
+{
+    StorageMemory& mem = allocateStorage();
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<int> p_int("int", 42, -3000000, 3000000);
+        config::Param<float> p_float("float", 0.5F, -1.F, 1.F);
+        config::Param<const char*> p_string("string", "hello");
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) >= 0);
+
+        int result = 0;
+        std::string output = runCLI("list", &result);
+        CHECK(result == 0);
+        CHECK(output.find("int") != std::string::npos);
+        CHECK(output.find("string") != std::string::npos);
+
+        (void)runCLI("set int -2000001", &result);
+        CHECK(result == 0);
+        CHECK(p_int.get() == -2000001);
+        (void)runCLI("set int 1e3", &result);
+        CHECK(result == 0);
+        CHECK(p_int.get() == 1000);
+        (void)runCLI("set int 3000001", &result);
+        CHECK(result == -EINVAL);
+        (void)runCLI("set float -0.25", &result);
+        CHECK(result == 0);
+        CHECK(os::float_eq::exactlyEqual(p_float.get(), -0.25F));
+        (void)runCLI("set string world", &result);
+        CHECK(result == 0);
+        CHECK(test::streq(p_string.get().c_str(), "world"));
+        (void)runCLI("set nope 1", &result);
+        CHECK(result < 0);
+        (void)runCLI("set int", &result);
+        CHECK(result == -EINVAL);
+
+        output = runCLI("get int", &result);
+        CHECK(result == 0);
+        CHECK(output.find("1000") != std::string::npos);
+
+        // The dump is the base64 of the exported image
+        output = runCLI("dump", &result);
+        CHECK(result == 0);
+        while (!output.empty() && (output.back() == '\n'))
+        {
+            output.pop_back();
+        }
+        std::uint8_t image[config::MaxImageSize];
+        const int image_size = config::exportImage(image, sizeof(image));
+        REQUIRE(image_size > 0);
+        std::vector<char> encoded(os::base64::predictEncodedDataLength(std::size_t(image_size)) + 1U);
+        const std::vector<std::uint8_t> image_vector(image, image + image_size);
+        CHECK(output == os::base64::encode(image_vector, encoded.data()));
+
+        // Loading it back in two chunks; the first one is a multiple of 3 bytes
+        CHECK(p_int.set(0) == 0);
+        const std::string first = "load " + output.substr(0, 8);
+        const std::string second = "load 6 " + output.substr(8);
+        (void)runCLI(first.c_str(), &result);
+        CHECK(result == 0);
+        CHECK(p_int.get() == 0);
+        (void)runCLI(second.c_str(), &result);
+        CHECK(result == 0);
+        CHECK(p_int.get() == 1000);
+
+        (void)runCLI("load 5 AAAA", &result);
+        CHECK(result == -EINVAL);
+        (void)runCLI("load !!!!", &result);
+        CHECK(result == -EINVAL);
+
+        (void)runCLI("save", &result);
+        CHECK(result == 0);
+        CHECK(!config::hasUnsavedChanges());
+
+        (void)runCLI("bogus", &result);
+        CHECK(result == -EINVAL);
+    }));
+}
+
+TEST_CASE(ListenerCanUseConfig)
+{
+    StorageMemory& mem = allocateStorage();
+    CHECK(test::runIsolated([&]()
+    {
+        config::Param<int> p_source("source", 0, 0, 100);
+        config::Param<int> p_mirror("mirror", 0, 0, 100);
+
+        // Mirrors one parameter into another from the notification, which must not deadlock
+        struct Mirror : public config::IChangeListener
+        {
+            int source_index = -1;
+            unsigned num_calls = 0;
+
+            void onParamChanged(int index) override
+            {
+                num_calls++;
+                if (index == source_index)
+                {
+                    (void)configSet("mirror", configGetByIndex(index));
+                    (void)config::hasUnsavedChanges();
+                }
+            }
+        } mirror;
+        mirror.source_index = p_source.index;
+
+        config::ChangeTracker tracker;
+
+        CHECK(config::subscribe(&mirror) == 0);
+        CHECK(config::subscribe(&tracker) == 0);
+        CHECK(config::subscribe(nullptr) == -EINVAL);
+
+        RamStorage storage(mem, false);
+        REQUIRE(config::init(&storage) >= 0);
+        CHECK(mirror.num_calls == 0);                  // Nothing differs from the defaults
+
+        CHECK(p_source.set(17) == 0);
+        CHECK(p_mirror.get() == 17);
+        CHECK(mirror.num_calls == 2);
+        CHECK(tracker.fetch(p_source));
+        CHECK(tracker.fetch(p_mirror));
+        CHECK(!tracker.fetchAny());
+
+        CHECK(p_source.set(17) == 0);                  // Same value, no notification
+        CHECK(mirror.num_calls == 2);
+
+        CHECK(config::unsubscribe(&mirror) == 0);
+        CHECK(config::unsubscribe(&mirror) == -ENOENT);
+        CHECK(p_source.set(18) == 0);
+        CHECK(p_mirror.get() == 17);
+        CHECK(tracker.fetchAny());
+    }));
+}
+
+TEST_CASE(InvalidRegistrationHalts)
+{
+    CHECK(test::halts([]()
+    {
+        config::Param<int> a("same", 0, 0, 1);
+        config::Param<float> b("same", 0.F, 0.F, 1.F);
+    }));
+
+    CHECK(test::halts([]()
+    {
+        config::Param<int> a("bad_default", 2, 0, 1);
+    }));
+
+    CHECK(test::halts([]()
+    {
+        config::Param<const char*> a("long_default", "0123456789abcdefX");
+    }));
+
+    // Sanity check of the test itself
+    CHECK(!test::halts([]()
+    {
+        config::Param<int> a("a", 0, 0, 1);
+        config::Param<int> b("b", 0, 0, 1);
+    }));
+}
+
+TEST_CASE(IncrementalSaveBoolsOnly)
+{
+    // The first bool half-word is at offset zero when there are no other values
+    StorageMemory& mem = allocateStorage();
+    const auto run = [&](int expected_init_code, bool expected_a, bool expected_b, bool new_a, bool new_b)
+    {
+        return test::runIsolated([&]()
+        {
+            config::Param<bool> p_a("a", false);
+            config::Param<bool> p_b("b", false);
+
+            RamStorage storage(mem, true);
+            REQUIRE(config::init(&storage) == expected_init_code);
+            CHECK(p_a.get() == expected_a);
+            CHECK(p_b.get() == expected_b);
+            CHECK(p_a.set(new_a) == 0);
+            CHECK(p_b.set(new_b) == 0);
+            CHECK(config::save() == 0);
+        });
+    };
+
+    CHECK(run(InitCodeLayoutMismatch, false, false, false, false));
+    CHECK(run(InitCodeRestored, false, false, true, false));
+    CHECK(run(InitCodeRestored, true, false, true, true));
+    CHECK(run(InitCodeRestored, true, true, false, true));
+    CHECK(mem.num_erases == 0);
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * This file is built twice: with the lookup tables and with OS_CRC_USE_LOOKUP_TABLES=0.
+ */
+
+#include "test.hpp"
+#include <zubax_chibios/util/crc.hpp>
+#include <vector>
+#include <random>
+
+namespace crc = os::crc;
+
+namespace
+{
+
+const char CheckInput[] = "123456789";
+constexpr unsigned CheckInputLength = 9;
+
+std::vector<std::uint8_t> makeRandomBytes(std::mt19937& rng, std::size_t size)
+{
+    std::vector<std::uint8_t> out(size);
+    for (auto& x : out)
+    {
+        x = std::uint8_t(rng());
+    }
+    return out;
+}
+
+/**
+ * Feeds the data in random chunks at random alignments and checks that the result matches a single call.
+ */
+template <typename CRC>
+bool checkChunking(const CRC& prototype)
+{
+    std::mt19937 rng(42);
+    for (int i = 0; i < 1000; i++)
+    {
+        const auto data = makeRandomBytes(rng, 1U + rng() % 300U);     // add() does not accept null pointers
+
+        CRC whole = prototype;
+        whole.add(data.data(), unsigned(data.size()));
+
+        CRC bytewise = prototype;
+        for (auto x : data)
+        {
+            bytewise.add(x);
+        }
+
+        CRC chunked = prototype;
+        std::size_t offset = 0;
+        while (offset < data.size())
+        {
+            const std::size_t chunk = std::min<std::size_t>(rng() % 11U, data.size() - offset);
+            chunked.add(data.data() + offset, unsigned(chunk));
+            offset += chunk;
+        }
+
+        if (!CHECK(whole.get() == bytewise.get()) ||
+            !CHECK(whole.get() == chunked.get()))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+TEST_CASE(CRC16CCITTCheckValues)
+{
+    crc::CRC16CCITT xmodem;
+    xmodem.add(CheckInput, CheckInputLength);
+    CHECK(xmodem.get() == 0x31C3U);
+
+    crc::CRC16CCITT ccitt_false(0xFFFFU);
+    ccitt_false.add(CheckInput, CheckInputLength);
+    CHECK(ccitt_false.get() == 0x29B1U);
+
+    CHECK(checkChunking(crc::CRC16CCITT()));
+    CHECK(checkChunking(crc::CRC16CCITT(0xFFFFU)));
+}
+
+TEST_CASE(CRC32CheckValues)
+{
+    crc::CRC32 plain;
+    plain.add(CheckInput, CheckInputLength);
+    CHECK(plain.get() == 0x2DFD2D88U);
+
+    // The common CRC-32 (zlib, Ethernet) is the same algorithm with inverted initial value and output
+    crc::CRC32 standard(0xFFFFFFFFU);
+    standard.add(CheckInput, CheckInputLength);
+    CHECK(~standard.get() == 0xCBF43926U);
+
+    // Continuation
+    crc::CRC32 first;
+    first.add(CheckInput, 4);
+    crc::CRC32 second(first.get());
+    second.add(CheckInput + 4, CheckInputLength - 4);
+    CHECK(second.get() == plain.get());
+
+    CHECK(checkChunking(crc::CRC32()));
+    CHECK(checkChunking(crc::CRC32(0xFFFFFFFFU)));
+}
+
+TEST_CASE(CRC64WECheckValues)
+{
+    crc::CRC64WE c;
+    c.add(CheckInput, CheckInputLength);
+    CHECK(c.get() == 0x62EC59E3F1A4F00AULL);
+
+    CHECK(crc::CRC64WE().get() == 0);
+
+    CHECK(checkChunking(crc::CRC64WE()));
+}
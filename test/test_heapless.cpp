@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "test.hpp"
+#include <zubax_chibios/util/heapless.hpp>
+#include <string>
+#include <random>
+#include <limits>
+
+using namespace os::heapless;
+
+TEST_CASE(IntToString)
+{
+    CHECK(test::streq(intToString(0).c_str(), "0"));
+    CHECK(test::streq(intToString(-1).c_str(), "-1"));
+    CHECK(test::streq(intToString(123456789).c_str(), "123456789"));
+    CHECK(test::streq(intToString(std::numeric_limits<std::int32_t>::min()).c_str(), "-2147483648"));
+    CHECK(test::streq(intToString(std::numeric_limits<std::int64_t>::min()).c_str(), "-9223372036854775808"));
+    CHECK(test::streq(intToString(std::numeric_limits<std::uint64_t>::max()).c_str(), "18446744073709551615"));
+    CHECK(test::streq(intToString(std::int8_t(-128)).c_str(), "-128"));
+    CHECK(test::streq(intToString<16>(255).c_str(), "ff"));
+    CHECK(test::streq(intToString<16>(-255).c_str(), "-ff"));
+    CHECK(test::streq(intToString<2>(std::uint8_t(0xA5)).c_str(), "10100101"));
+    CHECK(test::streq(intToString<36>(35).c_str(), "z"));
+    CHECK(test::streq(intToString(true).c_str(), "1"));
+
+    std::mt19937 rng(42);
+    for (int i = 0; i < 10000; i++)
+    {
+        const auto x = std::int32_t(rng());
+        CHECK(test::streq(intToString(x).c_str(), std::to_string(x).c_str()));
+    }
+}
+
+TEST_CASE(StringBasics)
+{
+    String<8> s;
+    CHECK(s.empty());
+    CHECK(s.capacity() == 8);
+
+    s = "abc";
+    CHECK(s.size() == 3);
+    CHECK(s == "abc");
+    CHECK("abc" == s);
+    CHECK(!(s == "abcd"));
+
+    s += "defghijk";                    // Truncated at the capacity
+    CHECK(s.size() == 8);
+    CHECK(s == "abcdefgh");
+    CHECK(s.c_str()[8] == '\0');
+    CHECK(s.front() == 'a');
+    CHECK(s.back() == 'h');
+
+    s.clear();
+    s.append('x');
+    s.append(-42);
+    s.append(" ");
+    CHECK(s == "x-42 ");
+
+    CHECK(String<>("MiXeD").toLowerCase() == "mixed");
+    CHECK(String<>("MiXeD").toUpperCase() == "MIXED");
+
+    const auto joined = String<4>("ab") + String<4>("cd") + "ef";
+    CHECK(joined == "abcdef");
+    CHECK(joined.capacity() >= 8);
+}
+
+TEST_CASE(Formatting)
+{
+    CHECK(String<>("%d-%s").format(42, "x") == "42-x");
+    CHECK(format("%04x", 0xBEEF) == "beef");
+    CHECK("The %s answer is %d!"_format("Great", 42) == "The Great answer is 42!");
+    CHECK(concatenate("The answer is ", 42, '!') == "The answer is 42!");
+    CHECK(OS_HEAPLESS_FORMAT("{} + {} = {}", 2, 2, "4") == "2 + 2 = 4");
+    CHECK(OS_HEAPLESS_FORMAT("no placeholders") == "no placeholders");
+}
+
+TEST_CASE(FloatToString)
+{
+    CHECK(test::streq(floatToString(0.0F).c_str(), "0"));
+    CHECK(test::streq(floatToString(-0.0F).c_str(), "-0"));
+    CHECK(test::streq(floatToString(1.5F).c_str(), "1.5"));
+    CHECK(test::streq(floatToString(100.0F).c_str(), "100"));
+    CHECK(test::streq(floatToString(1e-5F, 3).c_str(), "1e-05"));
+    CHECK(test::streq(floatToString(std::numeric_limits<float>::infinity()).c_str(), "inf"));
+    CHECK(test::streq(floatToString(-std::numeric_limits<float>::infinity()).c_str(), "-inf"));
+    CHECK(test::streq(floatToString(std::numeric_limits<float>::quiet_NaN()).c_str(), "nan"));
+
+    // Must be the same as printf() for all floats, see impl_::formatFloat()
+    std::mt19937 rng(42);
+    for (int i = 0; i < 100000; i++)
+    {
+        std::uint32_t bits = std::uint32_t(rng());
+        float x = 0;
+        std::memcpy(&x, &bits, 4);
+        if (!std::isfinite(x))
+        {
+            continue;
+        }
+        const int precision = 1 + int(rng() % 9U);
+        char reference[64];
+        std::snprintf(reference, sizeof(reference), "%.*g", precision, double(x));
+        const auto s = floatToString(x, precision);
+        if (!CHECK(test::streq(s.c_str(), reference)))
+        {
+            std::printf("%s != %s\n", s.c_str(), reference);
+            break;
+        }
+    }
+}
+
+TEST_CASE(StaticVector)
+{
+    StaticVector<std::string, 3> v;
+    CHECK(v.empty());
+    CHECK(v.push_back("a"));
+    CHECK(v.emplace_back(2, 'b'));
+    CHECK(v.insert(v.begin(), "c") == v.begin());
+    CHECK(v.full());
+    CHECK(!v.push_back("d"));
+    CHECK(v.size() == 3);
+    CHECK((v[0] == "c") && (v[1] == "a") && (v[2] == "bb"));
+
+    v.erase(v.begin() + 1);
+    CHECK((v.size() == 2) && (v[0] == "c") && (v[1] == "bb"));
+
+    auto copy = v;
+    v.clear();
+    CHECK(v.empty());
+    CHECK((copy.size() == 2) && (copy.back() == "bb"));
+}
+
+TEST_CASE(RingBuffer)
+{
+    RingBuffer<int, 4> q;
+    int x = 0;
+    CHECK(!q.pop(x));
+    for (int i = 0; i < 4; i++)
+    {
+        CHECK(q.push(i));
+    }
+    CHECK(!q.push(4));
+    CHECK(q.size() == 4);
+
+    // Wrapping around many times
+    for (int i = 4; i < 1000; i++)
+    {
+        REQUIRE(q.pop(x));
+        CHECK(x == (i - 4));
+        CHECK(q.push(i));
+    }
+    CHECK(q.size() == 4);
+    q.clear();
+    CHECK(q.empty());
+}
+
+TEST_CASE(MPSCRingBuffer)
+{
+    MPSCRingBuffer<int, 4> q;
+    int x = 0;
+    CHECK(!q.pop(x));
+    for (int i = 0; i < 1000; i++)
+    {
+        CHECK(q.push(i));
+        CHECK(q.push(-i));
+        REQUIRE(q.pop(x));
+        CHECK(x == i);
+        REQUIRE(q.pop(x));
+        CHECK(x == -i);
+    }
+    CHECK(!q.pop(x));
+}
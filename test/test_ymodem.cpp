@@ -0,0 +1,653 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * The receiver is connected to a model of the sender via the loopback channel of the shim.
+ * The sender reacts to every byte transmitted by the receiver synchronously, so no threads are needed, except the
+ * writer of the pipelined receiver, which runs when the receiver blocks on a full queue or on the final drain.
+ */
+
+#include "test.hpp"
+#include <shim/shim.hpp>
+#include <zubax_chibios/bootloader/loaders/ymodem.hpp>
+#include <zubax_chibios/util/crc.hpp>
+#include <vector>
+#include <string>
+#include <random>
+
+namespace ymodem = bootloader::ymodem_loader;
+
+namespace
+{
+
+constexpr std::uint8_t SOH = 0x01;
+constexpr std::uint8_t STX = 0x02;
+constexpr std::uint8_t EOT = 0x04;
+constexpr std::uint8_t ACK = 0x06;
+constexpr std::uint8_t NAK = 0x15;
+constexpr std::uint8_t CAN = 0x18;
+constexpr std::uint8_t C   = 0x43;
+constexpr std::uint8_t G   = 0x47;
+
+constexpr std::uint8_t PaddingByte = 0x1A;
+
+using Bytes = std::vector<std::uint8_t>;
+
+/**
+ * Sender side of YMODEM, XMODEM, and YMODEM-G.
+ */
+class Sender
+{
+    shim::LoopbackChannel& channel_;
+    const Bytes file_;
+
+    enum class State
+    {
+        WaitingForRequest,
+        WaitingForHeaderAck,
+        WaitingForDataRequest,
+        Sending,
+        WaitingForEOTAck,
+        Done
+    } state_ = State::WaitingForRequest;
+
+    bool use_crc_ = true;
+    bool streaming_ = false;
+    unsigned next_block_ = 0;       // Index of the next data block, starting from zero
+
+    std::size_t getBlockSize() const { return use_1k_blocks ? 1024U : 128U; }
+    unsigned getNumBlocks() const { return unsigned((file_.size() + getBlockSize() - 1U) / getBlockSize()); }
+
+    void sendBlock(std::uint8_t sequence_id, const Bytes& payload)
+    {
+        Bytes block;
+        block.push_back((payload.size() == 1024U) ? STX : SOH);
+        block.push_back(sequence_id);
+        block.push_back(std::uint8_t(~sequence_id));
+        block.insert(block.end(), payload.begin(), payload.end());
+        if (use_crc_)
+        {
+            os::crc::CRC16CCITT crc;
+            crc.add(payload.data(), unsigned(payload.size()));
+            block.push_back(std::uint8_t(crc.get() >> 8));
+            block.push_back(std::uint8_t(crc.get()));
+        }
+        else
+        {
+            std::uint8_t sum = 0;
+            for (auto x : payload)
+            {
+                sum = std::uint8_t(sum + x);
+            }
+            block.push_back(sum);
+        }
+
+        if (corrupt_block == sequence_id)
+        {
+            corrupt_block = -1;                     // Only once
+            block[3] ^= 0x55U;
+        }
+        if (truncate_block == sequence_id)
+        {
+            truncate_block = -1;
+            block.resize(block.size() / 2);
+        }
+
+        num_blocks_sent++;
+        channel_.push(block.data(), block.size());
+    }
+
+    void sendHeader()
+    {
+        Bytes payload(128, 0);
+        std::copy(header.begin(), header.end(), payload.begin());
+        sendBlock(0, payload);
+    }
+
+    /// Sends the block at next_block_ or EOT, doesn't advance
+    void sendCurrent()
+    {
+        if (next_block_ >= getNumBlocks())
+        {
+            channel_.push(EOT);
+            state_ = State::WaitingForEOTAck;
+            return;
+        }
+        const std::size_t offset = next_block_ * getBlockSize();
+        Bytes payload(getBlockSize(), PaddingByte);
+        std::copy(file_.begin() + long(offset),
+                  file_.begin() + long(std::min(file_.size(), offset + getBlockSize())),
+                  payload.begin());
+        sendBlock(std::uint8_t(next_block_ + 1U), payload);
+        if (duplicate_block == int(next_block_ + 1U))
+        {
+            duplicate_block = -1;
+            sendBlock(std::uint8_t(next_block_ + 1U), payload);
+        }
+        state_ = State::Sending;
+    }
+
+    void startTransfer(std::uint8_t request)
+    {
+        use_crc_ = request != NAK;
+        streaming_ = request == G;
+        if (xmodem)
+        {
+            sendCurrent();
+        }
+        else
+        {
+            sendHeader();
+            state_ = streaming_ ? State::WaitingForDataRequest : State::WaitingForHeaderAck;
+        }
+    }
+
+    void stream()
+    {
+        while (state_ == State::Sending)
+        {
+            next_block_++;
+            sendCurrent();
+        }
+    }
+
+    void handle(std::uint8_t byte)
+    {
+        received.push_back(byte);
+
+        if (byte == CAN)
+        {
+            num_cancellations++;
+            return;
+        }
+        if ((cancel_after_blocks > 0) && (num_blocks_sent >= unsigned(cancel_after_blocks)))
+        {
+            channel_.push(CAN);
+            channel_.push(CAN);
+            return;
+        }
+
+        switch (state_)
+        {
+        case State::WaitingForRequest:
+        {
+            if (((byte == C) && supports_crc) || ((byte == G) && supports_streaming) || (byte == NAK))
+            {
+                startTransfer(byte);
+            }
+            break;
+        }
+        case State::WaitingForHeaderAck:
+        {
+            if (byte == ACK)
+            {
+                state_ = State::WaitingForDataRequest;
+            }
+            else if (byte == NAK)
+            {
+                sendHeader();
+            }
+            break;
+        }
+        case State::WaitingForDataRequest:
+        {
+            if ((byte == (streaming_ ? G : (use_crc_ ? C : NAK))))
+            {
+                sendCurrent();
+                if (streaming_)
+                {
+                    stream();
+                }
+            }
+            break;
+        }
+        case State::Sending:
+        {
+            if (byte == ACK)
+            {
+                next_block_++;
+                sendCurrent();
+            }
+            else if (byte == NAK)
+            {
+                sendCurrent();
+            }
+            break;
+        }
+        case State::WaitingForEOTAck:
+        {
+            if (byte == ACK)
+            {
+                state_ = State::Done;
+            }
+            else if (byte == NAK)
+            {
+                channel_.push(EOT);
+            }
+            break;
+        }
+        case State::Done:
+        {
+            break;
+        }
+        }
+    }
+
+public:
+    // Behavior of the sender, can be changed before the transfer is started
+    bool xmodem = false;
+    bool use_1k_blocks = true;
+    bool supports_crc = true;
+    bool supports_streaming = false;
+    std::string header;             ///< Contents of block 0, null characters included
+    int corrupt_block = -1;         ///< Sequence ID of the block that will be damaged once
+    int truncate_block = -1;        ///< Sequence ID of the block that will be sent incomplete once
+    int duplicate_block = -1;       ///< Sequence ID of the block that will be sent twice once
+    int cancel_after_blocks = -1;
+
+    // Observations
+    Bytes received;
+    unsigned num_blocks_sent = 0;
+    unsigned num_cancellations = 0;
+
+    Sender(shim::LoopbackChannel& channel, const Bytes& file) :
+        channel_(channel),
+        file_(file)
+    {
+        header = std::string("firmware.bin") + '\0' + std::to_string(file.size()) + " 13050335443 0644";
+        header.push_back('\0');
+        channel_.on_transmit = [this](std::uint8_t byte) { handle(byte); };
+    }
+
+    ~Sender() { channel_.on_transmit = nullptr; }
+
+    bool isDone() const { return state_ == State::Done; }
+};
+
+class Sink : public bootloader::IDownloadStreamSink
+{
+public:
+    Bytes data;
+    unsigned num_chunks = 0;
+    unsigned num_flushes = 0;
+    int fail_at_chunk = -1;
+    int flush_result = 0;
+
+    int handleNextDataChunk(const void* chunk, std::size_t size) override
+    {
+        if (!CHECK(num_flushes == 0))
+        {
+            return -1;
+        }
+        if (int(num_chunks++) == fail_at_chunk)
+        {
+            return -EIO;
+        }
+        auto p = static_cast<const std::uint8_t*>(chunk);
+        data.insert(data.end(), p, p + size);
+        return 0;
+    }
+
+    int flush() override
+    {
+        num_flushes++;
+        return flush_result;
+    }
+};
+
+Bytes makeFile(std::size_t size)
+{
+    std::mt19937 rng{unsigned(size)};
+    Bytes out(size);
+    for (auto& x : out)
+    {
+        x = std::uint8_t(rng());
+    }
+    return out;
+}
+
+int runTransfer(shim::LoopbackChannel& channel, Sink& sink,
+                ymodem::YModemReceiver::Mode mode = ymodem::YModemReceiver::Mode::CRC16)
+{
+    ymodem::YModemReceiver receiver(channel.getChannel(), mode);
+    return receiver.download(sink);
+}
+
+}
+
+TEST_CASE(YModem1K)
+{
+    for (std::size_t size : { 1U, 1023U, 1024U, 1025U, 3000U })
+    {
+        shim::LoopbackChannel channel;
+        const Bytes file = makeFile(size);
+        Sender sender(channel, file);
+        Sink sink;
+
+        CHECK(runTransfer(channel, sink) == ymodem::ErrOK);
+        CHECK(sender.isDone());
+        CHECK(sink.data == file);                   // Padding removed according to the file size
+        CHECK(sink.num_flushes == 1);
+        CHECK(sender.num_cancellations > 0);        // No more files wanted
+        CHECK(channel.getNumPending() == 0);
+    }
+}
+
+TEST_CASE(YModem128Checksum)
+{
+    shim::LoopbackChannel channel;
+    const Bytes file = makeFile(1000);
+    Sender sender(channel, file);
+    sender.use_1k_blocks = false;
+    sender.supports_crc = false;
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink, ymodem::YModemReceiver::Mode::Checksum) == ymodem::ErrOK);
+    CHECK(sink.data == file);
+    CHECK(sink.num_chunks == 8);
+    CHECK(sink.num_flushes == 1);
+    CHECK((!sender.received.empty()) && (sender.received.front() == NAK));
+}
+
+TEST_CASE(FallbackToChecksum)
+{
+    shim::LoopbackChannel channel;
+    const Bytes file = makeFile(300);
+    Sender sender(channel, file);
+    sender.supports_crc = false;
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink) == ymodem::ErrOK);
+    CHECK(sink.data == file);
+    CHECK(std::count(sender.received.begin(), sender.received.end(), C) == 3);
+}
+
+TEST_CASE(Streaming)
+{
+    shim::LoopbackChannel channel;
+    const Bytes file = makeFile(5000);
+    Sender sender(channel, file);
+    sender.supports_streaming = true;
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink, ymodem::YModemReceiver::Mode::Streaming) == ymodem::ErrOK);
+    CHECK(sink.data == file);
+    CHECK(sink.num_flushes == 1);
+    // Only the requests and the final handshake, no per-block acknowledgments
+    CHECK(std::count(sender.received.begin(), sender.received.end(), ACK) == 1);
+}
+
+TEST_CASE(StreamingFallback)
+{
+    shim::LoopbackChannel channel;
+    const Bytes file = makeFile(2000);
+    Sender sender(channel, file);
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink, ymodem::YModemReceiver::Mode::Streaming) == ymodem::ErrOK);
+    CHECK(sink.data == file);
+    CHECK(std::count(sender.received.begin(), sender.received.end(), G) == 3);
+}
+
+TEST_CASE(StreamingErrorIsFatal)
+{
+    shim::LoopbackChannel channel;
+    Sender sender(channel, makeFile(5000));
+    sender.supports_streaming = true;
+    sender.corrupt_block = 2;
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink, ymodem::YModemReceiver::Mode::Streaming) ==
+          -ymodem::ErrProtocolError);
+    CHECK(sink.num_flushes == 0);
+    CHECK(sender.num_cancellations > 0);
+}
+
+TEST_CASE(XModem)
+{
+    shim::LoopbackChannel channel;
+    const Bytes file = makeFile(200);
+    Sender sender(channel, file);
+    sender.xmodem = true;
+    sender.use_1k_blocks = false;
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink) == ymodem::ErrOK);
+    REQUIRE(sink.data.size() == 256);               // The size is unknown, so the padding is kept
+    CHECK(std::equal(file.begin(), file.end(), sink.data.begin()));
+    CHECK(std::all_of(sink.data.begin() + 200, sink.data.end(), [](std::uint8_t x) { return x == PaddingByte; }));
+    CHECK(sink.num_flushes == 1);
+    CHECK(sender.num_cancellations == 0);           // There is no session in XMODEM
+}
+
+TEST_CASE(Retransmissions)
+{
+    shim::LoopbackChannel channel;
+    const Bytes file = makeFile(4000);
+    Sender sender(channel, file);
+    sender.corrupt_block = 2;
+    sender.truncate_block = 3;
+    sender.duplicate_block = 4;
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink) == ymodem::ErrOK);
+    CHECK(sink.data == file);
+    CHECK(sink.num_chunks == 4);
+    CHECK(sink.num_flushes == 1);
+}
+
+TEST_CASE(HeaderParsing)
+{
+    // No attributes after the size
+    {
+        shim::LoopbackChannel channel;
+        const Bytes file = makeFile(1500);
+        Sender sender(channel, file);
+        sender.header = std::string("a.bin") + '\0' + "1500";
+        Sink sink;
+        CHECK(runTransfer(channel, sink) == ymodem::ErrOK);
+        CHECK(sink.data == file);
+    }
+    // Malformed size is treated as unknown
+    {
+        shim::LoopbackChannel channel;
+        const Bytes file = makeFile(1500);
+        Sender sender(channel, file);
+        sender.header = std::string("a.bin") + '\0' + "15x0";
+        Sink sink;
+        CHECK(runTransfer(channel, sink) == ymodem::ErrOK);
+        CHECK(sink.data.size() == 2048);
+    }
+    // No size at all
+    {
+        shim::LoopbackChannel channel;
+        const Bytes file = makeFile(100);
+        Sender sender(channel, file);
+        sender.header = std::string("a.bin");
+        Sink sink;
+        CHECK(runTransfer(channel, sink) == ymodem::ErrOK);
+        CHECK(sink.data.size() == 1024);
+    }
+    // Null block: the sender has nothing to send
+    {
+        shim::LoopbackChannel channel;
+        Sender sender(channel, makeFile(100));
+        sender.header = "";
+        Sink sink;
+        CHECK(runTransfer(channel, sink) == -ymodem::ErrRemoteRefusedToProvideFile);
+        CHECK(sink.num_chunks == 0);
+    }
+    // The file name is not terminated
+    {
+        shim::LoopbackChannel channel;
+        Sender sender(channel, makeFile(100));
+        sender.header = std::string(128, 'x');
+        Sink sink;
+        CHECK(runTransfer(channel, sink) == -ymodem::ErrProtocolError);
+    }
+}
+
+TEST_CASE(EarlyEndOfTransmission)
+{
+    shim::LoopbackChannel channel;
+    const Bytes file = makeFile(2000);
+    Sender sender(channel, file);
+    sender.header = std::string("a.bin") + '\0' + "3000";
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink) == -ymodem::ErrProtocolError);
+    CHECK(sink.num_flushes == 0);
+    CHECK(sender.num_cancellations > 0);
+}
+
+TEST_CASE(PastEndOfFile)
+{
+    shim::LoopbackChannel channel;
+    Sender sender(channel, makeFile(3000));
+    sender.header = std::string("a.bin") + '\0' + "1024";
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink) == -ymodem::ErrProtocolError);
+    CHECK(sink.num_flushes == 0);
+}
+
+TEST_CASE(SinkErrors)
+{
+    {
+        shim::LoopbackChannel channel;
+        Sender sender(channel, makeFile(3000));
+        Sink sink;
+        sink.fail_at_chunk = 1;
+        CHECK(runTransfer(channel, sink) == -EIO);
+        CHECK(sink.num_flushes == 0);
+        CHECK(sender.num_cancellations > 0);
+        CHECK(!sender.isDone());
+    }
+    {
+        shim::LoopbackChannel channel;
+        Sender sender(channel, makeFile(3000));
+        Sink sink;
+        sink.flush_result = -EIO;
+        CHECK(runTransfer(channel, sink) == -EIO);
+        CHECK(sink.num_flushes == 1);
+        CHECK(!sender.isDone());                    // EOT is not confirmed
+    }
+}
+
+TEST_CASE(CancelledByRemote)
+{
+    shim::LoopbackChannel channel;
+    Sender sender(channel, makeFile(5000));
+    sender.cancel_after_blocks = 2;
+    Sink sink;
+
+    CHECK(runTransfer(channel, sink) == -ymodem::ErrTransferCancelledByRemote);
+    CHECK(sink.num_flushes == 0);
+}
+
+TEST_CASE(NoSender)
+{
+    shim::LoopbackChannel channel;
+    Sink sink;
+    ymodem::YModemReceiver receiver(channel.getChannel());
+
+    const auto started_at = chVTGetSystemTime();
+    CHECK(receiver.download(sink) == -ymodem::ErrRetriesExhausted);
+    CHECK(chVTTimeElapsedSinceX(started_at) >= MS2ST(60000));
+    CHECK(sink.num_chunks == 0);
+    CHECK(std::count(channel.transmitted.begin(), channel.transmitted.end(), CAN) == 5);
+}
+
+TEST_CASE(PipelinedYModem)
+{
+    ymodem::PipelinedYModemReceiver<> receiver(nullptr);
+    (void)receiver;                                 // The worker is not started until the first download
+
+    for (std::size_t size : { 1U, 1025U, 5000U })
+    {
+        shim::LoopbackChannel channel;
+        const Bytes file = makeFile(size);
+        Sender sender(channel, file);
+        Sink sink;
+        ymodem::PipelinedYModemReceiver<> pipelined(channel.getChannel());
+
+        CHECK(pipelined.download(sink) == ymodem::ErrOK);
+        CHECK(sender.isDone());
+        CHECK(sink.data == file);
+        CHECK(sink.num_flushes == 1);
+    }                                               // The worker is joined here
+}
+
+TEST_CASE(PipelinedYModemReuse)
+{
+    shim::LoopbackChannel channel;
+    ymodem::PipelinedYModemReceiver<3> receiver(channel.getChannel());
+
+    for (std::size_t size : { 4000U, 2000U })
+    {
+        const Bytes file = makeFile(size);
+        Sender sender(channel, file);
+        Sink sink;
+        CHECK(receiver.download(sink) == ymodem::ErrOK);
+        CHECK(sink.data == file);
+        CHECK(sink.num_flushes == 1);
+    }
+
+    // An error in the previous download doesn't affect the next one
+    {
+        Sender sender(channel, makeFile(3000));
+        Sink sink;
+        sink.fail_at_chunk = 0;
+        CHECK(receiver.download(sink) == -EIO);
+    }
+    {
+        const Bytes file = makeFile(3000);
+        Sender sender(channel, file);
+        Sink sink;
+        CHECK(receiver.download(sink) == ymodem::ErrOK);
+        CHECK(sink.data == file);
+    }
+}
+
+TEST_CASE(PipelinedSinkErrors)
+{
+    // Reported while the transfer is in progress, as soon as the queue is full
+    {
+        shim::LoopbackChannel channel;
+        Sender sender(channel, makeFile(8000));
+        Sink sink;
+        sink.fail_at_chunk = 1;
+        ymodem::PipelinedYModemReceiver<> receiver(channel.getChannel());
+        CHECK(receiver.download(sink) == -EIO);
+        CHECK(sink.num_chunks == 2);                // The queued data is discarded after the error
+        CHECK(sink.num_flushes == 0);
+        CHECK(sender.num_cancellations > 0);
+        CHECK(!sender.isDone());
+    }
+    // The last chunk fails after all blocks are acknowledged, which is detected by the drain before the flush
+    {
+        shim::LoopbackChannel channel;
+        Sender sender(channel, makeFile(3000));
+        Sink sink;
+        sink.fail_at_chunk = 2;
+        ymodem::PipelinedYModemReceiver<> receiver(channel.getChannel());
+        CHECK(receiver.download(sink) == -EIO);
+        CHECK(sink.num_chunks == 3);
+        CHECK(sink.num_flushes == 0);
+        CHECK(!sender.isDone());
+    }
+    // The flush fails
+    {
+        shim::LoopbackChannel channel;
+        Sender sender(channel, makeFile(3000));
+        Sink sink;
+        sink.flush_result = -EIO;
+        ymodem::PipelinedYModemReceiver<> receiver(channel.getChannel());
+        CHECK(receiver.download(sink) == -EIO);
+        CHECK(sink.num_flushes == 1);
+        CHECK(!sender.isDone());
+    }
+}
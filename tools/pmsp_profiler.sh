@@ -10,6 +10,12 @@
 #        have a coffee. When you're back, you'll see the flamegraph. Note that frequent calls to GDB significantly
 #        interfere with normal operation of the target, which means that you can't profile real-time tasks with it.
 #
+#        Alternatively, if the firmware is built with the on-target sampler (BUILD_PROFILER=1) and exposes
+#        os::profiler::executeCLICommand() via the CLI, the samples can be streamed over the CLI serial port instead:
+#            pmsp_profiler.sh --serial=/dev/ttyACM0 --rate=2000 --duration=10
+#        This mode doesn't use GDB and doesn't stop the target, but only two stack frames are available per sample
+#        (PC and LR). It requires pyserial.
+#
 
 set -e
 
@@ -37,6 +43,11 @@ elf=`find build -name *.elf`
 append=0
 fgfontsize=10
 fgwidth=1900
+serial=''
+baudrate=115200
+command='prof'
+rate=1000
+duration=10
 
 for i in "$@"
 do
@@ -59,6 +70,21 @@ do
         --fgwidth=*)
             fgwidth="${i#*=}"
             ;;
+        --serial=*)
+            serial="${i#*=}"
+            ;;
+        --baudrate=*)
+            baudrate="${i#*=}"
+            ;;
+        --command=*)
+            command="${i#*=}"
+            ;;
+        --rate=*)
+            rate="${i#*=}"
+            ;;
+        --duration=*)
+            duration="${i#*=}"
+            ;;
         *)
             usage
             ;;
@@ -73,11 +99,97 @@ stacksfile=/tmp/pmpn-stacks.log
 foldfile=/tmp/pmpn-folded.txt
 graphfile=/tmp/pmpn-flamegraph.svg
 gdberrfile=/tmp/pmpn-gdberr.log
+streamerfile=/tmp/pmpn-streamer.py
 
 #
 # Sampling if requested. Note that if $append is true, the stack file will not be rewritten.
+# In the streaming mode, the samples are folded right away.
+#
+if [[ -n $serial ]]
+then
+    cat << 'EOF' > $streamerfile
+#
+# Receives the binary sample stream from the target and folds it; see os::profiler::streamSamples().
 #
-if [[ $nsamples > 0 ]]
+from __future__ import print_function, division
+import sys, struct, time, subprocess, collections, serial
+
+port, baudrate, command, duration, elf = sys.argv[1:]
+MARKER = 0xFFFFFFFF
+START = struct.pack('<II', MARKER, 0x50534D50)
+
+ser = serial.Serial(port, int(baudrate), timeout=0.1)
+ser.flushInput()
+ser.write((command + '\r\n').encode())
+
+deadline = time.time() + float(duration) + 5
+buf = bytearray()
+samples = []
+started = False
+finished = False
+while not finished:
+    if time.time() > deadline:
+        raise Exception('Stream timed out; started: %s' % started)
+    buf += bytearray(ser.read(max(1, ser.inWaiting())))
+    if not started:
+        pos = buf.find(START)
+        if pos < 0:
+            continue
+        started = True
+        del buf[:pos + len(START)]
+    while len(buf) >= 8:
+        pc, lr = struct.unpack('<II', bytes(buf[:8]))
+        del buf[:8]
+        if pc == MARKER:
+            finished = True
+            break
+        samples.append((pc, lr))
+    print('\r%d samples' % len(samples), end='', file=sys.stderr)
+
+ser.timeout = 1
+trailer = bytes(buf) + ser.readline() + ser.readline()      # Summary printed by the target after the stream
+print('\n' + trailer.decode('ascii', 'ignore').strip(), file=sys.stderr)
+
+def code_address(lr):
+    # EXC_RETURN values can't be resolved; the call site is right before the return address
+    return None if lr >= 0xF0000000 or lr < 2 else (lr & ~1) - 2
+
+addresses = set()
+for pc, lr in samples:
+    addresses.add(pc & ~1)
+    if code_address(lr) is not None:
+        addresses.add(code_address(lr))
+addresses = sorted(addresses)
+
+a2l = subprocess.Popen(['arm-none-eabi-addr2line', '-f', '-C', '-e', elf],
+                       stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+output = a2l.communicate(''.join('0x%x\n' % x for x in addresses).encode())[0].decode('utf8', 'ignore')
+functions = dict(zip(addresses, output.splitlines()[::2]))
+
+stacks = collections.defaultdict(int)
+stack_tops = collections.defaultdict(int)
+for pc, lr in samples:
+    fun = functions.get(pc & ~1, '??')
+    frames = ['ISR' if pc & 1 else 'Thread']
+    caller = functions.get(code_address(lr), '??')
+    if caller not in ('??', fun):
+        frames.append(caller)
+    frames.append(fun)
+    stacks[';'.join(frames)] += 1
+    stack_tops[fun] += 1
+
+for s, f in sorted(stacks.items()):
+    print(s, f)
+
+print('Top consumers (distribution of the stack tops):', file=sys.stderr)
+for name, num in sorted(stack_tops.items(), key=lambda x: x[1], reverse=True)[:10]:
+    print('% 5.1f%%   ' % (100 * num / max(1, len(samples))), name, file=sys.stderr)
+EOF
+
+    echo "Executable: $elf"
+    python $streamerfile $serial $baudrate "$command sample $rate $(($duration * 1000))" $duration $elf > $foldfile
+    echo "Folded stacks saved to $foldfile"
+elif [[ $nsamples > 0 ]]
 then
     [[ $append = 0 ]] && (rm -f $stacksfile; echo "Old stacks removed")
 
@@ -103,7 +215,7 @@ fi
 #
 # Folding the stacks.
 #
-[ -f $stacksfile ] || die "Where are the stack samples?"
+[[ -n $serial ]] || [ -f $stacksfile ] || die "Where are the stack samples?"
 
 cat << 'EOF' > /tmp/pmpn-folder.py
 #
@@ -226,9 +338,11 @@ for name,num in sorted(stack_tops.items(), key=lambda (name, num): num, reverse=
     print('% 5.1f%%   ' % (100 * num / num_stack_frames), name, file=sys.stderr)
 EOF
 
-cat $stacksfile | python /tmp/pmpn-folder.py > $foldfile
-
-echo "Folded stacks saved to $foldfile"
+if [[ -z $serial ]]
+then
+    cat $stacksfile | python /tmp/pmpn-folder.py > $foldfile
+    echo "Folded stacks saved to $foldfile"
+fi
 
 #
 # Graphing.
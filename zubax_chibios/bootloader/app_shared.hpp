@@ -11,6 +11,8 @@
 #include <cassert>
 #include <tuple>
 #include <type_traits>
+#include <utility>
+#include <initializer_list>
 #include <cstring>
 #include "util.hpp"
 
@@ -40,15 +42,84 @@ enum class AutoErase
     DoNotErase
 };
 
+/**
+ * Integrity check policies. A policy defines the size of the check value and the function that computes it;
+ * custom policies, e.g. based on a hardware CRC unit, can be defined likewise.
+ * The default policy is CRC-64-WE, which is the most reliable one and is compatible with the older versions
+ * of this module.
+ */
+struct CRC64WEIntegrityCheck
+{
+    static constexpr unsigned Size = 8;
+
+    static void compute(const void* data, unsigned len, std::uint8_t* out)
+    {
+        CRC64WE crc;
+        crc.add(data, len);
+        const auto x = crc.get();
+        std::memmove(out, &x, Size);
+    }
+};
+
+/**
+ * CRC-32 (IEEE 802.3), shares the lookup table with the rest of the firmware.
+ */
+struct CRC32IntegrityCheck
+{
+    static constexpr unsigned Size = 4;
+
+    static void compute(const void* data, unsigned len, std::uint8_t* out)
+    {
+        os::crc::CRC32 crc(0xFFFFFFFFU);
+        crc.add(data, len);
+        const std::uint32_t x = ~crc.get();
+        std::memmove(out, &x, Size);
+    }
+};
+
+/**
+ * Does not verify the data at all, only marks the storage as written; this is the cheapest option for small
+ * structures that are exchanged often, where the storage is known to retain its contents reliably.
+ * The marker depends on the size of the structure, so that different structures are not confused.
+ */
+template <std::uint32_t Signature>
+struct SignatureIntegrityCheck
+{
+    static_assert(Signature > 0xFFFFU, "The signature must not be zeroed by the size of the structure");
+
+    static constexpr unsigned Size = 4;
+
+    static void compute(const void*, unsigned len, std::uint8_t* out)
+    {
+        const std::uint32_t x = Signature ^ len;
+        std::memmove(out, &x, Size);
+    }
+};
+
 /**
  * Implementation details, do not use directly
  */
 namespace impl_
 {
+/**
+ * Typed pointers define the access size; raw memory pointers consume the rest of the structure.
+ */
+template <typename Pointee>
+struct PointerAccessSize
+{
+    static constexpr unsigned Value = sizeof(Pointee);
+};
+
+template <>
+struct PointerAccessSize<void>
+{
+    static constexpr unsigned Value = 0xFFFFFFFFU;
+};
 
 template <
     typename Container,
     StorageUtilizationCheckMode StorageUtilizationCheck,
+    typename IntegrityCheck,
     typename Pointers
     >
 class AppSharedMarshaller
@@ -57,12 +128,12 @@ class AppSharedMarshaller
 
     struct ContainerWrapper
     {
-        static constexpr unsigned CRCSize = 8;
+        static constexpr unsigned CheckSize = IntegrityCheck::Size;
 
         Container container;
 
     private:
-        std::uint8_t crc_bytes[CRCSize] = {}; // We don't want to force any additional alignment, so use array of bytes
+        std::uint8_t check_bytes[CheckSize] = {}; // We don't want to force any additional alignment, so use bytes
 
     public:
         ContainerWrapper() : container()  { }
@@ -70,89 +141,142 @@ class AppSharedMarshaller
         ContainerWrapper(const Container& c) :
             container(c)
         {
-            CRC64WE crc_computer;
-            crc_computer.add(&container, sizeof(container));
-            const auto computed = crc_computer.get();
-            std::memmove(&crc_bytes[0], &computed, CRCSize);
+            updateCheck();
+        }
+
+        void updateCheck()
+        {
+            IntegrityCheck::compute(&container, sizeof(container), &check_bytes[0]);
         }
 
-        bool isCRCValid() const
+        bool isCheckValid() const
         {
-            CRC64WE crc_computer;
-            crc_computer.add(&container, sizeof(container));
-            const auto computed = crc_computer.get();
-            return 0 == std::memcmp(&computed, &crc_bytes[0], CRCSize);
+            std::uint8_t computed[CheckSize];
+            IntegrityCheck::compute(&container, sizeof(container), &computed[0]);
+            return 0 == std::memcmp(&computed[0], &check_bytes[0], CheckSize);
+        }
+
+        void invalidateCheck()
+        {
+            std::memset(&check_bytes[0], 0, CheckSize);
         }
     };
 
     //static_assert(std::is_pod<Container>::value, "Container must be a POD type");
 
-    template <int N>
-    struct IntegerAsType
+    static constexpr unsigned TotalSize = sizeof(ContainerWrapper);
+    static constexpr unsigned NumPointers = std::tuple_size<Pointers>::value;
+    static constexpr unsigned Unlimited = PointerAccessSize<void>::Value;
+
+    using PointerIndexes = std::make_index_sequence<NumPointers>;
+
+    template <typename P>
+    using BlockSize = PointerAccessSize<typename std::remove_cv<typename std::remove_pointer<P>::type>::type>;
+
+    template <std::size_t... Is>
+    static constexpr unsigned getBlockOffset(unsigned index, std::index_sequence<Is...>)
     {
-        static constexpr int Value = N;
-    };
+        const unsigned sizes[] = { BlockSize<typename std::tuple_element<Is, Pointers>::type>::Value..., 0U };
+        unsigned offset = 0;
+        for (unsigned i = 0; i < index; i++)
+        {
+            offset = (sizes[i] > (Unlimited - offset)) ? Unlimited : (offset + sizes[i]);
+        }
+        return offset;
+    }
+
+    static_assert(getBlockOffset(NumPointers, PointerIndexes()) >= TotalSize,
+                  "Storage is not large enough for the structure");
 
-    template <unsigned A, unsigned B>
-    struct ConstexprMin                                         // In GCC 4.8, std::min() is not yet constexpr.
+    static_assert((StorageUtilizationCheck == StorageUtilizationCheckMode::RequireFullStorageUtilization) ?
+                  ((NumPointers == 0) || (getBlockOffset(NumPointers - 1U, PointerIndexes()) < TotalSize)) :
+                  true,
+                  "Not all scattered storage blocks are used. "
+                  "Disable this error by using option AllowUnderutilizedStorage.");
+
+    /**
+     * Location of the part of the structure that is kept in the block.
+     */
+    template <std::size_t Index>
+    struct Block
     {
-        static constexpr unsigned Result = (A < B) ? A : B;
+        static constexpr unsigned Offset = getBlockOffset(Index, PointerIndexes());
+        static constexpr unsigned Size =
+            (Offset >= TotalSize) ? 0U :
+            ((BlockSize<typename std::tuple_element<Index, Pointers>::type>::Value < (TotalSize - Offset)) ?
+             BlockSize<typename std::tuple_element<Index, Pointers>::type>::Value : (TotalSize - Offset));
     };
 
-    template <unsigned MaxSize, typename T>                     // Holy pants why auto doesn't work here
-    IntegerAsType<ConstexprMin<sizeof(T), MaxSize>::Result> readOne(void* destination, const volatile T* ptr)
+    template <unsigned Size, typename T>
+    static typename std::enable_if<(Size > 0)>::type readOne(void* destination, const volatile T* ptr)
     {
         const T x = *ptr;                                       // Guaranteeing proper pointer access
-        std::memmove(destination, &x, ConstexprMin<sizeof(T), MaxSize>::Result);
-        return {};
+        std::memcpy(destination, &x, Size);
     }
 
-    template <unsigned MaxSize>
-    IntegerAsType<MaxSize> readOne(void* destination, const void* ptr)
+    template <unsigned Size>
+    static typename std::enable_if<(Size > 0)>::type readOne(void* destination, const void* ptr)
     {
-        std::memmove(destination, ptr, MaxSize);                // Raw memory access
-        return {};
+        std::memcpy(destination, ptr, Size);                    // Raw memory access
     }
 
-    template <unsigned MaxSize, typename T>
-    IntegerAsType<ConstexprMin<sizeof(T), MaxSize>::Result> writeOne(const void* source, volatile T* ptr)
+    template <unsigned Size, typename T>
+    static typename std::enable_if<(Size > 0)>::type writeOne(const void* source, volatile T* ptr)
     {
         T x = T();
-        std::memmove(&x, source, ConstexprMin<sizeof(T), MaxSize>::Result);
+        std::memcpy(&x, source, Size);
         *ptr = x;                                               // Guaranteeing proper pointer access
-        return {};
     }
 
-    template <unsigned MaxSize>
-    IntegerAsType<MaxSize> writeOne(const void* source, void* ptr)
+    template <unsigned Size>
+    static typename std::enable_if<(Size > 0)>::type writeOne(const void* source, void* ptr)
     {
-        std::memmove(ptr, source, MaxSize);                     // Raw memory access
-        return {};
+        std::memcpy(ptr, source, Size);                         // Raw memory access
     }
 
-    template <bool WriteNotRead, unsigned PtrIndex, unsigned RemainingSize>
-    typename std::enable_if<(RemainingSize > 0)>::type unwindReadWrite(void* structure)
+    template <unsigned Size, typename P>
+    static typename std::enable_if<(Size == 0)>::type readOne(void*, P) { }
+
+    template <unsigned Size, typename P>
+    static typename std::enable_if<(Size == 0)>::type writeOne(const void*, P) { }
+
+    template <std::size_t Index>
+    void readBlock(std::uint8_t* structure)
     {
-        static_assert(PtrIndex < std::tuple_size<Pointers>::value, "Storage is not large enough for the structure");
-        const auto ret = WriteNotRead ?
-                         writeOne<RemainingSize>(structure, std::get<PtrIndex>(pointers_)) :
-                         readOne<RemainingSize>(structure, std::get<PtrIndex>(pointers_));
+        readOne<Block<Index>::Size>(structure + Block<Index>::Offset, std::get<Index>(pointers_));
+    }
 
-        constexpr auto Increment = decltype(ret)::Value;
-        static_assert(RemainingSize >= Increment, "Rock is dead");
+    /**
+     * If the reference is provided, the block is written only if its contents differ from the reference.
+     */
+    template <std::size_t Index>
+    void writeBlock(const std::uint8_t* structure, const std::uint8_t* reference)
+    {
+        constexpr unsigned Offset = Block<Index>::Offset;
+        constexpr unsigned Size = Block<Index>::Size;
+        if ((reference == nullptr) || (std::memcmp(structure + Offset, reference + Offset, Size) != 0))
+        {
+            writeOne<Size>(structure + Offset, std::get<Index>(pointers_));
+        }
+    }
 
-        structure = static_cast<void*>(static_cast<std::uint8_t*>(structure) + Increment);
-        unwindReadWrite<WriteNotRead, PtrIndex + 1U, RemainingSize - Increment>(structure);
+    // The pack expansions are unrolled by the compiler, every block is accessed with its own width
+    template <std::size_t... Is>
+    void readAll(ContainerWrapper& wrapper, std::index_sequence<Is...>)
+    {
+        auto structure = reinterpret_cast<std::uint8_t*>(&wrapper);
+        (void)structure;
+        (void)std::initializer_list<int>{ (readBlock<Is>(structure), 0)... };
     }
 
-    template <bool, unsigned PtrIndex, unsigned RemainingSize>
-    typename std::enable_if<(RemainingSize == 0)>::type unwindReadWrite(void*)
+    template <std::size_t... Is>
+    void writeAll(const ContainerWrapper& wrapper, const ContainerWrapper* reference, std::index_sequence<Is...>)
     {
-        static_assert((StorageUtilizationCheck == StorageUtilizationCheckMode::RequireFullStorageUtilization) ?
-                      PtrIndex == std::tuple_size<Pointers>::value :
-                      true,
-                      "Not all scattered storage blocks are used. "
-                      "Disable this error by using option AllowUnderutilizedStorage.");
+        auto structure = reinterpret_cast<const std::uint8_t*>(&wrapper);
+        auto ref = reinterpret_cast<const std::uint8_t*>(reference);
+        (void)structure;
+        (void)ref;
+        (void)std::initializer_list<int>{ (writeBlock<Is>(structure, ref), 0)... };
     }
 
 public:
@@ -168,13 +292,15 @@ public:
     {
         ContainerWrapper wrapper;
 
-        unwindReadWrite<false, 0, sizeof(wrapper)>(&wrapper);
+        readAll(wrapper, PointerIndexes());
 
-        const bool valid = wrapper.isCRCValid();
+        const bool valid = wrapper.isCheckValid();
 
         if (valid && (auto_erase == AutoErase::EraseAfterRead))
         {
-            erase();
+            ContainerWrapper erased = wrapper;
+            erased.invalidateCheck();
+            writeAll(erased, &wrapper, PointerIndexes());
         }
 
         return {wrapper.container, valid};
@@ -186,17 +312,43 @@ public:
     void write(const Container& cont)
     {
         ContainerWrapper wrapper(cont);
-        unwindReadWrite<true, 0, sizeof(wrapper)>(&wrapper);
+        writeAll(wrapper, nullptr, PointerIndexes());
     }
 
     /**
-     * Invalidates the stored data.
+     * Modifies the stored data in place; only the blocks whose contents have changed are written, which usually
+     * are the blocks of the modified fields and of the integrity check. Usage:
+     *     marshaller.update([](DataType& x) { x.field = 123; });
+     * @return False if there is no valid data stored, in which case nothing is written and the modifier is not
+     *         invoked.
+     */
+    template <typename Modifier>
+    bool update(Modifier modifier)
+    {
+        ContainerWrapper stored;
+        readAll(stored, PointerIndexes());
+        if (!stored.isCheckValid())
+        {
+            return false;
+        }
+
+        ContainerWrapper modified = stored;
+        modifier(modified.container);
+        modified.updateCheck();
+        writeAll(modified, &stored, PointerIndexes());
+        return true;
+    }
+
+    /**
+     * Invalidates the stored data. Only the blocks that contain the integrity check are written.
      */
     void erase()
     {
-        ContainerWrapper wrapper;
-        std::memset(&wrapper, 0, sizeof(wrapper));
-        unwindReadWrite<true, 0, sizeof(wrapper)>(&wrapper);
+        ContainerWrapper stored;
+        readAll(stored, PointerIndexes());
+        ContainerWrapper erased = stored;
+        erased.invalidateCheck();
+        writeAll(erased, &stored, PointerIndexes());
     }
 };
 
@@ -220,6 +372,8 @@ public:
  *     }
  *     // Writing data:
  *     marshaller.write(the_data);
+ *     // Modifying some of the fields of the stored data:
+ *     marshaller.update([](DataType& x) { x.counter++; });
  *     // Erasing data:
  *     marshaller.erase();
  *
@@ -229,25 +383,32 @@ public:
  *                                      used, i.e. if the Container structure is smaller than the allocated storage.
  *                                      Refer to @ref StorageUtilizationCheckMode for info.
  *
+ * @tparam IntegrityCheck               Policy that computes the check value stored after the structure,
+ *                                      e.g. @ref CRC64WEIntegrityCheck (default), @ref CRC32IntegrityCheck,
+ *                                      or @ref SignatureIntegrityCheck. The bootloader and the application must
+ *                                      use the same policy.
+ *
  * @param pointers                      List of pointers to registers or memory where the structure will be stored or
  *                                      retrieved from. Pointer type defines access mode and size, e.g. a uint32
  *                                      pointer will be accessed in 32-bit mode, and its memory block will be used to
  *                                      store exactly 4 bytes, etc. Supported pointer sizes are 8, 16, 32, and 64 bit.
  *
  * @return                              An instance of @ref impl_::AppSharedMarshaller<>.
- *                                      The returned instance supports methods read(), write(), and erase(), that can
- *                                      be used to read, write, and erase the storage, respectively.
+ *                                      The returned instance supports methods read(), write(), update(), and erase(),
+ *                                      that can be used to read, write, modify, and erase the storage, respectively.
  */
 template <
     typename Container,
     StorageUtilizationCheckMode StorageUtilizationCheck =
         StorageUtilizationCheckMode::AllowUnderutilizedStorage,
+    typename IntegrityCheck = CRC64WEIntegrityCheck,
     typename... RegisterPointers
     >
 auto makeAppSharedMarshaller(RegisterPointers... pointers)
 {
     typedef impl_::AppSharedMarshaller<Container,
                                        StorageUtilizationCheck,
+                                       IntegrityCheck,
                                        decltype(std::make_tuple(pointers...))> Type;
     return Type(std::make_tuple(pointers...));
 }
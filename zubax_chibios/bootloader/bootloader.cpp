@@ -7,6 +7,8 @@
 #include "bootloader.hpp"
 #include <ch.hpp>
 #include <zubax_chibios/util/heapless.hpp>
+#include <algorithm>
+#include <cstddef>
 
 
 namespace bootloader
@@ -14,25 +16,98 @@ namespace bootloader
 /*
  * Bootloader
  */
+std::pair<std::uint64_t, bool> Bootloader::computeImageCRC(std::size_t descriptor_offset, std::size_t image_size)
+{
+    // The CRC field of the descriptor is treated as zeros, since it cannot cover itself
+    const std::size_t masked_begin = descriptor_offset + offsetof(AppDescriptor, app_info.image_crc);
+    const std::size_t masked_end = masked_begin + sizeof(AppInfo::image_crc);
+
+    CRC64WE crc;
+
+    const auto add = [&crc, masked_begin, masked_end](const std::uint8_t* data, std::size_t pos, std::size_t len)
+    {
+        const std::size_t end = pos + len;
+        if ((end <= masked_begin) || (pos >= masked_end))
+        {
+            crc.add(data, len);                         // Fast path, no overlap with the CRC field
+            return;
+        }
+        for (; pos < end; pos++, data++)
+        {
+            crc.add(((pos >= masked_begin) && (pos < masked_end)) ? std::uint8_t(0) : *data);
+        }
+    };
+
+    const auto view = backend_.getMemoryMappedView();
+    if (view.first != nullptr)
+    {
+        if (image_size > view.second)
+        {
+            return {0, false};
+        }
+        add(static_cast<const std::uint8_t*>(view.first), 0, image_size);
+    }
+    else
+    {
+        std::uint8_t buffer[ReadChunkSize];
+        for (std::size_t offset = 0; offset < image_size;)
+        {
+            const std::size_t chunk = std::min<std::size_t>(image_size - offset, sizeof(buffer));
+            const int res = backend_.read(offset, buffer, chunk);
+            if ((res <= 0) || (std::size_t(res) > chunk))
+            {
+                return {0, false};
+            }
+            add(buffer, offset, std::size_t(res));
+            offset += std::size_t(res);
+        }
+    }
+
+    return {crc.get(), true};
+}
+
 std::pair<Bootloader::AppDescriptor, bool> Bootloader::locateAppDescriptor()
 {
-    constexpr auto Step = 8;
+    constexpr std::size_t Step = 8;
+    static_assert(ReadChunkSize % Step == 0, "Chunk size must be a multiple of the descriptor alignment");
+
+    const auto view = backend_.getMemoryMappedView();
+    const auto reference = AppDescriptor::getSignatureValue();
+
+    std::uint8_t buffer[ReadChunkSize];
+    std::size_t chunk_offset = 0;
+    std::size_t chunk_size = 0;
 
     for (std::size_t offset = 0;; offset += Step)
     {
-        // Reading the storage in 8 bytes increments until we've found the signature
+        // Scanning the storage in 8 bytes increments until we've found the signature
+        const std::uint8_t* signature = nullptr;
+        if (view.first != nullptr)
         {
-            std::uint8_t signature[Step] = {};
-            int res = backend_.read(offset, signature, sizeof(signature));
-            if (res != sizeof(signature))
+            if ((offset + Step) > view.second)
             {
                 break;
             }
-            const auto reference = AppDescriptor::getSignatureValue();
-            if (!std::equal(std::begin(signature), std::end(signature), std::begin(reference)))
+            signature = static_cast<const std::uint8_t*>(view.first) + offset;
+        }
+        else
+        {
+            if ((offset + Step) > (chunk_offset + chunk_size))
             {
-                continue;
+                const int res = backend_.read(offset, buffer, sizeof(buffer));
+                if (res < int(Step))
+                {
+                    break;
+                }
+                chunk_offset = offset;
+                chunk_size = std::size_t(res);
             }
+            signature = &buffer[offset - chunk_offset];
+        }
+
+        if (!std::equal(std::begin(reference), std::end(reference), signature))
+        {
+            continue;
         }
 
         // Reading the entire descriptor
@@ -51,31 +126,13 @@ std::pair<Bootloader::AppDescriptor, bool> Bootloader::locateAppDescriptor()
 
         // Checking firmware CRC
         {
-            constexpr auto WordSize = 4;
-            const auto crc_offset_in_words = (offset + offsetof(AppDescriptor, app_info.image_crc)) / WordSize;
-            const auto image_size_in_words = desc.app_info.image_size / WordSize;
-
-            CRC64WE crc;
-
-            for (unsigned i = 0; i < image_size_in_words; i++)
-            {
-                std::uint32_t word = 0;
-                if ((i != crc_offset_in_words) && (i != (crc_offset_in_words + 1)))
-                {
-                    int res = backend_.read(i * WordSize, &word, WordSize);
-                    if (res != WordSize)
-                    {
-                        continue;
-                    }
-                }
+            constexpr std::size_t WordSize = 4;
+            const auto crc = computeImageCRC(offset, (desc.app_info.image_size / WordSize) * WordSize);
 
-                crc.add(&word, WordSize);
-            }
-
-            if (crc.get() != desc.app_info.image_crc)
+            if (!crc.second || (crc.first != desc.app_info.image_crc))
             {
                 DEBUG_LOG("App descriptor found, but CRC is invalid (%s != %s)\n",
-                          os::heapless::intToString(crc.get()).c_str(),
+                          os::heapless::intToString(crc.first).c_str(),
                           os::heapless::intToString(desc.app_info.image_crc).c_str());
                 continue;       // Look further...
             }
@@ -92,6 +149,7 @@ std::pair<Bootloader::AppDescriptor, bool> Bootloader::locateAppDescriptor()
 void Bootloader::verifyAppAndUpdateState()
 {
     const auto appdesc_result = locateAppDescriptor();
+    cached_app_info_ = {appdesc_result.first.app_info, appdesc_result.second};
     if (appdesc_result.second)
     {
         DEBUG_LOG("App found; version %d.%d.%x, %d bytes\n",
@@ -133,8 +191,7 @@ State Bootloader::getState()
 std::pair<AppInfo, bool> Bootloader::getAppInfo()
 {
     os::MutexLocker mlock(mutex_);
-    const auto res = locateAppDescriptor();
-    return {res.first.app_info, res.second};
+    return cached_app_info_;
 }
 
 void Bootloader::cancelBoot()
@@ -206,6 +263,8 @@ int Bootloader::upgradeApp(IDownloader& downloader)
         }
         }
 
+        cached_app_info_ = {AppInfo(), false};     // The old image is about to be destroyed
+
         int res = backend_.beginUpgrade();
         if (res < 0)
         {
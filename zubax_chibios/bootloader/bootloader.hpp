@@ -85,6 +85,13 @@ public:
      * @return number of bytes read; negative on error
      */
     virtual int read(std::size_t offset, void* data, std::size_t size) = 0;
+
+    /**
+     * Optional. If the storage is memory mapped (e.g. on-chip flash), returns the pointer to its beginning and
+     * its size in bytes. This allows the bootloader to verify the image directly in memory, bypassing read().
+     * The default implementation returns nullptr, which means that the data can be accessed only via read().
+     */
+    virtual std::pair<const void*, std::size_t> getMemoryMappedView() const { return {nullptr, 0}; }
 };
 
 /**
@@ -99,6 +106,13 @@ public:
      * @return Negative on error, non-negative on success.
      */
     virtual int handleNextDataChunk(const void* data, std::size_t size) = 0;
+
+    /**
+     * Invoked by the downloader once the last chunk is received, before the transfer is confirmed to the remote.
+     * Sinks that process the data asynchronously must complete all pending operations here.
+     * @return Negative on error, non-negative on success.
+     */
+    virtual int flush() { return 0; }
 };
 
 /**
@@ -133,6 +147,11 @@ class Bootloader
 
     chibios_rt::Mutex mutex_;
 
+    /**
+     * Result of the last verification; it can only be invalidated by an upgrade.
+     */
+    std::pair<AppInfo, bool> cached_app_info_;
+
     /**
      * Refer to the Brickproof Bootloader specs.
      */
@@ -156,6 +175,13 @@ class Bootloader
     };
     static_assert(sizeof(AppDescriptor) == 32, "Invalid packing");
 
+    /**
+     * Storage is read in chunks of this size unless it is memory mapped.
+     */
+    static constexpr unsigned ReadChunkSize = 256;
+
+    std::pair<std::uint64_t, bool> computeImageCRC(std::size_t descriptor_offset, std::size_t image_size);
+
     std::pair<AppDescriptor, bool> locateAppDescriptor();
 
     void verifyAppAndUpdateState();
@@ -173,6 +199,7 @@ public:
 
     /**
      * Returns info about the application, if any.
+     * The application is verified only once at startup and once after every upgrade, so this call is cheap.
      * @return First component is the application, second component is the status:
      *         true means that the info is valid, false means that there is no application to work with.
      */
@@ -5,6 +5,7 @@
  */
 
 #include "ymodem.hpp"
+#include <zubax_chibios/util/crc.hpp>
 #include <ch.hpp>
 #include <hal.h>
 #include <numeric>
@@ -31,6 +32,7 @@ struct ControlCharacters
     static constexpr std::uint8_t NAK = 0x15;
     static constexpr std::uint8_t CAN = 0x18;
     static constexpr std::uint8_t C   = 0x43;
+    static constexpr std::uint8_t G   = 0x47;
 };
 
 }
@@ -50,6 +52,41 @@ std::uint8_t YModemReceiver::computeChecksum(const void* data, unsigned size)
     return std::accumulate(p, p + size, 0);
 }
 
+std::uint16_t YModemReceiver::computeCRC16(const void* data, unsigned size)
+{
+    os::crc::CRC16CCITT crc;                            // XMODEM flavor, zero initial value
+    crc.add(data, size);
+    return crc.get();
+}
+
+std::uint8_t YModemReceiver::selectInitiationRequest(unsigned attempt, bool& out_use_crc, bool& out_streaming) const
+{
+    out_use_crc = false;
+    out_streaming = false;
+
+    if (preferred_mode_ == Mode::Streaming)
+    {
+        if (attempt < InitiationAttemptsPerMode)
+        {
+            out_use_crc = true;
+            out_streaming = true;
+            return ControlCharacters::G;
+        }
+        attempt -= InitiationAttemptsPerMode;
+    }
+
+    if (preferred_mode_ != Mode::Checksum)
+    {
+        if (attempt < InitiationAttemptsPerMode)
+        {
+            out_use_crc = true;
+            return ControlCharacters::C;
+        }
+    }
+
+    return ControlCharacters::NAK;
+}
+
 int YModemReceiver::send(std::uint8_t byte)
 {
     DEBUG_LOG("YMODEM TX 0x%x\n", byte);
@@ -102,7 +139,7 @@ void YModemReceiver::abort()
 }
 
 std::pair<YModemReceiver::BlockReceptionResult, int>
-YModemReceiver::receiveBlock(unsigned& out_size, std::uint8_t& out_sequence)
+YModemReceiver::receiveBlock(unsigned& out_size, std::uint8_t& out_sequence, bool use_crc)
 {
     // Header byte
     std::uint8_t header_byte = 0;
@@ -164,8 +201,8 @@ YModemReceiver::receiveBlock(unsigned& out_size, std::uint8_t& out_sequence)
     out_sequence = sequence_id_bytes[0];
 
     // Payload
-    constexpr auto ChecksumSize = 1;
-    const auto block_size_with_checksum = out_size + ChecksumSize;
+    const unsigned checksum_size = use_crc ? 2 : 1;
+    const auto block_size_with_checksum = out_size + checksum_size;
     res = receive(buffer_, block_size_with_checksum, BlockPayloadTimeoutMSec);
     if (res < 0)
     {
@@ -177,7 +214,16 @@ YModemReceiver::receiveBlock(unsigned& out_size, std::uint8_t& out_sequence)
     }
 
     // Checksum validation
-    if (computeChecksum(buffer_, out_size) != buffer_[out_size])
+    if (use_crc)
+    {
+        const std::uint16_t received_crc = std::uint16_t((buffer_[out_size] << 8) | buffer_[out_size + 1]);
+        if (computeCRC16(buffer_, out_size) != received_crc)
+        {
+            DEBUG_LOG("YMODEM CRC error, not 0x%x\n", received_crc);
+            return { BlockReceptionResult::ProtocolError, 0 };
+        }
+    }
+    else if (computeChecksum(buffer_, out_size) != buffer_[out_size])
     {
         DEBUG_LOG("YMODEM checksum error, not %d\n", buffer_[out_size]);
         return { BlockReceptionResult::ProtocolError, 0 };
@@ -257,6 +303,8 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
     std::uint32_t remaining_file_size = 0;
     bool file_size_known = false;
     std::uint8_t expected_sequence_id = 123;             // Arbitrary invalid value
+    bool use_crc = false;
+    bool streaming = false;
 
     enum class Mode
     {
@@ -269,7 +317,7 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
      * The sequence ID will be 0 in case of YMODEM, and 1 in case of XMODEM.
      */
     const auto started_at_st = chVTGetSystemTime();
-    for (;;)
+    for (unsigned attempt = 0;; attempt++)
     {
         DEBUG_LOG("Trying to initiate X/YMODEM transfer...\n");
 
@@ -280,8 +328,9 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
             return -ErrRetriesExhausted;
         }
 
-        // Requesting transmission in checksum mode
-        int res = send(ControlCharacters::NAK);
+        // Requesting transmission in the most preferred mode, falling back to less preferred ones
+        const std::uint8_t request = selectInitiationRequest(attempt, use_crc, streaming);
+        int res = send(request);
         if (res != 1)
         {
             abort();
@@ -290,7 +339,7 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
 
         // Receiving the block
         unsigned size = 0;
-        const auto block_rx_res = receiveBlock(size, expected_sequence_id);
+        const auto block_rx_res = receiveBlock(size, expected_sequence_id, use_crc);
         if (block_rx_res.first == BlockReceptionResult::Success)
         {
             ;
@@ -340,12 +389,15 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
             }
             file_size_known = remaining_file_size > 0;
 
-            // The zero block requires a dedicated ACK, sending it now
-            res = send(ControlCharacters::ACK);
-            if (res != 1)
+            // The zero block requires a dedicated ACK, sending it now; the streaming mode doesn't use ACK
+            if (!streaming)
             {
-                abort();
-                return sendResultToErrorCode(res);
+                res = send(ControlCharacters::ACK);
+                if (res != 1)
+                {
+                    abort();
+                    return sendResultToErrorCode(res);
+                }
             }
         }
         else if (expected_sequence_id == 1)
@@ -374,10 +426,23 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
 
     assert(file_size_known ? true : (remaining_file_size == 0));
 
+    DEBUG_LOG("YMODEM CRC=%d streaming=%d\n", int(use_crc), int(streaming));
+
     /*
-     * Receiving the file
+     * Receiving the file.
+     * YMODEM requires another request after the zero block, same as the one that initiated the transfer.
+     * In the streaming mode, the sender doesn't wait for any response until EOT.
      */
-    bool ack = mode == Mode::XModem;    // YMODEM requires another NAK after the zero block
+    constexpr std::uint8_t NoResponse = 0;
+    std::uint8_t response = NoResponse;
+    if (mode == Mode::YModem)
+    {
+        response = streaming ? ControlCharacters::G : (use_crc ? ControlCharacters::C : ControlCharacters::NAK);
+    }
+    else
+    {
+        response = streaming ? NoResponse : ControlCharacters::ACK;
+    }
     unsigned remaining_retries = MaxRetries;
     for (;;)
     {
@@ -390,18 +455,22 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
         remaining_retries--;
 
         // Confirming or re-requesting
-        int res = send(ack ? ControlCharacters::ACK : ControlCharacters::NAK);
+        int res = 1;
+        if (response != NoResponse)
+        {
+            res = send(response);
+        }
         if (res != 1)
         {
             abort();
             return sendResultToErrorCode(res);
         }
-        ack = false;
+        response = streaming ? NoResponse : ControlCharacters::NAK;
 
         // Receiving the block
         unsigned size = 0;
         std::uint8_t sequence_id = 0;
-        const auto block_rx_res = receiveBlock(size, sequence_id);
+        const auto block_rx_res = receiveBlock(size, sequence_id, use_crc);
         if (block_rx_res.first == BlockReceptionResult::Success)
         {
             ;
@@ -409,6 +478,12 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
         else if (block_rx_res.first == BlockReceptionResult::Timeout ||
                  block_rx_res.first == BlockReceptionResult::ProtocolError)
         {
+            if (streaming)                                      // No retransmissions in the streaming mode
+            {
+                DEBUG_LOG("YMODEM streaming error\n");
+                abort();
+                return -ErrProtocolError;
+            }
             continue;
         }
         else if (block_rx_res.first == BlockReceptionResult::EndOfTransmission)
@@ -439,10 +514,10 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
         remaining_retries = MaxRetries;                         // Reset retries on successful reception
 
         // Processing the block
-        if ((sequence_id + 1) == expected_sequence_id)          // Duplicate block, acknowledge silently
+        if (((sequence_id + 1) & 0xFF) == expected_sequence_id && !streaming)   // Duplicate, acknowledge silently
         {
             DEBUG_LOG("YMODEM duplicate block skipped\n");
-            ack = true;
+            response = ControlCharacters::ACK;
             continue;
         }
         if (sequence_id != expected_sequence_id)                // Totally wrong sequence, abort
@@ -478,7 +553,23 @@ int YModemReceiver::download(IDownloadStreamSink& sink)
         }
 
         // Done, continue to the next block
-        ack = true;
+        if (!streaming)
+        {
+            response = ControlCharacters::ACK;
+        }
+    }
+
+    /*
+     * Making sure the sink has processed everything before confirming the transfer.
+     */
+    {
+        const int res = sink.flush();
+        if (res < 0)
+        {
+            DEBUG_LOG("YMODEM sink flush failed %d\n", res);
+            abort();
+            return res;
+        }
     }
 
     /*
@@ -11,6 +11,8 @@
 #include <cstdint>
 #include <array>
 #include <utility>
+#include <algorithm>
+#include <cstring>
 
 
 namespace bootloader
@@ -31,18 +33,36 @@ static constexpr std::int16_t ErrRemoteRefusedToProvideFile     = 20005;
  * Downloads data using YMODEM or XMODEM protocol over the specified ChibiOS channel
  * (e.g. serial port, USB CDC ACM, TCP, ...).
  *
- * This class will request Checksum mode, in order to retain compatibility both with XMODEM and YMODEM senders
- * (YMODEM-compatible senders do support checksum mode as well as CRC mode).
+ * By default, this class will request CRC-16 mode, falling back to Checksum mode if the sender does not respond,
+ * in order to retain compatibility with old XMODEM senders that don't support CRC.
+ * Optionally, YMODEM-G streaming mode can be requested, where the sender doesn't wait for acknowledgment after
+ * every block; this is much faster on high-latency links such as USB CDC ACM, but there is no error recovery:
+ * any error aborts the transfer. Hence it should be used only with links that are reliable on their own.
+ * If the sender doesn't support YMODEM-G, the class falls back to CRC-16 and then to Checksum mode.
  * Both 1K and 128-byte blocks are supported.
  * Overall, the following protocols are supported:
  *      - YMODEM
+ *      - YMODEM-G
  *      - XMODEM
+ *      - XMODEM-CRC
  *      - XMODEM-1K
  *
  * Reference: http://pauillac.inria.fr/~doligez/zmodem/ymodem.txt
  */
 class YModemReceiver : public IDownloader
 {
+public:
+    /**
+     * The most preferred mode that will be requested from the sender.
+     */
+    enum class Mode
+    {
+        Checksum,                       ///< Legacy 8-bit checksum
+        CRC16,                          ///< CRC-16, falls back to Checksum
+        Streaming                       ///< YMODEM-G, falls back to CRC-16
+    };
+
+private:
     static constexpr unsigned BlockSizeXModem = 128;
     static constexpr unsigned BlockSize1K     = 1024;
     static constexpr unsigned WorstCaseBlockSizeWithCRC = BlockSize1K + 2;
@@ -55,7 +75,10 @@ class YModemReceiver : public IDownloader
 
     static constexpr unsigned MaxRetries = 3;
 
+    static constexpr unsigned InitiationAttemptsPerMode = 3;
+
     ::BaseChannel* const channel_;
+    const Mode preferred_mode_;
 
     std::uint8_t buffer_[WorstCaseBlockSizeWithCRC];
 
@@ -63,6 +86,14 @@ class YModemReceiver : public IDownloader
 
     static std::uint8_t computeChecksum(const void* data, unsigned size);
 
+    static std::uint16_t computeCRC16(const void* data, unsigned size);
+
+    /**
+     * Selects the character that initiates the transfer, depending on the number of attempts made so far.
+     * The most preferred mode is tried first, then the less preferred ones.
+     */
+    std::uint8_t selectInitiationRequest(unsigned attempt, bool& out_use_crc, bool& out_streaming) const;
+
     int send(std::uint8_t byte);
 
     int receive(void* data, unsigned size, unsigned timeout_msec);
@@ -83,11 +114,13 @@ class YModemReceiver : public IDownloader
 
     /**
      * Reads a block from the channel. This function does not transmit anything.
+     * @param use_crc   True if the block is protected with CRC-16 rather than with 8-bit checksum.
      * @return First component: @ref BlockReceptionResult
      *         Second component: system error code, if applicable
      */
     std::pair<BlockReceptionResult, int> receiveBlock(unsigned& out_size,
-                                                      std::uint8_t& out_sequence);
+                                                      std::uint8_t& out_sequence,
+                                                      bool use_crc);
 
     static bool tryParseZeroBlock(const std::uint8_t* const data,
                                   const unsigned size,
@@ -97,12 +130,179 @@ class YModemReceiver : public IDownloader
     static int processDownloadedBlock(IDownloadStreamSink& sink, void* data, unsigned size);
 
 public:
-    YModemReceiver(::BaseChannel* channel) :
-        channel_(channel)
+    YModemReceiver(::BaseChannel* channel,
+                   Mode preferred_mode = Mode::CRC16) :
+        channel_(channel),
+        preferred_mode_(preferred_mode)
     { }
 
     int download(IDownloadStreamSink& sink) override;
 };
 
+/**
+ * Same as @ref YModemReceiver, except that the received data is fed into the sink from a dedicated worker thread.
+ * This allows to receive the next block while the previous one is being written, e.g. into flash.
+ * Every block is acknowledged as soon as its checksum is verified and it is put into the queue; if the sink fails,
+ * the transfer is cancelled at the next block or at the end of the transfer, whichever comes first.
+ *
+ * The object contains the buffers and the working area of the worker, that is NumBuffers KB plus WorkerStackSize,
+ * roughly 3 KB with the default parameters; consider static allocation rather than the stack.
+ * The worker is stopped and joined by the destructor.
+ *
+ * @tparam NumBuffers           Number of queued blocks, up to 1 KB each.
+ * @tparam WorkerStackSize      Stack size of the worker thread; must be enough for the sink.
+ */
+template <unsigned NumBuffers = 2, unsigned WorkerStackSize = 1024>
+class PipelinedYModemReceiver : public YModemReceiver
+{
+    static_assert(NumBuffers > 0, "At least one buffer is needed");
+
+    class PipelinedSink : public IDownloadStreamSink,
+                          public chibios_rt::BaseStaticThread<WorkerStackSize>
+    {
+        static constexpr unsigned MaxChunkSize = 1024;
+
+        std::uint8_t buffers_[NumBuffers][MaxChunkSize];
+        std::size_t sizes_[NumBuffers] = {};
+        unsigned head_ = 0;
+        unsigned tail_ = 0;
+
+        chibios_rt::CounterSemaphore free_slots_{NumBuffers};
+        chibios_rt::CounterSemaphore filled_slots_{0};
+
+        IDownloadStreamSink* downstream_ = nullptr;
+        volatile int error_ = 0;
+
+        const ::tprio_t priority_;
+        bool started_ = false;
+        volatile bool stop_ = false;
+        chibios_rt::ThreadReference worker_{nullptr};
+
+        void main() override
+        {
+            chibios_rt::BaseThread::setName("ymodem_writer");
+
+            for (;;)
+            {
+                (void)filled_slots_.wait();
+                if (stop_)                      // The queue is always drained before the stop request is issued
+                {
+                    break;
+                }
+
+                if (error_ >= 0)                // Once failed, the rest of the data is discarded
+                {
+                    const int res = downstream_->handleNextDataChunk(buffers_[tail_], sizes_[tail_]);
+                    if (res < 0)
+                    {
+                        error_ = res;
+                    }
+                }
+                tail_ = (tail_ + 1U) % NumBuffers;
+
+                free_slots_.signal();
+            }
+        }
+
+    public:
+        explicit PipelinedSink(::tprio_t priority) : priority_(priority) { }
+
+        ~PipelinedSink()
+        {
+            if (started_)
+            {
+                stop_ = true;
+                filled_slots_.signal();
+                (void)worker_.wait();
+            }
+        }
+
+        void begin(IDownloadStreamSink& downstream)
+        {
+            downstream_ = &downstream;
+            error_ = 0;
+            if (!started_)
+            {
+                started_ = true;
+                worker_ = this->start(priority_);
+            }
+        }
+
+        int handleNextDataChunk(const void* data, std::size_t size) override
+        {
+            auto bytes = static_cast<const std::uint8_t*>(data);
+            while (size > 0)
+            {
+                if (error_ < 0)
+                {
+                    return error_;
+                }
+
+                (void)free_slots_.wait();
+
+                const std::size_t chunk = std::min<std::size_t>(size, MaxChunkSize);
+                std::memcpy(buffers_[head_], bytes, chunk);
+                sizes_[head_] = chunk;
+                head_ = (head_ + 1U) % NumBuffers;
+
+                filled_slots_.signal();
+
+                bytes += chunk;
+                size -= chunk;
+            }
+            return error_;
+        }
+
+        /**
+         * Waits for the worker to process all queued chunks; does not flush the downstream sink.
+         */
+        int drain()
+        {
+            // Waiting for the worker to release all slots
+            for (unsigned i = 0; i < NumBuffers; i++)
+            {
+                (void)free_slots_.wait();
+            }
+            for (unsigned i = 0; i < NumBuffers; i++)
+            {
+                free_slots_.signal();
+            }
+            return error_;
+        }
+
+        int flush() override
+        {
+            const int res = drain();
+            return (res < 0) ? res : downstream_->flush();
+        }
+    } sink_;
+
+public:
+    /**
+     * @param channel           Same as for @ref YModemReceiver.
+     * @param preferred_mode    Same as for @ref YModemReceiver.
+     * @param worker_priority   Priority of the worker thread; it is started on the first download.
+     */
+    PipelinedYModemReceiver(::BaseChannel* channel,
+                            Mode preferred_mode = Mode::CRC16,
+                            ::tprio_t worker_priority = NORMALPRIO - 1) :
+        YModemReceiver(channel, preferred_mode),
+        sink_(worker_priority)
+    { }
+
+    int download(IDownloadStreamSink& sink) override
+    {
+        sink_.begin(sink);
+        // The downstream sink is flushed by the base class on success only
+        const int res = YModemReceiver::download(sink_);
+        const int drain_res = sink_.drain();    // Nothing must be pending once we're done, even if we failed
+        if (res < 0)
+        {
+            return res;
+        }
+        return (drain_res < 0) ? drain_res : res;
+    }
+};
+
 }
 }
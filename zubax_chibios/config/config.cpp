@@ -18,21 +18,41 @@
 #include <cstring>
 #include <cmath>
 #include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <iterator>
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/util/float_eq.hpp>
+#include <zubax_chibios/util/crc.hpp>
 #include "config.hpp"
 
-#ifndef CONFIG_PARAMS_MAX
-#  define CONFIG_PARAMS_MAX     40
-#endif
-
 #ifndef CONFIG_PARAM_MAX_NAME_LENGTH
 #  define CONFIG_PARAM_MAX_NAME_LENGTH     92    // UAVCAN compliant
 #endif
 
+#ifndef CONFIG_CHANGE_LISTENERS_MAX
+#  define CONFIG_CHANGE_LISTENERS_MAX      8
+#endif
+
+/*
+ * Layout of the bulk transfer image, see config.hpp.
+ * The storage starts with the same header, but the CRC covers the index table as well:
+ *      OFFSET_LAYOUT_HASH  uint32      layout hash
+ *      OFFSET_CRC          uint32      CRC-32 of everything below
+ *      OFFSET_TABLE_INFO   uint16      number of entries in the index table
+ *                          uint16      size of the values, bytes
+ *      OFFSET_TABLE        StoredIndexEntry[]
+ *                          values, same as in the image
+ * The index table makes the storage self-describing, so that the values can be restored by their names after
+ * the set of parameters has changed.
+ */
 #define OFFSET_LAYOUT_HASH      0
 #define OFFSET_CRC              4
 #define OFFSET_VALUES           8
+#define OFFSET_TABLE_INFO       8
+#define OFFSET_TABLE            12
+
+static_assert(OFFSET_VALUES == os::config::ImageHeaderSize, "Image layout");
 
 using namespace os::config;
 
@@ -40,12 +60,50 @@ using namespace os::config;
 static constexpr int InitCodeRestored       = 1;
 static constexpr int InitCodeLayoutMismatch = 2;
 static constexpr int InitCodeCRCMismatch    = 3;
+static constexpr int InitCodeMigrated       = 4;
+
+static constexpr std::size_t ValuePoolCapacity = MaxImageSize - OFFSET_VALUES;
+
+/**
+ * The key is the CRC-32 of the name followed by the type and the size of the value, so a param whose type has
+ * changed is not restored. The offset is relative to the beginning of the values.
+ */
+struct StoredIndexEntry
+{
+    std::uint32_t key;
+    std::uint16_t offset;
+    std::uint8_t bit;                   ///< Bools only
+    std::uint8_t size;
+};
+static_assert(sizeof(StoredIndexEntry) == 8, "Storage layout");
+static_assert(MaxStorageSize == (MaxImageSize + 4U + sizeof(StoredIndexEntry) * CONFIG_PARAMS_MAX), "Storage layout");
 
 
 static const ConfigParam* _descr_pool[CONFIG_PARAMS_MAX];
-static float _value_pool[CONFIG_PARAMS_MAX];
+
+/*
+ * Values in their native representation, packed as described in config.hpp; the layout is built when the
+ * registry is frozen. Bools are addressed by the byte offset and the bit number within the byte.
+ */
+alignas(4) static std::uint8_t _value_pool[ValuePoolCapacity];
+static std::uint16_t _value_offset[CONFIG_PARAMS_MAX];
+static std::uint8_t _value_bit[CONFIG_PARAMS_MAX];
+static std::size_t _value_pool_size = 0;
+
+/*
+ * Keys of the index table, see StoredIndexEntry. The CRC state covers the index table of the current layout,
+ * which is immutable, so only the values need to be processed when the CRC is computed.
+ */
+static std::uint32_t _value_key[CONFIG_PARAMS_MAX];
+static std::uint32_t _table_crc = 0;
+
+/*
+ * Indexes of _descr_pool[] sorted by name; built once when the registry is frozen.
+ */
+static std::uint16_t _sorted_index[CONFIG_PARAMS_MAX];
 
 static int _num_params = 0;
+static int _num_string_params = 0;
 static std::uint32_t _layout_hash = 0;
 static bool _frozen = false;
 
@@ -53,18 +111,67 @@ static chibios_rt::Mutex _mutex;
 
 static unsigned _modification_cnt = 0;
 
-static IStorageBackend* g_storage = nullptr;
+/*
+ * Dirty tracking: one bit per param that has been modified since the last save or restore.
+ * The stored image flag is set if the storage contains a complete and valid image of the current layout,
+ * which makes incremental saves possible.
+ */
+static constexpr int IndexMaskSize = (CONFIG_PARAMS_MAX + 31) / 32;
+static std::uint32_t _dirty_mask[IndexMaskSize];
+static bool _stored_image_valid = false;
+
+/*
+ * Change listeners are notified with the main mutex released, so they have their own.
+ */
+static IChangeListener* _listeners[CONFIG_CHANGE_LISTENERS_MAX];
+static chibios_rt::Mutex _listeners_mutex;
 
+/*
+ * Sequence counter that allows to read the value pool without locking (seqlock).
+ * All writers hold the mutex, so there can be only one writer at a time.
+ * The value is odd while an update is in progress.
+ */
+static volatile unsigned _pool_sequence = 0;
 
-static std::uint32_t crc32_step(std::uint32_t crc, std::uint8_t new_byte)
+struct PoolUpdateLocker
 {
-    crc = crc ^ (std::uint32_t)new_byte;
-    for (int j = 7; j >= 0; j--)
+    PoolUpdateLocker()
     {
-        crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        _pool_sequence = _pool_sequence + 1U;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
     }
-    return crc;
-}
+
+    ~PoolUpdateLocker()
+    {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        _pool_sequence = _pool_sequence + 1U;
+    }
+};
+
+/*
+ * One value in the storage representation, except that a bool takes a whole byte here, zero or one.
+ */
+struct Value
+{
+    alignas(4) std::uint8_t bytes[(StringValueSize > 4) ? StringValueSize : 4];
+
+    float         asFloat() const { float x;        std::memcpy(&x, bytes, 4); return x; }
+    std::int32_t  asInt()   const { std::int32_t x; std::memcpy(&x, bytes, 4); return x; }
+    bool          asBool()  const { return bytes[0] != 0; }
+    const char*   asString() const { return reinterpret_cast<const char*>(bytes); }
+
+    void setFloat(float x)        { std::memcpy(bytes, &x, 4); }
+    void setInt(std::int32_t x)   { std::memcpy(bytes, &x, 4); }
+    void setBool(bool x)          { bytes[0] = x ? 1U : 0U; }
+    void setString(const char* x)
+    {
+        std::memset(bytes, 0, sizeof(bytes));
+        std::strncpy(reinterpret_cast<char*>(bytes), (x == nullptr) ? "" : x, CONFIG_PARAM_STRING_MAX_LENGTH);
+    }
+};
+
+static IStorageBackend* g_storage = nullptr;
+
 
 static std::uint32_t crc32(const void* data, int len)
 {
@@ -74,291 +181,1040 @@ static std::uint32_t crc32(const void* data, int len)
         return 0;
     }
 
-    std::uint32_t crc = 0;
-    for (int i = 0; i < len; i++)
+    os::crc::CRC32 crc;
+    crc.add(data, unsigned(len));
+    return crc.get();
+}
+
+static bool isIndexValid(int index)
+{
+    return (index >= 0) && (index < _num_params);
+}
+
+/**
+ * Number of bytes the value occupies in the storage.
+ */
+static std::size_t getValueSize(const ConfigParam* descr)
+{
+    switch (descr->type)
+    {
+    case CONFIG_TYPE_BOOL:
+    {
+        return 1;
+    }
+    case CONFIG_TYPE_STRING:
     {
-        crc = crc32_step(crc, *(((const std::uint8_t*)data) + i));
+        return StringValueSize;
+    }
+    default:
+    {
+        return 4;
+    }
     }
-    return crc;
 }
 
-static bool isValid(const ConfigParam* descr, float value)
+static void loadValue(const std::uint8_t* pool, int index, Value& out)
 {
-    assert(descr);
-
-    if (!std::isfinite(value))
+    const ConfigParam* const descr = _descr_pool[index];
+    if (descr->type == CONFIG_TYPE_BOOL)
     {
-        return false;
+        out.setBool(((pool[_value_offset[index]] >> _value_bit[index]) & 1U) != 0);
+    }
+    else
+    {
+        std::memcpy(out.bytes, pool + _value_offset[index], getValueSize(descr));
     }
+}
 
-    if (std::strlen(descr->name) > CONFIG_PARAM_MAX_NAME_LENGTH)
+static void storeValue(std::uint8_t* pool, int index, const Value& value)
+{
+    const ConfigParam* const descr = _descr_pool[index];
+    if (descr->type == CONFIG_TYPE_BOOL)
     {
-        return false;
+        const std::uint8_t mask = std::uint8_t(1U << _value_bit[index]);
+        pool[_value_offset[index]] = std::uint8_t(value.asBool() ? (pool[_value_offset[index]] | mask) :
+                                                                   (pool[_value_offset[index]] & ~mask));
+    }
+    else
+    {
+        std::memcpy(pool + _value_offset[index], value.bytes, getValueSize(descr));
     }
+}
 
+static bool areValuesEqual(const ConfigParam* descr, const Value& a, const Value& b)
+{
     switch (descr->type)
     {
     case CONFIG_TYPE_BOOL:
     {
-        if (!os::float_eq::close(value, 0.F) &&
-            !os::float_eq::close(value, 1.F))
-        {
-            return false;
-        }
+        return a.asBool() == b.asBool();
+    }
+    case CONFIG_TYPE_STRING:
+    {
+        return std::strncmp(a.asString(), b.asString(), StringValueSize) == 0;
+    }
+    default:
+    {
+        return std::memcmp(a.bytes, b.bytes, 4) == 0;
+    }
+    }
+}
+
+static void getDefaultValue(const ConfigParam* descr, Value& out)
+{
+    switch (descr->type)
+    {
+    case CONFIG_TYPE_FLOAT:
+    {
+        out.setFloat(descr->default_);
         break;
     }
     case CONFIG_TYPE_INT:
     {
-        volatile const long truncated = long(value);
-        if (!os::float_eq::close(value, float(truncated)))
-        {
-            return false;
-        }
+        out.setInt(descr->default_int);
+        break;
     }
-    /* no break */
-    case CONFIG_TYPE_FLOAT:
+    case CONFIG_TYPE_BOOL:
     {
-        if (value > descr->max || value < descr->min)
-        {
-            return false;
-        }
+        out.setBool(descr->default_int != 0);
+        break;
+    }
+    case CONFIG_TYPE_STRING:
+    {
+        out.setString(descr->default_string);
         break;
     }
     default:
     {
         assert(0);
-        return false;
+        break;
     }
     }
-    return true;
 }
 
-static int indexByName(const char* name)
+static bool isValid(const ConfigParam* descr, const Value& value)
 {
-    assert(name);
-    if (!name)
+    assert(descr);
+
+    switch (descr->type)
     {
-        return -1;
+    case CONFIG_TYPE_FLOAT:
+    {
+        const float x = value.asFloat();
+        return std::isfinite(x) && (x <= descr->max) && (x >= descr->min);
     }
-    for (int i = 0; i < _num_params; i++)
+    case CONFIG_TYPE_INT:
+    {
+        const std::int32_t x = value.asInt();
+        return (x <= descr->max_int) && (x >= descr->min_int);
+    }
+    case CONFIG_TYPE_BOOL:
+    {
+        return value.bytes[0] <= 1U;
+    }
+    case CONFIG_TYPE_STRING:
     {
-        if (!std::strcmp(_descr_pool[i]->name, name))
+        // Must be terminated within the capacity, no control characters
+        for (std::size_t i = 0; i < StringValueSize; i++)
         {
-            return i;
+            if (value.bytes[i] == 0)
+            {
+                return true;
+            }
+            if ((value.bytes[i] < 0x20U) || (value.bytes[i] == 0x7FU))
+            {
+                return false;
+            }
         }
+        return false;
+    }
+    default:
+    {
+        assert(0);
+        return false;
+    }
     }
-    return -1;
 }
 
-void configRegisterParam_(const ConfigParam* param)
+/**
+ * Conversion for the legacy float interface; integers are accepted only if the float value is integral.
+ */
+static bool makeValueFromFloat(const ConfigParam* descr, float x, Value& out)
 {
-    // This function can not be executed after the startup initialization is finished
-    assert(!_frozen);
-    if (_frozen)
+    if (!std::isfinite(x))
     {
-        return;
+        return false;
     }
 
-    ASSERT_ALWAYS(param && param->name);
-    ASSERT_ALWAYS(_num_params < CONFIG_PARAMS_MAX);  // If fails here, increase CONFIG_PARAMS_MAX
-    ASSERT_ALWAYS(isValid(param, param->default_)); // If fails here, param descriptor is invalid
-    ASSERT_ALWAYS(indexByName(param->name) < 0);   // If fails here, param name is not unique
-
-    // Register this param
-    const int index = _num_params++;
-    ASSERT_ALWAYS(_descr_pool[index] == NULL);
-    ASSERT_ALWAYS(os::float_eq::closeToZero(_value_pool[index]));
-    _descr_pool[index] = param;
-    _value_pool[index] = param->default_;
-
-    // Update the layout identification hash
-    for (const char* c = param->name; *c; c++)
+    switch (descr->type)
     {
-        _layout_hash = crc32_step(_layout_hash, *c);
+    case CONFIG_TYPE_FLOAT:
+    {
+        out.setFloat(x);
+        return true;
     }
-}
-
-static void reinitializeDefaults()
-{
-    for (int i = 0; i < _num_params; i++)
+    case CONFIG_TYPE_INT:
+    {
+        // 2^31 is exactly representable, so this is the tightest bound that does not overflow the cast
+        if ((x < -2147483648.F) || (x >= 2147483648.F))
+        {
+            return false;
+        }
+        const float rounded = std::round(x);
+        if (!os::float_eq::close(x, rounded))
+        {
+            return false;
+        }
+        out.setInt(std::int32_t(rounded));
+        return true;
+    }
+    case CONFIG_TYPE_BOOL:
+    {
+        if (!os::float_eq::close(x, 0.F) &&
+            !os::float_eq::close(x, 1.F))
+        {
+            return false;
+        }
+        out.setBool(!os::float_eq::closeToZero(x));
+        return true;
+    }
+    default:
     {
-        _value_pool[i] = _descr_pool[i]->default_;
+        return false;
+    }
     }
 }
 
-int configSave(void)
+static bool makeValueFromInt(const ConfigParam* descr, std::int32_t x, Value& out)
 {
-    ASSERT_ALWAYS(_frozen);
-    os::MutexLocker locker(_mutex);
-
-    // Erase
-    int flash_res = g_storage->erase();
-    if (flash_res)
+    switch (descr->type)
     {
-        goto flash_error;
+    case CONFIG_TYPE_FLOAT:
+    {
+        out.setFloat(float(x));
+        return true;
     }
-
-    // Write Layout
-    flash_res = g_storage->write(OFFSET_LAYOUT_HASH, &_layout_hash, 4);
-    if (flash_res)
+    case CONFIG_TYPE_INT:
     {
-        goto flash_error;
+        out.setInt(x);
+        return true;
+    }
+    case CONFIG_TYPE_BOOL:
+    {
+        out.setBool(x != 0);
+        return (x == 0) || (x == 1);
+    }
+    default:
+    {
+        return false;
     }
+    }
+}
 
+/**
+ * Lock-free read, see configGetByIndex().
+ */
+static void readValue(int index, Value& out)
+{
+    for (;;)
     {
-        // Write CRC
-        const int pool_len = _num_params * sizeof(_value_pool[0]);
-        const std::uint32_t true_crc = crc32(_value_pool, pool_len);
-        flash_res = g_storage->write(OFFSET_CRC, &true_crc, 4);
-        if (flash_res)
+        const unsigned seq = _pool_sequence;
+        if ((seq & 1U) != 0)
         {
-            goto flash_error;
+            // We preempted the writer; spinning here would never let it finish, so wait on the mutex instead
+            os::MutexLocker locker(_mutex);
+            loadValue(_value_pool, index, out);
+            return;
         }
 
-        // Write Values
-        flash_res = g_storage->write(OFFSET_VALUES, _value_pool, pool_len);
-        if (flash_res)
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        loadValue(_value_pool, index, out);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+
+        if (seq == _pool_sequence)
         {
-            goto flash_error;
+            return;
         }
     }
-
-    return 0;
-
-    flash_error:
-    assert(flash_res);
-    return flash_res;
 }
 
-int configErase(void)
+static void buildSortedIndex()
 {
-    ASSERT_ALWAYS(_frozen);
-    os::MutexLocker locker(_mutex);
-    int res = g_storage->erase();
-    if (res >= 0)
+    // Insertion sort; executed only once, the number of params is small
+    for (int i = 0; i < _num_params; i++)
     {
-        reinitializeDefaults();
-        _modification_cnt += 1;
+        int k = i;
+        while ((k > 0) && (std::strcmp(_descr_pool[_sorted_index[k - 1]]->name, _descr_pool[i]->name) > 0))
+        {
+            _sorted_index[k] = _sorted_index[k - 1];
+            k--;
+        }
+        _sorted_index[k] = std::uint16_t(i);
     }
-    return res;
 }
 
-const char* configNameByIndex(int index)
+/**
+ * Words go first, so that they are naturally aligned; then strings; then bools, packed eight per byte.
+ */
+static void buildValueLayout()
 {
-    ASSERT_ALWAYS(_frozen);
-    assert(index >= 0);
-    if (index < 0 || index >= _num_params)
+    std::size_t offset = 0;
+    for (int i = 0; i < _num_params; i++)
     {
-        return NULL;
+        if ((_descr_pool[i]->type == CONFIG_TYPE_FLOAT) || (_descr_pool[i]->type == CONFIG_TYPE_INT))
+        {
+            _value_offset[i] = std::uint16_t(offset);
+            offset += 4;
+        }
     }
-    return _descr_pool[index]->name;
-}
-
-int configSet(const char* name, float value)
-{
-    int retval = 0;
-    ASSERT_ALWAYS(_frozen);
-    os::MutexLocker locker(_mutex);
-
-    const int index = indexByName(name);
-    if (index < 0)
+    for (int i = 0; i < _num_params; i++)
     {
-        retval = -ENOENT;
-        goto leave;
+        if (_descr_pool[i]->type == CONFIG_TYPE_STRING)
+        {
+            _value_offset[i] = std::uint16_t(offset);
+            offset += StringValueSize;
+        }
     }
-
-    if (!isValid(_descr_pool[index], value))
+    unsigned num_bools = 0;
+    for (int i = 0; i < _num_params; i++)
     {
-        retval = -EINVAL;
-        goto leave;
+        if (_descr_pool[i]->type == CONFIG_TYPE_BOOL)
+        {
+            _value_offset[i] = std::uint16_t(offset + num_bools / 8U);
+            _value_bit[i] = std::uint8_t(num_bools % 8U);
+            num_bools++;
+        }
     }
+    offset += (num_bools + 7U) / 8U;
+    offset = (offset + 3U) & ~std::size_t(3U);      // The storage is word-oriented, see getStorageSpan()
 
-    _modification_cnt += 1;
-    _value_pool[index] = value;
+    ASSERT_ALWAYS(offset <= ValuePoolCapacity);
+    _value_pool_size = offset;
+}
 
-    leave:
-    return retval;
+static StoredIndexEntry makeIndexEntry(int index)
+{
+    StoredIndexEntry e;
+    e.key = _value_key[index];
+    e.offset = _value_offset[index];
+    e.bit = (_descr_pool[index]->type == CONFIG_TYPE_BOOL) ? _value_bit[index] : 0;
+    e.size = std::uint8_t(getValueSize(_descr_pool[index]));
+    return e;
 }
 
-int configGetDescr(const char* name, ConfigParam* out)
+static void buildIndexTableCRC()
 {
-    ASSERT_ALWAYS(_frozen);
-    assert(out);
-    if (!out)
+    const std::uint16_t table_info[2] = { std::uint16_t(_num_params), std::uint16_t(_value_pool_size) };
+    os::crc::CRC32 crc;
+    crc.add(table_info, sizeof(table_info));
+    for (int i = 0; i < _num_params; i++)
     {
-        return -EINVAL;
+        const StoredIndexEntry e = makeIndexEntry(i);
+        crc.add(&e, sizeof(e));
     }
+    _table_crc = crc.get();
+}
 
-    int retval = 0;
+/**
+ * The values follow immediately after the last entry of the index table.
+ */
+static std::size_t getIndexEntryOffset(int entry_index)
+{
+    return OFFSET_TABLE + sizeof(StoredIndexEntry) * std::size_t(entry_index);
+}
+
+static std::uint32_t computeStorageCRC(const void* values)
+{
+    os::crc::CRC32 crc(_table_crc);
+    crc.add(values, unsigned(_value_pool_size));
+    return crc.get();
+}
+
+static int indexByName(const char* name)
+{
+    assert(name);
+    if (!name)
+    {
+        return -1;
+    }
+
+    // The sorted index is not available until the registry is frozen, falling back to linear search
+    if (!_frozen)
+    {
+        for (int i = 0; i < _num_params; i++)
+        {
+            if (!std::strcmp(_descr_pool[i]->name, name))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Binary search, O(log N)
+    int low = 0;
+    int high = _num_params - 1;
+    while (low <= high)
+    {
+        const int mid = (low + high) / 2;
+        const int index = _sorted_index[mid];
+        const int cmp = std::strcmp(_descr_pool[index]->name, name);
+        if (cmp == 0)
+        {
+            return index;
+        }
+        if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return -1;
+}
+
+int configRegisterParam_(const ConfigParam* param)
+{
+    // This function can not be executed after the startup initialization is finished
+    assert(!_frozen);
+    if (_frozen)
+    {
+        return -1;
+    }
+
+    ASSERT_ALWAYS(param && param->name);
+    ASSERT_ALWAYS(std::strlen(param->name) <= CONFIG_PARAM_MAX_NAME_LENGTH);
+    ASSERT_ALWAYS(_num_params < CONFIG_PARAMS_MAX);  // If fails here, increase CONFIG_PARAMS_MAX
+    ASSERT_ALWAYS(indexByName(param->name) < 0);   // If fails here, param name is not unique
+
+    if (param->type == CONFIG_TYPE_STRING)
+    {
+        // If fails here, increase CONFIG_STRING_PARAMS_MAX or CONFIG_PARAM_STRING_MAX_LENGTH
+        ASSERT_ALWAYS(_num_string_params < CONFIG_STRING_PARAMS_MAX);
+        ASSERT_ALWAYS((param->default_string == NULL) ||
+                      (std::strlen(param->default_string) <= CONFIG_PARAM_STRING_MAX_LENGTH));
+        _num_string_params++;
+    }
+
+    Value default_value;
+    getDefaultValue(param, default_value);
+    ASSERT_ALWAYS(isValid(param, default_value)); // If fails here, param descriptor is invalid
+
+    // Register this param; the value will be initialized when the layout is built
+    const int index = _num_params++;
+    ASSERT_ALWAYS(_descr_pool[index] == NULL);
+    _descr_pool[index] = param;
+
+    // The key identifies the value in the storage; the type is included because it defines the storage format
+    os::crc::CRC32 key_crc;
+    key_crc.add(param->name, unsigned(std::strlen(param->name)));
+    const std::uint8_t type_info[2] = { std::uint8_t(param->type), std::uint8_t(getValueSize(param)) };
+    key_crc.add(type_info, sizeof(type_info));
+    _value_key[index] = key_crc.get();
+    for (int i = 0; i < index; i++)
+    {
+        ASSERT_ALWAYS(_value_key[i] != _value_key[index]);  // If fails here, rename the param (hash collision)
+    }
+
+    // Update the layout identification hash
+    os::crc::CRC32 layout_crc(_layout_hash);
+    layout_crc.add(&_value_key[index], 4);
+    _layout_hash = layout_crc.get();
+
+    return index;
+}
+
+static void setIndexBit(std::uint32_t* mask, int index)
+{
+    mask[index / 32] |= std::uint32_t(1) << (index % 32);
+}
+
+static bool getIndexBit(const std::uint32_t* mask, int index)
+{
+    return (mask[index / 32] & (std::uint32_t(1) << (index % 32))) != 0;
+}
+
+static void markDirty(int index)
+{
+    setIndexBit(_dirty_mask, index);
+}
+
+static bool isDirty(int index)
+{
+    return getIndexBit(_dirty_mask, index);
+}
+
+/**
+ * Must be invoked with the main mutex released.
+ * The listeners are invoked from a copy of the list with no locks held, so they can use the config API.
+ */
+static void notifyListeners(const std::uint32_t* changed_mask)
+{
+    IChangeListener* listeners[CONFIG_CHANGE_LISTENERS_MAX];
+    {
+        os::MutexLocker locker(_listeners_mutex);
+        std::copy(std::begin(_listeners), std::end(_listeners), std::begin(listeners));
+    }
+
+    for (int i = 0; i < _num_params; i++)
+    {
+        if (getIndexBit(changed_mask, i))
+        {
+            for (auto x : listeners)
+            {
+                if (x != nullptr)
+                {
+                    x->onParamChanged(i);
+                }
+            }
+        }
+    }
+}
+
+static bool isAnyDirty()
+{
+    for (auto x : _dirty_mask)
+    {
+        if (x != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void clearDirty()
+{
+    for (auto& x : _dirty_mask)
+    {
+        x = 0;
+    }
+}
+
+/**
+ * Location of the value in the storage, extended to halfword boundaries because that is the smallest unit
+ * some flash controllers can program. Words and strings are word-aligned, so only bools can share a halfword.
+ * The value pool is padded to a word boundary, so the span never goes beyond it.
+ */
+static void getStorageSpan(int index, std::size_t& out_offset, std::size_t& out_size)
+{
+    const std::size_t begin = _value_offset[index] & ~std::size_t(1U);
+    const std::size_t end = (_value_offset[index] + getValueSize(_descr_pool[index]) + 1U) & ~std::size_t(1U);
+    out_offset = begin;
+    out_size = end - begin;
+}
+
+/**
+ * Incremental save is possible if only the dirty values and the CRC need to be written, and the storage
+ * allows to overwrite them without erasing. Plain flash backends always need the full rewrite, because every
+ * save programs the CRC and all values.
+ */
+static bool canSaveIncrementally()
+{
+    return _stored_image_valid && g_storage->canWriteWithoutErase();
+}
+
+static void reinitializeDefaults(std::uint32_t* out_changed_mask = nullptr)
+{
+    for (int i = 0; i < _num_params; i++)
+    {
+        Value default_value;
+        getDefaultValue(_descr_pool[i], default_value);
+        if (out_changed_mask != nullptr)
+        {
+            Value current;
+            loadValue(_value_pool, i, current);
+            if (!areValuesEqual(_descr_pool[i], current, default_value))
+            {
+                setIndexBit(out_changed_mask, i);
+            }
+        }
+        storeValue(_value_pool, i, default_value);
+    }
+}
+
+int configSave(void)
+{
+    ASSERT_ALWAYS(_frozen);
     os::MutexLocker locker(_mutex);
 
+    // Nothing to do if the stored values are up to date
+    if (_stored_image_valid && !isAnyDirty())
+    {
+        return 0;
+    }
+
+    const int pool_len = int(_value_pool_size);
+    const std::size_t values_offset = getIndexEntryOffset(_num_params);
+    const std::uint32_t true_crc = computeStorageCRC(_value_pool);
+    int flash_res = 0;
+
+    if (canSaveIncrementally())
+    {
+        // Write only the changed values; bools share spans, which grow with the index, so each is written once.
+        // The first span may be at offset zero if there are only bools, hence the sentinel.
+        constexpr std::size_t NoBoolOffset = SIZE_MAX;
+        std::size_t last_bool_offset = NoBoolOffset;
+        for (int i = 0; i < _num_params; i++)
+        {
+            std::size_t offset = 0;
+            std::size_t size = 0;
+            getStorageSpan(i, offset, size);
+            const bool is_bool = _descr_pool[i]->type == CONFIG_TYPE_BOOL;
+            if (isDirty(i) && !(is_bool && (offset == last_bool_offset)))
+            {
+                flash_res = g_storage->write(values_offset + offset, &_value_pool[offset], size);
+                if (flash_res)
+                {
+                    goto flash_error;
+                }
+                if (is_bool)
+                {
+                    last_bool_offset = offset;
+                }
+            }
+        }
+    }
+    else
+    {
+        // Erase, unless the backend can overwrite the old data in place
+        if (!g_storage->canWriteWithoutErase())
+        {
+            flash_res = g_storage->erase();
+            if (flash_res)
+            {
+                goto flash_error;
+            }
+        }
+
+        // Write Layout
+        flash_res = g_storage->write(OFFSET_LAYOUT_HASH, &_layout_hash, 4);
+        if (flash_res)
+        {
+            goto flash_error;
+        }
+
+        // Write Index Table
+        const std::uint16_t table_info[2] = { std::uint16_t(_num_params), std::uint16_t(_value_pool_size) };
+        flash_res = g_storage->write(OFFSET_TABLE_INFO, table_info, sizeof(table_info));
+        if (flash_res)
+        {
+            goto flash_error;
+        }
+        for (int i = 0; i < _num_params; i++)
+        {
+            const StoredIndexEntry e = makeIndexEntry(i);
+            flash_res = g_storage->write(getIndexEntryOffset(i), &e, sizeof(e));
+            if (flash_res)
+            {
+                goto flash_error;
+            }
+        }
+
+        // Write Values
+        flash_res = g_storage->write(values_offset, _value_pool, pool_len);
+        if (flash_res)
+        {
+            goto flash_error;
+        }
+    }
+
+    // Write CRC
+    flash_res = g_storage->write(OFFSET_CRC, &true_crc, 4);
+    if (flash_res)
+    {
+        goto flash_error;
+    }
+
+    clearDirty();
+    _stored_image_valid = true;
+    return 0;
+
+    flash_error:
+    assert(flash_res);
+    _stored_image_valid = false;        // The storage is in unknown state now, full rewrite will be needed
+    return flash_res;
+}
+
+int configErase(void)
+{
+    ASSERT_ALWAYS(_frozen);
+    std::uint32_t changed_mask[IndexMaskSize] = {};
+    int res = 0;
+    {
+        os::MutexLocker locker(_mutex);
+        res = g_storage->erase();
+        if (res >= 0)
+        {
+            PoolUpdateLocker pool_locker;
+            reinitializeDefaults(changed_mask);
+            _modification_cnt += 1;
+        }
+        // Whatever the outcome, the stored image is gone; the defaults will be used after restart
+        _stored_image_valid = false;
+        clearDirty();
+    }
+    notifyListeners(changed_mask);
+    return res;
+}
+
+const char* configNameByIndex(int index)
+{
+    ASSERT_ALWAYS(_frozen);
+    assert(index >= 0);
+    if (index < 0 || index >= _num_params)
+    {
+        return NULL;
+    }
+    return _descr_pool[index]->name;
+}
+
+int configIndexByName(const char* name)
+{
+    ASSERT_ALWAYS(_frozen);
+    const int index = indexByName(name);
+    return (index < 0) ? -ENOENT : index;
+}
+
+static int setValue(int index, const Value& value, std::uint32_t* out_changed_mask)
+{
+    os::MutexLocker locker(_mutex);
+
+    if (!isValid(_descr_pool[index], value))
+    {
+        return -EINVAL;
+    }
+
+    _modification_cnt += 1;
+
+    Value current;
+    loadValue(_value_pool, index, current);
+    if (!areValuesEqual(_descr_pool[index], current, value))
+    {
+        markDirty(index);
+        setIndexBit(out_changed_mask, index);
+        PoolUpdateLocker pool_locker;
+        storeValue(_value_pool, index, value);
+    }
+
+    return 0;
+}
+
+static int setValueAndNotify(int index, const Value& value)
+{
+    std::uint32_t changed_mask[IndexMaskSize] = {};
+    const int res = setValue(index, value, changed_mask);
+    notifyListeners(changed_mask);
+    return res;
+}
+
+int configSet(const char* name, float value)
+{
+    ASSERT_ALWAYS(_frozen);
+    const int index = indexByName(name);
+    return (index < 0) ? -ENOENT : configSetByIndex(index, value);
+}
+
+int configSetByIndex(int index, float value)
+{
+    ASSERT_ALWAYS(_frozen);
+    if (!isIndexValid(index))
+    {
+        return -ENOENT;
+    }
+    Value v;
+    if (!makeValueFromFloat(_descr_pool[index], value, v))
+    {
+        return -EINVAL;
+    }
+    return setValueAndNotify(index, v);
+}
+
+int configSetIntByIndex(int index, std::int32_t value)
+{
+    ASSERT_ALWAYS(_frozen);
+    if (!isIndexValid(index))
+    {
+        return -ENOENT;
+    }
+    Value v;
+    if (!makeValueFromInt(_descr_pool[index], value, v))
+    {
+        return -EINVAL;
+    }
+    return setValueAndNotify(index, v);
+}
+
+int configSetStringByIndex(int index, const char* value)
+{
+    ASSERT_ALWAYS(_frozen);
+    if (!isIndexValid(index))
+    {
+        return -ENOENT;
+    }
+    if ((_descr_pool[index]->type != CONFIG_TYPE_STRING) ||
+        (value == nullptr) ||
+        (std::strlen(value) > CONFIG_PARAM_STRING_MAX_LENGTH))
+    {
+        return -EINVAL;
+    }
+    Value v;
+    v.setString(value);
+    return setValueAndNotify(index, v);
+}
+
+int configGetDescr(const char* name, ConfigParam* out)
+{
+    ASSERT_ALWAYS(_frozen);
+    assert(out);
+    if (!out)
+    {
+        return -EINVAL;
+    }
+
+    // The registry is immutable once frozen, no locking is needed
     const int index = indexByName(name);
     if (index < 0)
     {
-        retval = -ENOENT;
-        goto leave;
+        return -ENOENT;
     }
 
     *out = *_descr_pool[index];
-
-    leave:
-    return retval;
+    return 0;
 }
 
 float configGet(const char* name)
 {
     ASSERT_ALWAYS(_frozen);
-    os::MutexLocker locker(_mutex);
     const int index = indexByName(name);
     assert(index >= 0);
-    const float val = (index < 0) ? nanf("") : _value_pool[index];
-    assert(std::isfinite(val));
-    return val;
+    return (index < 0) ? nanf("") : configGetByIndex(index);
 }
 
-namespace os
+float configGetByIndex(int index)
 {
-namespace config
+    ASSERT_ALWAYS(_frozen);
+    assert(isIndexValid(index));
+    if (!isIndexValid(index))
+    {
+        return nanf("");
+    }
+
+    Value v;
+    readValue(index, v);
+
+    switch (_descr_pool[index]->type)
+    {
+    case CONFIG_TYPE_FLOAT:
+    {
+        return v.asFloat();
+    }
+    case CONFIG_TYPE_INT:
+    {
+        return float(v.asInt());
+    }
+    case CONFIG_TYPE_BOOL:
+    {
+        return v.asBool() ? 1.F : 0.F;
+    }
+    default:
+    {
+        return nanf("");
+    }
+    }
+}
+
+std::int32_t configGetIntByIndex(int index)
 {
+    ASSERT_ALWAYS(_frozen);
+    assert(isIndexValid(index));
+    if (!isIndexValid(index))
+    {
+        return 0;
+    }
 
-int init(IStorageBackend* storage)
+    Value v;
+    readValue(index, v);
+
+    switch (_descr_pool[index]->type)
+    {
+    case CONFIG_TYPE_FLOAT:
+    {
+        const float x = std::min(std::max(v.asFloat(), -2147483648.F), 2147483520.F);    // Largest float below 2^31
+        return std::int32_t(x);
+    }
+    case CONFIG_TYPE_INT:
+    {
+        return v.asInt();
+    }
+    case CONFIG_TYPE_BOOL:
+    {
+        return v.asBool() ? 1 : 0;
+    }
+    default:
+    {
+        assert(0);
+        return 0;
+    }
+    }
+}
+
+int configGetStringByIndex(int index, char* out, std::size_t size)
 {
-    ASSERT_ALWAYS(_num_params <= CONFIG_PARAMS_MAX);  // being paranoid
-    ASSERT_ALWAYS(!_frozen);
+    ASSERT_ALWAYS(_frozen);
+    if (!isIndexValid(index) || (_descr_pool[index]->type != CONFIG_TYPE_STRING) || (out == nullptr))
+    {
+        return -EINVAL;
+    }
 
-    if (storage == nullptr)
+    Value v;
+    readValue(index, v);
+
+    const std::size_t len = std::strlen(v.asString());
+    if (size > 0)
+    {
+        const std::size_t copy_len = std::min(len, size - 1U);
+        std::memcpy(out, v.bytes, copy_len);
+        out[copy_len] = '\0';
+    }
+    return int(len);
+}
+
+static int computeStoredCRC(std::size_t begin, std::size_t end, std::uint32_t& out_crc)
+{
+    os::crc::CRC32 crc;
+    while (begin < end)
+    {
+        std::uint8_t buf[32];
+        const std::size_t chunk = std::min(end - begin, sizeof(buf));
+        const int res = g_storage->read(begin, buf, chunk);
+        if (res)
+        {
+            return res;
+        }
+        crc.add(buf, unsigned(chunk));
+        begin += chunk;
+    }
+    out_crc = crc.get();
+    return 0;
+}
+
+/**
+ * Maps the stored values onto the current layout by their keys, in one pass over the stored index table.
+ * The values that are not found or not valid are left default; all values are marked dirty, because the stored
+ * layout will be replaced on the next save.
+ * The caller must initialize the defaults. Returns negative errno on storage failure, or if the stored image
+ * is not consistent.
+ */
+static int migrateValues(int num_entries, std::size_t values_size)
+{
+    // The table can't be larger than our limits, because the storage was dimensioned for them
+    if ((num_entries > CONFIG_PARAMS_MAX) || (values_size > ValuePoolCapacity))
     {
         return -EINVAL;
     }
 
-    g_storage = storage;
+    const std::size_t values_offset = getIndexEntryOffset(num_entries);
+    std::uint32_t true_crc = 0;
+    int res = computeStoredCRC(OFFSET_TABLE_INFO, values_offset + values_size, true_crc);
+    if (res)
+    {
+        return res;
+    }
+    std::uint32_t stored_crc = 0;
+    res = g_storage->read(OFFSET_CRC, &stored_crc, 4);
+    if (res)
+    {
+        return res;
+    }
+    if (true_crc != stored_crc)
+    {
+        return -EINVAL;
+    }
 
-    _frozen = true;
+    for (int k = 0; k < num_entries; k++)
+    {
+        StoredIndexEntry e;
+        res = g_storage->read(getIndexEntryOffset(k), &e, sizeof(e));
+        if (res)
+        {
+            return res;
+        }
+
+        const int index = int(std::find(&_value_key[0], &_value_key[_num_params], e.key) - &_value_key[0]);
+        if ((index >= _num_params) ||
+            (e.size != getValueSize(_descr_pool[index])) ||
+            ((std::size_t(e.offset) + e.size) > values_size) ||
+            (e.bit > 7))
+        {
+            continue;                   // The param was removed, or the entry is malformed
+        }
+
+        Value v;
+        res = g_storage->read(values_offset + e.offset, v.bytes, e.size);
+        if (res)
+        {
+            return res;
+        }
+        if (_descr_pool[index]->type == CONFIG_TYPE_BOOL)
+        {
+            v.setBool(((v.bytes[0] >> e.bit) & 1U) != 0);
+        }
+        if (isValid(_descr_pool[index], v))
+        {
+            storeValue(_value_pool, index, v);
+        }
+    }
+
+    for (int i = 0; i < _num_params; i++)
+    {
+        markDirty(i);
+    }
+    return 0;
+}
+
+/**
+ * Returns one of the init codes, or negative errno.
+ */
+static int restoreValues()
+{
+    os::MutexLocker locker(_mutex);
+    PoolUpdateLocker pool_locker;
 
     int retval = 0;
 
-    // Read the layout hash
+    // Read the header and the size of the index table
     std::uint32_t stored_layout_hash = 0xdeadbeef;
+    std::uint16_t table_info[2] = {};
     int flash_res = g_storage->read(OFFSET_LAYOUT_HASH, &stored_layout_hash, 4);
     if (flash_res)
     {
         goto flash_error;
     }
+    flash_res = g_storage->read(OFFSET_TABLE_INFO, table_info, sizeof(table_info));
+    if (flash_res)
+    {
+        goto flash_error;
+    }
 
-    // If the layout hash has not changed, we can restore the values safely
-    if (stored_layout_hash == _layout_hash)
+    // If the layout has not changed, the values can be read directly
+    if ((stored_layout_hash == _layout_hash) &&
+        (table_info[0] == _num_params) &&
+        (table_info[1] == _value_pool_size))
     {
-        const int pool_len = _num_params * sizeof(_value_pool[0]);
+        const int pool_len = int(_value_pool_size);
 
         // Read the data
-        flash_res = g_storage->read(OFFSET_VALUES, _value_pool, pool_len);
+        flash_res = g_storage->read(getIndexEntryOffset(_num_params), _value_pool, pool_len);
         if (flash_res)
         {
             goto flash_error;
         }
 
         // Check CRC
-        const std::uint32_t true_crc = crc32(_value_pool, pool_len);
+        const std::uint32_t true_crc = computeStorageCRC(_value_pool);
         std::uint32_t stored_crc = 0;
         flash_res = g_storage->read(OFFSET_CRC, &stored_crc, 4);
         if (flash_res)
@@ -370,11 +1226,16 @@ int init(IStorageBackend* storage)
         if (true_crc == stored_crc)
         {
             retval = InitCodeRestored;
+            _stored_image_valid = true;
             for (int i = 0; i < _num_params; i++)
             {
-                if (!isValid(_descr_pool[i], _value_pool[i]))
+                Value v;
+                loadValue(_value_pool, i, v);
+                if (!isValid(_descr_pool[i], v))
                 {
-                    _value_pool[i] = _descr_pool[i]->default_;
+                    getDefaultValue(_descr_pool[i], v);
+                    storeValue(_value_pool, i, v);
+                    markDirty(i);
                 }
             }
         }
@@ -386,8 +1247,21 @@ int init(IStorageBackend* storage)
     }
     else
     {
+        // The layout has changed, restoring what can be restored
         reinitializeDefaults();
-        retval = InitCodeLayoutMismatch;
+        flash_res = migrateValues(table_info[0], table_info[1]);
+        if (flash_res == 0)
+        {
+            retval = InitCodeMigrated;
+        }
+        else if (flash_res == -EINVAL)
+        {
+            retval = InitCodeLayoutMismatch;
+        }
+        else
+        {
+            goto flash_error;
+        }
     }
 
     return retval;
@@ -398,10 +1272,179 @@ int init(IStorageBackend* storage)
     return flash_res;
 }
 
+namespace os
+{
+namespace config
+{
+
+int init(IStorageBackend* storage)
+{
+    ASSERT_ALWAYS(_num_params <= CONFIG_PARAMS_MAX);  // being paranoid
+    ASSERT_ALWAYS(!_frozen);
+
+    if (storage == nullptr)
+    {
+        return -EINVAL;
+    }
+
+    g_storage = storage;
+
+    buildSortedIndex();
+    buildValueLayout();
+    buildIndexTableCRC();
+    reinitializeDefaults();
+    _frozen = true;
+
+    const int res = restoreValues();
+
+    // The values were equal to the defaults before the restoration
+    std::uint32_t changed_mask[IndexMaskSize] = {};
+    {
+        os::MutexLocker locker(_mutex);
+        for (int i = 0; i < _num_params; i++)
+        {
+            Value current;
+            Value default_value;
+            loadValue(_value_pool, i, current);
+            getDefaultValue(_descr_pool[i], default_value);
+            if (!areValuesEqual(_descr_pool[i], current, default_value))
+            {
+                setIndexBit(changed_mask, i);
+            }
+        }
+    }
+    notifyListeners(changed_mask);
+
+    return res;
+}
+
+std::size_t getImageSize()
+{
+    ASSERT_ALWAYS(_frozen);
+    return OFFSET_VALUES + _value_pool_size;
+}
+
+int exportImage(void* out_image, std::size_t size)
+{
+    ASSERT_ALWAYS(_frozen);
+    const std::size_t image_size = getImageSize();
+    if (out_image == nullptr)
+    {
+        return -EINVAL;
+    }
+    if (size < image_size)
+    {
+        return -ENOSPC;
+    }
+
+    auto out = static_cast<std::uint8_t*>(out_image);
+    {
+        os::MutexLocker locker(_mutex);
+        std::memcpy(out + OFFSET_VALUES, _value_pool, _value_pool_size);
+    }
+    const std::uint32_t crc = crc32(out + OFFSET_VALUES, int(_value_pool_size));
+    std::memcpy(out + OFFSET_LAYOUT_HASH, &_layout_hash, 4);
+    std::memcpy(out + OFFSET_CRC, &crc, 4);
+
+    return int(image_size);
+}
+
+int importImage(const void* image, std::size_t size)
+{
+    ASSERT_ALWAYS(_frozen);
+    if ((image == nullptr) || (size != getImageSize()))
+    {
+        return -EINVAL;
+    }
+
+    auto in = static_cast<const std::uint8_t*>(image);
+    std::uint32_t layout_hash = 0;
+    std::uint32_t crc = 0;
+    std::memcpy(&layout_hash, in + OFFSET_LAYOUT_HASH, 4);
+    std::memcpy(&crc, in + OFFSET_CRC, 4);
+    if ((layout_hash != _layout_hash) || (crc != crc32(in + OFFSET_VALUES, int(_value_pool_size))))
+    {
+        return -EINVAL;
+    }
+
+    // All values are validated before anything is modified, so that the image is applied either entirely or not at all
+    for (int i = 0; i < _num_params; i++)
+    {
+        Value v;
+        loadValue(in + OFFSET_VALUES, i, v);
+        if (!isValid(_descr_pool[i], v))
+        {
+            return -EINVAL;
+        }
+    }
+
+    std::uint32_t changed_mask[IndexMaskSize] = {};
+    {
+        os::MutexLocker locker(_mutex);
+        PoolUpdateLocker pool_locker;
+        for (int i = 0; i < _num_params; i++)
+        {
+            Value current;
+            Value v;
+            loadValue(_value_pool, i, current);
+            loadValue(in + OFFSET_VALUES, i, v);
+            if (!areValuesEqual(_descr_pool[i], current, v))
+            {
+                markDirty(i);
+                setIndexBit(changed_mask, i);
+                storeValue(_value_pool, i, v);
+            }
+        }
+        _modification_cnt += 1;
+    }
+    notifyListeners(changed_mask);
+
+    return 0;
+}
+
+int subscribe(IChangeListener* listener)
+{
+    if (listener == nullptr)
+    {
+        return -EINVAL;
+    }
+    os::MutexLocker locker(_listeners_mutex);
+    for (auto& x : _listeners)
+    {
+        if (x == nullptr)
+        {
+            x = listener;
+            return 0;
+        }
+    }
+    return -ENOMEM;                     // If fails here, increase CONFIG_CHANGE_LISTENERS_MAX
+}
+
+int unsubscribe(IChangeListener* listener)
+{
+    os::MutexLocker locker(_listeners_mutex);
+    for (auto& x : _listeners)
+    {
+        if ((x != nullptr) && (x == listener))
+        {
+            x = nullptr;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
 unsigned getModificationCounter()
 {
     return _modification_cnt;           // Atomic access
 }
 
+bool hasUnsavedChanges()
+{
+    ASSERT_ALWAYS(_frozen);
+    os::MutexLocker locker(_mutex);
+    return isAnyDirty();
+}
+
 }
 }
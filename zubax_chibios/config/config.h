@@ -7,18 +7,35 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Capacity of string parameters, not including the terminator.
+ */
+#ifndef CONFIG_PARAM_STRING_MAX_LENGTH
+#  define CONFIG_PARAM_STRING_MAX_LENGTH    15
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Every type is stored natively: float and int as 32-bit words, bool as one bit, strings as fixed-size arrays.
+ */
 typedef enum
 {
     CONFIG_TYPE_FLOAT,
     CONFIG_TYPE_INT,
-    CONFIG_TYPE_BOOL
+    CONFIG_TYPE_BOOL,
+    CONFIG_TYPE_STRING
 } ConfigDataType;
 
+/**
+ * The float fields are provided for all numeric types; integer parameters are validated against the exact
+ * integer fields though, because float can't represent all 32-bit integers.
+ */
 typedef struct
 {
     const char* name;
@@ -26,6 +43,10 @@ typedef struct
     float min;
     float max;
     ConfigDataType type;
+    int32_t default_int;            ///< CONFIG_TYPE_INT and CONFIG_TYPE_BOOL only
+    int32_t min_int;
+    int32_t max_int;
+    const char* default_string;     ///< CONFIG_TYPE_STRING only
 } ConfigParam;
 
 
@@ -34,9 +55,9 @@ typedef struct
 #  define GLUE(a, b)  GLUE_(a, b)
 #endif
 
-#define CONFIG_PARAM_RAW_(name, default_, min, max, type)             \
+#define CONFIG_PARAM_RAW_(name, default_, min, max, type, default_int, min_int, max_int, default_string) \
     static const ConfigParam GLUE(_config_local_param_, __LINE__) =   \
-        {name, default_, min, max, type};                             \
+        {name, default_, min, max, type, default_int, min_int, max_int, default_string}; \
     __attribute__((constructor, unused))                              \
     static void GLUE(_config_local_constructor_, __LINE__)(void) {    \
         configRegisterParam_(&GLUE(_config_local_param_, __LINE__));  \
@@ -46,18 +67,26 @@ typedef struct
  * Parameter definition macros.
  * Defined parameter can be accessed through configGet("param-name"), configGetDescr(...).
  */
-#define CONFIG_PARAM_FLOAT(name, default_, min, max)  CONFIG_PARAM_RAW_(name, default_, min, max, CONFIG_TYPE_FLOAT)
-#define CONFIG_PARAM_INT(name, default_, min, max)    CONFIG_PARAM_RAW_(name, default_, min, max, CONFIG_TYPE_INT)
-#define CONFIG_PARAM_BOOL(name, default_)             CONFIG_PARAM_RAW_(name, default_, 0,   1,   CONFIG_TYPE_BOOL)
+#define CONFIG_PARAM_FLOAT(name, default_, min, max)  \
+    CONFIG_PARAM_RAW_(name, default_, min, max, CONFIG_TYPE_FLOAT, 0, 0, 0, NULL)
+#define CONFIG_PARAM_INT(name, default_, min, max)    \
+    CONFIG_PARAM_RAW_(name, default_, min, max, CONFIG_TYPE_INT, default_, min, max, NULL)
+#define CONFIG_PARAM_BOOL(name, default_)             \
+    CONFIG_PARAM_RAW_(name, default_, 0, 1, CONFIG_TYPE_BOOL, default_, 0, 1, NULL)
+#define CONFIG_PARAM_STRING(name, default_)           \
+    CONFIG_PARAM_RAW_(name, 0, 0, 0, CONFIG_TYPE_STRING, 0, 0, 0, default_)
 
 
 /**
  * Internal logic; shall never be called explicitly.
+ * @return Index of the new parameter, or negative if it could not be registered.
  */
-void configRegisterParam_(const ConfigParam* param);
+int configRegisterParam_(const ConfigParam* param);
 
 /**
  * Saves the config into the non-volatile memory.
+ * Only the modified values are written if the storage backend allows that; if nothing was modified since the last
+ * save or restore, the storage is not accessed at all.
  * May enter a huge critical section, so it shall never be called concurrently with hard real time processes.
  */
 int configSave(void);
@@ -74,13 +103,37 @@ int configErase(void);
  */
 const char* configNameByIndex(int index);
 
+/**
+ * @param [in] name Parameter name
+ * @return Non-negative parameter index, or negative errno if there is no such parameter
+ */
+int configIndexByName(const char* name);
+
 /**
  * @param [in] name  Parameter name
- * @param [in] value Parameter value
+ * @param [in] value Parameter value; integers beyond 2^24 can't be set exactly this way, see configSetIntByIndex()
  * @return 0 if the parameter does exist and the value is valid, negative errno otherwise.
+ *         String parameters can't be set this way.
  */
 int configSet(const char* name, float value);
 
+/**
+ * Same as @ref configSet(), but O(1).
+ */
+int configSetByIndex(int index, float value);
+
+/**
+ * Sets an integer or bool parameter exactly, or a float parameter with the nearest representable value.
+ * @return 0 if the parameter does exist and the value is valid, negative errno otherwise.
+ */
+int configSetIntByIndex(int index, int32_t value);
+
+/**
+ * @param [in] value Null-terminated, at most CONFIG_PARAM_STRING_MAX_LENGTH characters, no control characters
+ * @return 0 if the parameter is a string and the value is valid, negative errno otherwise.
+ */
+int configSetStringByIndex(int index, const char* value);
+
 /**
  * @param [in]  name Parameter name
  * @param [out] out  Parameter descriptor
@@ -91,9 +144,31 @@ int configGetDescr(const char* name, ConfigParam* out);
 /**
  * @param [in] name Parameter name
  * @return The parameter value if it does exist; otherwise fires an assert() in debug builds, returns NAN in release.
+ *         String parameters are reported as NAN.
  */
 float configGet(const char* name);
 
+/**
+ * Lock-free version of @ref configGet() that accepts the parameter index instead of name.
+ * Complexity is O(1). This function does not block unless it preempted an ongoing update of the same value pool,
+ * in which case it waits for the update to complete. Shall not be used from ISR.
+ * @param [in] index Non-negative parameter index
+ * @return The parameter value if it does exist; otherwise fires an assert() in debug builds, returns NAN in release.
+ */
+float configGetByIndex(int index);
+
+/**
+ * Lock-free like @ref configGetByIndex(), but returns integer parameters exactly; float parameters are truncated.
+ * @return The parameter value if it is numeric; otherwise fires an assert() in debug builds, returns 0 in release.
+ */
+int32_t configGetIntByIndex(int index);
+
+/**
+ * Copies the value of a string parameter; the output is always null-terminated unless the size is zero.
+ * @return Length of the value, or negative errno if the parameter is not a string.
+ */
+int configGetStringByIndex(int index, char* out, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
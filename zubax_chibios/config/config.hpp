@@ -8,9 +8,22 @@
 
 #include <type_traits>
 #include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <ch.hpp>
+#include <zubax_chibios/sys/sys.hpp>
 #include <zubax_chibios/util/float_eq.hpp>
+#include <zubax_chibios/util/heapless.hpp>
 #include "config.h"
 
+#ifndef CONFIG_PARAMS_MAX
+#  define CONFIG_PARAMS_MAX             40
+#endif
+
+#ifndef CONFIG_STRING_PARAMS_MAX
+#  define CONFIG_STRING_PARAMS_MAX      4
+#endif
+
 namespace os
 {
 namespace config
@@ -25,6 +38,12 @@ struct Param : public ::ConfigParam
     Param& operator=(const Param&) = delete;
 
     static_assert(std::is_floating_point<T>() || std::is_integral<T>(), "One does not simply use T here");
+    static_assert(std::is_floating_point<T>() || (sizeof(T) < 4) || ((sizeof(T) == 4) && std::is_signed<T>()),
+                  "Integers are stored as int32, so the type must fit in it");
+
+    static constexpr bool IsFloat = std::is_floating_point<T>();
+
+    const int index;
 
     Param(const char* arg_name, T arg_default, T arg_min, T arg_max) : ConfigParam
     {
@@ -32,17 +51,23 @@ struct Param : public ::ConfigParam
         float(arg_default),
         float(arg_min),
         float(arg_max),
-        std::is_floating_point<T>() ? CONFIG_TYPE_FLOAT : CONFIG_TYPE_INT
-    }
-    {
-        ::configRegisterParam_(this);
-    }
+        IsFloat ? CONFIG_TYPE_FLOAT : CONFIG_TYPE_INT,
+        IsFloat ? 0 : std::int32_t(arg_default),
+        IsFloat ? 0 : std::int32_t(arg_min),
+        IsFloat ? 0 : std::int32_t(arg_max),
+        nullptr
+    },
+    index(::configRegisterParam_(this))
+    { }
 
-    T get() const { return T(::configGet(name)); }
+    /*
+     * Values are accessed in their native representation, so integers are never converted to float.
+     */
+    T get() const { return read(std::integral_constant<bool, IsFloat>()); }
 
     int set(const T& value) const
     {
-        return ::configSet(name, float(value));
+        return write(value, std::integral_constant<bool, IsFloat>());
     }
 
     int setAndSave(const T& value) const
@@ -55,31 +80,46 @@ struct Param : public ::ConfigParam
         return ::configSave();
     }
 
-    bool isMax() const { return get() >= T(::ConfigParam::max); }
-    bool isMin() const { return get() <= T(::ConfigParam::min); }
+    bool isMax() const { return IsFloat ? (get() >= T(::ConfigParam::max)) : (get() >= T(::ConfigParam::max_int)); }
+    bool isMin() const { return IsFloat ? (get() <= T(::ConfigParam::min)) : (get() <= T(::ConfigParam::min_int)); }
+
+private:
+    T read(std::true_type) const  { return T(::configGetByIndex(index)); }
+    T read(std::false_type) const { return T(::configGetIntByIndex(index)); }
+
+    int write(const T& value, std::true_type) const  { return ::configSetByIndex(index, float(value)); }
+    int write(const T& value, std::false_type) const { return ::configSetIntByIndex(index, std::int32_t(value)); }
 };
 
 template <>
 struct Param<bool> : public ::ConfigParam
 {
+    Param(const Param&) = delete;
+    Param& operator=(const Param&) = delete;
+
+    const int index;
+
     Param(const char* arg_name, bool arg_default) : ConfigParam
     {
         arg_name,
         arg_default ? 1.F : 0.F,
         0.F,
         1.F,
-        CONFIG_TYPE_BOOL
-    }
-    {
-        ::configRegisterParam_(this);
-    }
+        CONFIG_TYPE_BOOL,
+        arg_default ? 1 : 0,
+        0,
+        1,
+        nullptr
+    },
+    index(::configRegisterParam_(this))
+    { }
 
-    bool get() const { return !float_eq::closeToZero(::configGet(name)); }
+    bool get() const { return ::configGetIntByIndex(index) != 0; }
     operator bool() const { return get(); }
 
     int set(bool value) const
     {
-        return ::configSet(name, float(value));
+        return ::configSetIntByIndex(index, value ? 1 : 0);
     }
 
     int setAndSave(bool value) const
@@ -93,6 +133,54 @@ struct Param<bool> : public ::ConfigParam
     }
 };
 
+template <>
+struct Param<const char*> : public ::ConfigParam
+{
+    Param(const Param&) = delete;
+    Param& operator=(const Param&) = delete;
+
+    using String = heapless::String<CONFIG_PARAM_STRING_MAX_LENGTH>;
+
+    const int index;
+
+    Param(const char* arg_name, const char* arg_default) : ConfigParam
+    {
+        arg_name,
+        0.F,
+        0.F,
+        0.F,
+        CONFIG_TYPE_STRING,
+        0,
+        0,
+        0,
+        arg_default
+    },
+    index(::configRegisterParam_(this))
+    { }
+
+    String get() const
+    {
+        char buffer[CONFIG_PARAM_STRING_MAX_LENGTH + 1];
+        (void)::configGetStringByIndex(index, buffer, sizeof(buffer));
+        return String(buffer);
+    }
+
+    int set(const char* value) const
+    {
+        return ::configSetStringByIndex(index, value);
+    }
+
+    int setAndSave(const char* value) const
+    {
+        const int res = set(value);
+        if (res < 0)
+        {
+            return res;
+        }
+        return ::configSave();
+    }
+};
+
 } // namespace _internal
 
 /**
@@ -102,11 +190,14 @@ struct Param<bool> : public ::ConfigParam
  *      static Param<int> param_foo("foo", 1, -1, 1);
  *      static Param<float> param_bar("bar", 72.12, -16.456, 100.0);
  *      static Param<bool> param_baz("baz", true);
+ *      static Param<const char*> param_qux("qux", "default");     // Up to CONFIG_PARAM_STRING_MAX_LENGTH chars
  *
  * Usage:
  *      double my_data = param_baz ? (moon_phase * param_foo.get()) : (mercury_phase * param_bar.get());
  *
- * Parameter value access complexity is O(N) where N is the total number of params.
+ * Parameter value access complexity is O(1); the index of the parameter is cached when it is registered,
+ * so reads are lock-free and never contend with the CLI or other threads.
+ * Values are stored in their native types, so integers are exact in the whole int32 range, and bools take one bit.
  *
  * Thanks for attending the class.
  */
@@ -124,9 +215,19 @@ public:
     virtual int read(std::size_t offset, void* data, std::size_t len) = 0;
     virtual int write(std::size_t offset, const void* data, std::size_t len) = 0;
     virtual int erase() = 0;
+
+    /**
+     * Returns true if write() can be applied to previously written locations without erase(),
+     * e.g. if the backend is log-structured. In this case configSave() does not erase the storage.
+     */
+    virtual bool canWriteWithoutErase() const { return false; }
 };
 
 /**
+ * Restores the values from the storage. If the set of parameters has changed since the values were saved,
+ * the values of the parameters that still exist with the same name and type are restored, and the new
+ * parameters are initialized with defaults; the storage will be rewritten in the new layout on the next save.
+ *
  * Returns 0 if everything is OK, even if the configuration could not be restored (this is not an error).
  * All other interface functions assume that the config module was initialized successfully.
  * Returns negative errno in case of unrecoverable fault.
@@ -136,10 +237,176 @@ int init(IStorageBackend* storage);
 /**
  * Returns the number of times configSet() was executed successfully.
  * The returned value can only grow (with overflow).
- * This value can be used to reload changed parameter values in the background.
+ * This value can be used to reload changed parameter values in the background; see also @ref ChangeTracker.
  */
 unsigned getModificationCounter();
 
+/**
+ * Returns true if some of the parameters were modified since they were last saved or restored,
+ * i.e. if configSave() would write anything. This can be used to batch multiple modifications into one save.
+ */
+bool hasUnsavedChanges();
+
+/**
+ * Receives notifications about parameter changes, see @ref subscribe().
+ */
+class IChangeListener
+{
+public:
+    virtual ~IChangeListener() { }
+
+    /**
+     * Invoked after the value of the parameter has been changed by configSet(), configErase(), importImage(),
+     * or restored by init(). Setting a parameter to its current value is not a change.
+     * The call is made from the context of the thread that changed the value, with no config locks held,
+     * so the listener may use the config API, including configSet() and unsubscribe(); it should return quickly
+     * though, since it blocks the writer. A notification that is already being delivered can still reach
+     * a listener that has been unsubscribed concurrently.
+     * @param index     Index of the parameter, as in Param<>::index and configNameByIndex().
+     */
+    virtual void onParamChanged(int index) = 0;
+};
+
+/**
+ * Registers a listener; the number of listeners is limited by CONFIG_CHANGE_LISTENERS_MAX.
+ * Listeners that are subscribed before init() will be notified about the values restored from the storage.
+ * Must be invoked after the OS is initialized.
+ * @return 0 on success, -ENOMEM if there are too many listeners.
+ */
+int subscribe(IChangeListener* listener);
+
+/**
+ * @return 0 on success, -ENOENT if the listener was not subscribed.
+ */
+int unsubscribe(IChangeListener* listener);
+
+/**
+ * Accumulates the indexes of changed parameters until they are fetched by the consumer thread,
+ * which can then reload only what has changed instead of polling getModificationCounter().
+ * Optionally signals events to the consumer thread on every change, so that it can wait for changes.
+ * Usage:
+ *      static os::config::ChangeTracker tracker;     // Must be subscribed, e.g. os::config::subscribe(&tracker)
+ *      ...
+ *      if (tracker.fetch(param_gain))
+ *      {
+ *          gain = param_gain.get();
+ *      }
+ */
+class ChangeTracker : public IChangeListener
+{
+    std::uint32_t pending_[(CONFIG_PARAMS_MAX + 31) / 32] = {};
+    ::thread_t* thread_ = nullptr;
+    ::eventmask_t events_ = 0;
+
+    void onParamChanged(int index) override
+    {
+        if ((index < 0) || (index >= CONFIG_PARAMS_MAX))
+        {
+            return;
+        }
+        {
+            CriticalSectionLocker locker;
+            pending_[index / 32] |= std::uint32_t(1) << (index % 32);
+        }
+        if (thread_ != nullptr)
+        {
+            chEvtSignal(thread_, events_);
+        }
+    }
+
+public:
+    ChangeTracker() { }
+
+    /**
+     * @param thread_to_signal  Thread that will receive the events on every change.
+     * @param events            Event mask that will be signaled.
+     */
+    ChangeTracker(::thread_t* thread_to_signal, ::eventmask_t events) :
+        thread_(thread_to_signal),
+        events_(events)
+    { }
+
+    /**
+     * Returns true if the parameter has changed since the last call, and clears the pending flag.
+     */
+    bool fetch(int index)
+    {
+        if ((index < 0) || (index >= CONFIG_PARAMS_MAX))
+        {
+            return false;
+        }
+        const std::uint32_t bit = std::uint32_t(1) << (index % 32);
+        CriticalSectionLocker locker;
+        const bool changed = (pending_[index / 32] & bit) != 0;
+        pending_[index / 32] &= ~bit;
+        return changed;
+    }
+
+    template <typename Parameter>
+    bool fetch(const Parameter& param) { return fetch(param.index); }
+
+    /**
+     * Returns true if any parameter has changed since the last call, and clears all pending flags.
+     * This is convenient if the consumer reloads all of its parameters at once.
+     */
+    bool fetchAny()
+    {
+        bool changed = false;
+        CriticalSectionLocker locker;
+        for (auto& x : pending_)
+        {
+            changed = changed || (x != 0);
+            x = 0;
+        }
+        return changed;
+    }
+};
+
+/**
+ * Bulk transfer image of all parameter values, see @ref exportImage().
+ * Little-endian:
+ *      uint32  layout hash     - identifies the set of parameters and their types; images are compatible only if
+ *                                the hashes are equal
+ *      uint32  CRC-32          - of the values
+ *      values, packed:
+ *          - float and int parameters as 32-bit words, in the order of registration
+ *          - string parameters, @ref StringValueSize bytes each, null-padded, in the same order
+ *          - bool parameters, one bit each, LSB first, in the same order
+ *          - zero padding up to a multiple of 4 bytes
+ */
+static constexpr std::size_t ImageHeaderSize = 8;
+static constexpr std::size_t StringValueSize = ((CONFIG_PARAM_STRING_MAX_LENGTH + 1U + 3U) / 4U) * 4U;
+static constexpr std::size_t MaxImageSize = ImageHeaderSize +
+                                            CONFIG_PARAMS_MAX * 4U +
+                                            CONFIG_STRING_PARAMS_MAX * StringValueSize +
+                                            ((CONFIG_PARAMS_MAX + 31U) / 32U) * 4U;
+
+/**
+ * The storage holds the same values as the image, plus an index table of 8 bytes per parameter that allows to
+ * restore the values after parameters were added, removed, or reordered; see config.cpp.
+ * The storage backend must be at least this large.
+ */
+static constexpr std::size_t MaxStorageSize = MaxImageSize + 4U + 8U * CONFIG_PARAMS_MAX;
+
+/**
+ * Returns the size of the image for the current set of parameters, which is at most @ref MaxImageSize.
+ */
+std::size_t getImageSize();
+
+/**
+ * Writes a consistent snapshot of all parameter values into the buffer.
+ * @return Size of the image on success, -ENOSPC if the buffer is too small.
+ */
+int exportImage(void* out_image, std::size_t size);
+
+/**
+ * Applies all values from the image at once, like a sequence of configSet() with a single modification.
+ * Nothing is changed unless the layout hash and CRC match and all values are valid.
+ * The values are not saved automatically.
+ * @return 0 on success, -EINVAL if the image cannot be applied.
+ */
+int importImage(const void* image, std::size_t size);
+
 /**
  * Save configuration into the non-volatile memory.
  * @return Non-negative on success, negative errno on failure.
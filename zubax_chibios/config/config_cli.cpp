@@ -8,13 +8,92 @@
 #include <cstdlib>
 #include <cerrno>
 #include <cstring>
+#include <cstdint>
+#include <algorithm>
 #include <zubax_chibios/os.hpp>
+#include <zubax_chibios/util/base64.hpp>
 
 namespace os
 {
 namespace config
 {
 
+/*
+ * Image buffer shared by the dump and load commands; the CLI is never executed concurrently.
+ */
+static std::uint8_t _image[MaxImageSize];
+static std::size_t _image_load_offset;
+
+struct ByteRange
+{
+    std::uint8_t* const data;
+    const std::size_t len;
+
+    const std::uint8_t* cbegin() const { return data; }
+    std::uint8_t* begin() const { return data; }
+    std::size_t size() const { return len; }
+};
+
+static int dumpImage()
+{
+    const int res = exportImage(_image, sizeof(_image));
+    if (res < 0)
+    {
+        return res;
+    }
+
+    // Concatenation of base64 chunks is valid base64 as long as all chunks but the last are multiples of 3 bytes
+    static constexpr std::size_t ChunkSize = 48;
+    char encoded[base64::predictEncodedDataLength(ChunkSize) + 1];
+    for (std::size_t offset = 0; offset < std::size_t(res); offset += ChunkSize)
+    {
+        const ByteRange chunk{ _image + offset, std::min(ChunkSize, std::size_t(res) - offset) };
+        std::printf("%s", base64::encode(chunk, encoded));
+    }
+    std::puts("");
+    return 0;
+}
+
+/**
+ * The image can be loaded in one piece or in chunks, in which case each chunk is encoded separately and starts
+ * where the previous one ended. The image is applied once complete.
+ */
+static int loadImage(std::size_t offset, const char* encoded)
+{
+    const std::size_t image_size = getImageSize();
+    const std::size_t encoded_len = std::strlen(encoded);
+    const std::size_t len = ((encoded_len % 4U) == 0) ? base64::predictDecodedDataLength(encoded) : 0;
+    if ((offset != _image_load_offset) && (offset != 0))
+    {
+        std::printf("Error: Expected offset %u\n", unsigned(_image_load_offset));
+        return -EINVAL;
+    }
+    ByteRange destination{ _image + offset, len };
+    if ((len == 0) || (len > (image_size - offset)) || !base64::decode(destination, encoded))
+    {
+        _image_load_offset = 0;
+        std::puts("Error: Invalid data");
+        return -EINVAL;
+    }
+
+    _image_load_offset = offset + len;
+    if (_image_load_offset < image_size)
+    {
+        std::printf("%u/%u\n", unsigned(_image_load_offset), unsigned(image_size));
+        return 0;
+    }
+
+    _image_load_offset = 0;
+    const int res = importImage(_image, image_size);
+    if (res < 0)
+    {
+        std::puts("Error: Image rejected");
+        return res;
+    }
+    std::puts("OK");
+    return 0;
+}
+
 static int printParam(const char* name, bool verbose)
 {
     static int _max_name_len;
@@ -41,21 +120,32 @@ static int printParam(const char* name, bool verbose)
     {
         return res;
     }
+    const int index = configIndexByName(name);
 
     if (par.type == CONFIG_TYPE_FLOAT)
     {
-        std::printf("%-*s = %-12f", _max_name_len, name, double(configGet(name)));
+        std::printf("%-*s = %-12f", _max_name_len, name, double(configGetByIndex(index)));
         if (verbose)
         {
             std::printf("[%f, %f] (%f)", double(par.min), double(par.max), double(par.default_));
         }
     }
+    else if (par.type == CONFIG_TYPE_STRING)
+    {
+        char value[CONFIG_PARAM_STRING_MAX_LENGTH + 1];
+        (void)configGetStringByIndex(index, value, sizeof(value));
+        std::printf("%-*s = %-12s", _max_name_len, name, value);
+        if (verbose)
+        {
+            std::printf("(%s)", (par.default_string == nullptr) ? "" : par.default_string);
+        }
+    }
     else
     {
-        std::printf("%-*s = %-12i", _max_name_len, name, (int)configGet(name));
+        std::printf("%-*s = %-12li", _max_name_len, name, long(configGetIntByIndex(index)));
         if (verbose)
         {
-            std::printf("[%i, %i] (%i)", (int)par.min, (int)par.max, (int)par.default_);
+            std::printf("[%li, %li] (%li)", long(par.min_int), long(par.max_int), long(par.default_int));
         }
     }
     std::puts("");
@@ -83,6 +173,14 @@ int executeCLICommand(int argc, char *argv[])
         }
         return 0;
     }
+    else if (!std::strcmp(command, "dump"))
+    {
+        return dumpImage();
+    }
+    else if (!std::strcmp(command, "load") && ((argc == 2) || (argc == 3)))
+    {
+        return (argc == 2) ? loadImage(0, argv[1]) : loadImage(std::size_t(std::atoi(argv[1])), argv[2]);
+    }
     else if (!std::strcmp(command, "save"))
     {
         return configSave();
@@ -108,8 +206,30 @@ int executeCLICommand(int argc, char *argv[])
             return -EINVAL;
         }
         const char* const name = argv[1];
-        const float value = atoff(argv[2]);
-        int res = configSet(name, value);
+        const char* const value = argv[2];
+        ConfigParam par;
+        int res = configGetDescr(name, &par);
+        if (res)
+        {
+            return res;
+        }
+        const int index = configIndexByName(name);
+        if (par.type == CONFIG_TYPE_STRING)
+        {
+            res = configSetStringByIndex(index, value);
+        }
+        else if (par.type == CONFIG_TYPE_FLOAT)
+        {
+            res = configSetByIndex(index, atoff(value));
+        }
+        else
+        {
+            // Integers are parsed exactly if possible; values like 1e3 are accepted too
+            char* end = nullptr;
+            const long x = std::strtol(value, &end, 10);
+            const bool exact = (end != value) && (*end == '\0') && (x >= INT32_MIN) && (x <= INT32_MAX);
+            res = exact ? configSetIntByIndex(index, std::int32_t(x)) : configSetByIndex(index, atoff(value));
+        }
         if (res == 0)
         {
             res = printParam(name, false);
@@ -124,8 +244,12 @@ int executeCLICommand(int argc, char *argv[])
                   "  cfg erase\n"
                   "  cfg get <name>\n"
                   "  cfg set <name> <value>\n"
-                  "Note that save or erase may halt CPU for a few milliseconds which\n"
-                  "may cause transient failures in real time tasks or communications.");
+                  "  cfg dump\n"
+                  "  cfg load [offset] <base64>\n"
+                  "Note that save or erase may stall CPU while the flash is busy, which\n"
+                  "may cause transient failures in real time tasks or communications.\n"
+                  "Dump prints all values as a base64-encoded image, see os::config::exportImage();\n"
+                  "load applies such image, possibly split into chunks; offset is in decoded bytes.");
     }
     return -EINVAL;
 }
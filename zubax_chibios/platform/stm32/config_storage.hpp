@@ -8,10 +8,13 @@
 
 #include "flash_writer.hpp"
 #include <zubax_chibios/config/config.hpp>
+#include <zubax_chibios/util/crc.hpp>
 #include <cstdint>
 #include <cassert>
 #include <cstring>
 #include <cerrno>
+#include <iterator>
+#include <algorithm>
 
 
 namespace os
@@ -63,11 +66,349 @@ public:
         return FlashWriter().write(reinterpret_cast<void*>(address_ + offset), data, len) ? 0 : -EIO;
     }
 
+    /**
+     * The calling thread sleeps while the flash is being erased; interrupts are not disabled.
+     */
     int erase() override
     {
-        return FlashWriter().erase(reinterpret_cast<void*>(address_), size_) ? 0 : -EIO;
+        return AsyncFlashEraser::erase(reinterpret_cast<void*>(address_), size_);
     }
 };
 
+/**
+ * Log-structured configuration storage that avoids erasing the flash on every save.
+ * See os::config::IStorageBackend.
+ *
+ * The storage is presented to the config module as a flat array of 32-bit words, MaxDataSize bytes long.
+ * Every modified word is appended to the active sector as a separate record (index, value, CRC);
+ * words that were not modified are not written at all. The CRC of every record also covers the sequence number
+ * of its sector, so that stale records cannot be mistaken for valid ones.
+ * Two flash sectors are used in ping-pong: when the active sector is full, the latest values are compacted into
+ * the other sector, and only then the other sector's header is written, which makes it active.
+ * Therefore, flash erase is only required once per compaction.
+ *
+ * The current value of every word is cached in RAM, so the footprint is MaxDataSize bytes of RAM.
+ * MaxDataSize should be at least os::config::MaxStorageSize.
+ */
+template <std::size_t MaxDataSize>
+class LogStructuredConfigStorageBackend : public os::config::IStorageBackend
+{
+    static_assert(MaxDataSize > 0 && MaxDataSize % 4 == 0, "Data size must be a positive multiple of 4");
+
+    static constexpr std::size_t NumWords = MaxDataSize / 4;
+    static_assert(NumWords < 0xFFFEU, "Data size is too large");
+
+    static constexpr std::uint32_t HeaderMagic     = 0x534C435AU;   // "ZCLS" in ASCII, little endian
+    static constexpr std::uint32_t ErasedWord      = 0xFFFFFFFFU;
+    static constexpr std::uint16_t RecordIndexFree = 0xFFFFU;
+    static constexpr std::uint16_t RecordIndexWipe = 0xFFFEU;      ///< Invalidates all preceding records
+
+    struct Header
+    {
+        std::uint32_t sequence;
+        std::uint32_t magic;                                        ///< Written last
+    };
+    static_assert(sizeof(Header) == 8, "Invalid header size");
+
+    struct Record
+    {
+        std::uint32_t value;
+        std::uint16_t crc;
+        std::uint16_t index;                                        ///< Written last
+    };
+    static_assert(sizeof(Record) == 8, "Invalid record size");
+
+    const std::size_t sector_address_[2];
+    const std::size_t sector_size_;
+
+    std::uint32_t image_[NumWords];
+    bool loaded_ = false;
+
+    unsigned active_sector_ = 0;
+    std::uint32_t sequence_ = 0;
+    std::size_t next_record_offset_ = 0;
+
+    const Header& getHeader(unsigned sector) const
+    {
+        return *reinterpret_cast<const Header*>(sector_address_[sector]);
+    }
+
+    const Record& getRecord(unsigned sector, std::size_t offset) const
+    {
+        return *reinterpret_cast<const Record*>(sector_address_[sector] + offset);
+    }
+
+    void wipeImage()
+    {
+        for (auto& x : image_)
+        {
+            x = ErasedWord;
+        }
+    }
+
+    static bool isErased(const Record& rec)
+    {
+        return (rec.value == ErasedWord) && (rec.crc == 0xFFFFU) && (rec.index == RecordIndexFree);
+    }
+
+    static std::uint16_t computeRecordCRC(std::uint32_t sequence, std::uint16_t index, std::uint32_t value)
+    {
+        const std::uint8_t bytes[10] =
+        {
+            std::uint8_t(sequence), std::uint8_t(sequence >> 8), std::uint8_t(sequence >> 16),
+            std::uint8_t(sequence >> 24),
+            std::uint8_t(index), std::uint8_t(index >> 8),
+            std::uint8_t(value), std::uint8_t(value >> 8), std::uint8_t(value >> 16), std::uint8_t(value >> 24)
+        };
+        os::crc::CRC16CCITT crc(0xFFFFU);
+        crc.add(bytes, sizeof(bytes));
+        return crc.get();
+    }
+
+    int writeRecord(std::uint16_t index, std::uint32_t value)
+    {
+        if ((next_record_offset_ + sizeof(Record)) > sector_size_)
+        {
+            return -ENOSPC;
+        }
+
+        Record rec;
+        rec.value = value;
+        rec.crc = computeRecordCRC(sequence_, index, value);
+        rec.index = index;
+
+        void* const where = reinterpret_cast<void*>(sector_address_[active_sector_] + next_record_offset_);
+        next_record_offset_ += sizeof(Record);         // A failed record is skipped over on next load anyway
+
+        return FlashWriter().write(where, &rec, sizeof(rec)) ? 0 : -EIO;
+    }
+
+    /**
+     * Moves the latest values into the inactive sector and makes it active.
+     * This is the only place where flash is erased.
+     */
+    int compact()
+    {
+        const unsigned new_sector = active_sector_ ^ 1U;
+        void* const new_sector_ptr = reinterpret_cast<void*>(sector_address_[new_sector]);
+
+        DEBUG_LOG("Config log compaction into sector %u\n", new_sector);
+
+        // If anything goes wrong, the state will be reloaded from the flash on the next access
+        loaded_ = false;
+
+        const int erase_res = AsyncFlashEraser::erase(new_sector_ptr, sector_size_);
+        if (erase_res < 0)
+        {
+            return erase_res;
+        }
+
+        active_sector_ = new_sector;
+        sequence_ += 1U;
+        next_record_offset_ = sizeof(Header);
+
+        for (std::size_t i = 0; i < NumWords; i++)
+        {
+            if (image_[i] != ErasedWord)
+            {
+                const int res = writeRecord(std::uint16_t(i), image_[i]);
+                if (res < 0)
+                {
+                    return res;
+                }
+            }
+        }
+
+        // The header is written last, so that an interrupted compaction leaves the old sector active
+        const Header hdr { sequence_, HeaderMagic };
+        if (!FlashWriter().write(new_sector_ptr, &hdr, sizeof(hdr)))
+        {
+            return -EIO;
+        }
+
+        loaded_ = true;
+        return 0;
+    }
+
+    int appendRecord(std::uint16_t index, std::uint32_t value)
+    {
+        int res = writeRecord(index, value);
+        if (res == -ENOSPC)
+        {
+            res = compact();
+        }
+        return res;
+    }
+
+    int load()
+    {
+        if (loaded_)
+        {
+            return 0;
+        }
+
+        wipeImage();
+
+        // Selecting the active sector
+        bool found = false;
+        for (unsigned i = 0; i < 2; i++)
+        {
+            const Header& hdr = getHeader(i);
+            if ((hdr.magic == HeaderMagic) &&
+                (!found || static_cast<std::int32_t>(hdr.sequence - sequence_) > 0))
+            {
+                found = true;
+                active_sector_ = i;
+                sequence_ = hdr.sequence;
+            }
+        }
+
+        if (!found)
+        {
+            // Nothing stored yet, formatting. The compaction of an empty image is an empty sector.
+            active_sector_ = 1;
+            sequence_ = 0;
+            return compact();
+        }
+
+        // Replaying the log
+        next_record_offset_ = sizeof(Header);
+        while ((next_record_offset_ + sizeof(Record)) <= sector_size_)
+        {
+            const Record& rec = getRecord(active_sector_, next_record_offset_);
+            if (isErased(rec))
+            {
+                break;
+            }
+            next_record_offset_ += sizeof(Record);
+
+            if (rec.crc != computeRecordCRC(sequence_, rec.index, rec.value))
+            {
+                continue;                               // Interrupted write or corruption
+            }
+            if (rec.index == RecordIndexWipe)
+            {
+                wipeImage();
+            }
+            else if (rec.index < NumWords)
+            {
+                image_[rec.index] = rec.value;
+            }
+            else
+            {
+                ;                                       // Unknown record, probably from a different configuration
+            }
+        }
+
+        loaded_ = true;
+        return 0;
+    }
+
+public:
+    /**
+     * @param sector_a      Address of the first flash sector.
+     * @param sector_b      Address of the second flash sector.
+     * @param sector_size   Size of each sector; both sectors must be of the same size.
+     */
+    LogStructuredConfigStorageBackend(void* sector_a,
+                                      void* sector_b,
+                                      std::size_t sector_size) :
+        sector_address_{reinterpret_cast<std::size_t>(sector_a), reinterpret_cast<std::size_t>(sector_b)},
+        sector_size_(sector_size)
+    {
+        assert(sector_address_[0] % 256 == 0);
+        assert(sector_address_[1] % 256 == 0);
+        assert(sector_size_ % 256 == 0);
+        assert(sector_address_[0] > 0);
+        assert(sector_address_[1] > 0);
+        assert(sector_address_[0] != sector_address_[1]);
+        assert(sector_size_ >= (sizeof(Header) + sizeof(Record) * (NumWords + 1)));   // Must fit the compacted image
+    }
+
+    int read(std::size_t offset, void* data, std::size_t len) override
+    {
+        if ((data == nullptr) ||
+            (offset + len) > MaxDataSize)
+        {
+            assert(false);
+            return -EINVAL;
+        }
+
+        const int res = load();
+        if (res < 0)
+        {
+            return res;
+        }
+
+        std::memcpy(data, reinterpret_cast<const std::uint8_t*>(&image_[0]) + offset, len);
+        return 0;
+    }
+
+    int write(std::size_t offset, const void* data, std::size_t len) override
+    {
+        if ((data == nullptr) ||
+            (offset + len) > MaxDataSize)
+        {
+            assert(false);
+            return -EINVAL;
+        }
+
+        int res = load();
+        if (res < 0)
+        {
+            return res;
+        }
+
+        const auto src = static_cast<const std::uint8_t*>(data);
+
+        for (std::size_t index = offset / 4; (index * 4) < (offset + len); index++)
+        {
+            // Merging the new bytes into the word, in case the write is not word-aligned
+            std::uint32_t word = image_[index];
+            for (std::size_t byte = 0; byte < 4; byte++)
+            {
+                const std::size_t pos = index * 4 + byte;
+                if ((pos >= offset) && (pos < (offset + len)))
+                {
+                    reinterpret_cast<std::uint8_t*>(&word)[byte] = src[pos - offset];
+                }
+            }
+
+            if (word == image_[index])
+            {
+                continue;                               // Not changed, nothing to write
+            }
+
+            const std::uint32_t old_word = image_[index];
+            image_[index] = word;
+            res = appendRecord(std::uint16_t(index), word);
+            if (res < 0)
+            {
+                image_[index] = old_word;
+                return res;
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * Does not erase the flash; appends a record that invalidates all preceding records instead.
+     */
+    int erase() override
+    {
+        int res = load();
+        if (res < 0)
+        {
+            return res;
+        }
+
+        wipeImage();
+        return appendRecord(RecordIndexWipe, ErasedWord);
+    }
+
+    bool canWriteWithoutErase() const override { return true; }
+};
+
 }
 }
@@ -11,16 +11,120 @@
 #include <cassert>
 #include <cstring>
 #include <cstdint>
+#include <cerrno>
 #include <algorithm>
 
 #if !defined(FLASH_SR_WRPRTERR) // Compatibility
 # define FLASH_SR_WRPRTERR      FLASH_SR_WRPERR
 #endif
 
+/**
+ * x32 programming parallelism is available on STM32F2/F4/F7 if the supply voltage is at least 2.7 V.
+ * By default it is enabled if the board definition (STM32_VDD, in 10 mV units) says so; otherwise x16 is used,
+ * which works across the whole voltage range.
+ */
+#if !defined(OS_STM32_FLASH_WRITER_USE_X32)
+# if defined(FLASH_CR_PSIZE_1) && defined(STM32_VDD) && (STM32_VDD >= 270)
+#  define OS_STM32_FLASH_WRITER_USE_X32         1
+# else
+#  define OS_STM32_FLASH_WRITER_USE_X32         0
+# endif
+#endif
+
+/**
+ * Programming is done in chunks of this many bytes, each chunk in its own critical section.
+ * This bounds the interrupt latency to a few hundreds of microseconds regardless of the amount of data written.
+ */
+#if !defined(OS_STM32_FLASH_WRITER_PROGRAM_CHUNK_SIZE)
+# define OS_STM32_FLASH_WRITER_PROGRAM_CHUNK_SIZE       32
+#endif
+
 namespace os
 {
 namespace stm32
 {
+/**
+ * Flash memory layout of the supported MCU, used to erase exactly one page or sector at a time.
+ * All supported MCU have a single bank. Page erase parts are described up to their highest density;
+ * it is up to the application not to address flash that does not exist.
+ */
+struct FlashGeometry
+{
+    static constexpr std::size_t BaseAddress = 0x08000000;
+
+#if defined(FLASH_CR_PER)
+    static constexpr bool UsesPageErase = true;         ///< Units are addressed by address rather than by number
+#else
+    static constexpr bool UsesPageErase = false;
+#endif
+
+#if defined(STM32F446xx)
+    static constexpr unsigned NumEraseUnits = 8;
+#elif defined(STM32F105xC) || defined(STM32F107xC) || defined(STM32F373xC) || defined(STM32F378xx)
+    static constexpr unsigned NumEraseUnits = 128;
+#else
+    static constexpr unsigned NumEraseUnits = 0;
+#endif
+
+    struct EraseUnit
+    {
+        std::uint32_t number;   ///< Page or sector number, counting from the beginning of the flash
+        std::size_t address;    ///< Address of the first byte of the unit
+        std::size_t size;       ///< Zero if the address is outside of the flash
+    };
+
+    /**
+     * Finds the page or sector that contains the specified address.
+     */
+    static constexpr EraseUnit locateEraseUnit(const std::size_t address)
+    {
+        struct Run
+        {
+            std::size_t unit_size;
+            unsigned num_units;
+        };
+
+#if defined(STM32F446xx)
+        const Run runs[] = { { 16384, 4 }, { 65536, 1 }, { 131072, 3 } };
+#elif defined(STM32F105xC) || defined(STM32F107xC)
+        const Run runs[] = { { 2048, 128 } };
+#elif defined(STM32F373xC) || defined(STM32F378xx)
+        const Run runs[] = { { 2048, 128 } };
+#else
+        const Run runs[] = { { 0, 0 } };            // Unknown MCU, erase is not possible
+#endif
+
+        std::size_t run_address = BaseAddress;
+        std::uint32_t number = 0;
+        if (address >= run_address)
+        {
+            for (const Run& r : runs)
+            {
+                const std::size_t run_size = r.unit_size * r.num_units;
+                if ((address - run_address) < run_size)
+                {
+                    const std::size_t index = (address - run_address) / r.unit_size;
+                    return EraseUnit{ number + std::uint32_t(index), run_address + index * r.unit_size, r.unit_size };
+                }
+                run_address += run_size;
+                number += r.num_units;
+            }
+        }
+        return EraseUnit{ 0, 0, 0 };
+    }
+};
+
+#if defined(STM32F446xx)
+static_assert(FlashGeometry::locateEraseUnit(0x08003FFF).number == 0, "Flash geometry error");
+static_assert(FlashGeometry::locateEraseUnit(0x08010000).number == 4, "Flash geometry error");
+static_assert(FlashGeometry::locateEraseUnit(0x0807FFFF).number == 7, "Flash geometry error");
+static_assert(FlashGeometry::locateEraseUnit(0x08080000).size == 0, "Flash geometry error");
+#endif
+#if defined(STM32F105xC) || defined(STM32F107xC) || defined(STM32F373xC) || defined(STM32F378xx)
+static_assert(FlashGeometry::locateEraseUnit(0x0803FFFF).number == 127, "Flash geometry error");
+static_assert(FlashGeometry::locateEraseUnit(0x08040000).size == 0, "Flash geometry error");
+#endif
+
 /**
  * The code below assumes that HSI oscillator is up and running,
  * otherwise the Flash controller (FPEC) may misbehave.
@@ -28,6 +132,15 @@ namespace stm32
  */
 class FlashWriter
 {
+    friend class AsyncFlashEraser;
+
+    static constexpr std::uint32_t ErrorFlags = FLASH_SR_WRPRTERR |
+#ifdef FLASH_SR_PGERR
+        FLASH_SR_PGERR;
+#else
+        FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR;
+#endif
+
     static void waitReady()
     {
         do
@@ -57,13 +170,7 @@ class FlashWriter
                 FLASH->KEYR = 0x45670123UL;
                 FLASH->KEYR = 0xCDEF89ABUL;
             }
-            FLASH->SR |= FLASH_SR_EOP | FLASH_SR_WRPRTERR |
-#ifdef FLASH_SR_PGERR
-                FLASH_SR_PGERR
-#else
-                FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR
-#endif
-                ;
+            FLASH->SR |= FLASH_SR_EOP | ErrorFlags;
             FLASH->CR = 0;
         }
 
@@ -73,71 +180,244 @@ class FlashWriter
         }
     };
 
-    /// Returns negative if there's no match
-    static int mapAddressToSectorNumber(const std::size_t where)
+    /**
+     * Checks whether the region reads as erased, one word at a time where possible.
+     */
+    static bool isErased(const void* const where,
+                         const std::size_t how_much)
     {
-        if (where < 0x08000000)
+        auto bytes = static_cast<const std::uint8_t*>(where);
+        const auto end = bytes + how_much;
+
+        while ((bytes < end) && ((reinterpret_cast<std::size_t>(bytes) % 4U) != 0))
         {
-            return -1;
+            if (*bytes++ != 0xFFU)
+            {
+                return false;
+            }
         }
 
-#if defined(STM32F446xx)
-        // 16K
-        if (where < 0x08003FFF) { return 0; }
-        if (where < 0x08007FFF) { return 1; }
-        if (where < 0x0800BFFF) { return 2; }
-        if (where < 0x0800FFFF) { return 3; }
-        // 64K
-        if (where < 0x0801FFFF) { return 4; }
-        // 128K
-        if (where < 0x0803FFFF) { return 5; }
-        if (where < 0x0805FFFF) { return 6; }
-        if (where < 0x0807FFFF) { return 7; }
-#else
-        assert(false);
-#endif
+        auto words = reinterpret_cast<const std::uint32_t*>(bytes);
+        const auto words_end = words + std::size_t(end - bytes) / 4U;
+        while (words < words_end)
+        {
+            if (*words++ != 0xFFFFFFFFU)
+            {
+                return false;
+            }
+        }
 
-        return -1;
+        bytes = reinterpret_cast<const std::uint8_t*>(words);
+        while (bytes < end)
+        {
+            if (*bytes++ != 0xFFU)
+            {
+                return false;
+            }
+        }
+        return true;
     }
 
-public:
     /**
-     * Source and destination must be aligned at two bytes.
+     * Iterates over the pages or sectors that overlap with the specified region.
+     * If blank skipping is enabled, the units whose part within the region is already erased are skipped.
+     * The blank check is done by @ref next() unless @ref checkBlankUnits() has been called beforehand.
      */
-    bool write(const void* const where,
-               const void* const what,
-               const std::size_t how_much)
+    class EraseCursor
     {
-        if (((reinterpret_cast<std::size_t>(where)) % 2 != 0) ||
-            ((reinterpret_cast<std::size_t>(what)) % 2 != 0) ||
-            (where == nullptr) || (what == nullptr))
+        static constexpr unsigned BlankMaskSize = std::max(1U, (FlashGeometry::NumEraseUnits + 31U) / 32U);
+
+        std::size_t location_;
+        std::size_t end_;
+        bool skip_blank_;
+        bool blank_units_known_ = false;
+        unsigned num_skipped_ = 0;
+        std::uint32_t blank_mask_[BlankMaskSize] = {};      ///< Indexed by unit number
+
+        static std::size_t clipUnitEnd(const FlashGeometry::EraseUnit& unit, const std::size_t end)
         {
-            assert(false);
-            return false;
+            return std::min(unit.address + unit.size, end);
         }
 
-        const unsigned num_halfwords = (how_much + 1U) / 2U;
+        bool isBlankUnit(const FlashGeometry::EraseUnit& unit, const std::size_t unit_begin) const
+        {
+            if (blank_units_known_)
+            {
+                return (blank_mask_[unit.number / 32U] & (1UL << (unit.number % 32U))) != 0;
+            }
+            return isErased(reinterpret_cast<const void*>(unit_begin), clipUnitEnd(unit, end_) - unit_begin);
+        }
 
-        volatile std::uint16_t* flashptr16 = static_cast<std::uint16_t*>(const_cast<void*>(where));
-        const std::uint16_t* ramptr16 = static_cast<const std::uint16_t*>(what);
+    public:
+        EraseCursor(const void* where, std::size_t how_much, bool skip_blank) :
+            location_(reinterpret_cast<std::size_t>(where)),
+            end_(reinterpret_cast<std::size_t>(where) + how_much),
+            skip_blank_(skip_blank)
+        { }
 
+        /**
+         * Reads the whole region once and remembers which units are blank, so that @ref next() doesn't touch
+         * the flash. This takes a while, so it must be invoked from the thread context.
+         * Units at invalid addresses are left for @ref next() to report.
+         */
+        void checkBlankUnits()
         {
-            Prologuer prologuer;
+            if (!skip_blank_)
+            {
+                return;
+            }
+            std::size_t location = location_;
+            while (location < end_)
+            {
+                const auto unit = FlashGeometry::locateEraseUnit(location);
+                if ((unit.size == 0) || (unit.number >= FlashGeometry::NumEraseUnits))
+                {
+                    break;
+                }
+                if (isErased(reinterpret_cast<const void*>(location), clipUnitEnd(unit, end_) - location))
+                {
+                    blank_mask_[unit.number / 32U] |= 1UL << (unit.number % 32U);
+                }
+                location = unit.address + unit.size;
+            }
+            blank_units_known_ = true;
+        }
+
+        /**
+         * @param out_unit      Page address (if the FPEC uses page erase) or sector number.
+         * @return              1 if there is a unit to erase, 0 if done, negative on invalid address.
+         * This function may be invoked from ISR after @ref checkBlankUnits(), so it must not log anything.
+         */
+        int next(std::uint32_t& out_unit)
+        {
+            while (location_ < end_)
+            {
+                const auto unit = FlashGeometry::locateEraseUnit(location_);
+                if (unit.size == 0)
+                {
+                    return -EINVAL;
+                }
+                out_unit = FlashGeometry::UsesPageErase ? std::uint32_t(unit.address) : unit.number;
+
+                const std::size_t unit_begin = location_;
+                location_ = unit.address + unit.size;
+
+                if (skip_blank_ && isBlankUnit(unit, unit_begin))
+                {
+                    num_skipped_++;
+                    continue;
+                }
+                return 1;
+            }
+            return 0;
+        }
+
+        /// Number of units that were found blank and not erased
+        unsigned getNumSkippedUnits() const { return num_skipped_; }
+    };
+
+    /**
+     * Starts erasure of the page or sector returned by @ref EraseCursor. The FPEC must be unlocked and idle.
+     */
+    static void startUnitErase(const std::uint32_t unit, const std::uint32_t extra_cr_flags)
+    {
+#if defined(FLASH_CR_PER)
+        FLASH->CR = FLASH_CR_PER | extra_cr_flags;
+        FLASH->AR = unit;
+        FLASH->CR = FLASH_CR_PER | FLASH_CR_STRT | extra_cr_flags;
+#else
+        FLASH->CR = FLASH_CR_SER | (unit << 3) | extra_cr_flags;
+        FLASH->CR |= FLASH_CR_STRT;
+#endif
+    }
+
+    static constexpr bool UseX32 = OS_STM32_FLASH_WRITER_USE_X32 != 0;
+
+    static constexpr unsigned ProgramChunkSize = OS_STM32_FLASH_WRITER_PROGRAM_CHUNK_SIZE;
+
+    static_assert(ProgramChunkSize >= 4, "Program chunk size is too small");
+
+    static bool canProgramWord(std::size_t address, std::size_t remaining)
+    {
+        return UseX32 && ((address % 4U) == 0) && (remaining >= 4U);
+    }
+
+    /**
+     * Programs at most one chunk, either in words or in halfwords, in a dedicated critical section.
+     * The odd trailing byte, if any, is padded with 0xFF, so the adjacent byte is left erased.
+     * @return Number of bytes consumed from the source.
+     */
+    static std::size_t programChunk(const std::size_t address,
+                                    const std::uint8_t* const source,
+                                    const std::size_t remaining)
+    {
+        std::size_t offset = 0;
+
+        Prologuer prologuer;
 
+        if (canProgramWord(address, remaining))
+        {
+#ifdef FLASH_CR_PSIZE_1
+            FLASH->CR = FLASH_CR_PG | FLASH_CR_PSIZE_1;
+#endif
+            while ((offset < ProgramChunkSize) && ((remaining - offset) >= 4U))
+            {
+                std::uint32_t word = 0;
+                std::memcpy(&word, source + offset, 4);         // Source alignment doesn't matter
+                *reinterpret_cast<volatile std::uint32_t*>(address + offset) = word;
+                waitReady();
+                offset += 4U;
+            }
+        }
+        else
+        {
 #ifdef FLASH_CR_PSIZE_0
             FLASH->CR = FLASH_CR_PG | FLASH_CR_PSIZE_0;
 #else
             FLASH->CR = FLASH_CR_PG;
 #endif
-
-            for (unsigned i = 0; i < num_halfwords; i++)
+            while ((offset < ProgramChunkSize) && (offset < remaining))
             {
-                *flashptr16++ = *ramptr16++;
+                if ((offset > 0) && canProgramWord(address + offset, remaining - offset))
+                {
+                    break;                                      // Switching to x32 in the next chunk
+                }
+                const std::size_t n = std::min<std::size_t>(2U, remaining - offset);
+                std::uint16_t halfword = 0xFFFFU;
+                std::memcpy(&halfword, source + offset, n);
+                *reinterpret_cast<volatile std::uint16_t*>(address + offset) = halfword;
                 waitReady();
+                offset += n;
             }
+        }
 
-            waitReady();
-            FLASH->CR = 0;
+        FLASH->CR = 0;
+        return offset;
+    }
+
+public:
+    /**
+     * Destination must be aligned at two bytes; x32 programming is used where the destination is aligned at four.
+     * Interrupts are disabled only for the duration of one chunk (see OS_STM32_FLASH_WRITER_PROGRAM_CHUNK_SIZE).
+     */
+    bool write(const void* const where,
+               const void* const what,
+               const std::size_t how_much)
+    {
+        if (((reinterpret_cast<std::size_t>(where)) % 2 != 0) ||
+            (where == nullptr) || (what == nullptr))
+        {
+            assert(false);
+            return false;
+        }
+
+        const std::size_t address = reinterpret_cast<std::size_t>(where);
+        const std::uint8_t* const source = static_cast<const std::uint8_t*>(what);
+
+        std::size_t offset = 0;
+        while (offset < how_much)
+        {
+            offset += programChunk(address + offset, source + offset, how_much - offset);
         }
 
         return std::memcmp(what, where, how_much) == 0;
@@ -145,58 +425,91 @@ public:
 
     /**
      * Erases the specified region, possibly more if the region does not exactly match with the page/sector boundaries.
+     * Interrupts are disabled until each page/sector is erased; see @ref AsyncFlashEraser for a non-blocking option.
+     * @param skip_blank    If true, pages/sectors whose part within the region is already blank will not be erased.
+     *                      This saves time and wear, but the parts of such units outside of the region are left
+     *                      intact rather than erased.
      */
     bool erase(const void* const where,
-               const std::size_t how_much)
+               const std::size_t how_much,
+               const bool skip_blank = true)
     {
-#if defined(FLASH_CR_PER)
-        constexpr unsigned SmallestPageSize = 512;
-
-        for (std::size_t location = reinterpret_cast<std::size_t>(where);
-             location < (reinterpret_cast<std::size_t>(where) + how_much);
-             location += SmallestPageSize)
+        EraseCursor cursor(where, how_much, skip_blank);
+        std::uint32_t unit = 0;
+        int res = 0;
+        while ((res = cursor.next(unit)) > 0)
         {
+            DEBUG_LOG("Erasing unit 0x%08x\n", unsigned(unit));
             Prologuer prologuer;
-            FLASH->CR = FLASH_CR_PER;
-            FLASH->AR = page_address;
-            FLASH->CR = FLASH_CR_PER | FLASH_CR_STRT;
+            startUnitErase(unit, 0);
             waitReady();
             FLASH->CR = 0;
         }
-#else
-        constexpr unsigned SmallestSectorSize = 1024;
+        if (res < 0)
+        {
+            return false;
+        }
 
-        int sector_number = -1;
+        DEBUG_LOG("Erased %u B @ 0x%08x, %u units skipped as blank\n", unsigned(how_much),
+                  reinterpret_cast<unsigned>(where), cursor.getNumSkippedUnits());
+        return isErased(where, how_much);
+    }
+};
 
-        for (std::size_t location = reinterpret_cast<std::size_t>(where);
-             location < (reinterpret_cast<std::size_t>(where) + how_much);
-             location += SmallestSectorSize)
-        {
-            const int new_sector_number = mapAddressToSectorNumber(location);
-            if (new_sector_number < 0)
-            {
-                return false;
-            }
-            if (new_sector_number == sector_number)
-            {
-                continue;
-            }
-            sector_number = new_sector_number;
-            DEBUG_LOG("Erasing at 0x%08x, sector %d\n", unsigned(location), sector_number);
+/**
+ * Non-blocking erase driven by the FPEC interrupt: every next page or sector is started from the ISR when the
+ * previous one is finished, so interrupts stay enabled and the calling thread can sleep meanwhile.
+ * Note that the CPU still stalls if it fetches from the flash bank that is being erased (e.g. executes code
+ * that is not cached), so this does not make the erase completely transparent for real-time tasks; however,
+ * the OS keeps working, and tasks that don't touch flash are not affected.
+ *
+ * Blank units are skipped the same way as in @ref FlashWriter::erase(); the blank check of the whole region is
+ * done by @ref start() in the calling thread, so the ISR only starts the erase of the next unit.
+ *
+ * Only one erase can be in progress at a time, and @ref FlashWriter must not be used until it is finished.
+ * The interrupt priority can be set via OS_STM32_FLASH_IRQ_PRIORITY. The interrupt handler is defined by the
+ * library unless OS_STM32_FLASH_DEFINE_IRQ_HANDLER is set to zero.
+ */
+class AsyncFlashEraser
+{
+    static FlashWriter::EraseCursor cursor_;
 
-            Prologuer prologuer;
-            FLASH->CR = FLASH_CR_SER | (sector_number << 3);
-            FLASH->CR |= FLASH_CR_STRT;
-            waitReady();
-            FLASH->CR = 0;
-        }
-#endif
+    static int startNextUnitOrFinish();
 
-        DEBUG_LOG("Erased %u B @ 0x%08x\n", unsigned(how_much), reinterpret_cast<unsigned>(where));
-        return std::all_of(reinterpret_cast<const std::uint8_t*>(where),
-                           reinterpret_cast<const std::uint8_t*>(where) + how_much,
-                           [](std::uint8_t x) { return x == 0xFF; });
+public:
+    /**
+     * Starts erasing the region. Returns as soon as the blank check of the region is done and the first unit
+     * is started.
+     * @param skip_blank    See @ref FlashWriter::erase().
+     * @return  0 on success, -EBUSY if another erase is in progress, -EINVAL if the region is invalid,
+     *          -EIO if the flash controller has failed.
+     */
+    static int start(const void* where, std::size_t how_much, bool skip_blank = true);
+
+    /**
+     * Does not block.
+     * @return  1 if the erase is still in progress, 0 if it is finished successfully, -EIO on failure.
+     */
+    static int poll();
+
+    /**
+     * Blocks the calling thread until the erase is finished.
+     * @return  Same as @ref poll(), or -ETIMEDOUT.
+     */
+    static int wait(::systime_t timeout = TIME_INFINITE);
+
+    /**
+     * Convenience wrapper that starts the erase and waits for its completion.
+     * @return  0 on success, negative errno on failure.
+     */
+    static int erase(const void* where, std::size_t how_much, bool skip_blank = true)
+    {
+        const int res = start(where, how_much, skip_blank);
+        return (res < 0) ? res : wait();
     }
+
+    /// Do not call directly; this is invoked from the FPEC ISR, see OS_STM32_FLASH_DEFINE_IRQ_HANDLER.
+    static void handleInterrupt();
 };
 
 }
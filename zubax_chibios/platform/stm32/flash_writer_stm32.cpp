@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "flash_writer.hpp"
+#include <zubax_chibios/os.hpp>
+
+/**
+ * The FPEC interrupt is number 4 on all STM32, so its vector is at offset 0x50.
+ * Must be within the range of the kernel-aware priorities.
+ */
+#if !defined(OS_STM32_FLASH_IRQ_PRIORITY)
+# define OS_STM32_FLASH_IRQ_PRIORITY    CORTEX_MINIMUM_PRIORITY
+#endif
+
+/**
+ * Set to zero if the application defines the FPEC interrupt handler itself, e.g. because it shares the vector;
+ * such a handler must invoke os::stm32::AsyncFlashEraser::handleInterrupt().
+ */
+#if !defined(OS_STM32_FLASH_DEFINE_IRQ_HANDLER)
+# define OS_STM32_FLASH_DEFINE_IRQ_HANDLER      1
+#endif
+
+namespace os
+{
+namespace stm32
+{
+namespace
+{
+
+enum class State
+{
+    Idle,
+    InProgress,
+    Finished,           ///< Erased, not yet verified
+    Succeeded,
+    Failed
+};
+
+volatile State g_state = State::Idle;
+
+const void* g_where = nullptr;
+std::size_t g_how_much = 0;
+chibios_rt::BinarySemaphore g_completion_semaphore(true);
+
+bool g_irq_enabled = false;
+
+constexpr std::uint32_t InterruptFlags = FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+
+}
+
+FlashWriter::EraseCursor AsyncFlashEraser::cursor_(nullptr, 0, false);
+
+/**
+ * Invoked either from the thread that starts the erase or from the ISR, with the kernel unlocked.
+ * @return The result of @ref FlashWriter::EraseCursor::next(), i.e. negative if the region is invalid.
+ */
+int AsyncFlashEraser::startNextUnitOrFinish()
+{
+    std::uint32_t unit = 0;
+    const int res = cursor_.next(unit);
+    if (res > 0)
+    {
+        FlashWriter::startUnitErase(unit, InterruptFlags);
+    }
+    else
+    {
+        FLASH->CR = FLASH_CR_LOCK;
+
+        CriticalSectionLocker locker;
+        g_state = (res == 0) ? State::Finished : State::Failed;
+        g_completion_semaphore.signalI();
+    }
+    return res;
+}
+
+int AsyncFlashEraser::start(const void* where, std::size_t how_much, bool skip_blank)
+{
+    if (where == nullptr)
+    {
+        return -EINVAL;
+    }
+
+    {
+        CriticalSectionLocker locker;
+
+        if ((g_state == State::InProgress) || (FLASH->SR & FLASH_SR_BSY))
+        {
+            return -EBUSY;
+        }
+        g_state = State::InProgress;
+        g_completion_semaphore.resetI(true);
+    }
+
+    if (!g_irq_enabled)
+    {
+        g_irq_enabled = true;
+        nvicEnableVector(FLASH_IRQn, OS_STM32_FLASH_IRQ_PRIORITY);
+    }
+
+    g_where = where;
+    g_how_much = how_much;
+    cursor_ = FlashWriter::EraseCursor(where, how_much, skip_blank);
+    cursor_.checkBlankUnits();                  // Here rather than in the ISR, because it reads the whole region
+
+    if (FLASH->CR & FLASH_CR_LOCK)
+    {
+        FLASH->KEYR = 0x45670123UL;
+        FLASH->KEYR = 0xCDEF89ABUL;
+    }
+    FLASH->SR |= FLASH_SR_EOP | FlashWriter::ErrorFlags;
+    FLASH->CR = 0;
+
+    const int res = startNextUnitOrFinish();
+    if (res < 0)
+    {
+        return res;                             // The region is invalid
+    }
+
+    // The controller may have failed already, in which case the ISR has been invoked by now
+    return (g_state == State::Failed) ? -EIO : 0;
+}
+
+int AsyncFlashEraser::poll()
+{
+    switch (g_state)
+    {
+    case State::InProgress:
+    {
+        return 1;
+    }
+    case State::Finished:
+    {
+        // Verification is done in the thread context because it may take a while
+        const bool ok = FlashWriter::isErased(g_where, g_how_much);
+        DEBUG_LOG("Async erase of %u B @ 0x%08x finished, ok=%d, %u units skipped as blank\n",
+                  unsigned(g_how_much), unsigned(reinterpret_cast<std::size_t>(g_where)), int(ok),
+                  cursor_.getNumSkippedUnits());
+        g_state = ok ? State::Succeeded : State::Failed;
+        return ok ? 0 : -EIO;
+    }
+    case State::Idle:
+    case State::Succeeded:
+    {
+        return 0;
+    }
+    case State::Failed:
+    default:
+    {
+        return -EIO;
+    }
+    }
+}
+
+int AsyncFlashEraser::wait(::systime_t timeout)
+{
+    for (;;)
+    {
+        const int res = poll();
+        if (res <= 0)
+        {
+            return res;
+        }
+        if (g_completion_semaphore.wait(timeout) == MSG_TIMEOUT)
+        {
+            return -ETIMEDOUT;
+        }
+    }
+}
+
+void AsyncFlashEraser::handleInterrupt()
+{
+    const std::uint32_t sr = FLASH->SR;
+    FLASH->SR = sr;                             // Write one to clear, including OPERR where available
+
+    if (g_state != State::InProgress)
+    {
+        return;                                 // Spurious
+    }
+
+    if (sr & FlashWriter::ErrorFlags)
+    {
+        FLASH->CR = FLASH_CR_LOCK;
+
+        CriticalSectionLocker locker;
+        g_state = State::Failed;
+        g_completion_semaphore.signalI();
+    }
+    else if (sr & FLASH_SR_EOP)
+    {
+        startNextUnitOrFinish();
+    }
+    else
+    {
+        ;                                       // Not ours
+    }
+}
+
+}
+}
+
+#if OS_STM32_FLASH_DEFINE_IRQ_HANDLER
+
+extern "C"
+{
+
+CH_IRQ_HANDLER(Vector50)
+{
+    CH_IRQ_PROLOGUE();
+    os::stm32::AsyncFlashEraser::handleInterrupt();
+    CH_IRQ_EPILOGUE();
+}
+
+}
+
+#endif
@@ -13,8 +13,11 @@
 
 #include <cstdint>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
 #include <hal.h>
 #include <zubax_chibios/os.hpp>
+#include <zubax_chibios/util/crc.hpp>
 
 #if !defined(DISABLE_WATCHDOG_IN_RELEASE_BUILD)
 # define DISABLE_WATCHDOG_IN_RELEASE_BUILD      0
@@ -30,26 +33,79 @@
 # endif
 #endif
 
+/*
+ * Every logical watchdog has its own deadline; the deadlines are checked by one supervisor, which is a kernel
+ * virtual timer, so the check does not depend on any thread. The supervisor wakes up at the nearest deadline
+ * or when the IWDG needs to be reloaded, whichever comes first, so it doesn't need periodic ticks.
+ * If any of the deadlines is missed, the supervisor stops reloading the IWDG and shortens its timeout, so the
+ * reset occurs promptly. The IWDG timeout equals the longest logical timeout; it catches the cases where the
+ * supervisor itself can't run, e.g. if the interrupts are disabled.
+ * The expired watchdog is recorded in the .noinit RAM, see watchdogGetLastExpiry().
+ */
+
 #define KR_KEY_ACCESS   0x5555
 #define KR_KEY_RELOAD   0xAAAA
 #define KR_KEY_ENABLE   0xCCCC
 
 #define MAX_RELOAD_VAL  0xFFF
 
-#define MAX_NUM_WATCHDOGS 31
+#if !defined(WATCHDOG_MAX_TIMERS)
+# define WATCHDOG_MAX_TIMERS    31
+#endif
+
+#define EXPIRY_RECORD_MAGIC     0x58455744U     // "DWEX" in ASCII, little endian
 
 #if !defined(RCC_CSR_IWDGRSTF)
 # define RCC_CSR_IWDGRSTF   RCC_CSR_WDGRSTF
 #endif
 
+/*
+ * Survives reset; validated by the CRC because the RAM contains garbage after power-up.
+ */
+struct ExpiryRecord
+{
+    std::uint32_t magic;
+    WatchdogExpiryInfo info;
+    std::uint32_t crc;
+};
+
+static ExpiryRecord _expiry_record __attribute__((section (".noinit")));
+
+static WatchdogExpiryInfo _last_expiry;
+static bool _last_expiry_valid = false;
 
 static unsigned _wdg_timeout_ms = 0;
 
-static std::uint32_t _mask __attribute__((section (".noinit")));
-static std::uint8_t _num_watchdogs __attribute__((section (".noinit")));
+/*
+ * The timestamps are written by watchdogReset() without locking, because a word store is atomic.
+ * The other fields are populated before the watchdog is counted, so the supervisor never sees them incomplete.
+ */
+static volatile systime_t _last_reset[WATCHDOG_MAX_TIMERS];
+static systime_t _timeout[WATCHDOG_MAX_TIMERS];
+static unsigned _timeout_ms[WATCHDOG_MAX_TIMERS];
+static const char* _name[WATCHDOG_MAX_TIMERS];
+static volatile unsigned _num_watchdogs = 0;
+
+static virtual_timer_t _supervisor_vt;
+static systime_t _reload_interval = 0;
 
 static bool _triggered_reset = false;
 
+/*
+ * Intervals are computed with wrapping arithmetic, so they must be well below the range of systime_t.
+ */
+static constexpr systime_t MaxInterval = systime_t(~systime_t(0)) / 2U;
+
+static std::uint64_t msecToTicks(unsigned msec)
+{
+    return (std::uint64_t(msec) * CH_CFG_ST_FREQUENCY + 999U) / 1000U;
+}
+
+static unsigned ticksToMSec(systime_t ticks)
+{
+    return unsigned((std::uint64_t(ticks) * 1000U) / CH_CFG_ST_FREQUENCY);
+}
+
 static void setTimeout(unsigned timeout_ms)
 {
     if (timeout_ms <= 0)
@@ -80,6 +136,78 @@ static void setTimeout(unsigned timeout_ms)
 #endif
 }
 
+/**
+ * Invoked from the supervisor; the hardware resets the MCU in a few milliseconds.
+ */
+static void handleExpiration(unsigned id, systime_t elapsed)
+{
+    _expiry_record.info = WatchdogExpiryInfo();
+    _expiry_record.info.id = int(id);
+    if (_name[id] != NULL)
+    {
+        std::strncpy(_expiry_record.info.name, _name[id], WATCHDOG_NAME_MAX_LENGTH);
+    }
+    _expiry_record.info.timeout_ms = _timeout_ms[id];
+    _expiry_record.info.elapsed_ms = ticksToMSec(elapsed);
+    _expiry_record.magic = EXPIRY_RECORD_MAGIC;
+    os::crc::CRC32 crc;
+    crc.add(&_expiry_record.info, sizeof(_expiry_record.info));
+    _expiry_record.crc = crc.get();
+
+#if !DISABLE_WATCHDOG
+    IWDG->KR = KR_KEY_ACCESS;
+    IWDG->RLR = 0;
+    IWDG->KR = KR_KEY_RELOAD;
+#endif
+}
+
+static void supervise(void* arg)
+{
+    (void)arg;
+
+    const systime_t now = chVTGetSystemTimeX();
+    systime_t next = _reload_interval;
+
+    const unsigned num_watchdogs = _num_watchdogs;
+    for (unsigned i = 0; i < num_watchdogs; i++)
+    {
+        const systime_t elapsed = systime_t(now - _last_reset[i]);
+        if (elapsed >= _timeout[i])
+        {
+            handleExpiration(i, elapsed);
+            return;                     // Not rescheduling
+        }
+        const systime_t remaining = systime_t(_timeout[i] - elapsed);
+        if (remaining < next)
+        {
+            next = remaining;
+        }
+    }
+
+    IWDG->KR = KR_KEY_RELOAD;
+
+    chSysLockFromISR();
+    chVTSetI(&_supervisor_vt, systime_t(next + 1U), &supervise, NULL);     // Waking up just after the deadline
+    chSysUnlockFromISR();
+}
+
+static void restoreExpiryRecord()
+{
+    os::crc::CRC32 crc;
+    crc.add(&_expiry_record.info, sizeof(_expiry_record.info));
+
+    _last_expiry_valid = _triggered_reset &&
+                         (_expiry_record.magic == EXPIRY_RECORD_MAGIC) &&
+                         (_expiry_record.crc == crc.get());
+    if (_last_expiry_valid)
+    {
+        _last_expiry = _expiry_record.info;
+        _last_expiry.name[WATCHDOG_NAME_MAX_LENGTH] = '\0';
+    }
+
+    _expiry_record.magic = 0;           // Will not be reported again after a reset of other kind
+}
+
 void watchdogInit(void)
 {
     ASSERT_ALWAYS(_wdg_timeout_ms == 0);      // Make sure it wasn't initialized earlier
@@ -96,8 +224,10 @@ void watchdogInit(void)
 #endif
     }
 
-    _mask = 0;
+    restoreExpiryRecord();
+
     _num_watchdogs = 0;
+    chVTObjectInit(&_supervisor_vt);
 
 #ifdef DBGMCU_CR_DBG_IWDG_STOP
     chSysSuspend();
@@ -111,7 +241,21 @@ bool watchdogTriggeredLastReset(void)
     return _triggered_reset;
 }
 
+bool watchdogGetLastExpiry(WatchdogExpiryInfo* out_info)
+{
+    if (_last_expiry_valid && (out_info != NULL))
+    {
+        *out_info = _last_expiry;
+    }
+    return _last_expiry_valid;
+}
+
 int watchdogCreate(unsigned timeout_ms)
+{
+    return watchdogCreateNamed(timeout_ms, NULL);
+}
+
+int watchdogCreateNamed(unsigned timeout_ms, const char* name)
 {
     if (timeout_ms <= 0)
     {
@@ -119,36 +263,48 @@ int watchdogCreate(unsigned timeout_ms)
         return -1;
     }
 
-    chSysSuspend();
-    if (_num_watchdogs >= MAX_NUM_WATCHDOGS)
+    ASSERT_ALWAYS(msecToTicks(timeout_ms) <= MaxInterval);     // If fails here, use 32-bit system time
+    const systime_t timeout = systime_t(msecToTicks(timeout_ms));
+
+    chSysLock();
+    const unsigned new_id = _num_watchdogs;
+    if (new_id >= WATCHDOG_MAX_TIMERS)
     {
-        chSysEnable();
+        chSysUnlock();
         assert(0);
         return -1;
     }
-    const int new_id = _num_watchdogs++;
-    _mask |= 1U << new_id;                 // Reset immediately
-    chSysEnable();
+    _last_reset[new_id] = chVTGetSystemTimeX();     // Reset immediately
+    _timeout[new_id] = timeout;
+    _timeout_ms[new_id] = timeout_ms;
+    _name[new_id] = name;
+    _num_watchdogs = new_id + 1U;
+    chSysUnlock();
 
     if (timeout_ms > _wdg_timeout_ms)
     {
         setTimeout(timeout_ms);
         _wdg_timeout_ms = timeout_ms;
+
+        // The supervisor must reload the IWDG well before it expires; the actual timeout may be shorter
+        // than requested because of the limited range of the reload register
+        const unsigned max_hw_timeout_ms = MAX_RELOAD_VAL * 6U;
+        const std::uint64_t interval = msecToTicks(std::max(std::min(timeout_ms, max_hw_timeout_ms) / 2U, 1U));
+        chSysLock();
+        _reload_interval = systime_t(std::min<std::uint64_t>(interval, MaxInterval));
+        chSysUnlock();
     }
-    return new_id;
+
+    // Running the supervisor as soon as possible, because the new deadline may be the nearest one
+    chSysLock();
+    chVTSetI(&_supervisor_vt, 1, &supervise, NULL);
+    chSysUnlock();
+
+    return int(new_id);
 }
 
 void watchdogReset(int id)
 {
-    assert(id >= 0 && id < _num_watchdogs);
-
-    chSysSuspend();
-    _mask |= 1U << id;
-    const std::uint32_t valid_bits_mask = (1U << _num_watchdogs) - 1;
-    if ((_mask & valid_bits_mask) == valid_bits_mask)
-    {
-        IWDG->KR = KR_KEY_RELOAD;
-        _mask = 0;
-    }
-    chSysEnable();
+    assert(id >= 0 && unsigned(id) < _num_watchdogs);
+    _last_reset[id] = chVTGetSystemTimeX();
 }
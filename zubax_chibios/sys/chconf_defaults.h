@@ -23,6 +23,33 @@ extern void zchSysHaltHook(const char* reason);
 #endif
 #define CH_CFG_SYSTEM_HALT_HOOK(reason)         zchSysHaltHook(reason)
 
+/*
+ * Optional CPU time profiler, see profiler.hpp.
+ * It uses the context switch hook, the IRQ hooks, and the per-thread extra fields, so the application must not
+ * define these when the profiler is enabled.
+ */
+#ifndef OS_PROFILER_ENABLED
+#define OS_PROFILER_ENABLED                     0
+#endif
+
+#if OS_PROFILER_ENABLED
+#if defined(CH_CFG_CONTEXT_SWITCH_HOOK) || defined(CH_CFG_IRQ_PROLOGUE_HOOK) || \
+    defined(CH_CFG_IRQ_EPILOGUE_HOOK) || defined(CH_CFG_THREAD_EXTRA_FIELDS) || defined(CH_CFG_THREAD_INIT_HOOK)
+#error The profiler cannot be used together with application-defined thread or IRQ hooks
+#endif
+#ifndef __ASSEMBLER__
+struct ch_thread;
+extern void zchProfilerContextSwitchHook(struct ch_thread* ntp, struct ch_thread* otp);
+extern void zchProfilerIrqPrologueHook(void);
+extern void zchProfilerIrqEpilogueHook(void);
+#endif
+#define CH_CFG_THREAD_EXTRA_FIELDS              uint64_t zch_profiler_cycles;
+#define CH_CFG_THREAD_INIT_HOOK(tp)             { (tp)->zch_profiler_cycles = 0; }
+#define CH_CFG_CONTEXT_SWITCH_HOOK(ntp, otp)    zchProfilerContextSwitchHook(ntp, otp)
+#define CH_CFG_IRQ_PROLOGUE_HOOK()              zchProfilerIrqPrologueHook()
+#define CH_CFG_IRQ_EPILOGUE_HOOK()              zchProfilerIrqEpilogueHook()
+#endif
+
 /*
  * Component defaults.
  */
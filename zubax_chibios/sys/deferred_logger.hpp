@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Deferred logging: the hot path stores only the timestamp, the format string pointer, and the raw arguments;
+ * formatting is done later, by a background thread or by whoever drains the queue.
+ * Usage:
+ *      os::DeferredLogQueue<64> g_log_queue;            // Shared by all loggers, e.g. a global object
+ *      os::DeferredLogger g_logger("Motor", g_log_queue);
+ *      os::DeferredLogDrainThread<> g_log_drain_thread;  // Optional, see below
+ *      ...
+ *      g_log_drain_thread.start(g_log_queue, LOWPRIO);  // Or call drain() periodically from an existing thread
+ *      ...
+ *      g_logger.println("rpm %f, phase %d", rpm, phase);   // Safe to call from ISR
+ *
+ * The format string and all string arguments are stored by pointer, so they must stay valid until the entry is
+ * formatted; normally these are string literals. Supported arguments are integers up to 32 bits, floating point
+ * (stored as float), strings, and pointers. Length modifiers in the format string are ignored, because
+ * the arguments are converted to the type expected by the conversion specifier.
+ */
+
+#pragma once
+
+#include "sys.hpp"
+#include <ch.hpp>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#if defined(OS_USE_CHPRINTF) && OS_USE_CHPRINTF
+# include <chprintf.h>
+#endif
+
+
+namespace os
+{
+/**
+ * One log entry, stored in the queue as is. May be streamed out in binary form and decoded on the host,
+ * using the ELF file to resolve the format string address.
+ */
+struct DeferredLogEntry
+{
+    static constexpr unsigned MaxArgs = 6;
+
+    enum class ArgType : std::uint8_t
+    {
+        Signed,
+        Unsigned,
+        Float,
+        String,
+        Pointer
+    };
+
+    union Arg
+    {
+        std::int32_t s;
+        std::uint32_t u;
+        float f;
+        const char* str;
+        const void* ptr;
+    };
+
+    ::systime_t timestamp = 0;
+    const char* name = nullptr;
+    const char* format = nullptr;
+    std::uint8_t num_args = 0;
+    ArgType types[MaxArgs] = {};
+    Arg args[MaxArgs] = {};
+
+    /**
+     * Formats the message (without the name and timestamp) into the buffer; the output is always null-terminated.
+     * @return Length of the output string.
+     */
+    std::size_t formatMessage(char* const out, const std::size_t size) const
+    {
+        if ((out == nullptr) || (size == 0))
+        {
+            return 0;
+        }
+
+        const char* fmt = (format == nullptr) ? "" : format;
+        std::size_t pos = 0;
+        unsigned arg_index = 0;
+
+        while ((*fmt != '\0') && ((pos + 1U) < size))
+        {
+            if (*fmt != '%')
+            {
+                out[pos++] = *fmt++;
+                continue;
+            }
+            if (fmt[1] == '%')
+            {
+                out[pos++] = '%';
+                fmt += 2;
+                continue;
+            }
+
+            // Flags, width, and precision are kept; length modifiers are dropped
+            char spec[16] = { *fmt++ };
+            unsigned spec_len = 1;
+            while ((*fmt != '\0') && (std::strchr("-+ #0123456789.", *fmt) != nullptr) &&
+                   (spec_len < (sizeof(spec) - 2U)))
+            {
+                spec[spec_len++] = *fmt++;
+            }
+            while ((*fmt != '\0') && (std::strchr("hlLqjzt", *fmt) != nullptr))
+            {
+                fmt++;
+            }
+            if ((*fmt == '\0') || (arg_index >= num_args))
+            {
+                break;                                                  // Malformed format string
+            }
+            const char conversion = *fmt++;
+            spec[spec_len++] = conversion;
+            spec[spec_len] = '\0';
+
+            const int res = formatArg(out + pos, size - pos, spec, conversion, types[arg_index], args[arg_index]);
+            arg_index++;
+            if (res > 0)
+            {
+                pos += std::min(std::size_t(res), size - pos - 1U);
+            }
+        }
+
+        out[pos] = '\0';
+        return pos;
+    }
+
+private:
+    static int formatArg(char* out, std::size_t size, const char* spec, char conversion, ArgType type, Arg arg)
+    {
+        switch (conversion)
+        {
+        case 'd':
+        case 'i':
+        {
+            const std::int32_t x = (type == ArgType::Float) ? std::int32_t(arg.f) : arg.s;
+            return print(out, size, spec, int(x));
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+        {
+            const std::uint32_t x = (type == ArgType::Float) ? std::uint32_t(arg.f) : arg.u;
+            return print(out, size, spec, unsigned(x));
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        {
+            double x = double(arg.f);
+            if (type == ArgType::Signed)
+            {
+                x = double(arg.s);
+            }
+            if ((type == ArgType::Unsigned) || (type == ArgType::String) || (type == ArgType::Pointer))
+            {
+                x = double(arg.u);
+            }
+            return print(out, size, spec, x);
+        }
+        case 's':
+        {
+            return print(out, size, spec, ((type == ArgType::String) && (arg.str != nullptr)) ? arg.str : "?");
+        }
+        case 'p':
+        {
+            return print(out, size, spec, arg.ptr);
+        }
+        default:
+        {
+            return print(out, size, "%s", "?");
+        }
+        }
+    }
+
+    template <typename T>
+    static int print(char* out, std::size_t size, const char* spec, T value)
+    {
+#if defined(OS_USE_CHPRINTF) && OS_USE_CHPRINTF
+        return chsnprintf(out, size, spec, value);
+#else
+        return std::snprintf(out, size, spec, value);
+#endif
+    }
+};
+
+/**
+ * Type-erased queue interface, used by @ref DeferredLogger.
+ */
+class IDeferredLogQueue
+{
+public:
+    virtual ~IDeferredLogQueue() { }
+
+    /**
+     * Never blocks; safe to call from ISR or from a critical section.
+     */
+    virtual void push(const DeferredLogEntry& entry) = 0;
+
+    /**
+     * Formats all pending entries and prints them via @ref lowsyslog().
+     * Must be invoked from a thread.
+     */
+    virtual void drain() = 0;
+};
+
+/**
+ * Fixed capacity queue of log entries. If the queue is full, the oldest entry is dropped.
+ * The queue does not drain itself; see @ref DeferredLogDrainThread.
+ * @tparam Capacity             Maximum number of pending entries.
+ */
+template <unsigned Capacity>
+class DeferredLogQueue : public IDeferredLogQueue
+{
+    static_assert(Capacity > 0, "Capacity must be positive");
+
+    DeferredLogEntry entries_[Capacity];
+    unsigned out_ = 0;
+    unsigned len_ = 0;
+    std::uint32_t num_dropped_ = 0;
+
+public:
+    void push(const DeferredLogEntry& entry) override
+    {
+        CriticalSectionLocker locker;
+        if (len_ >= Capacity)
+        {
+            out_ = (out_ + 1U) % Capacity;
+            len_--;
+            num_dropped_++;
+        }
+        entries_[(out_ + len_) % Capacity] = entry;
+        len_++;
+    }
+
+    /**
+     * @return True if an entry was popped, false if the queue is empty.
+     */
+    bool pop(DeferredLogEntry& out_entry)
+    {
+        CriticalSectionLocker locker;
+        if (len_ == 0)
+        {
+            return false;
+        }
+        out_entry = entries_[out_];
+        out_ = (out_ + 1U) % Capacity;
+        len_--;
+        return true;
+    }
+
+    void drain() override
+    {
+        DeferredLogEntry e;
+        while (pop(e))
+        {
+            char text[128];
+            (void)e.formatMessage(text, sizeof(text));
+            const unsigned msec = unsigned(ST2MS(e.timestamp));
+            lowsyslog("%u.%03u %s: %s\n", msec / 1000U, msec % 1000U, (e.name == nullptr) ? "" : e.name, text);
+        }
+    }
+
+    /**
+     * Number of entries lost due to queue overflows.
+     */
+    std::uint32_t getNumDropped() const { return num_dropped_; }
+};
+
+/**
+ * Background thread that drains a queue periodically. It is a separate object, so that the applications that
+ * drain the queue from an existing thread don't pay for another working area.
+ * @tparam StackSize    Stack size of the thread; must be enough for the formatting functions.
+ */
+template <unsigned StackSize = 1024>
+class DeferredLogDrainThread : private chibios_rt::BaseStaticThread<StackSize>
+{
+    IDeferredLogQueue* queue_ = nullptr;
+    unsigned period_msec_ = 0;
+
+    void main() override
+    {
+        chibios_rt::BaseThread::setName("deferred_log");
+        for (;;)
+        {
+            queue_->drain();
+            chibios_rt::BaseThread::sleep(MS2ST(period_msec_));
+        }
+    }
+
+public:
+    /**
+     * Starts the thread that invokes @ref IDeferredLogQueue::drain() periodically. Can be called only once.
+     */
+    void start(IDeferredLogQueue& queue, ::tprio_t priority, unsigned period_msec = 10)
+    {
+        ASSERT_ALWAYS(queue_ == nullptr);
+        queue_ = &queue;
+        period_msec_ = std::max(1U, period_msec);
+        (void)chibios_rt::BaseStaticThread<StackSize>::start(priority);
+    }
+};
+
+/**
+ * Works like @ref Logger, except that the message is formatted later, see @ref DeferredLogQueue.
+ */
+class DeferredLogger
+{
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+    encode(DeferredLogEntry& e, unsigned index, T x)
+    {
+        static_assert(sizeof(T) <= 4, "64-bit integers are not supported");
+        if (std::is_signed<T>::value)
+        {
+            e.types[index] = DeferredLogEntry::ArgType::Signed;
+            e.args[index].s = std::int32_t(x);
+        }
+        else
+        {
+            e.types[index] = DeferredLogEntry::ArgType::Unsigned;
+            e.args[index].u = std::uint32_t(x);
+        }
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type
+    encode(DeferredLogEntry& e, unsigned index, T x)
+    {
+        e.types[index] = DeferredLogEntry::ArgType::Float;
+        e.args[index].f = float(x);
+    }
+
+    static void encode(DeferredLogEntry& e, unsigned index, const char* x)
+    {
+        e.types[index] = DeferredLogEntry::ArgType::String;
+        e.args[index].str = x;
+    }
+
+    static void encode(DeferredLogEntry& e, unsigned index, const void* x)
+    {
+        e.types[index] = DeferredLogEntry::ArgType::Pointer;
+        e.args[index].ptr = x;
+    }
+
+    static void encodeAll(DeferredLogEntry&, unsigned) { }
+
+    template <typename T, typename... Rest>
+    static void encodeAll(DeferredLogEntry& e, unsigned index, T x, Rest... rest)
+    {
+        encode(e, index, x);
+        encodeAll(e, index + 1U, rest...);
+    }
+
+    const char* const name_;
+    IDeferredLogQueue& queue_;
+
+public:
+    DeferredLogger(const char* module_name, IDeferredLogQueue& queue) :
+        name_(module_name),
+        queue_(queue)
+    { }
+
+    /**
+     * Never blocks; safe to call from ISR.
+     * The output will be terminated with a newline automatically.
+     */
+    template <typename... Args>
+    void println(const char* format, Args... args)
+    {
+        static_assert(sizeof...(Args) <= DeferredLogEntry::MaxArgs, "Too many arguments");
+        DeferredLogEntry e;
+        e.timestamp = chVTGetSystemTimeX();
+        e.name = name_;
+        e.format = format;
+        e.num_args = std::uint8_t(sizeof...(Args));
+        encodeAll(e, 0, args...);
+        queue_.push(e);
+    }
+
+    const char* getName() const { return name_; }
+};
+
+}
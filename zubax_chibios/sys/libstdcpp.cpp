@@ -8,35 +8,62 @@
 #include <cstdlib>
 #include <sys/types.h>
 #include "sys.hpp"
+#include <zubax_chibios/util/allocators.hpp>
+
+/*
+ * Memory is allocated via malloc(), which is served by the heap allocator if one is installed, see os::setHeap().
+ * Exceptions are disabled, so allocation failures are fatal.
+ */
+static void* allocate(size_t sz)
+{
+    void* const p = std::malloc(sz);
+    if (p == nullptr)
+    {
+        chSysHalt("new");
+    }
+    return p;
+}
+
+static void deallocate(void* p)
+{
+    if (p != nullptr)
+    {
+        os::memory::IAllocator* const heap = os::getHeap();
+        if ((heap == nullptr) || !heap->deallocate(p))
+        {
+            chSysHalt("delete");
+        }
+    }
+}
 
 void* operator new(size_t sz)
 {
-    return chCoreAlloc(sz);
+    return allocate(sz);
 }
 
 void* operator new[](size_t sz)
 {
-    return chCoreAlloc(sz);
+    return allocate(sz);
 }
 
-void operator delete(void*)
+void operator delete(void* p)
 {
-    chSysHalt("delete");
+    deallocate(p);
 }
 
-void operator delete[](void*)
+void operator delete[](void* p)
 {
-    chSysHalt("delete");
+    deallocate(p);
 }
 
-void operator delete(void*, unsigned)
+void operator delete(void* p, unsigned)
 {
-    chSysHalt("delete");
+    deallocate(p);
 }
 
-void operator delete[](void*, unsigned)
+void operator delete[](void* p, unsigned)
 {
-    chSysHalt("delete");
+    deallocate(p);
 }
 
 /*
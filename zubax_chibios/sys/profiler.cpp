@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "profiler.hpp"
+#include <zubax_chibios/os.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#if !OS_PROFILER_ENABLED
+# error The profiler requires OS_PROFILER_ENABLED, use BUILD_PROFILER=1
+#endif
+
+#if !CH_CFG_USE_REGISTRY
+# error The profiler requires CH_CFG_USE_REGISTRY
+#endif
+
+#define OS_PROFILER_STACK_MEASUREMENT_AVAILABLE \
+    (CH_DBG_FILL_THREADS && (CH_DBG_ENABLE_STACK_CHECK || CH_CFG_USE_DYNAMIC))
+
+/*
+ * Defined by the ChibiOS linker script; both stacks are filled by the startup code.
+ */
+extern "C"
+{
+extern std::uint8_t __main_stack_base__[];
+extern std::uint8_t __main_stack_end__[];
+extern std::uint8_t __main_thread_stack_base__[];
+extern std::uint8_t __main_thread_stack_end__[];
+}
+
+namespace os
+{
+namespace profiler
+{
+namespace
+{
+/*
+ * All of the state below is modified either with the kernel locked or from the outermost ISR,
+ * so no additional synchronization is needed.
+ */
+::rtcnt_t g_last_timestamp;
+std::uint64_t g_elapsed_cycles;
+std::uint64_t g_isr_cycles;
+unsigned g_irq_nesting;
+
+/**
+ * Returns the number of cycles since the previous invocation.
+ * Intervals longer than the counter period (about 25 seconds at 168 MHz) are truncated, which can only happen
+ * if the system goes that long without context switches and interrupts.
+ */
+inline std::uint32_t advance()
+{
+    const ::rtcnt_t now = chSysGetRealtimeCounterX();
+    const std::uint32_t delta = std::uint32_t(now - g_last_timestamp);
+    g_last_timestamp = now;
+    g_elapsed_cycles += delta;
+    return delta;
+}
+
+std::uint32_t measureStackUsage(const std::uint8_t* const base, const std::uint8_t* const end)
+{
+    const std::uint8_t* p = base;
+    while ((p < end) && (*p == CH_DBG_STACK_FILL_VALUE))
+    {
+        p++;
+    }
+    return std::uint32_t(end - p);
+}
+
+void fillThreadInfo(const ::thread_t* const tp, ContextInfo& out)
+{
+    out.name = tp->name;
+    out.priority = tp->prio;
+    {
+        CriticalSectionLocker locker;
+        out.cpu_cycles = tp->zch_profiler_cycles;
+    }
+
+#if OS_PROFILER_STACK_MEASUREMENT_AVAILABLE
+    const auto base = reinterpret_cast<const std::uint8_t*>(tp->wabase);
+    // The main thread runs on the process stack; other threads keep the descriptor on top of the working area
+    const auto end = (tp == &ch.mainthread) ? __main_thread_stack_end__ : reinterpret_cast<const std::uint8_t*>(tp);
+    if ((base != nullptr) && (base < end))
+    {
+        out.stack_size = std::uint32_t(end - base);
+        out.stack_used = measureStackUsage(base, end);
+    }
+#endif
+}
+
+}
+
+unsigned takeSnapshot(Summary& out_summary, ContextInfo* out_threads, unsigned capacity)
+{
+    out_summary = Summary();
+
+    {
+        CriticalSectionLocker locker;
+        chThdGetSelfX()->zch_profiler_cycles += advance();
+        out_summary.elapsed_cycles = g_elapsed_cycles;
+        out_summary.isr.cpu_cycles = g_isr_cycles;
+    }
+
+    out_summary.isr.name = "ISR";
+    out_summary.isr.stack_size = std::uint32_t(__main_stack_end__ - __main_stack_base__);
+    out_summary.isr.stack_used = measureStackUsage(__main_stack_base__, __main_stack_end__);
+
+    unsigned num_written = 0;
+    for (::thread_t* tp = chRegFirstThread(); tp != nullptr; tp = chRegNextThread(tp))
+    {
+        out_summary.num_threads++;
+        if ((out_threads != nullptr) && (num_written < capacity))
+        {
+            out_threads[num_written] = ContextInfo();
+            fillThreadInfo(tp, out_threads[num_written]);
+            num_written++;
+        }
+    }
+
+    return num_written;
+}
+
+void reset()
+{
+    {
+        CriticalSectionLocker locker;
+        (void)advance();
+        g_elapsed_cycles = 0;
+        g_isr_cycles = 0;
+    }
+
+    for (::thread_t* tp = chRegFirstThread(); tp != nullptr; tp = chRegNextThread(tp))
+    {
+        CriticalSectionLocker locker;
+        tp->zch_profiler_cycles = 0;
+    }
+}
+
+static void printContext(const ContextInfo& info, std::uint64_t elapsed_cycles)
+{
+    const float percent = (elapsed_cycles > 0) ? (float(info.cpu_cycles) * 100.0F / float(elapsed_cycles)) : 0.0F;
+
+    std::printf("%-20s ", (info.name == nullptr) ? "?" : info.name);
+    if (info.priority > 0)
+    {
+        std::printf("%4u ", unsigned(info.priority));
+    }
+    else
+    {
+        std::printf("%4s ", "-");
+    }
+    std::printf("%6.2f%% ", double(percent));
+    if (info.stack_size > 0)
+    {
+        std::printf("%5u/%-5u\n", unsigned(info.stack_used), unsigned(info.stack_size));
+    }
+    else
+    {
+        std::printf("%5s\n", "?");
+    }
+}
+
+int executeCLICommand(int argc, char *argv[])
+{
+    const char* const command = (argc < 1) ? "" : argv[0];
+
+    if ((argc == 3) && !std::strcmp(command, "sample"))
+    {
+        const int res = streamSamples(getStdIOStream(), unsigned(std::atoi(argv[1])), unsigned(std::atoi(argv[2])));
+        if (res < 0)
+        {
+            std::printf("Error %d\n", res);
+            return res;
+        }
+        std::printf("\n%d samples, %u dropped\n", res, unsigned(getNumDroppedSamples()));
+        return 0;
+    }
+
+    if ((argc > 1) || ((argc == 1) && (std::strcmp(command, "reset") != 0)))
+    {
+        std::puts("Usage: [reset | sample <rate_hz> <duration_ms>]");
+        return -EINVAL;
+    }
+
+    static constexpr unsigned MaxThreads = 16;
+    ContextInfo threads[MaxThreads];
+    Summary summary;
+    const unsigned num_threads = takeSnapshot(summary, threads, MaxThreads);
+
+    std::printf("%-20s %4s %7s %11s\n", "Context", "Prio", "CPU", "Stack");
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+        printContext(threads[i], summary.elapsed_cycles);
+    }
+    printContext(summary.isr, summary.elapsed_cycles);
+
+    if (summary.num_threads > num_threads)
+    {
+        std::printf("%u threads omitted\n", summary.num_threads - num_threads);
+    }
+    std::printf("Elapsed %.3f Mcycles\n", double(summary.elapsed_cycles) * 1e-6);
+
+    if (argc == 1)
+    {
+        reset();
+    }
+    return 0;
+}
+
+}
+}
+
+/*
+ * Kernel hooks, see chconf_defaults.h.
+ * Nested IRQs are accounted as part of the outermost one; the nesting counter is always restored by the time
+ * a nested ISR returns, so it doesn't need to be updated atomically.
+ */
+extern "C"
+{
+
+void zchProfilerContextSwitchHook(::thread_t* ntp, ::thread_t* otp)
+{
+    (void)ntp;
+    otp->zch_profiler_cycles += os::profiler::advance();
+}
+
+void zchProfilerIrqPrologueHook(void)
+{
+    using namespace os::profiler;
+    if (g_irq_nesting++ == 0)
+    {
+        chThdGetSelfX()->zch_profiler_cycles += advance();
+    }
+}
+
+void zchProfilerIrqEpilogueHook(void)
+{
+    using namespace os::profiler;
+    if (g_irq_nesting == 1)
+    {
+        g_isr_cycles += advance();
+    }
+    g_irq_nesting--;
+}
+
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * On-target CPU time and stack usage profiler.
+ * Enabled with BUILD_PROFILER=1, which defines OS_PROFILER_ENABLED; see chconf_defaults.h for the kernel hooks used.
+ *
+ * CPU time is measured in cycles of the realtime counter (DWT CYCCNT on ARMv7-M) and accumulated on every
+ * context switch and on entry to and exit from every kernel-aware ISR. The time spent in ISRs is accounted
+ * separately from threads; fast interrupts are not instrumented and are accounted to the interrupted context.
+ * Stack usage is estimated from the stack fill pattern, so it requires CH_DBG_FILL_THREADS.
+ *
+ * The statistical sampler records the PC and LR of the interrupted code from the SysTick exception, which is
+ * free in the tick-less mode, see sampling_profiler.cpp. The SysTick priority is above the kernel, so sampling
+ * works inside critical sections and kernel-aware ISRs as well.
+ */
+
+#pragma once
+
+#include <ch.hpp>
+#include <hal.h>
+#include <cstdint>
+
+
+namespace os
+{
+namespace profiler
+{
+/**
+ * Statistics of one thread, or of the ISR context.
+ */
+struct ContextInfo
+{
+    const char* name = nullptr;
+    ::tprio_t priority = 0;         ///< Zero for the ISR context
+    std::uint64_t cpu_cycles = 0;
+    std::uint32_t stack_size = 0;   ///< Bytes; zero if unknown
+    std::uint32_t stack_used = 0;   ///< Bytes, high watermark since the thread was started
+};
+
+struct Summary
+{
+    std::uint64_t elapsed_cycles = 0;   ///< Since the last reset; equals the sum of all accounted CPU time
+    ContextInfo isr;                    ///< All kernel-aware ISRs combined
+    unsigned num_threads = 0;           ///< Total, may exceed the capacity of the output array
+};
+
+/**
+ * Collects the statistics of all threads registered in the system.
+ * @param out_summary   Global statistics, including the ISR context.
+ * @param out_threads   Per-thread statistics, may be null if the capacity is zero.
+ * @param capacity      Size of the output array; excess threads will be omitted.
+ * @return              Number of entries written to the output array.
+ */
+unsigned takeSnapshot(Summary& out_summary, ContextInfo* out_threads, unsigned capacity);
+
+/**
+ * Resets the CPU time counters. Stack watermarks cannot be reset.
+ */
+void reset();
+
+/**
+ * One sample of the statistical sampler.
+ * The least significant bit of the PC is set if the interrupted code was an ISR, otherwise it is cleared.
+ */
+struct Sample
+{
+    std::uint32_t pc = 0;
+    std::uint32_t lr = 0;
+};
+
+/**
+ * Starts the sampler; samples are accumulated in a RAM ring, see OS_PROFILER_SAMPLER_BUFFER_SIZE.
+ * If the ring is full, new samples are dropped.
+ * @return 0 on success, -EINVAL if the rate is not supported.
+ */
+int startSampling(unsigned rate_hz);
+
+void stopSampling();
+
+/**
+ * Fetches the accumulated samples, oldest first. Must be invoked from a thread.
+ * @return Number of samples written to the output array.
+ */
+unsigned readSamples(Sample* out_samples, unsigned capacity);
+
+/**
+ * Number of samples lost due to ring overflows since the sampler was started.
+ */
+std::uint32_t getNumDroppedSamples();
+
+/**
+ * Runs the sampler for the specified time, streaming the samples into the channel in real time.
+ * The stdout mutex is held meanwhile, so that the text output doesn't interleave with the binary stream;
+ * enable OS_LOG_BUFFER_SIZE in order to not block the threads that write logs via the same port.
+ *
+ * Stream format: little-endian 32-bit words, two words per record:
+ *      0xFFFFFFFF 0x50534D50   - start marker ("PMSP")
+ *      PC         LR           - one sample, see @ref Sample
+ *      0xFFFFFFFF 0xFFFFFFFF   - end marker
+ * PC values with all bits set cannot occur in samples.
+ *
+ * @return Number of streamed samples, negative error code on failure.
+ */
+int streamSamples(::BaseChannel* channel, unsigned rate_hz, unsigned duration_msec);
+
+/**
+ * Prints the statistics via stdout.
+ * Commands:
+ *      (none)                          - print the statistics
+ *      reset                           - print the statistics, then reset the counters
+ *      sample <rate_hz> <duration_ms>  - stream samples via stdout, see @ref streamSamples()
+ * @return 0 on success, negative error code otherwise.
+ */
+int executeCLICommand(int argc, char *argv[]);
+
+}
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * The sampling part of the profiler, see profiler.hpp.
+ * The SysTick exception is used as the sampling timer, because it is available on all Cortex-M cores and
+ * it is not used by the kernel in the tick-less mode. The exception handler does not interact with the kernel,
+ * so its priority can be above the kernel.
+ */
+
+#include "profiler.hpp"
+#include <zubax_chibios/os.hpp>
+#include <cerrno>
+
+#if CH_CFG_ST_TIMEDELTA == 0
+# error The sampling profiler requires the tick-less mode, because SysTick is used by the kernel otherwise
+#endif
+
+/**
+ * Samples are 8 bytes large; the size must be a power of two.
+ */
+#if !defined(OS_PROFILER_SAMPLER_BUFFER_SIZE)
+# define OS_PROFILER_SAMPLER_BUFFER_SIZE        256
+#endif
+
+/**
+ * Must be above the kernel, otherwise the samples taken inside critical sections will be attributed to
+ * the end of the critical section.
+ */
+#if !defined(OS_PROFILER_SAMPLER_IRQ_PRIORITY)
+# define OS_PROFILER_SAMPLER_IRQ_PRIORITY       CORTEX_MAXIMUM_PRIORITY
+#endif
+
+/**
+ * SysTick is clocked from the core clock.
+ */
+#if !defined(OS_PROFILER_SAMPLER_CLOCK_HZ)
+# define OS_PROFILER_SAMPLER_CLOCK_HZ           STM32_HCLK
+#endif
+
+/**
+ * Sampling is expensive, so the rate is limited in order to keep the system operational.
+ */
+#if !defined(OS_PROFILER_SAMPLER_MAX_RATE_HZ)
+# define OS_PROFILER_SAMPLER_MAX_RATE_HZ        20000
+#endif
+
+#if OS_PROFILER_SAMPLER_IRQ_PRIORITY >= CORTEX_MAX_KERNEL_PRIORITY
+# error OS_PROFILER_SAMPLER_IRQ_PRIORITY must be above the kernel priority
+#endif
+
+namespace os
+{
+namespace profiler
+{
+namespace
+{
+
+constexpr unsigned BufferSize = OS_PROFILER_SAMPLER_BUFFER_SIZE;
+static_assert((BufferSize >= 2) && ((BufferSize & (BufferSize - 1U)) == 0), "Buffer size must be a power of two");
+static_assert(sizeof(Sample) == 8, "Stream format relies on the sample layout");
+
+/*
+ * Single producer (the exception handler), single consumer (a thread), so no locking is needed.
+ */
+Sample g_buffer[BufferSize];
+volatile unsigned g_write_index;
+volatile unsigned g_read_index;
+volatile std::uint32_t g_num_dropped;
+
+constexpr std::uint32_t MarkerPC = 0xFFFFFFFFU;
+constexpr std::uint32_t StartMarkerLR = 0x50534D50U;  // "PMSP"
+constexpr std::uint32_t EndMarkerLR = 0xFFFFFFFFU;
+
+constexpr unsigned StreamBatchSize = 16;
+constexpr unsigned StreamWriteTimeoutMSec = 100;
+
+inline void writeRecords(::BaseChannel* channel, const Sample* records, unsigned num_records)
+{
+    (void)chnWriteTimeout(channel, reinterpret_cast<const std::uint8_t*>(records),
+                          num_records * sizeof(Sample), MS2ST(StreamWriteTimeoutMSec));
+}
+
+}
+
+/**
+ * Invoked from the exception handler below.
+ * @param frame         The basic exception frame of the interrupted code: R0-R3, R12, LR, PC, xPSR.
+ * @param exc_return    The EXC_RETURN value; bit 3 is cleared if the interrupted code was an ISR.
+ */
+extern "C" __attribute__((used))
+void zchSamplingProfilerHandleFrame(const std::uint32_t* const frame, std::uint32_t exc_return)
+{
+    const unsigned w = g_write_index;
+    const unsigned next = (w + 1U) & (BufferSize - 1U);
+    if (next == g_read_index)
+    {
+        g_num_dropped = g_num_dropped + 1U;
+        return;
+    }
+
+    g_buffer[w].pc = (frame[6] & ~1U) | (((exc_return & 8U) == 0) ? 1U : 0U);
+    g_buffer[w].lr = frame[5];
+    __DMB();                                    // The sample must be complete before the index is updated
+    g_write_index = next;
+}
+
+int startSampling(unsigned rate_hz)
+{
+    if ((rate_hz == 0) || (rate_hz > OS_PROFILER_SAMPLER_MAX_RATE_HZ))
+    {
+        return -EINVAL;
+    }
+    const std::uint32_t reload = std::uint32_t(OS_PROFILER_SAMPLER_CLOCK_HZ / rate_hz) - 1U;
+    if ((reload == 0) || (reload > SysTick_LOAD_RELOAD_Msk))
+    {
+        return -EINVAL;                                 // The counter is 24 bit wide
+    }
+
+    stopSampling();
+
+    g_read_index = g_write_index;
+    g_num_dropped = 0;
+
+    NVIC_SetPriority(SysTick_IRQn, OS_PROFILER_SAMPLER_IRQ_PRIORITY);
+    SysTick->LOAD = reload;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+
+    return 0;
+}
+
+void stopSampling()
+{
+    SysTick->CTRL = 0;
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+}
+
+unsigned readSamples(Sample* out_samples, unsigned capacity)
+{
+    unsigned num_read = 0;
+    unsigned r = g_read_index;
+    const unsigned w = g_write_index;
+    __DMB();                                    // Not reading the samples until the index is loaded
+
+    while ((r != w) && (num_read < capacity))
+    {
+        out_samples[num_read++] = g_buffer[r];
+        r = (r + 1U) & (BufferSize - 1U);
+    }
+
+    g_read_index = r;
+    return num_read;
+}
+
+std::uint32_t getNumDroppedSamples()
+{
+    return g_num_dropped;
+}
+
+int streamSamples(::BaseChannel* channel, unsigned rate_hz, unsigned duration_msec)
+{
+    if (channel == nullptr)
+    {
+        return -EINVAL;
+    }
+
+    MutexLocker locker(getStdIOMutex());
+
+    const int res = startSampling(rate_hz);
+    if (res < 0)
+    {
+        return res;
+    }
+
+    Sample batch[StreamBatchSize];
+    batch[0].pc = MarkerPC;
+    batch[0].lr = StartMarkerLR;
+    writeRecords(channel, batch, 1);
+
+    int num_streamed = 0;
+    const ::systime_t started_at = chVTGetSystemTimeX();
+    while (chVTTimeElapsedSinceX(started_at) < MS2ST(duration_msec))
+    {
+        const unsigned n = readSamples(batch, StreamBatchSize);
+        if (n > 0)
+        {
+            writeRecords(channel, batch, n);
+            num_streamed += int(n);
+        }
+        else
+        {
+            chThdSleepMilliseconds(1);
+        }
+    }
+
+    stopSampling();
+
+    for (;;)
+    {
+        const unsigned n = readSamples(batch, StreamBatchSize);
+        if (n == 0)
+        {
+            break;
+        }
+        writeRecords(channel, batch, n);
+        num_streamed += int(n);
+    }
+
+    batch[0].pc = MarkerPC;
+    batch[0].lr = EndMarkerLR;
+    writeRecords(channel, batch, 1);
+
+    return num_streamed;
+}
+
+}
+}
+
+/*
+ * The handler must be naked, because it needs to locate the exception frame before the stack pointer is changed.
+ * The frame is on the process stack if the interrupted code was a thread, otherwise on the main stack.
+ */
+extern "C" __attribute__((naked))
+void SysTick_Handler(void)
+{
+    asm volatile
+    (
+        "tst    lr, #4                              \n"
+        "ite    eq                                  \n"
+        "mrseq  r0, msp                             \n"
+        "mrsne  r0, psp                             \n"
+        "mov    r1, lr                              \n"
+        "b      zchSamplingProfilerHandleFrame      \n"
+    );
+}
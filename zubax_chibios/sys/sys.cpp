@@ -10,9 +10,11 @@
 #include <cstdio>
 #include <cassert>
 #include <cstring>
+#include <cstdint>
 #include <cstdarg>
 #include <type_traits>
 #include <zubax_chibios/util/heapless.hpp>
+#include <zubax_chibios/util/allocators.hpp>
 
 #if !CH_CFG_USE_REGISTRY
 # pragma message "CH_CFG_USE_REGISTRY is disabled, panic reports will be incomplete"
@@ -22,6 +24,7 @@ namespace os
 {
 
 extern void emergencyPrint(const char* str);
+extern void emergencyFlushLog();
 
 __attribute__((weak))
 void applicationHaltHook(void) { }
@@ -62,6 +65,18 @@ bool isRebootRequested()
     return reboot_request_flag;
 }
 
+static memory::IAllocator* heap_allocator = nullptr;
+
+void setHeap(memory::IAllocator* allocator)
+{
+    heap_allocator = allocator;
+}
+
+memory::IAllocator* getHeap()
+{
+    return heap_allocator;
+}
+
 } // namespace os
 
 extern "C"
@@ -84,6 +99,7 @@ void zchSysHaltHook(const char* msg)
      * Printing the general panic message
      */
     port_disable();
+    emergencyFlushLog();                // The last messages before the panic are often the most useful ones
     emergencyPrint("\r\nPANIC [");
 #if CH_CFG_USE_REGISTRY
     const thread_t *pthread = chThdGetSelfX();
@@ -199,19 +215,61 @@ unsigned sleep(unsigned int seconds)
 
 void* malloc(size_t sz)
 {
-    return chCoreAlloc(sz);
+    os::memory::IAllocator* const heap = os::getHeap();
+    return (heap != nullptr) ? heap->allocate(sz) : chCoreAlloc(sz);
 }
 
-void* calloc(size_t, size_t)
+void* calloc(size_t num, size_t sz)
 {
-    chSysHalt("calloc");
-    return nullptr;
+    os::memory::IAllocator* const heap = os::getHeap();
+    if (heap == nullptr)
+    {
+        chSysHalt("calloc");
+        return nullptr;
+    }
+    if ((sz > 0) && (num > (SIZE_MAX / sz)))
+    {
+        return nullptr;
+    }
+    void* const p = heap->allocate(num * sz);
+    if (p != nullptr)
+    {
+        std::memset(p, 0, num * sz);
+    }
+    return p;
 }
 
-void* realloc(void*, size_t)
+void* realloc(void* p, size_t sz)
 {
-    chSysHalt("realloc");
-    return nullptr;
+    os::memory::IAllocator* const heap = os::getHeap();
+    if (heap == nullptr)
+    {
+        chSysHalt("realloc");
+        return nullptr;
+    }
+    if (p == nullptr)
+    {
+        return heap->allocate(sz);
+    }
+
+    const std::size_t old_size = heap->getBlockSize(p);
+    if (old_size == 0)
+    {
+        chSysHalt("realloc");
+        return nullptr;
+    }
+    if (sz <= old_size)
+    {
+        return p;                       // Pool blocks can't shrink
+    }
+
+    void* const new_p = heap->allocate(sz);
+    if (new_p != nullptr)
+    {
+        std::memcpy(new_p, p, old_size);
+        (void)heap->deallocate(p);
+    }
+    return new_p;
 }
 
 void free(void* p)
@@ -221,7 +279,11 @@ void free(void* p)
      */
     if (p != nullptr)
     {
-        chSysHalt("free");
+        os::memory::IAllocator* const heap = os::getHeap();
+        if ((heap == nullptr) || !heap->deallocate(p))
+        {
+            chSysHalt("free");
+        }
     }
 }
 
@@ -51,7 +51,7 @@ static constexpr unsigned DefaultStdIOByteWriteTimeoutMSec = 2;		///< Enough for
 /**
  * NuttX-like console print; should be used instead of printf()/chprintf()
  * This function always outputs into the debug UART regardless of the current stdout configuration.
- * TODO: use type safe version based on variadic templates.
+ * See also os::DeferredLogger, which is type safe and moves the formatting off the hot path.
  */
 __attribute__ ((format (printf, 1, 2)))
 void lowsyslog(const char* format, ...);
@@ -75,6 +75,18 @@ public:
     const char* getName() const { return name_; }
 };
 
+/**
+ * Number of bytes of @ref lowsyslog() and @ref Logger output lost due to log buffer overflows.
+ * Always zero unless the log buffer is enabled via OS_LOG_BUFFER_SIZE.
+ */
+std::uint32_t getNumDroppedLogBytes();
+
+/**
+ * Starts the thread that writes out the log buffer; does nothing unless the buffer is enabled via OS_LOG_BUFFER_SIZE.
+ * The log output is accumulated in the buffer until then. Should be invoked once during initialization.
+ */
+void startLogDrainThread();
+
 /**
  * Changes current stdout stream and its write timeout.
  * This setting does not affect @ref lowsyslog().
@@ -87,6 +99,19 @@ void setStdIOStream(::BaseChannel* stream, unsigned byte_write_timeout_msec = De
  */
 chibios_rt::Mutex& getStdIOMutex();
 
+namespace memory
+{
+class IAllocator;
+}
+
+/**
+ * Installs the allocator that serves malloc(), free(), new, delete, etc., e.g. os::memory::PoolHeap<>.
+ * By default, memory is allocated via chCoreAlloc() and can't be freed. Memory allocated before the
+ * allocator was installed still can't be freed. Should be invoked once during initialization.
+ */
+void setHeap(memory::IAllocator* allocator);
+memory::IAllocator* getHeap();
+
 /**
  * Emergency termination hook that can be overriden by the application.
  * The hook must return immediately after bringing the hardware into a safe state.
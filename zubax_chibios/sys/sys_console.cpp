@@ -13,100 +13,347 @@
 #include <cassert>
 #include <cstring>
 #include <cstdarg>
+#include <cstdint>
+#include <algorithm>
 
 
+/*
+ * If OS_LOG_BUFFER_SIZE is nonzero, lowsyslog() and Logger don't wait for the UART. The formatted text is put into
+ * a ring buffer instead, which is written out by a dedicated low priority thread, see os::startLogDrainThread().
+ * If the buffer is full, the oldest text is discarded, see os::getNumDroppedLogBytes(). The text that is still in
+ * the buffer when the system halts is printed by the halt hook before the panic message.
+ * Otherwise the output is synchronous.
+ */
+#if !defined(OS_LOG_BUFFER_SIZE)
+# define OS_LOG_BUFFER_SIZE                     0
+#endif
+#if !defined(OS_LOG_DRAIN_THREAD_PRIORITY)
+# define OS_LOG_DRAIN_THREAD_PRIORITY           LOWPRIO
+#endif
+#if !defined(OS_LOG_DRAIN_THREAD_STACK_SIZE)
+# define OS_LOG_DRAIN_THREAD_STACK_SIZE         512
+#endif
+
 namespace os
 {
 
+extern void emergencyPrint(const char* str);
+
 static chibios_rt::Mutex mutex_;
 
-static int writeExpandingCrLf(::BaseChannel* stream, unsigned timeout_msec, const char* str)
+static constexpr unsigned FormatBufferSize = 256;
+
+static char format_buffer_[FormatBufferSize];
+
+/**
+ * Newlines are expanded, the rest is written in runs, one channel call per run.
+ */
+static int writeExpandingCrLf(::BaseChannel* stream, unsigned timeout_msec, const char* str, std::size_t len)
 {
     const auto timeout = MS2ST(timeout_msec);
     int ret = 0;
 
-    for (const char* pc = str; *pc != '\0'; pc++)
+    const char* const end = str + len;
+    while (str < end)
     {
-        if (*pc == '\n')
+        const char* const newline = static_cast<const char*>(std::memchr(str, '\n', std::size_t(end - str)));
+        const std::size_t run_len = std::size_t(((newline == nullptr) ? end : newline) - str);
+
+        if (run_len > 0)
         {
-            if (MSG_OK != chnPutTimeout(stream, '\r', timeout))
+            const std::size_t written = chnWriteTimeout(stream, reinterpret_cast<const std::uint8_t*>(str),
+                                                        run_len, timeout);
+            ret += int(written);
+            if (written != run_len)
             {
                 break;
             }
-            ret++;
+            str += run_len;
         }
-        if (MSG_OK != chnPutTimeout(stream, *pc, timeout))
+
+        if (newline != nullptr)
         {
-            break;
+            static const std::uint8_t CrLf[] = { '\r', '\n' };
+            const std::size_t written = chnWriteTimeout(stream, CrLf, sizeof(CrLf), timeout);
+            ret += int(written);
+            if (written != sizeof(CrLf))
+            {
+                break;
+            }
+            str++;
         }
-        ret++;
     }
 
     return ret;
 }
 
-static int genericPrint(::BaseChannel* stream, unsigned timeout_msec, const char* format, va_list vl)
+static int writeExpandingCrLf(::BaseChannel* stream, unsigned timeout_msec, const char* str)
 {
-    MutexLocker locker(mutex_);
-
-    /*
-     * Printing the string into the buffer
-     */
-    static char buffer[256];
+    return writeExpandingCrLf(stream, timeout_msec, str, std::strlen(str));
+}
 
+/**
+ * The output is always null terminated, possibly truncated.
+ */
+static void formatToBuffer(char* buffer, std::size_t buffer_size, const char* format, va_list vl)
+{
 #if defined(OS_USE_CHPRINTF) && OS_USE_CHPRINTF
     MemoryStream ms;
-    msObjectInit(&ms, (uint8_t*)buffer, sizeof(buffer), 0);
+    msObjectInit(&ms, (uint8_t*)buffer, buffer_size, 0);
     ::BaseSequentialStream* chp = (::BaseSequentialStream*)&ms;
     chvprintf(chp, format, vl);
     chSequentialStreamPut(chp, 0);
+    buffer[buffer_size - 1] = '\0';
 #else
     using namespace std;
-    vsnprintf(buffer, sizeof(buffer), format, vl);
+    vsnprintf(buffer, buffer_size, format, vl);
 #endif
+}
+
+static int genericPrint(::BaseChannel* stream, unsigned timeout_msec, const char* format, va_list vl)
+{
+    MutexLocker locker(mutex_);
+
+    /*
+     * Printing the string into the buffer
+     */
+    formatToBuffer(format_buffer_, sizeof(format_buffer_), format, vl);
 
     /*
      * Writing the buffer replacing "\n" --> "\r\n"
      */
-    return writeExpandingCrLf(stream, timeout_msec, buffer);
+    return writeExpandingCrLf(stream, timeout_msec, format_buffer_);
 }
 
 
 // Lowsyslog config is fixed
 static constexpr unsigned LowsyslogWriteTimeoutMSec = 1000;
 
+#if OS_LOG_BUFFER_SIZE > 0
+
+namespace
+{
+/**
+ * Producers never wait for the consumer; if there's not enough space, the oldest data is dropped.
+ */
+class LogRingBuffer
+{
+    char buffer_[OS_LOG_BUFFER_SIZE];
+    std::size_t out_ = 0;
+    std::size_t len_ = 0;
+    std::uint32_t num_dropped_ = 0;
+
+public:
+    void push(const char* data, std::size_t size)
+    {
+        if (size > sizeof(buffer_))                       // Only the tail will fit anyway
+        {
+            num_dropped_ += size - sizeof(buffer_);
+            data += size - sizeof(buffer_);
+            size = sizeof(buffer_);
+        }
+
+        CriticalSectionLocker locker;
+
+        const std::size_t free_space = sizeof(buffer_) - len_;
+        if (size > free_space)
+        {
+            const std::size_t drop = size - free_space;
+            out_ = (out_ + drop) % sizeof(buffer_);
+            len_ -= drop;
+            num_dropped_ += drop;
+        }
+
+        std::size_t in = (out_ + len_) % sizeof(buffer_);
+        len_ += size;
+        while (size > 0)                                  // At most two iterations
+        {
+            const std::size_t chunk = std::min(size, sizeof(buffer_) - in);
+            std::memcpy(&buffer_[in], data, chunk);
+            in = (in + chunk) % sizeof(buffer_);
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    /**
+     * Stops after the first newline, so that the output is mostly line aligned.
+     * @return Number of bytes copied.
+     */
+    std::size_t pop(char* out, std::size_t max_size)
+    {
+        CriticalSectionLocker locker;
+        return popUnlocked(out, max_size);
+    }
+
+    /**
+     * Same as @ref pop(), for the halt hook, where the interrupts are disabled and the kernel must not be used.
+     */
+    std::size_t popUnlocked(char* out, std::size_t max_size)
+    {
+        std::size_t n = 0;
+        while ((n < max_size) && (len_ > 0))
+        {
+            const char c = buffer_[out_];
+            out[n++] = c;
+            out_ = (out_ + 1U) % sizeof(buffer_);
+            len_--;
+            if (c == '\n')
+            {
+                break;
+            }
+        }
+        return n;
+    }
+
+    std::uint32_t getNumDropped() const { return num_dropped_; }
+};
+
+LogRingBuffer log_buffer_;
+
+class LogDrainThread : public chibios_rt::BaseStaticThread<OS_LOG_DRAIN_THREAD_STACK_SIZE>
+{
+    chibios_rt::BinarySemaphore data_available_{false};     // The output accumulated before the start is pending
+
+    void main() override
+    {
+        chibios_rt::BaseThread::setName("log");
+
+        for (;;)
+        {
+            (void)data_available_.wait();
+
+            char chunk[64];
+            std::size_t size = 0;
+            while ((size = log_buffer_.pop(chunk, sizeof(chunk))) > 0)
+            {
+                MutexLocker locker(mutex_);     // Not interleaving with stdout if it shares the same channel
+                (void)writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, chunk, size);
+            }
+        }
+    }
+
+public:
+    void notify()
+    {
+        data_available_.signal();
+    }
+};
+
+LogDrainThread log_drain_thread_;
+
+}
+
+/// Held while a log message is being put into the buffer, so that messages don't interleave
+static chibios_rt::Mutex log_mutex_;
+static char log_format_buffer_[FormatBufferSize];
+
+static void logWrite(const char* str)
+{
+    log_buffer_.push(str, std::strlen(str));
+}
+
+static void logCommit()
+{
+    log_drain_thread_.notify();
+}
+
+std::uint32_t getNumDroppedLogBytes()
+{
+    return log_buffer_.getNumDropped();
+}
+
+void startLogDrainThread()
+{
+    static bool started = false;
+    ASSERT_ALWAYS(!started);
+    started = true;
+    (void)log_drain_thread_.start(OS_LOG_DRAIN_THREAD_PRIORITY);
+}
+
+void emergencyFlushLog()
+{
+    char chunk[64];
+    std::size_t size = 0;
+    while ((size = log_buffer_.popUnlocked(chunk, sizeof(chunk))) > 0)
+    {
+        for (std::size_t i = 0; i < size; i++)
+        {
+            const char str[] = { chunk[i], '\0' };
+            emergencyPrint((chunk[i] == '\n') ? "\r\n" : str);
+        }
+    }
+}
+
+#else
+
+static chibios_rt::Mutex& log_mutex_ = mutex_;
+static char (&log_format_buffer_)[FormatBufferSize] = format_buffer_;
+
+static void logWrite(const char* str)
+{
+    (void)writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, str);
+}
+
+static void logCommit() { }
+
+std::uint32_t getNumDroppedLogBytes()
+{
+    return 0;
+}
+
+void startLogDrainThread() { }
+
+void emergencyFlushLog() { }
+
+#endif
+
 void lowsyslog(const char* format, ...)
 {
-    va_list vl;
-    va_start(vl, format);
-    genericPrint((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, format, vl);
-    va_end(vl);
+    {
+        MutexLocker locker(log_mutex_);
+
+        va_list vl;
+        va_start(vl, format);
+        formatToBuffer(log_format_buffer_, sizeof(log_format_buffer_), format, vl);
+        va_end(vl);
+
+        logWrite(log_format_buffer_);
+    }
+    logCommit();
 }
 
 
 void Logger::println(const char* format, ...)
 {
-    MutexLocker locker(mutex_);
+    {
+        MutexLocker locker(log_mutex_);
 
-    writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, name_);
-    writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, ": ");
+        logWrite(name_);
+        logWrite(": ");
 
-    va_list vl;
-    va_start(vl, format);
-    genericPrint((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, format, vl);
-    va_end(vl);
+        va_list vl;
+        va_start(vl, format);
+        formatToBuffer(log_format_buffer_, sizeof(log_format_buffer_), format, vl);
+        va_end(vl);
 
-    writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, "\n");
+        logWrite(log_format_buffer_);
+        logWrite("\n");
+    }
+    logCommit();
 }
 
 void Logger::puts(const char* line)
 {
-    MutexLocker locker(mutex_);
+    {
+        MutexLocker locker(log_mutex_);
 
-    writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, name_);
-    writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, ": ");
-    writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, line);
-    writeExpandingCrLf((::BaseChannel*)&STDOUT_SD, LowsyslogWriteTimeoutMSec, "\n");
+        logWrite(name_);
+        logWrite(": ");
+        logWrite(line);
+        logWrite("\n");
+    }
+    logCommit();
 }
 
 
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * Bounded-time memory allocators.
+ *  - Pool: fixed-size blocks, O(1) allocation and deallocation, safe to use from ISR.
+ *  - PoolHeap: a set of pools of different block sizes; can be installed as the system heap via os::setHeap(),
+ *    which makes malloc(), free(), new, and delete usable:
+ *          static os::memory::PoolHeap<os::memory::Pool<32, 64>, os::memory::Pool<128, 16>> g_heap;
+ *          ...
+ *          os::setHeap(&g_heap);
+ *  - Arena: bump allocator with bulk reset or scoped rollback; not thread safe.
+ */
+
+#pragma once
+
+#include <zubax_chibios/sys/sys.hpp>
+#include <type_traits>
+#include <utility>
+#include <tuple>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <new>
+
+
+namespace os
+{
+namespace memory
+{
+/**
+ * All blocks are aligned at this boundary.
+ */
+static constexpr std::size_t MaxAlignment = alignof(std::max_align_t);
+
+/**
+ * Generic allocator interface, used by the system heap.
+ */
+class IAllocator
+{
+public:
+    virtual ~IAllocator() { }
+
+    /**
+     * @return Null pointer if there is not enough memory.
+     */
+    virtual void* allocate(std::size_t size) = 0;
+
+    /**
+     * @return False if the pointer does not belong to this allocator, in which case nothing is done.
+     */
+    virtual bool deallocate(void* ptr) = 0;
+
+    /**
+     * @return Usable size of the block, zero if the pointer does not belong to this allocator.
+     */
+    virtual std::size_t getBlockSize(const void* ptr) const = 0;
+};
+
+struct PoolStatistics
+{
+    std::size_t block_size = 0;
+    unsigned capacity = 0;
+    unsigned used = 0;
+    unsigned peak = 0;                  ///< High water mark
+    std::uint32_t num_failures = 0;     ///< Allocation requests that could not be served because the pool was empty
+};
+
+/**
+ * Type-independent part of @ref Pool.
+ * All operations are done in a critical section of constant length; it is safe to use the pool from ISR.
+ */
+class PoolCore
+{
+    struct Node
+    {
+        Node* next;
+    };
+
+    std::uint8_t* const storage_;
+    const std::size_t block_size_;
+    const unsigned capacity_;
+
+    Node* free_list_ = nullptr;
+    unsigned used_ = 0;
+    unsigned peak_ = 0;
+    std::uint32_t num_failures_ = 0;
+
+public:
+    PoolCore(void* storage, std::size_t block_size, unsigned capacity) :
+        storage_(static_cast<std::uint8_t*>(storage)),
+        block_size_(block_size),
+        capacity_(capacity)
+    {
+        assert((block_size_ >= sizeof(Node)) && (block_size_ % MaxAlignment == 0));
+        for (unsigned i = capacity_; i > 0; i--)
+        {
+            auto node = reinterpret_cast<Node*>(storage_ + block_size_ * (i - 1U));
+            node->next = free_list_;
+            free_list_ = node;
+        }
+    }
+
+    PoolCore(const PoolCore&) = delete;
+    PoolCore& operator=(const PoolCore&) = delete;
+
+    bool owns(const void* ptr) const
+    {
+        auto p = static_cast<const std::uint8_t*>(ptr);
+        return (p >= storage_) && (p < (storage_ + block_size_ * capacity_));
+    }
+
+    void* allocate()
+    {
+        CriticalSectionLocker locker;
+        Node* const node = free_list_;
+        if (node == nullptr)
+        {
+            num_failures_++;
+            return nullptr;
+        }
+        free_list_ = node->next;
+        used_++;
+        if (used_ > peak_)
+        {
+            peak_ = used_;
+        }
+        return node;
+    }
+
+    /**
+     * The pointer must belong to this pool.
+     */
+    void deallocate(void* ptr)
+    {
+        ASSERT_ALWAYS(owns(ptr) && (((static_cast<std::uint8_t*>(ptr) - storage_) % block_size_) == 0));
+        CriticalSectionLocker locker;
+        ASSERT_ALWAYS(used_ > 0);
+        auto node = static_cast<Node*>(ptr);
+        node->next = free_list_;
+        free_list_ = node;
+        used_--;
+    }
+
+    std::size_t getBlockSize() const { return block_size_; }
+
+    PoolStatistics getStatistics() const
+    {
+        PoolStatistics s;
+        s.block_size = block_size_;
+        s.capacity = capacity_;
+        CriticalSectionLocker locker;
+        s.used = used_;
+        s.peak = peak_;
+        s.num_failures = num_failures_;
+        return s;
+    }
+};
+
+/**
+ * Pool of fixed-size blocks with statically allocated storage.
+ * @tparam BlockSize    Maximum allocation size; will be rounded up to @ref MaxAlignment.
+ * @tparam NumBlocks    Capacity of the pool.
+ */
+template <std::size_t BlockSize, unsigned NumBlocks>
+class Pool : public IAllocator
+{
+    static_assert((BlockSize > 0) && (NumBlocks > 0), "Invalid pool dimensions");
+
+public:
+    static constexpr std::size_t ActualBlockSize = ((BlockSize + MaxAlignment - 1U) / MaxAlignment) * MaxAlignment;
+
+private:
+    alignas(MaxAlignment) std::uint8_t storage_[ActualBlockSize * NumBlocks];
+    PoolCore core_;
+
+public:
+    Pool() : core_(storage_, ActualBlockSize, NumBlocks) { }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    void* allocate(std::size_t size) override
+    {
+        return (size <= ActualBlockSize) ? core_.allocate() : nullptr;
+    }
+
+    bool deallocate(void* ptr) override
+    {
+        if (!core_.owns(ptr))
+        {
+            return false;
+        }
+        core_.deallocate(ptr);
+        return true;
+    }
+
+    std::size_t getBlockSize(const void* ptr) const override
+    {
+        return core_.owns(ptr) ? ActualBlockSize : 0;
+    }
+
+    PoolCore& getCore() { return core_; }
+
+    PoolStatistics getStatistics() const { return core_.getStatistics(); }
+};
+
+/**
+ * A set of pools, e.g. PoolHeap<Pool<32, 64>, Pool<128, 16>>.
+ * An allocation request is served by the smallest pool that fits the size; if that pool is exhausted,
+ * by the next larger one. The number of steps is bounded by the number of pools.
+ */
+template <typename... Pools>
+class PoolHeap : public IAllocator
+{
+    static constexpr unsigned NumPools = sizeof...(Pools);
+    static_assert(NumPools > 0, "At least one pool is needed");
+
+    std::tuple<Pools...> pools_;
+    PoolCore* cores_[NumPools];
+
+    template <std::size_t... Is>
+    void collectCores(std::index_sequence<Is...>)
+    {
+        PoolCore* const cores[] = { &std::get<Is>(pools_).getCore()... };
+        for (unsigned i = 0; i < NumPools; i++)
+        {
+            cores_[i] = cores[i];
+        }
+    }
+
+public:
+    PoolHeap()
+    {
+        collectCores(std::index_sequence_for<Pools...>());
+        // Sorting by block size, so that the smallest suitable pool is always found first
+        for (unsigned i = 1; i < NumPools; i++)
+        {
+            for (unsigned k = i; (k > 0) && (cores_[k - 1]->getBlockSize() > cores_[k]->getBlockSize()); k--)
+            {
+                std::swap(cores_[k - 1], cores_[k]);
+            }
+        }
+    }
+
+    PoolHeap(const PoolHeap&) = delete;
+    PoolHeap& operator=(const PoolHeap&) = delete;
+
+    void* allocate(std::size_t size) override
+    {
+        for (auto c : cores_)
+        {
+            if (c->getBlockSize() >= size)
+            {
+                void* const p = c->allocate();
+                if (p != nullptr)
+                {
+                    return p;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    bool deallocate(void* ptr) override
+    {
+        for (auto c : cores_)
+        {
+            if (c->owns(ptr))
+            {
+                c->deallocate(ptr);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::size_t getBlockSize(const void* ptr) const override
+    {
+        for (auto c : cores_)
+        {
+            if (c->owns(ptr))
+            {
+                return c->getBlockSize();
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Per-pool statistics, in the order of increasing block size.
+     */
+    unsigned getNumPools() const { return NumPools; }
+
+    PoolStatistics getPoolStatistics(unsigned index) const
+    {
+        return (index < NumPools) ? cores_[index]->getStatistics() : PoolStatistics();
+    }
+};
+
+/**
+ * Bump allocator; memory is released all at once, either by @ref reset() or by destroying a @ref Scope.
+ * Objects allocated from the arena are never destroyed, so only trivially destructible types can be constructed.
+ * This class is not thread safe.
+ */
+class Arena
+{
+    std::uint8_t* const buffer_;
+    const std::size_t capacity_;
+
+    std::size_t offset_ = 0;
+    std::size_t peak_ = 0;
+    std::uint32_t num_failures_ = 0;
+
+public:
+    using Marker = std::size_t;
+
+    /**
+     * Releases all memory allocated since the scope was entered.
+     */
+    class Scope
+    {
+        Arena& arena_;
+        const Marker marker_;
+
+    public:
+        explicit Scope(Arena& arena) :
+            arena_(arena),
+            marker_(arena.getMarker())
+        { }
+
+        ~Scope() { arena_.rewind(marker_); }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    Arena(void* buffer, std::size_t capacity) :
+        buffer_(static_cast<std::uint8_t*>(buffer)),
+        capacity_(capacity)
+    { }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /**
+     * @param alignment     Must be a power of two.
+     * @return              Null pointer if there is not enough memory.
+     */
+    void* allocate(std::size_t size, std::size_t alignment = MaxAlignment)
+    {
+        assert((alignment > 0) && ((alignment & (alignment - 1U)) == 0));
+        const std::uintptr_t base = reinterpret_cast<std::uintptr_t>(buffer_);
+        const std::uintptr_t aligned = (base + offset_ + alignment - 1U) & ~std::uintptr_t(alignment - 1U);
+        const std::size_t start = std::size_t(aligned - base);
+
+        if ((start > capacity_) || (size > (capacity_ - start)))
+        {
+            num_failures_++;
+            return nullptr;
+        }
+
+        offset_ = start + size;
+        if (offset_ > peak_)
+        {
+            peak_ = offset_;
+        }
+        return buffer_ + start;
+    }
+
+    /**
+     * @return Null pointer if there is not enough memory.
+     */
+    template <typename T, typename... Args>
+    T* construct(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "Destructors of arena objects are never invoked");
+        void* const p = allocate(sizeof(T), alignof(T));
+        return (p == nullptr) ? nullptr : new (p) T(std::forward<Args>(args)...);
+    }
+
+    Marker getMarker() const { return offset_; }
+
+    /**
+     * Releases all memory allocated after the marker was taken.
+     */
+    void rewind(Marker marker)
+    {
+        assert(marker <= offset_);
+        offset_ = marker;
+    }
+
+    void reset() { offset_ = 0; }
+
+    std::size_t getCapacity() const { return capacity_; }
+    std::size_t getUsed()     const { return offset_; }
+    std::size_t getPeak()     const { return peak_; }     ///< High water mark
+
+    std::uint32_t getNumFailures() const { return num_failures_; }
+};
+
+/**
+ * Arena with statically allocated storage.
+ */
+template <std::size_t Capacity>
+class StaticArena : public Arena
+{
+    alignas(MaxAlignment) std::uint8_t storage_[Capacity];
+
+public:
+    StaticArena() : Arena(storage_, Capacity) { }
+};
+
+}
+}
@@ -8,6 +8,11 @@
  * Base64 encoder and decoder optimized for deeply embedded systems.
  * This implementation is somewhat inspired by this source (released into public domain):
  *      https://en.wikibooks.org/wiki/Algorithm_Implementation/Miscellaneous/Base64#C.2B.2B
+ *
+ * Symbols are decoded via a 256-byte lookup table that is computed at compile time and resides in ROM;
+ * every group of four symbols is validated with a single check and assembled into a 24-bit word.
+ * Besides the one-shot functions, there are streaming classes StreamEncoder and StreamDecoder that can be fed
+ * with chunks of arbitrary size, e.g. as they arrive from a serial link.
  */
 
 #pragma once
@@ -15,12 +20,126 @@
 #include <cstdint>
 #include <cstring>
 #include <cstddef>
+#include <cerrno>
 #include <iterator>
 
 namespace os
 {
 namespace base64
 {
+/**
+ * Implementation details, do not use directly.
+ */
+namespace impl_
+{
+
+constexpr std::uint8_t WhitespaceSymbol = 0x40;     ///< Ignored by the stream decoder, invalid otherwise
+constexpr std::uint8_t PaddingSymbol    = 0x80;
+constexpr std::uint8_t InvalidSymbol    = 0xFF;
+constexpr std::uint8_t SpecialSymbolMask = 0xC0;    ///< Valid data symbols never have these bits set
+
+struct DecodingTable
+{
+    std::uint8_t data[256];
+};
+
+constexpr DecodingTable makeDecodingTable()
+{
+    constexpr char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    DecodingTable t{};
+    for (unsigned i = 0; i < 256; i++)
+    {
+        t.data[i] = InvalidSymbol;
+    }
+    for (unsigned i = 0; i < 64; i++)
+    {
+        t.data[std::uint8_t(Alphabet[i])] = std::uint8_t(i);
+    }
+    t.data[std::uint8_t('=')] = PaddingSymbol;
+    t.data[std::uint8_t(' ')] = WhitespaceSymbol;
+    t.data[std::uint8_t('\t')] = WhitespaceSymbol;
+    t.data[std::uint8_t('\r')] = WhitespaceSymbol;
+    t.data[std::uint8_t('\n')] = WhitespaceSymbol;
+    return t;
+}
+
+template <typename = void>
+struct TableHolder
+{
+    static constexpr char EncodingAlphabet[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static constexpr DecodingTable Decoding = makeDecodingTable();
+};
+
+template <typename T>
+constexpr char TableHolder<T>::EncodingAlphabet[65];
+
+template <typename T>
+constexpr DecodingTable TableHolder<T>::Decoding;
+
+/**
+ * Encodes the 24 least significant bits of the word into four symbols.
+ */
+inline char* encodeWord(const std::uint32_t x, char* out)
+{
+    const auto& alphabet = TableHolder<>::EncodingAlphabet;
+    out[0] = alphabet[(x >> 18) & 0x3FU];
+    out[1] = alphabet[(x >> 12) & 0x3FU];
+    out[2] = alphabet[(x >> 6) & 0x3FU];
+    out[3] = alphabet[x & 0x3FU];
+    return out + 4;
+}
+
+/**
+ * Encodes the last one or two bytes of the data, adding the padding.
+ */
+inline char* encodeTail(const std::uint32_t x, const unsigned num_bytes, char* out)
+{
+    (void)encodeWord(x << ((num_bytes == 1) ? 16 : 8), out);
+    out[3] = '=';
+    if (num_bytes == 1)
+    {
+        out[2] = '=';
+    }
+    return out + 4;
+}
+
+/**
+ * Decodes a group of four symbols into the 24 most significant bits of the word, starting from bit 23.
+ * @return Number of data bytes in the group: 3, or 2 or 1 if the group is padded; zero if the group is invalid.
+ */
+inline unsigned decodeGroup(const char* const in, std::uint32_t& out_word)
+{
+    const auto& t = TableHolder<>::Decoding.data;
+    const std::uint32_t a = t[std::uint8_t(in[0])];
+    const std::uint32_t b = t[std::uint8_t(in[1])];
+    const std::uint32_t c = t[std::uint8_t(in[2])];
+    const std::uint32_t d = t[std::uint8_t(in[3])];
+
+    if (((a | b | c | d) & SpecialSymbolMask) == 0)     // Fast path
+    {
+        out_word = (a << 18) | (b << 12) | (c << 6) | d;
+        return 3;
+    }
+
+    if ((((a | b) & SpecialSymbolMask) != 0) || (d != PaddingSymbol))
+    {
+        return 0;
+    }
+    if (c == PaddingSymbol)
+    {
+        out_word = (a << 18) | (b << 12);
+        return 1;
+    }
+    if ((c & SpecialSymbolMask) != 0)
+    {
+        return 0;
+    }
+    out_word = (a << 18) | (b << 12) | (c << 6);
+    return 2;
+}
+
+}
+
 /**
  * @param num_bytes     Number of bytes of source data (non-encoded, raw bytes).
  *
@@ -48,41 +167,29 @@ constexpr static inline std::size_t predictEncodedDataLength(const std::size_t n
 template <typename Container>
 static const char* encode(const Container& input, char* const output_buffer)
 {
-    static const char* const Alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
     auto in = input.cbegin();
     char* out = &output_buffer[0];
 
     for (std::size_t i = 0; i < input.size() / 3U; i++)
     {
-        std::uint32_t x = std::uint32_t(*in++) << 16;
-        x +=              std::uint32_t(*in++) << 8;
-        x +=              std::uint32_t(*in++);
-        *out++ = Alphabet[(x & 0x00FC0000UL) >> 18];
-        *out++ = Alphabet[(x & 0x0003F000UL) >> 12];
-        *out++ = Alphabet[(x & 0x00000FC0UL) >> 6];
-        *out++ = Alphabet[(x & 0x0000003FUL)];
+        std::uint32_t x = std::uint32_t(std::uint8_t(*in++)) << 16;
+        x |=              std::uint32_t(std::uint8_t(*in++)) << 8;
+        x |=              std::uint32_t(std::uint8_t(*in++));
+        out = impl_::encodeWord(x, out);
     }
 
     switch (input.size() % 3)
     {
     case 1:
     {
-        const std::uint32_t x = (*in++) << 16; // Convert to big endian
-        *out++ = Alphabet[(x & 0x00FC0000UL) >> 18];
-        *out++ = Alphabet[(x & 0x0003F000UL) >> 12];
-        *out++ = '=';
-        *out++ = '=';
+        out = impl_::encodeTail(std::uint8_t(*in++), 1, out);
         break;
     }
     case 2:
     {
-        std::uint32_t x = std::uint32_t(*in++) << 16;
-        x +=              std::uint32_t(*in++) << 8;
-        *out++ = Alphabet[(x & 0x00FC0000UL) >> 18];
-        *out++ = Alphabet[(x & 0x0003F000UL) >> 12];
-        *out++ = Alphabet[(x & 0x00000FC0UL) >> 6];
-        *out++ = '=';
+        std::uint32_t x = std::uint32_t(std::uint8_t(*in++)) << 8;
+        x |=              std::uint32_t(std::uint8_t(*in++));
+        out = impl_::encodeTail(x, 2, out);
         break;
     }
     default:
@@ -154,54 +261,251 @@ bool decode(Container& out_container, const char* in)
     }
 
     auto out = std::begin(out_container);
-    std::uint32_t x = 0;
 
-    while (*in != '\0')
+    while (in != end)
     {
-        for (unsigned i = 0; i < 4; i++)
+        std::uint32_t x = 0;
+        const unsigned num_bytes = impl_::decodeGroup(in, x);
+        in += 4;
+        if ((num_bytes == 0) ||
+            ((num_bytes < 3) && (in != end)))           // Padding is allowed only at the end
+        {
+            return false;
+        }
+
+        *out++ = static_cast<std::uint8_t>((x >> 16) & 0x000000FFUL);
+        if (num_bytes > 1)
         {
-            x <<= 6;
-            if      (*in >= 0x41 && *in <= 0x5A) { x |= *in - 0x41; }
-            else if (*in >= 0x61 && *in <= 0x7A) { x |= *in - 0x47; }
-            else if (*in >= 0x30 && *in <= 0x39) { x |= *in + 0x04; }
-            else if (*in == 0x2B)                { x |= 0x3E; }
-            else if (*in == 0x2F)                { x |= 0x3F; }
-            else if (*in == '=')
+            *out++ = static_cast<std::uint8_t>((x >> 8 ) & 0x000000FFUL);
+        }
+        if (num_bytes > 2)
+        {
+            *out++ = static_cast<std::uint8_t>((x >> 0 ) & 0x000000FFUL);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Encodes a stream of data that arrives in chunks of arbitrary size.
+ * The concatenated output is identical to the output of @ref encode() applied to the concatenation of all chunks.
+ * The output is not zero-terminated.
+ *
+ *     StreamEncoder encoder;
+ *     char buf[StreamEncoder::predictFeedOutputLength(sizeof(chunk)) + StreamEncoder::MaxFinishOutputLength];
+ *     std::size_t len = encoder.feed(chunk, sizeof(chunk), buf);
+ *     ...
+ *     len = encoder.finish(buf);
+ */
+class StreamEncoder
+{
+    std::uint32_t pending_ = 0;         ///< Bytes that don't make a complete group yet
+    unsigned num_pending_ = 0;
+
+public:
+    static constexpr std::size_t MaxFinishOutputLength = 4;
+
+    /**
+     * @return The maximum number of symbols @ref feed() can output for the specified number of bytes.
+     */
+    static constexpr std::size_t predictFeedOutputLength(const std::size_t num_bytes)
+    {
+        return ((num_bytes + 2U) / 3U) * 4U;
+    }
+
+    /**
+     * @param output    Must be large enough, see @ref predictFeedOutputLength().
+     * @return          Number of symbols written.
+     */
+    std::size_t feed(const void* const data, const std::size_t size, char* const output)
+    {
+        auto in = static_cast<const std::uint8_t*>(data);
+        const auto end = in + size;
+        char* out = output;
+
+        if (num_pending_ > 0)
+        {
+            while ((num_pending_ < 3) && (in != end))
             {
-                switch (end - in)
-                {
-                case 1: //One pad character
-                {
-                    *out++ = static_cast<std::uint8_t>((x >> 16) & 0x000000FFUL);
-                    *out++ = static_cast<std::uint8_t>((x >> 8 ) & 0x000000FFUL);
-                    return true;
-                }
-                case 2:
+                pending_ = (pending_ << 8) | *in++;
+                num_pending_++;
+            }
+            if (num_pending_ < 3)
+            {
+                return 0;
+            }
+            out = impl_::encodeWord(pending_, out);
+            pending_ = 0;
+            num_pending_ = 0;
+        }
+
+        while ((end - in) >= 3)
+        {
+            out = impl_::encodeWord((std::uint32_t(in[0]) << 16) | (std::uint32_t(in[1]) << 8) | in[2], out);
+            in += 3;
+        }
+
+        while (in != end)
+        {
+            pending_ = (pending_ << 8) | *in++;
+            num_pending_++;
+        }
+
+        return std::size_t(out - output);
+    }
+
+    /**
+     * Outputs the remaining bytes with padding, and resets the encoder.
+     * @param output    Must accommodate at least @ref MaxFinishOutputLength symbols.
+     * @return          Number of symbols written.
+     */
+    std::size_t finish(char* const output)
+    {
+        const bool has_tail = num_pending_ > 0;
+        if (has_tail)
+        {
+            (void)impl_::encodeTail(pending_, num_pending_, output);
+        }
+        reset();
+        return has_tail ? MaxFinishOutputLength : 0;
+    }
+
+    void reset()
+    {
+        pending_ = 0;
+        num_pending_ = 0;
+    }
+};
+
+/**
+ * Decodes a stream of symbols that arrives in chunks of arbitrary size.
+ * Whitespace (spaces, tabs, line breaks) is ignored anywhere in the stream; padding is mandatory.
+ * Once an error is detected, all subsequent calls fail until the decoder is reset.
+ */
+class StreamDecoder
+{
+    std::uint32_t word_ = 0;
+    unsigned num_symbols_ = 0;          ///< Symbols of the current group, including padding
+    unsigned num_padding_ = 0;          ///< Padding symbols of the current group
+    bool padded_ = false;               ///< No data can follow
+    bool failed_ = false;
+
+    int fail()
+    {
+        failed_ = true;
+        return -EINVAL;
+    }
+
+    static std::uint8_t* emit(const std::uint32_t word, const unsigned num_bytes, std::uint8_t* out)
+    {
+        for (unsigned i = 0; i < num_bytes; i++)
+        {
+            *out++ = std::uint8_t(word >> (16U - i * 8U));
+        }
+        return out;
+    }
+
+public:
+    /**
+     * @return The maximum number of bytes @ref feed() can output for the specified number of symbols.
+     *         The bytes of a group are output when its last symbol is fed, so the symbols that are pending from
+     *         the previous calls do not increase the bound.
+     */
+    static constexpr std::size_t predictFeedOutputLength(const std::size_t num_symbols)
+    {
+        return ((num_symbols + 3U) / 4U) * 3U;
+    }
+
+    /**
+     * @param output    Must be large enough, see @ref predictFeedOutputLength().
+     * @return          Number of bytes written, or negative error code if the input is invalid.
+     */
+    int feed(const char* const data, const std::size_t size, std::uint8_t* const output)
+    {
+        if (failed_)
+        {
+            return -EINVAL;
+        }
+
+        const auto& table = impl_::TableHolder<>::Decoding.data;
+        const char* in = data;
+        const char* const end = data + size;
+        std::uint8_t* out = output;
+
+        while (in != end)
+        {
+            if ((num_symbols_ == 0) && !padded_ && ((end - in) >= 4))
+            {
+                std::uint32_t x = 0;
+                if (impl_::decodeGroup(in, x) == 3)
                 {
-                    *out++ = static_cast<std::uint8_t>((x >> 10) & 0x000000FFUL);
-                    return true;
+                    out = emit(x, 3, out);
+                    in += 4;
+                    continue;
                 }
-                default:
+            }
+
+            const std::uint8_t symbol = table[std::uint8_t(*in++)];
+            if (symbol == impl_::WhitespaceSymbol)
+            {
+                continue;
+            }
+            if (symbol == impl_::InvalidSymbol)
+            {
+                return fail();
+            }
+            if (symbol == impl_::PaddingSymbol)
+            {
+                if (num_symbols_ < 2)
                 {
-                    return false;
-                }
+                    return fail();
                 }
+                padded_ = true;
+                num_padding_++;
+                word_ <<= 6;
             }
             else
             {
-                return false;
+                if (padded_)
+                {
+                    return fail();
+                }
+                word_ = (word_ << 6) | symbol;
             }
 
-            in++;
+            if (++num_symbols_ == 4)
+            {
+                out = emit(word_, 3U - num_padding_, out);
+                word_ = 0;
+                num_symbols_ = 0;
+                num_padding_ = 0;
+            }
         }
 
-        *out++ = static_cast<std::uint8_t>((x >> 16) & 0x000000FFUL);
-        *out++ = static_cast<std::uint8_t>((x >> 8 ) & 0x000000FFUL);
-        *out++ = static_cast<std::uint8_t>((x >> 0 ) & 0x000000FFUL);
+        return int(out - output);
     }
 
-    return true;
-}
+    /**
+     * Checks that the stream has ended properly, and resets the decoder.
+     * @return Zero on success, negative error code if the stream is truncated or contained an error.
+     */
+    int finish()
+    {
+        const bool ok = !failed_ && (num_symbols_ == 0);
+        reset();
+        return ok ? 0 : -EINVAL;
+    }
+
+    void reset()
+    {
+        word_ = 0;
+        num_symbols_ = 0;
+        num_padding_ = 0;
+        padded_ = false;
+        failed_ = false;
+    }
+};
 
 }
 }
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2016 Zubax, zubax.com
+ * Distributed under the MIT License, available in the file LICENSE.
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+/*
+ * CRC algorithms used across the library.
+ * Two implementations are available for each algorithm, selected at compile time via OS_CRC_USE_LOOKUP_TABLES:
+ *  - Fast (default): slice-by-4 lookup tables, which are computed at compile time and reside in ROM.
+ *                    The tables occupy 2 KB for CRC-16, 4 KB for CRC-32, and 8 KB for CRC-64;
+ *                    they are linked only if used.
+ *  - Small: bitwise computation, 8 iterations per byte, no tables.
+ *
+ * The hardware CRC unit of STM32 is not used, because it does not support 64-bit polynomials, and on most
+ * parts its CRC-32 cannot be configured for reflected input with zero initial value, as used here.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#ifndef OS_CRC_USE_LOOKUP_TABLES
+# define OS_CRC_USE_LOOKUP_TABLES       1
+#endif
+
+namespace os
+{
+namespace crc
+{
+/**
+ * Implementation details, do not use directly.
+ */
+namespace impl_
+{
+
+template <typename T>
+struct SlicedTable
+{
+    static constexpr unsigned NumSlices = 4;
+    T data[NumSlices][256];
+};
+
+/// Table for a reflected (LSB-first) CRC
+template <typename T, T ReflectedPoly>
+constexpr SlicedTable<T> makeReflectedTable()
+{
+    SlicedTable<T> t{};
+    for (unsigned i = 0; i < 256; i++)
+    {
+        T crc = T(i);
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc & 1U) ? T((crc >> 1) ^ ReflectedPoly) : T(crc >> 1);
+        }
+        t.data[0][i] = crc;
+    }
+    for (unsigned i = 0; i < 256; i++)
+    {
+        for (unsigned s = 1; s < SlicedTable<T>::NumSlices; s++)
+        {
+            const T prev = t.data[s - 1][i];
+            t.data[s][i] = T((prev >> 8) ^ t.data[0][prev & 0xFFU]);
+        }
+    }
+    return t;
+}
+
+/// Table for a normal (MSB-first) CRC
+template <typename T, T Poly>
+constexpr SlicedTable<T> makeNormalTable()
+{
+    constexpr unsigned TopShift = sizeof(T) * 8U - 8U;
+    constexpr T TopBit = T(1) << (sizeof(T) * 8U - 1U);
+    SlicedTable<T> t{};
+    for (unsigned i = 0; i < 256; i++)
+    {
+        T crc = T(T(i) << TopShift);
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc & TopBit) ? T((crc << 1) ^ Poly) : T(crc << 1);
+        }
+        t.data[0][i] = crc;
+    }
+    for (unsigned i = 0; i < 256; i++)
+    {
+        for (unsigned s = 1; s < SlicedTable<T>::NumSlices; s++)
+        {
+            const T prev = t.data[s - 1][i];
+            t.data[s][i] = T((prev << 8) ^ t.data[0][prev >> TopShift]);
+        }
+    }
+    return t;
+}
+
+template <typename T, T ReflectedPoly>
+struct ReflectedTableHolder
+{
+    static constexpr SlicedTable<T> Table = makeReflectedTable<T, ReflectedPoly>();
+};
+
+template <typename T, T ReflectedPoly>
+constexpr SlicedTable<T> ReflectedTableHolder<T, ReflectedPoly>::Table;
+
+template <typename T, T Poly>
+struct NormalTableHolder
+{
+    static constexpr SlicedTable<T> Table = makeNormalTable<T, Poly>();
+};
+
+template <typename T, T Poly>
+constexpr SlicedTable<T> NormalTableHolder<T, Poly>::Table;
+
+} // namespace impl_
+
+/**
+ * CRC-16-CCITT, polynomial 0x1021, MSB first, no output xor.
+ * Initial value: 0 for CRC-16/XMODEM (default), 0xFFFF for CRC-16/CCITT-FALSE.
+ */
+class CRC16CCITT
+{
+    static constexpr std::uint16_t Poly = 0x1021U;
+
+    std::uint16_t crc_;
+
+public:
+    explicit CRC16CCITT(std::uint16_t initial_value = 0) : crc_(initial_value) { }
+
+    void add(std::uint8_t byte)
+    {
+#if OS_CRC_USE_LOOKUP_TABLES
+        const auto& t = impl_::NormalTableHolder<std::uint16_t, Poly>::Table.data;
+        crc_ = std::uint16_t((crc_ << 8) ^ t[0][std::uint8_t(crc_ >> 8) ^ byte]);
+#else
+        crc_ = std::uint16_t(crc_ ^ (std::uint16_t(byte) << 8));
+        for (int i = 0; i < 8; i++)
+        {
+            crc_ = (crc_ & 0x8000U) ? std::uint16_t((crc_ << 1) ^ Poly) : std::uint16_t(crc_ << 1);
+        }
+#endif
+    }
+
+    void add(const void* data, unsigned len)
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        assert(bytes != nullptr);
+#if OS_CRC_USE_LOOKUP_TABLES
+        const auto& t = impl_::NormalTableHolder<std::uint16_t, Poly>::Table.data;
+        while (len >= 4)
+        {
+            crc_ = std::uint16_t(t[3][std::uint8_t(crc_ >> 8) ^ bytes[0]] ^
+                                 t[2][std::uint8_t(crc_)      ^ bytes[1]] ^
+                                 t[1][bytes[2]] ^
+                                 t[0][bytes[3]]);
+            bytes += 4;
+            len -= 4;
+        }
+#endif
+        while (len --> 0)
+        {
+            add(*bytes++);
+        }
+    }
+
+    std::uint16_t get() const { return crc_; }
+};
+
+/**
+ * CRC-32 with reflected polynomial 0xEDB88320, as used by the configuration storage.
+ * Initial value: defaults to 0, can be set in order to continue a previously started computation
+ * Output xor: none
+ */
+class CRC32
+{
+    static constexpr std::uint32_t ReflectedPoly = 0xEDB88320U;
+
+    std::uint32_t crc_;
+
+public:
+    explicit CRC32(std::uint32_t initial_value = 0) : crc_(initial_value) { }
+
+    void add(std::uint8_t byte)
+    {
+#if OS_CRC_USE_LOOKUP_TABLES
+        const auto& t = impl_::ReflectedTableHolder<std::uint32_t, ReflectedPoly>::Table.data;
+        crc_ = (crc_ >> 8) ^ t[0][(crc_ ^ byte) & 0xFFU];
+#else
+        crc_ ^= std::uint32_t(byte);
+        for (int i = 0; i < 8; i++)
+        {
+            crc_ = (crc_ >> 1) ^ (ReflectedPoly & -(crc_ & 1U));
+        }
+#endif
+    }
+
+    void add(const void* data, unsigned len)
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        assert(bytes != nullptr);
+#if OS_CRC_USE_LOOKUP_TABLES
+        const auto& t = impl_::ReflectedTableHolder<std::uint32_t, ReflectedPoly>::Table.data;
+        while (len >= 4)
+        {
+            std::uint32_t word = 0;
+            std::memcpy(&word, bytes, 4);                       // Little endian; compiles into a single load
+            const std::uint32_t x = crc_ ^ word;
+            crc_ = t[3][x & 0xFFU] ^ t[2][(x >> 8) & 0xFFU] ^ t[1][(x >> 16) & 0xFFU] ^ t[0][x >> 24];
+            bytes += 4;
+            len -= 4;
+        }
+#endif
+        while (len --> 0)
+        {
+            add(*bytes++);
+        }
+    }
+
+    std::uint32_t get() const { return crc_; }
+};
+
+/**
+ * CRC-64-WE
+ * Description: http://reveng.sourceforge.net/crc-catalogue/17plus.htm#crc.cat-bits.64
+ * Initial value: 0xFFFFFFFFFFFFFFFF
+ * Poly: 0x42F0E1EBA9EA3693
+ * Reverse: no
+ * Output xor: 0xFFFFFFFFFFFFFFFF
+ * Check: 0x62EC59E3F1A4F00A
+ */
+class CRC64WE
+{
+    static constexpr std::uint64_t Poly = 0x42F0E1EBA9EA3693ULL;
+
+    std::uint64_t crc_;
+
+public:
+    CRC64WE() : crc_(0xFFFFFFFFFFFFFFFFULL) { }
+
+    void add(std::uint8_t byte)
+    {
+#if OS_CRC_USE_LOOKUP_TABLES
+        const auto& t = impl_::NormalTableHolder<std::uint64_t, Poly>::Table.data;
+        crc_ = (crc_ << 8) ^ t[0][std::uint8_t(crc_ >> 56) ^ byte];
+#else
+        crc_ ^= std::uint64_t(byte) << 56;
+        for (int i = 0; i < 8; i++)
+        {
+            crc_ = (crc_ & (std::uint64_t(1) << 63)) ? (crc_ << 1) ^ Poly : crc_ << 1;
+        }
+#endif
+    }
+
+    void add(const void* data, unsigned len)
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        assert(bytes != nullptr);
+#if OS_CRC_USE_LOOKUP_TABLES
+        const auto& t = impl_::NormalTableHolder<std::uint64_t, Poly>::Table.data;
+        while (len >= 4)
+        {
+            const std::uint32_t hi = std::uint32_t(crc_ >> 32);
+            crc_ = (crc_ << 32) ^
+                   t[3][std::uint8_t(hi >> 24) ^ bytes[0]] ^
+                   t[2][std::uint8_t(hi >> 16) ^ bytes[1]] ^
+                   t[1][std::uint8_t(hi >> 8)  ^ bytes[2]] ^
+                   t[0][std::uint8_t(hi)       ^ bytes[3]];
+            bytes += 4;
+            len -= 4;
+        }
+#endif
+        while (len --> 0)
+        {
+            add(*bytes++);
+        }
+    }
+
+    std::uint64_t get() const { return crc_ ^ 0xFFFFFFFFFFFFFFFFULL; }
+};
+
+}
+}
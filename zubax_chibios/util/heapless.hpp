@@ -20,6 +20,13 @@
 #include <cstdio>
 #include <limits>
 #include <cctype>
+#include <cmath>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <initializer_list>
+#include <utility>
+#include <new>
 
 
 namespace os
@@ -47,7 +54,7 @@ template <
     >
 inline auto intToString(T number)
 {
-    constexpr char Alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    static constexpr char Alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 
     static_assert(Radix >= 1, "Radix must be positive");
     static_assert(Radix <= (sizeof(Alphabet) / sizeof(Alphabet[0])), "Radix is too large");
@@ -71,6 +78,7 @@ inline auto intToString(T number)
             offset_(MaxChars)          // Field initialization is not working in GCC in this context, not sure why.
         {
             storage_[offset_] = '\0';
+            const bool negative = std::is_signed<T>::value && (x < 0);
 
             do
             {
@@ -101,7 +109,7 @@ inline auto intToString(T number)
             }
             while (x != 0);
 
-            if (std::is_signed<T>::value && (x < 0))    // Should be optimized with constexpr if.
+            if (negative)                               // The number is zero by now, so the sign is checked beforehand
             {
                 assert(offset_ > 0);
                 storage_[--offset_] = '-';
@@ -124,6 +132,182 @@ inline auto intToString(T number)
     return Container(number);
 }
 
+/**
+ * Implementation details, do not use directly.
+ */
+namespace impl_
+{
+
+template <typename = void>
+struct PowersOfTenHolder
+{
+    static constexpr int Size = 60;
+    static constexpr double Table[Size] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+        1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+        1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26, 1e27, 1e28, 1e29,
+        1e30, 1e31, 1e32, 1e33, 1e34, 1e35, 1e36, 1e37, 1e38, 1e39,
+        1e40, 1e41, 1e42, 1e43, 1e44, 1e45, 1e46, 1e47, 1e48, 1e49,
+        1e50, 1e51, 1e52, 1e53, 1e54, 1e55, 1e56, 1e57, 1e58, 1e59
+    };
+};
+
+template <typename T>
+constexpr double PowersOfTenHolder<T>::Table[];
+
+/// Enough for any output of formatFloat(), including the snprintf() fallback
+constexpr unsigned FloatBufferSize = 32;
+
+/// Longer precisions can't be handled exactly in double precision arithmetic
+constexpr int MaxFastFloatPrecision = 9;
+
+/**
+ * Formats the value like printf("%.*g", precision, value). The fast path is taken for precision of up to
+ * 9 significant digits and for magnitudes within the range of float, which covers all float values;
+ * snprintf() is used otherwise. The fast path may differ from snprintf() in the last digit when the value
+ * is within one ulp of double from the rounding tie.
+ * @param out   Must be at least FloatBufferSize bytes large. The output is always null terminated.
+ * @return      Length of the output.
+ */
+inline unsigned formatFloat(char* const out, const double value, const int precision)
+{
+    using Powers = PowersOfTenHolder<>;
+
+    const int prec = (precision < 1) ? 1 : precision;       // Same as printf()
+    char* w = out;
+
+    if (std::signbit(value))
+    {
+        *w++ = '-';
+    }
+    const double a = std::fabs(value);
+    if (std::isnan(a) || std::isinf(a))
+    {
+        std::memcpy(w, std::isnan(a) ? "nan" : "inf", 4);
+        return unsigned(w - out) + 3U;
+    }
+    if (a == 0.0)
+    {
+        *w++ = '0';
+        *w = '\0';
+        return unsigned(w - out);
+    }
+
+    /*
+     * Obtaining the decimal exponent and the significant digits; the initial estimate is off by one at most.
+     */
+    std::uint64_t digits = 0;
+    int e10 = 0;
+    bool ok = prec <= MaxFastFloatPrecision;
+    if (ok)
+    {
+        int e2 = 0;
+        (void)std::frexp(a, &e2);
+        e10 = int(std::floor(double(e2 - 1) * 0.30102999566398120));
+
+        const auto upper = std::uint64_t(Powers::Table[prec]);
+        const auto lower = std::uint64_t(Powers::Table[prec - 1]);
+        for (int attempt = 0; ok; attempt++)
+        {
+            const int k = prec - 1 - e10;
+            ok = (k < Powers::Size) && (-k < Powers::Size) && (attempt < 4);
+            if (ok)
+            {
+                const double m = (k >= 0) ? (a * Powers::Table[k]) : (a / Powers::Table[-k]);
+                digits = std::uint64_t(m + 0.5);
+                if ((double(digits) - m) == 0.5)
+                {
+                    // Possibly an exact tie, which is rounded to even, like in printf(); checking if m is exact
+                    const double error = (k >= 0) ? std::fma(a, Powers::Table[k], -m) :
+                                                    std::fma(m, Powers::Table[-k], -a);
+                    if ((error == 0.0) && ((digits & 1U) != 0))
+                    {
+                        digits--;
+                    }
+                }
+                if (digits >= upper)
+                {
+                    e10++;
+                }
+                else if (digits < lower)
+                {
+                    e10--;
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+    }
+    if (!ok)
+    {
+        const int res = std::snprintf(out, FloatBufferSize, "%.*g", precision, value);
+        return (res > 0) ? std::min(unsigned(res), FloatBufferSize - 1U) : 0;
+    }
+
+    char d[MaxFastFloatPrecision];
+    for (int i = prec - 1; i >= 0; i--)
+    {
+        d[i] = char('0' + int(digits % 10U));
+        digits /= 10U;
+    }
+    int num_digits = prec;
+    while ((num_digits > 1) && (d[num_digits - 1] == '0'))  // Trailing zeros are removed, like in printf()
+    {
+        num_digits--;
+    }
+
+    if ((e10 < -4) || (e10 >= prec))
+    {
+        *w++ = d[0];
+        if (num_digits > 1)
+        {
+            *w++ = '.';
+            std::memcpy(w, &d[1], unsigned(num_digits - 1));
+            w += num_digits - 1;
+        }
+        *w++ = 'e';
+        *w++ = (e10 < 0) ? '-' : '+';
+        const unsigned abs_e10 = unsigned((e10 < 0) ? -e10 : e10);
+        if (abs_e10 >= 100)
+        {
+            *w++ = char('0' + (abs_e10 / 100U));
+        }
+        *w++ = char('0' + ((abs_e10 / 10U) % 10U));
+        *w++ = char('0' + (abs_e10 % 10U));
+    }
+    else if (e10 >= 0)
+    {
+        const int num_int_digits = e10 + 1;
+        std::memcpy(w, &d[0], unsigned(num_int_digits));
+        w += num_int_digits;
+        if (num_digits > num_int_digits)
+        {
+            *w++ = '.';
+            std::memcpy(w, &d[num_int_digits], unsigned(num_digits - num_int_digits));
+            w += num_digits - num_int_digits;
+        }
+    }
+    else
+    {
+        *w++ = '0';
+        *w++ = '.';
+        for (int i = 0; i < (-e10 - 1); i++)
+        {
+            *w++ = '0';
+        }
+        std::memcpy(w, &d[0], unsigned(num_digits));
+        w += num_digits;
+    }
+
+    *w = '\0';
+    return unsigned(w - out);
+}
+
+}
+
 /**
  * The default capacity is optimal for most embedded use cases.
  */
@@ -198,15 +382,22 @@ public:
     template <unsigned C>
     void append(const String<C>& s)
     {
-        append(s.c_str());
+        append(s.c_str(), s.size());
     }
 
     void append(const char* p)
     {
-        while ((*p != '\0') && (len_ < Capacity))
-        {
-            buf_[len_++] = *p++;
-        }
+        append(p, unsigned(std::strlen(p)));
+    }
+
+    /**
+     * Appends the specified number of characters at once; the excess is truncated.
+     */
+    void append(const char* p, unsigned len)
+    {
+        const unsigned n = std::min(len, Capacity - len_);
+        std::memcpy(&buf_[len_], p, n);
+        len_ += n;
         buf_[len_] = '\0';
         assert(buf_[Capacity] == '\0');
     }
@@ -224,7 +415,8 @@ public:
     template <typename T>
     typename std::enable_if<std::is_integral<T>::value>::type append(const T& value)
     {
-        append(intToString(value).c_str());
+        const auto s = intToString(value);
+        append(s.c_str(), unsigned(s.length()));
     }
 
     template <typename T>
@@ -233,12 +425,8 @@ public:
         constexpr int Precision = std::numeric_limits<T>::digits10 + 1;
         static_assert(Precision > 1, "Invalid floating point type?");
 
-        char buffer[20];
-
-        using namespace std;
-        (void) snprintf(buffer, sizeof(buffer), "%.*g", Precision, double(value));
-
-        append(static_cast<const char*>(&buffer[0]));
+        char buffer[impl_::FloatBufferSize];
+        append(&buffer[0], impl_::formatFloat(&buffer[0], double(value), Precision));
     }
 
     void push_back(char c) { append(c); }
@@ -429,6 +617,102 @@ inline auto format(const char (&format_string)[FormatLength], Args&&... format_a
     return String<FormatLength>(format_string).format(std::forward<Args>(format_args)...);
 }
 
+/**
+ * Converts a floating point number to string like printf("%.*g"), see impl_::formatFloat().
+ * The default precision is sufficient to represent any value of the argument type.
+ * Usage example:
+ *      floatToString(1.5F).c_str()
+ *      floatToString(x, 3)
+ */
+template <
+    typename T,
+    typename std::enable_if<std::is_floating_point<T>::value>::type...
+    >
+inline auto floatToString(T number, int precision = std::numeric_limits<T>::digits10 + 1)
+{
+    String<impl_::FloatBufferSize - 1U> out;
+    char buffer[impl_::FloatBufferSize];
+    out.append(&buffer[0], impl_::formatFloat(&buffer[0], double(number), precision));
+    return out;
+}
+
+/**
+ * Implementation details of OS_HEAPLESS_FORMAT(), do not use directly.
+ */
+namespace impl_
+{
+
+constexpr unsigned constStrLen(const char* s)
+{
+    unsigned i = 0;
+    while (s[i] != '\0')
+    {
+        i++;
+    }
+    return i;
+}
+
+/// Returns the position of the next {} placeholder, or the length of the string if there are no more
+constexpr unsigned findPlaceholder(const char* s, unsigned pos)
+{
+    while ((s[pos] != '\0') && !((s[pos] == '{') && (s[pos + 1] == '}')))
+    {
+        pos++;
+    }
+    return pos;
+}
+
+constexpr unsigned countPlaceholders(const char* s)
+{
+    unsigned count = 0;
+    for (unsigned pos = findPlaceholder(s, 0); s[pos] != '\0'; pos = findPlaceholder(s, pos + 2U))
+    {
+        count++;
+    }
+    return count;
+}
+
+template <typename FormatHolder, unsigned Pos, unsigned Capacity>
+inline void appendCompiledFormat(String<Capacity>& out)
+{
+    constexpr unsigned Length = constStrLen(FormatHolder::get() + Pos);
+    out.append(FormatHolder::get() + Pos, Length);
+}
+
+template <typename FormatHolder, unsigned Pos, unsigned Capacity, typename T, typename... Args>
+inline void appendCompiledFormat(String<Capacity>& out, const T& head, const Args&... tail)
+{
+    constexpr unsigned Next = findPlaceholder(FormatHolder::get(), Pos);
+    out.append(FormatHolder::get() + Pos, Next - Pos);
+    out.append(head);
+    appendCompiledFormat<FormatHolder, Next + 2U>(out, tail...);
+}
+
+template <unsigned Capacity, typename FormatHolder, typename... Args>
+inline String<Capacity> formatCompiled(FormatHolder, const Args&... args)
+{
+    static_assert(countPlaceholders(FormatHolder::get()) == sizeof...(Args),
+                  "The number of {} placeholders must match the number of arguments");
+    String<Capacity> out;
+    appendCompiledFormat<FormatHolder, 0>(out, args...);
+    return out;
+}
+
+}
+
+/**
+ * Formats a string using a format string that is parsed at compile time, so that only the appends are left for
+ * the run time. Placeholders are written as {}, and their number is checked against the number of arguments.
+ * Arguments can be of any type accepted by String<>::append(); floats are formatted as by floatToString().
+ * The format string must be a string literal. Output capacity is DefaultStringCapacity.
+ * Usage example:
+ *      const auto str = OS_HEAPLESS_FORMAT("The {} answer is {}!", "Great", 42);
+ */
+#define OS_HEAPLESS_FORMAT(format_string, ...)                                                                  \
+    ::os::heapless::impl_::formatCompiled<::os::heapless::DefaultStringCapacity>(                               \
+        [] { struct Holder { static constexpr const char* get() { return format_string; } }; return Holder(); }(), \
+        ##__VA_ARGS__)
+
 /**
  * Like Python's print(), except that it returns the string by value as a heapless instance instead of
  * printing it.
@@ -453,5 +737,528 @@ inline Stream& operator<<(Stream& stream, const String<Capacity>& obj)
     return stream;
 }
 
+/**
+ * Vector with fixed capacity and in-place storage; the interface is similar to that of std::vector<>.
+ * The elements are constructed only when added, so T does not need to be default constructible.
+ * Operations that add elements fail and return false when the vector is full.
+ */
+template <typename T, unsigned Capacity_>
+class StaticVector
+{
+    static_assert(Capacity_ > 0, "Capacity must be positive");
+
+public:
+    static constexpr unsigned Capacity = Capacity_;
+
+    using value_type = T;
+    using size_type = unsigned;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_[Capacity];
+    unsigned len_ = 0;
+
+    T*       ptr(unsigned index)       { return reinterpret_cast<T*>(&storage_[index]); }
+    const T* ptr(unsigned index) const { return reinterpret_cast<const T*>(&storage_[index]); }
+
+public:
+    StaticVector() { }
+
+    StaticVector(std::initializer_list<T> init)
+    {
+        for (auto& x : init)
+        {
+            (void)push_back(x);
+        }
+    }
+
+    StaticVector(const StaticVector& other)
+    {
+        for (auto& x : other)
+        {
+            (void)push_back(x);
+        }
+    }
+
+    StaticVector(StaticVector&& other)
+    {
+        for (auto& x : other)
+        {
+            (void)push_back(std::move(x));
+        }
+        other.clear();
+    }
+
+    ~StaticVector() { clear(); }
+
+    StaticVector& operator=(const StaticVector& other)
+    {
+        if (this != &other)
+        {
+            clear();
+            for (auto& x : other)
+            {
+                (void)push_back(x);
+            }
+        }
+        return *this;
+    }
+
+    StaticVector& operator=(StaticVector&& other)
+    {
+        if (this != &other)
+        {
+            clear();
+            for (auto& x : other)
+            {
+                (void)push_back(std::move(x));
+            }
+            other.clear();
+        }
+        return *this;
+    }
+
+    constexpr unsigned capacity() const { return Capacity; }
+    constexpr unsigned max_size() const { return Capacity; }
+
+    unsigned size() const { return len_; }
+    bool empty()    const { return len_ == 0; }
+    bool full()     const { return len_ >= Capacity; }
+
+    template <typename... Args>
+    bool emplace_back(Args&&... args)
+    {
+        if (full())
+        {
+            return false;
+        }
+        new (ptr(len_)) T(std::forward<Args>(args)...);
+        len_++;
+        return true;
+    }
+
+    bool push_back(const T& x) { return emplace_back(x); }
+    bool push_back(T&& x)      { return emplace_back(std::move(x)); }
+
+    void pop_back()
+    {
+        assert(len_ > 0);
+        if (len_ > 0)
+        {
+            ptr(--len_)->~T();
+        }
+    }
+
+    /**
+     * Inserts the element before the position, shifting the following elements.
+     * @return Pointer to the inserted element, or end() if the vector is full.
+     */
+    template <typename... Args>
+    iterator emplace(const_iterator position, Args&&... args)
+    {
+        const unsigned index = unsigned(position - begin());
+        assert(index <= len_);
+        if (full() || (index > len_))
+        {
+            return end();
+        }
+        if (index == len_)
+        {
+            (void)emplace_back(std::forward<Args>(args)...);
+            return ptr(index);
+        }
+
+        T tmp(std::forward<Args>(args)...);         // The arguments may refer to the elements that will be moved
+        new (ptr(len_)) T(std::move(*ptr(len_ - 1U)));
+        for (unsigned i = len_ - 1U; i > index; i--)
+        {
+            *ptr(i) = std::move(*ptr(i - 1U));
+        }
+        *ptr(index) = std::move(tmp);
+        len_++;
+        return ptr(index);
+    }
+
+    iterator insert(const_iterator position, const T& x) { return emplace(position, x); }
+    iterator insert(const_iterator position, T&& x)      { return emplace(position, std::move(x)); }
+
+    /**
+     * @return Pointer to the element that follows the erased one.
+     */
+    iterator erase(const_iterator position)
+    {
+        const unsigned index = unsigned(position - begin());
+        assert(index < len_);
+        if (index >= len_)
+        {
+            return end();
+        }
+        for (unsigned i = index; (i + 1U) < len_; i++)
+        {
+            *ptr(i) = std::move(*ptr(i + 1U));
+        }
+        pop_back();
+        return ptr(index);
+    }
+
+    void clear()
+    {
+        while (len_ > 0)
+        {
+            pop_back();
+        }
+    }
+
+    T& operator[](unsigned index)
+    {
+        assert(index < len_);
+        return *ptr(index);
+    }
+    const T& operator[](unsigned index) const { return const_cast<StaticVector*>(this)->operator[](index); }
+
+    T&       front()       { return operator[](0); }
+    const T& front() const { return operator[](0); }
+
+    T&       back()       { return operator[](len_ - 1U); }
+    const T& back() const { return operator[](len_ - 1U); }
+
+    T*       data()       { return ptr(0); }
+    const T* data() const { return ptr(0); }
+
+    iterator begin() { return ptr(0); }
+    iterator end()   { return ptr(len_); }
+
+    const_iterator begin() const { return ptr(0); }
+    const_iterator end()   const { return ptr(len_); }
+};
+
+/**
+ * Implementation details, do not use directly.
+ */
+namespace impl_
+{
+
+template <typename T>
+using RawStorage = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+}
+
+/**
+ * Wait-free single-producer single-consumer queue.
+ * The producer and the consumer can be an ISR and a thread, or two threads, without any locking.
+ * If there are multiple producers, use @ref MPSCRingBuffer instead.
+ * @tparam Capacity must be a power of two.
+ */
+template <typename T, unsigned Capacity_>
+class RingBuffer
+{
+    static_assert((Capacity_ > 0) && ((Capacity_ & (Capacity_ - 1U)) == 0), "Capacity must be a power of two");
+
+public:
+    static constexpr unsigned Capacity = Capacity_;
+
+private:
+    impl_::RawStorage<T> storage_[Capacity];
+    std::atomic<unsigned> head_{0};             ///< Free running counter of popped elements, owned by the consumer
+    std::atomic<unsigned> tail_{0};             ///< Free running counter of pushed elements, owned by the producer
+
+    T* ptr(unsigned counter) { return reinterpret_cast<T*>(&storage_[counter & (Capacity - 1U)]); }
+
+public:
+    RingBuffer() { }
+    ~RingBuffer() { clear(); }
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    /**
+     * Producer side.
+     * @return False if the queue is full.
+     */
+    template <typename... Args>
+    bool emplace(Args&&... args)
+    {
+        const unsigned tail = tail_.load(std::memory_order_relaxed);
+        if ((tail - head_.load(std::memory_order_acquire)) >= Capacity)
+        {
+            return false;
+        }
+        new (ptr(tail)) T(std::forward<Args>(args)...);
+        tail_.store(tail + 1U, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T& x) { return emplace(x); }
+    bool push(T&& x)      { return emplace(std::move(x)); }
+
+    /**
+     * Consumer side.
+     * @return False if the queue is empty.
+     */
+    bool pop(T& out)
+    {
+        const unsigned head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        T* const p = ptr(head);
+        out = std::move(*p);
+        p->~T();
+        head_.store(head + 1U, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer side. Not safe to invoke while the producer is running.
+     */
+    void clear()
+    {
+        unsigned head = head_.load(std::memory_order_relaxed);
+        while (head != tail_.load(std::memory_order_acquire))
+        {
+            ptr(head)->~T();
+            head_.store(++head, std::memory_order_release);
+        }
+    }
+
+    /**
+     * The result may be outdated by the time the function returns, unless invoked from the producer or the consumer.
+     */
+    unsigned size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    constexpr unsigned capacity() const { return Capacity; }
+};
+
+/**
+ * Lock-free multiple-producer single-consumer queue; multiple consumers are also supported.
+ * Every slot carries a sequence number that tells whether it is free or holds an element for the current lap,
+ * so that producers only compete for the tail counter. If a producer is preempted after claiming a slot,
+ * the consumer will not see the following elements until that producer resumes; other producers are not affected.
+ * @tparam Capacity must be a power of two.
+ */
+template <typename T, unsigned Capacity_>
+class MPSCRingBuffer
+{
+    static_assert((Capacity_ > 1) && ((Capacity_ & (Capacity_ - 1U)) == 0), "Capacity must be a power of two");
+
+public:
+    static constexpr unsigned Capacity = Capacity_;
+
+private:
+    struct Slot
+    {
+        std::atomic<unsigned> sequence;
+        impl_::RawStorage<T> storage;
+
+        T* ptr() { return reinterpret_cast<T*>(&storage); }
+    };
+
+    Slot slots_[Capacity];
+    std::atomic<unsigned> head_{0};
+    std::atomic<unsigned> tail_{0};
+
+public:
+    MPSCRingBuffer()
+    {
+        for (unsigned i = 0; i < Capacity; i++)
+        {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~MPSCRingBuffer()
+    {
+        for (unsigned head = head_.load(); head != tail_.load(); head++)
+        {
+            slots_[head & (Capacity - 1U)].ptr()->~T();
+        }
+    }
+
+    MPSCRingBuffer(const MPSCRingBuffer&) = delete;
+    MPSCRingBuffer& operator=(const MPSCRingBuffer&) = delete;
+
+    /**
+     * @return False if the queue is full.
+     */
+    template <typename... Args>
+    bool emplace(Args&&... args)
+    {
+        unsigned tail = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots_[tail & (Capacity - 1U)];
+            const int diff = int(slot.sequence.load(std::memory_order_acquire) - tail);
+            if (diff == 0)
+            {
+                if (tail_.compare_exchange_weak(tail, tail + 1U, std::memory_order_relaxed))
+                {
+                    new (slot.ptr()) T(std::forward<Args>(args)...);
+                    slot.sequence.store(tail + 1U, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;                                   // Full
+            }
+            else
+            {
+                tail = tail_.load(std::memory_order_relaxed);   // Another producer got there first
+            }
+        }
+    }
+
+    bool push(const T& x) { return emplace(x); }
+    bool push(T&& x)      { return emplace(std::move(x)); }
+
+    /**
+     * @return False if the queue is empty.
+     */
+    bool pop(T& out)
+    {
+        unsigned head = head_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots_[head & (Capacity - 1U)];
+            const int diff = int(slot.sequence.load(std::memory_order_acquire) - (head + 1U));
+            if (diff == 0)
+            {
+                if (head_.compare_exchange_weak(head, head + 1U, std::memory_order_relaxed))
+                {
+                    out = std::move(*slot.ptr());
+                    slot.ptr()->~T();
+                    slot.sequence.store(head + Capacity, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;                                   // Empty
+            }
+            else
+            {
+                head = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Approximate; exact only when no producers or consumers are running.
+     */
+    unsigned size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    constexpr unsigned capacity() const { return Capacity; }
+};
+
+/**
+ * Associative container with fixed capacity, implemented as a sorted array of key-value pairs.
+ * Lookups are O(log N), insertions and deletions are O(N); for small N this is faster than a tree,
+ * and the memory is contiguous.
+ */
+template <typename Key, typename Value, unsigned Capacity_, typename Compare = std::less<Key>>
+class FlatMap
+{
+public:
+    static constexpr unsigned Capacity = Capacity_;
+
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = std::pair<Key, Value>;
+    using iterator = value_type*;
+    using const_iterator = const value_type*;
+
+private:
+    StaticVector<value_type, Capacity> items_;
+    Compare compare_;
+
+    iterator lowerBound(const Key& key)
+    {
+        return std::lower_bound(items_.begin(), items_.end(), key,
+                                [this](const value_type& item, const Key& k) { return compare_(item.first, k); });
+    }
+
+    bool matches(const_iterator it, const Key& key) const
+    {
+        return (it != items_.end()) && !compare_(key, it->first);
+    }
+
+public:
+    FlatMap() { }
+
+    explicit FlatMap(const Compare& compare) : compare_(compare) { }
+
+    /**
+     * @return Pointer to the value, or null if there is no such key.
+     */
+    Value* find(const Key& key)
+    {
+        const auto it = lowerBound(key);
+        return matches(it, key) ? &it->second : nullptr;
+    }
+    const Value* find(const Key& key) const { return const_cast<FlatMap*>(this)->find(key); }
+
+    bool contains(const Key& key) const { return find(key) != nullptr; }
+
+    /**
+     * Adds the entry or replaces the value of the existing one.
+     * @return Pointer to the stored value, or null if the map is full.
+     */
+    template <typename V>
+    Value* insert(const Key& key, V&& value)
+    {
+        const auto it = lowerBound(key);
+        if (matches(it, key))
+        {
+            it->second = std::forward<V>(value);
+            return &it->second;
+        }
+        const auto res = items_.emplace(it, key, std::forward<V>(value));
+        return (res == items_.end()) ? nullptr : &res->second;
+    }
+
+    /**
+     * @return True if the entry existed.
+     */
+    bool erase(const Key& key)
+    {
+        const auto it = lowerBound(key);
+        if (matches(it, key))
+        {
+            (void)items_.erase(it);
+            return true;
+        }
+        return false;
+    }
+
+    void clear() { items_.clear(); }
+
+    unsigned size() const { return items_.size(); }
+    bool empty()    const { return items_.empty(); }
+    bool full()     const { return items_.full(); }
+
+    constexpr unsigned capacity() const { return Capacity; }
+
+    /**
+     * Iteration is done in the order of increasing keys. The keys must not be modified.
+     */
+    iterator begin() { return items_.begin(); }
+    iterator end()   { return items_.end(); }
+
+    const_iterator begin() const { return items_.begin(); }
+    const_iterator end()   const { return items_.end(); }
+};
+
 }
 }
@@ -6,6 +6,9 @@
 
 /*
  * Simple command shell designed as a more versatile replacement to the ChibiOS embedded shell.
+ * Input is read in bulk, whatever has been received so far is fetched from the driver queue in one call,
+ * so that pasted or scripted input is not lost. Up and down arrow keys recall the command history.
+ * Command handlers are kept sorted by name, lookup is a binary search.
  */
 
 #pragma once
@@ -23,6 +26,7 @@
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/util/heapless.hpp>
 #include <functional>
+#include <algorithm>
 
 
 namespace os
@@ -62,23 +66,33 @@ class BaseChannelWrapper
             }
         } locker(channel_);
 
+        // Newlines are expanded, the rest is written in runs, one channel call per run
         std::size_t ret = 0;
 
-        for (const char* pc = str; *pc != '\0'; pc++)
+        while (*str != '\0')
         {
-            if (*pc == '\n')
+            const std::size_t run_len = std::strcspn(str, "\n");
+            if (run_len > 0)
             {
-                if (MSG_OK != chnPutTimeout(channel_, '\r', MS2ST(character_timeout_msec)))
+                const std::size_t written = write(str, run_len, character_timeout_msec);
+                ret += written;
+                if (written != run_len)
                 {
                     break;
                 }
-                ret++;
+                str += run_len;
             }
-            if (MSG_OK != chnPutTimeout(channel_, *pc, MS2ST(character_timeout_msec)))
+
+            if (*str == '\n')
             {
-                break;
+                const std::size_t written = write("\r\n", 2, character_timeout_msec);
+                ret += written;
+                if (written != 2)
+                {
+                    break;
+                }
+                str++;
             }
-            ret++;
         }
 
         return ret;
@@ -135,6 +149,36 @@ public:
         return chnPutTimeout(channel_, chr, MS2ST(timeout_msec));
     }
 
+    /**
+     * Waits for the first byte up to the specified timeout, then fetches the bytes that have been received
+     * meanwhile without waiting.
+     * @return Number of bytes read, zero on timeout.
+     */
+    std::size_t read(std::uint8_t* out, std::size_t size, unsigned timeout_msec)
+    {
+        if (size == 0)
+        {
+            return 0;
+        }
+        const int first = getChar(timeout_msec);
+        if (first < 0)
+        {
+            return 0;
+        }
+        out[0] = std::uint8_t(first);
+        return 1U + chnReadTimeout(channel_, out + 1, size - 1U, TIME_IMMEDIATE);
+    }
+
+    /**
+     * Writes the data as is, without newline expansion.
+     * @return Number of bytes written.
+     */
+    std::size_t write(const void* data, std::size_t size,
+                      unsigned timeout_msec = DefaultWriteCharacterTimeoutMSec)
+    {
+        return chnWriteTimeout(channel_, static_cast<const std::uint8_t*>(data), size, MS2ST(timeout_msec));
+    }
+
     // More methods may be added in the future
 };
 
@@ -157,6 +201,23 @@ public:
     virtual void execute(BaseChannelWrapper& ios, int argc, char** argv) = 0;
 };
 
+/**
+ * Operating mode of the shell.
+ */
+enum class Mode
+{
+    Normal,     //!< Normal mode, regular shell behavior
+    Silent,     //!< No echo unless the command is recognized; no prompt. Useful for bootloaders etc.
+    Batch       //!< No echo, no prompt; output of every command is terminated with BatchResponseTerminator
+};
+
+/**
+ * In the batch mode, the host may send the commands back to back, without waiting for the responses,
+ * and then split the output into responses using this character. Both LF and CR terminate the command line.
+ * The batch mode is entered and left using the built-in command "batch [on|off]".
+ */
+static constexpr char BatchResponseTerminator = '\x04';      // ASCII EOT
+
 /**
  * Implementation details, do not use directly.
  */
@@ -190,52 +251,76 @@ public:
     }
 };
 
+template <typename Container>
 class HelpCommandHandler : public ICommandHandler
 {
-    const ICommandHandler* const* const command_handlers_;
-    const unsigned max_handlers_;
+    const Container& command_handlers_;
 
     const char* getName() const override { return "help"; }
 
     void execute(BaseChannelWrapper& ios, int, char**) override
     {
         ios.print("Available commands:\n");
-        auto x = command_handlers_;
-        for (unsigned i = 0; i < max_handlers_; i++)
+        for (auto x : command_handlers_)
         {
-            if (*x != nullptr)
-            {
-                ios.print("\t%s\n", (*x)->getName());
-            }
-            x++;
+            ios.print("\t%s\n", x->getName());
         }
     }
 
 public:
-    HelpCommandHandler(const ICommandHandler* const* handlers, unsigned max_handlers) :
-        command_handlers_(handlers),
-        max_handlers_(max_handlers)
+    HelpCommandHandler(const Container& handlers) :
+        command_handlers_(handlers)
     { }
 };
 
-}
-
-/**
- * Operating mode of the shell.
- */
-enum class Mode
+class BatchCommandHandler : public ICommandHandler
 {
-    Normal,     //!< Normal mode, regular shell behavior
-    Silent      //!< No echo unless the command is recognized; no prompt. Useful for bootloaders etc.
+    Mode& mode_;
+    Mode mode_before_batch_ = Mode::Normal;
+
+    const char* getName() const override { return "batch"; }
+
+    void execute(BaseChannelWrapper& ios, int argc, char** argv) override
+    {
+        const bool enable = (argc < 2) || (std::strcmp(argv[1], "on") == 0);
+        if (!enable && (std::strcmp(argv[1], "off") != 0))
+        {
+            ios.print("Usage: batch [on|off]\n");
+            return;
+        }
+        if (enable && (mode_ != Mode::Batch))
+        {
+            mode_before_batch_ = mode_;
+            mode_ = Mode::Batch;
+        }
+        if (!enable && (mode_ == Mode::Batch))
+        {
+            mode_ = mode_before_batch_;
+        }
+    }
+
+public:
+    BatchCommandHandler(Mode& mode) :
+        mode_(mode)
+    { }
 };
 
+inline bool compareHandlerNames(const ICommandHandler* a, const ICommandHandler* b)
+{
+    return std::strcmp(a->getName(), b->getName()) < 0;
+}
+
+}
+
 /**
  * Shell command processor class.
+ * @tparam HistoryDepth     Number of recent command lines that can be recalled with the arrow keys; 0 disables.
  */
 template <unsigned MaxCommandHandlers = 10,
           unsigned MaxLineLength = 200,
           unsigned MaxCommandArguments = 15,
-          unsigned MaxPromptLength = 40>
+          unsigned MaxPromptLength = 40,
+          unsigned HistoryDepth = 4>
 class Shell
 {
 public:
@@ -244,23 +329,132 @@ public:
     using PromptRenderer = std::function<Prompt ()>;
 
 private:
+    static constexpr unsigned InputChunkSize = 64;
+    static constexpr unsigned EchoBufferSize = 64;
+
+    // The help handler is included in MaxCommandHandlers, the batch handler is not
+    using CommandHandlerTable = heapless::StaticVector<ICommandHandler*, MaxCommandHandlers + 1U>;
+
+    enum class EscapeState : std::uint8_t
+    {
+        None,
+        Escape,
+        ControlSequence
+    };
+
     const PromptRenderer prompt_renderer_;
 
-    ICommandHandler* command_handlers_[MaxCommandHandlers] = {};
+    CommandHandlerTable command_handlers_;      // Sorted by name
 
     char line_buffer_[MaxLineLength + 1] = {};
     unsigned pos_ = 0;
 
+    char history_[(HistoryDepth > 0) ? HistoryDepth : 1][MaxLineLength + 1] = {};   // Newest first
+    unsigned history_len_ = 0;
+    int history_pos_ = -1;                      // Entry being edited, negative if it is a new line
+
+    EscapeState escape_state_ = EscapeState::None;
+
+    char echo_buffer_[EchoBufferSize] = {};
+    unsigned echo_len_ = 0;
+
     bool need_prompt_ = true;
     Mode mode_;
 
-    impl_::HelpCommandHandler help_command_handler_;
+    impl_::HelpCommandHandler<CommandHandlerTable> help_command_handler_;
+    impl_::BatchCommandHandler batch_command_handler_;
 
-    void echo(BaseChannelWrapper& ios, char chr) const
+    /**
+     * The echo is accumulated and written in bulk, see @ref flushEcho().
+     */
+    void echo(BaseChannelWrapper& ios, char chr)
     {
-        if (mode_ != Mode::Silent)
+        if (mode_ == Mode::Normal)
+        {
+            if (echo_len_ >= EchoBufferSize)
+            {
+                flushEcho(ios);
+            }
+            echo_buffer_[echo_len_++] = chr;
+        }
+    }
+
+    void echo(BaseChannelWrapper& ios, const char* str)
+    {
+        while (*str != '\0')
+        {
+            echo(ios, *str++);
+        }
+    }
+
+    void flushEcho(BaseChannelWrapper& ios)
+    {
+        if (echo_len_ > 0)
+        {
+            (void)ios.write(echo_buffer_, echo_len_);
+            echo_len_ = 0;
+        }
+    }
+
+    void showPromptIfNeeded(BaseChannelWrapper& ios)
+    {
+        if (need_prompt_)
         {
-            (void)ios.putChar(chr);
+            need_prompt_ = false;
+            if (mode_ == Mode::Normal)
+            {
+                flushEcho(ios);
+                (void)ios.print(prompt_renderer_().c_str());
+            }
+        }
+    }
+
+    /**
+     * Replaces the line being edited, also on the terminal.
+     */
+    void replaceLine(BaseChannelWrapper& ios, const char* text)
+    {
+        for (; pos_ > 0; pos_--)
+        {
+            echo(ios, 8);
+        }
+        echo(ios, "\x1b[K");                    // Erase to the end of the line
+
+        pos_ = unsigned(std::min<std::size_t>(std::strlen(text), MaxLineLength));
+        std::memcpy(line_buffer_, text, pos_);
+        for (unsigned i = 0; i < pos_; i++)
+        {
+            echo(ios, line_buffer_[i]);
+        }
+    }
+
+    void addToHistory(const char* line)
+    {
+        if ((HistoryDepth == 0) || (mode_ != Mode::Normal))
+        {
+            return;
+        }
+        if ((history_len_ > 0) && (std::strcmp(history_[0], line) == 0))
+        {
+            return;                             // Repeated commands are not stored
+        }
+        history_len_ = std::min(history_len_ + 1U, HistoryDepth);
+        std::memmove(history_[1], history_[0], sizeof(history_[0]) * (history_len_ - 1U));
+        std::strncpy(history_[0], line, MaxLineLength);
+        history_[0][MaxLineLength] = '\0';
+    }
+
+    void recallHistory(BaseChannelWrapper& ios, bool older)
+    {
+        if (older && ((history_pos_ + 1) < int(history_len_)))
+        {
+            history_pos_++;
+            replaceLine(ios, history_[history_pos_]);
+        }
+        if (!older && (history_pos_ >= 0))
+        {
+            history_pos_--;
+            replaceLine(ios, (history_pos_ >= 0) ? history_[history_pos_] : "");
         }
     }
 
@@ -293,18 +487,20 @@ private:
         }
 
         // Command lookup, exit on success
-        for (auto x : command_handlers_)
+        const auto it = std::lower_bound(command_handlers_.begin(), command_handlers_.end(), argv[0],
+                                         [](const ICommandHandler* x, const char* name)
+                                         {
+                                             return std::strcmp(x->getName(), name) < 0;
+                                         });
+        if ((it != command_handlers_.end()) && (std::strcmp((*it)->getName(), argv[0]) == 0))
         {
-            if ((x != nullptr) && (std::strcmp(x->getName(), argv[0]) == 0))
+            // In silent mode we only echo if the command is recognized
+            if (mode_ == Mode::Silent)
             {
-                // In silent mode we only echo if the command is recognized
-                if (mode_ == Mode::Silent)
-                {
-                    (void)ios.print("%s\n", line);
-                }
-                x->execute(ios, argc, argv);
-                return;
+                (void)ios.print("%s\n", line);
             }
+            (*it)->execute(ios, argc, argv);
+            return;
         }
 
         // No such command
@@ -314,32 +510,113 @@ private:
         }
     }
 
+    void processCharacter(BaseChannelWrapper& ios, std::uint8_t chr)
+    {
+        showPromptIfNeeded(ios);
+
+        // Escape sequences; only the cursor up and down keys are recognized, the rest is ignored
+        if (escape_state_ == EscapeState::Escape)
+        {
+            escape_state_ = (chr == '[') ? EscapeState::ControlSequence : EscapeState::None;
+            return;
+        }
+        if (escape_state_ == EscapeState::ControlSequence)
+        {
+            if ((chr >= 0x20) && (chr <= 0x3F))
+            {
+                return;                                 // Parameter bytes, the sequence continues
+            }
+            escape_state_ = EscapeState::None;
+            if ((chr == 'A') || (chr == 'B'))
+            {
+                recallHistory(ios, chr == 'A');
+            }
+            return;
+        }
+
+        if ((chr == '\r') || ((chr == '\n') && (mode_ == Mode::Batch)))        // End of command
+        {
+            echo(ios, '\r');
+            echo(ios, '\n');
+            flushEcho(ios);
+            line_buffer_[pos_] = '\0';
+            if (pos_ > 0)
+            {
+                addToHistory(line_buffer_);
+                const bool was_batch = mode_ == Mode::Batch;
+                processCommand(ios, line_buffer_);
+                if (was_batch || (mode_ == Mode::Batch))
+                {
+                    (void)ios.putChar(BatchResponseTerminator);
+                }
+            }
+            reset();
+        }
+        else if (chr == 8 || chr == 127)            // DEL or BS (backspace)
+        {
+            if (pos_ > 0)
+            {
+                echo(ios, 8);       // Erase last char and move caret back
+                echo(ios, ' ');     // Put space on top of the erased character
+                echo(ios, 8);       // Move the caret back again
+                pos_ -= 1;
+            }
+        }
+        else if (chr == 27)                         // ESC
+        {
+            escape_state_ = EscapeState::Escape;
+        }
+        else if (chr >= 32)                         // Normal printable ASCII character and everything above ASCII
+        {
+            if (pos_ < MaxLineLength)
+            {
+                echo(ios, char(chr));
+                line_buffer_[pos_++] = char(chr);
+            }
+        }
+        else                                        // This also includes Ctrl+C, Ctrl+D, and LF
+        {
+            ;                                       // Invalid byte - ignore
+        }
+
+        // Invariants
+        assert(pos_ <= MaxLineLength);
+    }
+
 public:
     Shell(PromptRenderer prompt_renderer = []() { return "> "; },
           Mode mode = Mode::Normal) :
         prompt_renderer_(prompt_renderer),
         mode_(mode),
-        help_command_handler_(command_handlers_, MaxCommandHandlers)
+        help_command_handler_(command_handlers_),
+        batch_command_handler_(mode_)
     {
         addCommandHandler(&help_command_handler_);
+        addCommandHandler(&batch_command_handler_);
     }
 
     Mode getMode()    const { return mode_; }
     void setMode(Mode mode) { mode_ = mode; }
 
+    /**
+     * If there are several handlers with the same name, the one that was added first will be used.
+     * @return False if the handler table is full.
+     */
     bool addCommandHandler(ICommandHandler* chr)
     {
-        for (auto& x : command_handlers_)
+        assert(chr != nullptr);
+        if ((chr == nullptr) || command_handlers_.full())
         {
-            if (x == nullptr)
-            {
-                x = chr;
-                return true;
-            }
+            return false;
         }
-        return false;
+        const auto position = std::upper_bound(command_handlers_.begin(), command_handlers_.end(), chr,
+                                               impl_::compareHandlerNames);
+        return command_handlers_.insert(position, chr) != command_handlers_.end();
     }
 
+    /**
+     * Everything that has been received since the previous call is fetched in bulk and processed at once.
+     */
     void runFor(BaseChannelWrapper& ios, unsigned run_duration_msec)
     {
         const auto run_duration_st = MS2ST(run_duration_msec);
@@ -347,61 +624,21 @@ public:
 
         do
         {
-            if (need_prompt_)
-            {
-                need_prompt_ = false;
-                if (mode_ != Mode::Silent)
-                {
-                    (void)ios.print(prompt_renderer_().c_str());
-                }
-            }
+            showPromptIfNeeded(ios);
 
-            // Reading new character
+            // Reading new characters
             const auto elapsed = chVTTimeElapsedSinceX(started_at_st);
             const auto read_timeout_st = (run_duration_st > elapsed) ? (run_duration_st - elapsed) : 1;
-            const auto chr = ios.getChar(std::max(1U, unsigned(ST2MS(read_timeout_st))));
-            if (chr < 0)
-            {
-                continue;
-            }
+            std::uint8_t input[InputChunkSize];
+            const std::size_t num_read = ios.read(input, sizeof(input),
+                                                  std::max(1U, unsigned(ST2MS(read_timeout_st))));
 
-            // Processing the character
-            if (chr == '\r')                            // End of command
+            // Processing the characters
+            for (std::size_t i = 0; i < num_read; i++)
             {
-                echo(ios, '\r');
-                echo(ios, '\n');
-                line_buffer_[pos_] = '\0';
-                if (pos_ > 0)
-                {
-                    processCommand(ios, line_buffer_);
-                }
-                reset();
+                processCharacter(ios, input[i]);
             }
-            else if (chr == 8 || chr == 127)            // DEL or BS (backspace)
-            {
-                if (pos_ > 0)
-                {
-                    echo(ios, 8);       // Erase last char and move caret back
-                    echo(ios, ' ');     // Put space on top of the erased character
-                    echo(ios, 8);       // Move the caret back again
-                    pos_ -= 1;
-                }
-            }
-            else if (chr >= 32)                         // Normal printable ASCII character and everything above ASCII
-            {
-                if (pos_ < MaxLineLength)
-                {
-                    echo(ios, char(chr));
-                    line_buffer_[pos_++] = char(chr);
-                }
-            }
-            else                                        // This also includes Ctrl+C, Ctrl+D, and LF
-            {
-                ;                                       // Invalid byte - ignore
-            }
-
-            // Invariants
-            assert(pos_ <= MaxLineLength);
+            flushEcho(ios);
         }
         while (chVTTimeElapsedSinceX(started_at_st) <= run_duration_st);
     }
@@ -411,6 +648,8 @@ public:
         assert(pos_ <= MaxLineLength);
         pos_ = 0;
         need_prompt_ = true;
+        history_pos_ = -1;
+        escape_state_ = EscapeState::None;
     }
 };
 
@@ -6,6 +6,8 @@
 
 /*
  * Platform-independent I2C master implemented in software.
+ * Master blocks the calling thread for the whole transaction; AsyncMaster runs the bus from a timer ISR instead,
+ * see below.
  * Sources:
  *      https://en.wikipedia.org/wiki/I%C2%B2C
  *      http://www.robot-electronics.co.uk/i2c-tutorial
@@ -16,12 +18,51 @@
 #include <zubax_chibios/os.hpp>
 #include <unistd.h>
 #include <cstdint>
+#include <cerrno>
 #include <array>
 
 namespace os
 {
 namespace software_i2c
 {
+namespace impl_
+{
+
+class I2CPin
+{
+    GPIO_TypeDef* const port_;
+    const unsigned pin_;
+
+public:
+    I2CPin(GPIO_TypeDef* gpio_port, unsigned gpio_pin) :
+        port_(gpio_port), pin_(gpio_pin)
+    {
+    }
+
+    ~I2CPin()
+    {
+        set();       // Returning to default state
+    }
+
+    void set()       { palSetPad(port_, pin_); }
+    void clear()     { palClearPad(port_, pin_); }
+    bool get() const { return palReadPad(port_, pin_); }
+
+    void set(bool level)
+    {
+        if (level)
+        {
+            set();
+        }
+        else
+        {
+            clear();
+        }
+    }
+};
+
+}
+
 /**
  * Generic bit-banging I2C master on bare GPIO.
  * The pins must be configured in open-drain mode, at high level by default.
@@ -48,26 +89,7 @@ private:
     static constexpr unsigned DefaultClockStretchTimeoutUSec = 10000;
     static constexpr unsigned DefaultCycleDelayUSec = 10;
 
-    class I2CPin
-    {
-        GPIO_TypeDef* const port_;
-        const unsigned pin_;
-
-    public:
-        I2CPin(GPIO_TypeDef* gpio_port, unsigned gpio_pin) :
-            port_(gpio_port), pin_(gpio_pin)
-        {
-        }
-
-        ~I2CPin()
-        {
-            set();       // Returning to default state
-        }
-
-        void set()       { palSetPad(port_, pin_); }
-        void clear()     { palClearPad(port_, pin_); }
-        bool get() const { return palReadPad(port_, pin_); }
-    };
+    using I2CPin = impl_::I2CPin;
 
     I2CPin scl_;
     I2CPin sda_;
@@ -354,5 +376,503 @@ public:
     }
 };
 
+
+#if HAL_USE_GPT
+/**
+ * I2C master on bare GPIO that is clocked from a GPT timer ISR; transactions are queued and executed
+ * in the background, so the calling thread is not blocked and the CPU is not spent on busy waiting.
+ * Every timer tick executes one step of the bus state machine; a bit takes two ticks, so the SCL frequency
+ * is half the tick rate. The tick rate should not exceed 200 kHz, which yields 100 kHz SCL.
+ * The timer runs only while there are pending transactions.
+ *
+ * The pins must be configured in open-drain mode, at high level by default.
+ * The timer callback must invoke @ref handleTick(). Usage:
+ *     static void i2cTick(GPTDriver*);
+ *     static const GPTConfig gpt_config = { 1000000, &i2cTick, 0, 0 };
+ *     static AsyncMaster g_i2c(GPIO_PORT_I2C_SCL, GPIO_PIN_I2C_SCL,
+ *                              GPIO_PORT_I2C_SDA, GPIO_PIN_I2C_SDA,
+ *                              &GPTD5, 10);                         // 100 kHz ticks, 50 kHz SCL
+ *     static void i2cTick(GPTDriver*) { g_i2c.handleTick(); }
+ *     ...
+ *     gptStart(&GPTD5, &gpt_config);
+ *     AsyncMaster::Transaction t;
+ *     t.address = address;
+ *     t.rx_data = buffer;
+ *     t.rx_size = sizeof(buffer);
+ *     g_i2c.exchange(t);               // Returns immediately
+ *     ...
+ *     if (t.wait(MS2ST(10)) && (t.getResult() == AsyncMaster::Result::OK)) { ... }
+ */
+class AsyncMaster
+{
+public:
+    using Result = Master::Result;
+
+    /**
+     * The object must not be modified or destroyed while it is pending.
+     */
+    class Transaction
+    {
+        friend class AsyncMaster;
+
+        Transaction* next_ = nullptr;
+        chibios_rt::BinarySemaphore completion_{true};
+        volatile bool pending_ = false;
+        volatile Result result_ = Result::OK;
+
+    public:
+        std::uint8_t address = 0;
+        const void* tx_data = nullptr;
+        std::uint16_t tx_size = 0;
+        void* rx_data = nullptr;
+        std::uint16_t rx_size = 0;
+
+        bool isPending() const { return pending_; }
+
+        /**
+         * Valid once the transaction is not pending.
+         */
+        Result getResult() const { return result_; }
+
+        /**
+         * Blocks until the transaction is finished.
+         * @return False on timeout.
+         */
+        bool wait(::systime_t timeout = TIME_INFINITE)
+        {
+            while (pending_)
+            {
+                if (completion_.wait(timeout) == MSG_TIMEOUT)
+                {
+                    return !pending_;
+                }
+            }
+            return true;
+        }
+    };
+
+private:
+    static constexpr unsigned DefaultClockStretchTimeoutUSec = 10000;
+
+    enum class Symbol
+    {
+        Idle,
+        Start,
+        Bit,
+        Stop
+    };
+
+    enum class Stage
+    {
+        WriteAddress,
+        WriteData,
+        ReadAddress,
+        ReadData
+    };
+
+    impl_::I2CPin scl_;
+    impl_::I2CPin sda_;
+    ::GPTDriver* const gpt_;
+    const ::gptcnt_t tick_interval_;
+    const unsigned clock_stretch_timeout_usec_;
+
+    // The queue; the head is being executed
+    Transaction* head_ = nullptr;
+    Transaction* tail_ = nullptr;
+
+    // The state machine, accessed with the kernel locked
+    Symbol symbol_ = Symbol::Idle;
+    unsigned step_ = 0;
+    bool bit_value_ = false;
+    bool bit_is_read_ = false;
+    Stage stage_ = Stage::WriteAddress;
+    std::uint8_t byte_ = 0;
+    bool reading_ = false;
+    unsigned bit_index_ = 0;
+    unsigned byte_index_ = 0;
+    Result result_ = Result::OK;
+    unsigned stretch_ticks_ = 0;
+    unsigned stretch_limit_ticks_ = 0;
+
+    void beginStart()
+    {
+        sda_.set();                     // SCL is low unless the bus is idle
+        symbol_ = Symbol::Start;
+        step_ = 0;
+    }
+
+    void beginStop()
+    {
+        sda_.clear();
+        symbol_ = Symbol::Stop;
+        step_ = 0;
+    }
+
+    void beginBit()
+    {
+        if (bit_index_ < 8)
+        {
+            bit_is_read_ = reading_;
+            bit_value_ = reading_ || ((byte_ & 0x80U) != 0);
+        }
+        else
+        {
+            // Acknowledgement; the master acknowledges all bytes but the last one
+            bit_is_read_ = !reading_;
+            bit_value_ = !reading_ || ((byte_index_ + 1U) >= head_->rx_size);
+        }
+        sda_.set(bit_value_);
+        symbol_ = Symbol::Bit;
+        step_ = 0;
+    }
+
+    void beginByte(std::uint8_t value, bool read)
+    {
+        byte_ = value;
+        reading_ = read;
+        bit_index_ = 0;
+        beginBit();
+    }
+
+    void beginNextByte()
+    {
+        Transaction& t = *head_;
+        switch (stage_)
+        {
+        case Stage::WriteAddress:
+        case Stage::WriteData:
+        {
+            if (stage_ == Stage::WriteAddress)
+            {
+                stage_ = Stage::WriteData;
+                byte_index_ = 0;
+            }
+            if (byte_index_ < t.tx_size)
+            {
+                beginByte(static_cast<const std::uint8_t*>(t.tx_data)[byte_index_], false);
+            }
+            else if (t.rx_size > 0)
+            {
+                stage_ = Stage::ReadAddress;
+                beginStart();           // Repeated start
+            }
+            else
+            {
+                beginStop();
+            }
+            break;
+        }
+        case Stage::ReadAddress:
+        case Stage::ReadData:
+        {
+            if (stage_ == Stage::ReadAddress)
+            {
+                stage_ = Stage::ReadData;
+                byte_index_ = 0;
+            }
+            if (byte_index_ < t.rx_size)
+            {
+                beginByte(0, true);
+            }
+            else
+            {
+                beginStop();
+            }
+            break;
+        }
+        }
+    }
+
+    void handleBitDone(bool sample)
+    {
+        if (bit_index_ < 8)
+        {
+            byte_ = std::uint8_t((byte_ << 1) | ((reading_ && sample) ? 1U : 0U));
+            bit_index_++;
+            beginBit();
+            return;
+        }
+
+        if (!reading_ && sample)
+        {
+            result_ = Result::NACK;
+            beginStop();
+            return;
+        }
+
+        if (stage_ == Stage::ReadData)
+        {
+            static_cast<std::uint8_t*>(head_->rx_data)[byte_index_] = byte_;
+        }
+        if ((stage_ == Stage::WriteData) || (stage_ == Stage::ReadData))
+        {
+            byte_index_++;
+        }
+        beginNextByte();
+    }
+
+    /**
+     * @return False if SCL is held low by a slave, in which case the current step must be repeated later.
+     */
+    bool waitSCL()
+    {
+        if (scl_.get())
+        {
+            stretch_ticks_ = 0;
+            return true;
+        }
+        if (++stretch_ticks_ > stretch_limit_ticks_)
+        {
+            fail(Result::Timeout);
+        }
+        return false;
+    }
+
+    /**
+     * Releases the bus immediately, without stop condition.
+     */
+    void fail(Result result)
+    {
+        scl_.set();
+        sda_.set();
+        result_ = result;
+        finish();
+    }
+
+    void beginTransaction()
+    {
+        const Transaction& t = *head_;
+        result_ = Result::OK;
+        stretch_ticks_ = 0;
+        stage_ = (t.tx_size > 0) ? Stage::WriteAddress : Stage::ReadAddress;
+        beginStart();
+    }
+
+    void finish()
+    {
+        Transaction* const t = head_;
+        head_ = t->next_;
+        if (head_ == nullptr)
+        {
+            tail_ = nullptr;
+        }
+
+        t->next_ = nullptr;
+        t->result_ = result_;
+        t->pending_ = false;
+        t->completion_.signalI();
+
+        if (head_ != nullptr)
+        {
+            beginTransaction();
+        }
+        else
+        {
+            symbol_ = Symbol::Idle;
+            gptStopTimerI(gpt_);
+        }
+    }
+
+    void step()
+    {
+        switch (symbol_)
+        {
+        case Symbol::Start:
+        {
+            if (step_ == 0)
+            {
+                scl_.set();
+                step_ = 1;
+            }
+            else if (step_ == 1)
+            {
+                if (waitSCL())
+                {
+                    if (!sda_.get())
+                    {
+                        fail(Result::ArbitrationLost);
+                        break;
+                    }
+                    sda_.clear();
+                    step_ = 2;
+                }
+            }
+            else
+            {
+                scl_.clear();
+                const std::uint8_t address = std::uint8_t(head_->address << 1U);
+                beginByte((stage_ == Stage::ReadAddress) ? (address | 1U) : address, false);
+            }
+            break;
+        }
+        case Symbol::Bit:
+        {
+            if (step_ == 0)
+            {
+                scl_.set();
+                step_ = 1;
+            }
+            else if (waitSCL())
+            {
+                const bool sample = sda_.get();
+                if (!bit_is_read_ && bit_value_ && !sample)
+                {
+                    fail(Result::ArbitrationLost);
+                    break;
+                }
+                scl_.clear();
+                handleBitDone(sample);
+            }
+            else
+            {
+                ;                       // Clock stretching
+            }
+            break;
+        }
+        case Symbol::Stop:
+        {
+            if (step_ == 0)
+            {
+                scl_.set();
+                step_ = 1;
+            }
+            else if (step_ == 1)
+            {
+                if (waitSCL())
+                {
+                    sda_.set();
+                    step_ = 2;
+                }
+            }
+            else
+            {
+                if (!sda_.get() && (result_ == Result::OK))
+                {
+                    result_ = Result::ArbitrationLost;
+                }
+                finish();
+            }
+            break;
+        }
+        case Symbol::Idle:
+        default:
+        {
+            break;                      // Spurious tick
+        }
+        }
+    }
+
+public:
+    /**
+     * @param gpt               The timer must be started by the application, see the usage example.
+     * @param tick_interval     Timer period in timer counts.
+     */
+    AsyncMaster(GPIO_TypeDef* scl_port, unsigned scl_pin,
+                GPIO_TypeDef* sda_port, unsigned sda_pin,
+                ::GPTDriver* gpt, ::gptcnt_t tick_interval,
+                unsigned arg_clock_stretch_timeout_usec = DefaultClockStretchTimeoutUSec) :
+        scl_(scl_port, scl_pin),
+        sda_(sda_port, sda_pin),
+        gpt_(gpt),
+        tick_interval_(tick_interval),
+        clock_stretch_timeout_usec_(arg_clock_stretch_timeout_usec)
+    {
+        assert((gpt_ != nullptr) && (tick_interval_ > 0));
+    }
+
+    ~AsyncMaster()
+    {
+        assert(head_ == nullptr);       // Let all transactions finish before destroying the master
+    }
+
+    AsyncMaster(const AsyncMaster&) = delete;
+    AsyncMaster& operator=(const AsyncMaster&) = delete;
+
+    /**
+     * Queues the transaction and returns immediately; the transaction works like @ref Master::exchange().
+     * The completion can be awaited with @ref Transaction::wait().
+     * @return 0 on success, -EBUSY if the transaction is already pending, -EINVAL if it is empty or invalid.
+     */
+    int exchange(Transaction& t)
+    {
+        if ((t.address >= 128U) ||
+            ((t.tx_size == 0) && (t.rx_size == 0)) ||
+            ((t.tx_size > 0) && (t.tx_data == nullptr)) ||
+            ((t.rx_size > 0) && (t.rx_data == nullptr)))
+        {
+            return -EINVAL;
+        }
+
+        // The timer must have been started, its frequency is used to convert the timeout
+        assert(gpt_->config != nullptr);
+        const std::uint64_t tick_rate = gpt_->config->frequency / tick_interval_;
+        const unsigned stretch_limit = unsigned((std::uint64_t(clock_stretch_timeout_usec_) * tick_rate) / 1000000U);
+
+        CriticalSectionLocker locker;
+        if (t.pending_)
+        {
+            return -EBUSY;
+        }
+
+        t.next_ = nullptr;
+        t.pending_ = true;
+        t.completion_.resetI(true);
+
+        if (tail_ != nullptr)
+        {
+            tail_->next_ = &t;
+            tail_ = &t;
+        }
+        else
+        {
+            head_ = &t;
+            tail_ = &t;
+            stretch_limit_ticks_ = stretch_limit;
+            beginTransaction();
+            gptStartContinuousI(gpt_, tick_interval_);
+        }
+        return 0;
+    }
+
+    /**
+     * Blocking wrapper over @ref exchange(Transaction&); the calling thread sleeps until the transaction is finished.
+     */
+    Result exchange(std::uint8_t address,
+                    const void* tx_data, const std::uint16_t tx_size,
+                          void* rx_data, const std::uint16_t rx_size)
+    {
+        Transaction t;
+        t.address = address;
+        t.tx_data = tx_data;
+        t.tx_size = tx_size;
+        t.rx_data = rx_data;
+        t.rx_size = rx_size;
+        if (exchange(t) < 0)
+        {
+            assert(false);
+            return Result::NACK;
+        }
+        (void)t.wait();
+        return t.getResult();
+    }
+
+    bool isIdle() const
+    {
+        CriticalSectionLocker locker;
+        return head_ == nullptr;
+    }
+
+    /**
+     * Do not call directly; this must be invoked from the timer callback.
+     */
+    void handleTick()
+    {
+        chSysLockFromISR();
+        step();
+        chSysUnlockFromISR();
+    }
+};
+#endif
+
 }
 }
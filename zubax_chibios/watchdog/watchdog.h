@@ -6,16 +6,55 @@
 
 #pragma once
 
+#include <stdbool.h>
+
+/**
+ * Longer names are truncated in the expiry diagnostics.
+ */
+#ifndef WATCHDOG_NAME_MAX_LENGTH
+#  define WATCHDOG_NAME_MAX_LENGTH      15
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Describes the logical watchdog that caused the last reset.
+ */
+typedef struct
+{
+    int id;
+    char name[WATCHDOG_NAME_MAX_LENGTH + 1];    ///< Empty if the watchdog was created without name
+    unsigned timeout_ms;
+    unsigned elapsed_ms;                        ///< Since the last reset of the watchdog, when the expiry was detected
+} WatchdogExpiryInfo;
+
 void watchdogInit(void);
 
 bool watchdogTriggeredLastReset(void);
 
+/**
+ * @param [out] out_info    Populated if the last reset was triggered by an expired logical watchdog; may be NULL.
+ * @return                  True if the last reset was triggered by an expired logical watchdog.
+ */
+bool watchdogGetLastExpiry(WatchdogExpiryInfo* out_info);
+
+/**
+ * Every logical watchdog has its own deadline that does not depend on the other watchdogs.
+ * @return Non-negative ID of the new watchdog, negative on failure.
+ */
 int watchdogCreate(unsigned timeout_ms);
 
+/**
+ * Same as @ref watchdogCreate(), the name is reported in the expiry diagnostics.
+ * @param [in] name     Shall be a string literal or otherwise have static storage duration; may be NULL.
+ */
+int watchdogCreateNamed(unsigned timeout_ms, const char* name);
+
+/**
+ * Lock-free; can be invoked from any context.
+ */
 void watchdogReset(int id);
 
 #ifdef __cplusplus
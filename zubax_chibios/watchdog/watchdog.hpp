@@ -22,11 +22,14 @@ class Timer
 public:
     bool isStarted() const { return id_ >= 0; }
 
-    void startMSec(unsigned timeout_ms)
+    /**
+     * @param name  Reported in the expiry diagnostics, see @ref getLastExpiry(); shall be a string literal.
+     */
+    void startMSec(unsigned timeout_ms, const char* name = nullptr)
     {
         if (!isStarted())
         {
-            id_ = ::watchdogCreate(timeout_ms);
+            id_ = ::watchdogCreateNamed(timeout_ms, name);
             ASSERT_ALWAYS(isStarted());
         }
         else
@@ -35,6 +38,9 @@ public:
         }
     }
 
+    /**
+     * Only stores the current timestamp, the deadlines are checked by the supervisor.
+     */
     void reset()
     {
         assert(isStarted());
@@ -52,5 +58,15 @@ static inline bool wasLastResetTriggeredByWatchdog()
     return ::watchdogTriggeredLastReset();
 }
 
+using ExpiryInfo = ::WatchdogExpiryInfo;
+
+/**
+ * Returns true if the last reset was caused by an expired @ref Timer, in which case the output is populated.
+ */
+static inline bool getLastExpiry(ExpiryInfo& out_info)
+{
+    return ::watchdogGetLastExpiry(&out_info);
+}
+
 }
 }